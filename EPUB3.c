@@ -10,6 +10,10 @@ const char * kEPUB3SpineTypeID = "_EPUB3Spine_t";
 const char * kEPUB3SpineItemTypeID = "_EPUB3SpineItem_t";
 const char * kEPUB3TocTypeID = "_EPUB3Toc_t";
 const char * kEPUB3TocItemTypeID = "_EPUB3TocItem_t";
+const char * kEPUB3EntryReaderTypeID = "_EPUB3EntryReader_t";
+const char * kEPUB3EntryDataTypeID = "_EPUB3EntryData_t";
+const char * kEPUB3WriterTypeID = "_EPUB3Writer_t";
+const char * kEPUB3IngestTypeID = "_EPUB3Ingest_t";
 
 
 #ifndef PARSE_CONTEXT_STACK_DEPTH
@@ -147,19 +151,27 @@ void EPUB3ObjectRelease(void *object)
 {
   if(object == NULL) return;
 
-  EPUB3ObjectRef obj = (EPUB3ObjectRef)object;
-  obj->_type.refCount--;
-  if(obj->_type.refCount == 0) {
-    EPUB3_FREE_AND_NULL(obj);
+  if(EPUB3ObjectDropReference(object)) {
+    EPUB3_FREE_AND_NULL(object);
   }
 }
 
+// Returns YES when that was the last reference, which leaves the caller to tear the object down and free it.
+// Checking the count and dropping the reference in one atomic step means exactly one thread ever sees the last
+EPUB3Bool EPUB3ObjectDropReference(void *object)
+{
+  assert(object != NULL);
+
+  EPUB3ObjectRef obj = (EPUB3ObjectRef)object;
+  return __sync_sub_and_fetch(&obj->_type.refCount, 1) == 0 ? kEPUB3_YES : kEPUB3_NO;
+}
+
 void EPUB3ObjectRetain(void *object)
 {
   if(object == NULL) return;
 
   EPUB3ObjectRef obj = (EPUB3ObjectRef)object;
-  obj->_type.refCount++;
+  (void)__sync_add_and_fetch(&obj->_type.refCount, 1);
 }
 
 void * EPUB3ObjectInitWithTypeID(void *object, const char *typeID)
@@ -184,6 +196,25 @@ EPUB3Ref EPUB3Create()
   memory->archive = NULL;
   memory->archivePath = NULL;
   memory->archiveFileCount = 0;
+  memory->archiveIndex = NULL;
+  memory->archiveMemory.base = NULL;
+  memory->archiveMemory.size = 0;
+  memory->archiveIsMapped = kEPUB3_NO;
+  memory->archiveFile.fd = -1;
+  memory->archiveFile.size = 0;
+  memory->archiveBlockCache = NULL;
+  fill_fopen_filefunc(&memory->archiveCursorFileFuncs);
+  pthread_mutex_init(&memory->archiveCursorLock, NULL);
+  memory->idleArchiveCursorCount = 0;
+  memory->extractionThreadCount = 1;
+  memory->extractionUsesIOURing = kEPUB3_NO;
+  memory->integrityPolicy = kEPUB3IntegrityVerify;
+  memset(&memory->entryCache, 0, sizeof(memory->entryCache));
+  pthread_mutex_init(&memory->entryCache.lock, NULL);
+  pthread_mutex_init(&memory->spinePrefetcherLock, NULL);
+  memory->spinePrefetcher = NULL;
+  memory->rootFilePath = NULL;
+  memory->rootPath = NULL;
   return memory;
 }
 
@@ -207,18 +238,106 @@ EXPORT EPUB3Ref EPUB3CreateWithArchiveAtPath(const char * path, EPUB3Error *erro
   return epub;
 }
 
+EXPORT EPUB3Ref EPUB3CreateWithMappedArchiveAtPath(const char * path, EPUB3Error *error)
+{
+  assert(path != NULL);
+
+  EPUB3Ref epub = EPUB3Create();
+  *error = EPUB3PrepareMappedArchiveAtPath(epub, path);
+  if(*error != kEPUB3Success) {
+    EPUB3Release(epub);
+    return NULL;
+  }
+
+  *error = EPUB3InitAndValidate(epub);
+  if(*error != kEPUB3Success) {
+    EPUB3Release(epub);
+    return NULL;
+  }
+
+  return epub;
+}
+
+EXPORT EPUB3Ref EPUB3CreateWithArchiveInMemory(const void * bytes, size_t byteCount, EPUB3Error *error)
+{
+  assert(bytes != NULL);
+
+  EPUB3Ref epub = EPUB3Create();
+  *error = EPUB3PrepareArchiveInMemory(epub, bytes, byteCount);
+  if(*error != kEPUB3Success) {
+    EPUB3Release(epub);
+    return NULL;
+  }
+
+  *error = EPUB3InitAndValidate(epub);
+  if(*error != kEPUB3Success) {
+    EPUB3Release(epub);
+    return NULL;
+  }
+
+  return epub;
+}
+
+EXPORT EPUB3Ref EPUB3CreateWithIO(const EPUB3IOCallbacks * callbacks, void * context, EPUB3Error *error)
+{
+  assert(callbacks != NULL);
+
+  EPUB3Ref epub = EPUB3Create();
+  *error = EPUB3PrepareArchiveWithIO(epub, callbacks, context);
+  if(*error != kEPUB3Success) {
+    EPUB3Release(epub);
+    return NULL;
+  }
+
+  *error = EPUB3InitAndValidate(epub);
+  if(*error != kEPUB3Success) {
+    EPUB3Release(epub);
+    return NULL;
+  }
+
+  return epub;
+}
+
 EPUB3Error EPUB3PrepareArchiveAtPath(EPUB3Ref epub, const char * path)
+{
+  return EPUB3PrepareArchiveAtPathWithFileFuncs(epub, path, NULL);
+}
+
+// path may be NULL when fileFuncs does not read from the filesystem
+EPUB3Error EPUB3PrepareArchiveAtPathWithFileFuncs(EPUB3Ref epub, const char * path, zlib_filefunc_def * fileFuncs)
 {
   assert(epub != NULL);
-  assert(path != NULL);
+  assert(path != NULL || fileFuncs != NULL);
 
   EPUB3Error error = kEPUB3Success;
-  unzFile archive = unzOpen(path);
+  unzFile archive = unzOpen2(path, fileFuncs);
   if (archive != NULL)
   {
     epub->archive = archive;
-    epub->archiveFileCount = EPUB3GetFileCountInArchive(archive);
-    epub->archivePath = strdup(path);
+    epub->archiveFileCount = EPUB3GetFileCountInArchive(epub);
+    epub->archivePath = path != NULL ? strdup(path) : NULL;
+    struct stat st;
+    EPUB3Bool haveStat = kEPUB3_NO;
+    if(fileFuncs != NULL) {
+      epub->archiveCursorFileFuncs = *fileFuncs;
+      haveStat = path != NULL && stat(path, &st) == 0;
+    }
+    else if((epub->archiveFile.fd = open(path, O_RDONLY)) >= 0) {
+      if(fstat(epub->archiveFile.fd, &st) == 0) {
+        epub->archiveFile.size = (uLong)st.st_size;
+        fill_pread_filefunc(&epub->archiveCursorFileFuncs, &epub->archiveFile);
+        haveStat = kEPUB3_YES;
+      }
+    }
+    // Walk the central directory once so later lookups don't have to, unless another process already has
+    if(haveStat && EPUB3SharedArchiveIndexCacheIsEnabled()) {
+      epub->archiveIndex = EPUB3ArchiveIndexCreateWithSharedCache(archive, path, &st);
+    } else {
+      epub->archiveIndex = EPUB3ArchiveIndexCreateWithArchive(archive);
+    }
+    if(epub->archiveIndex == NULL) {
+      error = kEPUB3ArchiveUnavailableError;
+    }
   }
   else // unzOpen can return a NULL filestream
     error = kEPUB3UnknownError;
@@ -226,19 +345,89 @@ EPUB3Error EPUB3PrepareArchiveAtPath(EPUB3Ref epub, const char * path)
   return error;
 }
 
+EPUB3Error EPUB3PrepareMappedArchiveAtPath(EPUB3Ref epub, const char * path)
+{
+  assert(epub != NULL);
+  assert(path != NULL);
+
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    return kEPUB3UnknownError;
+  }
+  struct stat st;
+  if(fstat(fd, &st) < 0 || st.st_size == 0) {
+    close(fd);
+    return kEPUB3UnknownError;
+  }
+  void * bytes = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); // The mapping keeps its own reference to the file
+  if(bytes == MAP_FAILED) {
+    fprintf(stderr, "Error [%d] mapping %s\n", errno, path);
+    return kEPUB3UnknownError;
+  }
+
+  epub->archiveMemory.base = bytes;
+  epub->archiveMemory.size = (uLong)st.st_size;
+  epub->archiveIsMapped = kEPUB3_YES;
+
+  zlib_filefunc_def fileFuncs;
+  fill_memory_filefunc(&fileFuncs, &epub->archiveMemory);
+  return EPUB3PrepareArchiveAtPathWithFileFuncs(epub, path, &fileFuncs);
+}
+
+EPUB3Error EPUB3PrepareArchiveInMemory(EPUB3Ref epub, const void * bytes, size_t byteCount)
+{
+  assert(epub != NULL);
+  assert(bytes != NULL);
+
+  if(byteCount == 0) return kEPUB3InvalidArgumentError;
+
+  // Borrowed: the caller keeps the bytes alive, we never unmap or free them
+  epub->archiveMemory.base = bytes;
+  epub->archiveMemory.size = (uLong)byteCount;
+  epub->archiveIsMapped = kEPUB3_NO;
+
+  zlib_filefunc_def fileFuncs;
+  fill_memory_filefunc(&fileFuncs, &epub->archiveMemory);
+  return EPUB3PrepareArchiveAtPathWithFileFuncs(epub, NULL, &fileFuncs);
+}
+
+EPUB3Error EPUB3PrepareArchiveWithIO(EPUB3Ref epub, const EPUB3IOCallbacks * callbacks, void * context)
+{
+  assert(epub != NULL);
+  assert(callbacks != NULL);
+
+  epub->archiveBlockCache = EPUB3BlockCacheCreate(callbacks, context);
+  if(epub->archiveBlockCache == NULL) {
+    if(callbacks->close != NULL) callbacks->close(context);
+    return kEPUB3InvalidArgumentError;
+  }
+  epub->archiveReadAt.read_at = EPUB3BlockCacheReadAt;
+  epub->archiveReadAt.opaque = epub->archiveBlockCache;
+  epub->archiveReadAt.size = (uLong)callbacks->size;
+
+  zlib_filefunc_def fileFuncs;
+  fill_read_at_filefunc(&fileFuncs, &epub->archiveReadAt);
+  return EPUB3PrepareArchiveAtPathWithFileFuncs(epub, NULL, &fileFuncs);
+}
+
+static const char * EPUB3ArchiveDescription(EPUB3Ref epub)
+{
+  return epub->archivePath != NULL ? epub->archivePath : "<memory>";
+}
+
 EPUB3Error EPUB3InitAndValidate(EPUB3Ref epub)
 {
   assert(epub != NULL);
-  char * opfPath = NULL;
-  EPUB3Error error = EPUB3CopyRootFilePathFromContainer(epub, &opfPath);
+  const char * opfPath = NULL;
+  EPUB3Error error = EPUB3GetRootFilePath(epub, &opfPath);
   if(error != kEPUB3Success) {
-    fprintf(stderr, "Error (%d[%d]) opening and validating epub file at %s.\n", error, __LINE__, epub->archivePath);
+    fprintf(stderr, "Error (%d[%d]) opening and validating epub file at %s.\n", error, __LINE__, EPUB3ArchiveDescription(epub));
   }
   error = EPUB3InitFromOPF(epub, opfPath);
   if(error != kEPUB3Success) {
-    fprintf(stderr, "Error (%d[%d]) parsing epub file at %s.\n", error, __LINE__, epub->archivePath);
+    fprintf(stderr, "Error (%d[%d]) parsing epub file at %s.\n", error, __LINE__, EPUB3ArchiveDescription(epub));
   }
-  EPUB3_FREE_AND_NULL(opfPath);
   return error;
 }
 
@@ -256,18 +445,52 @@ EXPORT void EPUB3Release(EPUB3Ref epub)
 {
   if(epub == NULL) return;
 
-  if(epub->_type.refCount == 1) {
+  // Every retain of the book retains these too. Read them before the book can go away under another thread
+  EPUB3MetadataRef metadata = epub->metadata;
+  EPUB3ManifestRef manifest = epub->manifest;
+  EPUB3SpineRef spine = epub->spine;
+  EPUB3Bool isLast = EPUB3ObjectDropReference(epub);
+  if(isLast) {
+    // Stop the prefetch thread before anything it reads goes away
+    EPUB3SpinePrefetcherFree(epub->spinePrefetcher);
+    epub->spinePrefetcher = NULL;
+    pthread_mutex_destroy(&epub->spinePrefetcherLock);
     if(epub->archive != NULL) {
       unzClose(epub->archive);
       epub->archive = NULL;
     }
+    while(epub->idleArchiveCursorCount > 0) {
+      unzClose(epub->idleArchiveCursors[--epub->idleArchiveCursorCount]);
+    }
+    pthread_mutex_destroy(&epub->archiveCursorLock);
+    if(epub->archiveFile.fd >= 0) {
+      close(epub->archiveFile.fd);
+      epub->archiveFile.fd = -1;
+    }
+    // Callers may still hold the cached data; the cache only drops its own references
+    EPUB3EntryCacheTrimToBudget(epub, 0);
+    pthread_mutex_destroy(&epub->entryCache.lock);
+    EPUB3ArchiveIndexFree(epub->archiveIndex);
+    epub->archiveIndex = NULL;
+    EPUB3BlockCacheFree(epub->archiveBlockCache);
+    epub->archiveBlockCache = NULL;
+    if(epub->archiveIsMapped) {
+      munmap((void *)epub->archiveMemory.base, (size_t)epub->archiveMemory.size);
+      epub->archiveIsMapped = kEPUB3_NO;
+    }
+    epub->archiveMemory.base = NULL;
+    epub->archiveMemory.size = 0;
     EPUB3_FREE_AND_NULL(epub->archivePath);
+    EPUB3_FREE_AND_NULL(epub->rootFilePath);
+    EPUB3_FREE_AND_NULL(epub->rootPath);
   }
 
-  EPUB3MetadataRelease(epub->metadata);
-  EPUB3ManifestRelease(epub->manifest);
-  EPUB3SpineRelease(epub->spine);
-  EPUB3ObjectRelease(epub);
+  EPUB3MetadataRelease(metadata);
+  EPUB3ManifestRelease(manifest);
+  EPUB3SpineRelease(spine);
+  if(isLast) {
+    EPUB3_FREE_AND_NULL(epub);
+  }
 }
 
 EPUB3MetadataRef EPUB3CopyMetadata(EPUB3Ref epub)
@@ -433,7 +656,7 @@ EXPORT char * EPUB3CopyMetaElementPathWithName(EPUB3Ref epub, const char * name)
     return fullPathCopy;
 }
 
-EXPORT EPUB3Error EPUB3CopyCoverImage(EPUB3Ref epub, void ** bytes, uint32_t * byteCount)
+EXPORT EPUB3Error EPUB3CopyCoverImage(EPUB3Ref epub, void ** bytes, uint64_t * byteCount)
 {
   assert(epub != NULL);
 
@@ -483,7 +706,7 @@ void EPUB3TocRetain(EPUB3TocRef toc)
 void EPUB3TocRelease(EPUB3TocRef toc)
 {
   if(toc == NULL) return;
-  if(toc->_type.refCount == 1) {
+  if(EPUB3ObjectDropReference(toc)) {
     EPUB3TocItemChildListItemPtr itemPtr = toc->rootItemsHead;
     int totalItemsToFree = toc->rootItemCount;
     while(itemPtr != NULL) {
@@ -495,8 +718,8 @@ void EPUB3TocRelease(EPUB3TocRef toc)
       EPUB3_FREE_AND_NULL(tmp);
     }
     toc->rootItemCount = 0;
+    EPUB3_FREE_AND_NULL(toc);
   }
-  EPUB3ObjectRelease(toc);
 }
 
 EPUB3TocItemRef EPUB3TocItemCreate()
@@ -522,7 +745,7 @@ void EPUB3TocItemRelease(EPUB3TocItemRef item)
 {
   if(item == NULL) return;
 
-  if(item->_type.refCount == 1) {
+  if(EPUB3ObjectDropReference(item)) {
     item->parent = NULL; // zero weak ref
     EPUB3_FREE_AND_NULL(item->title);
     EPUB3_FREE_AND_NULL(item->href);
@@ -537,9 +760,8 @@ void EPUB3TocItemRelease(EPUB3TocItemRef item)
       EPUB3_FREE_AND_NULL(tmp);
     }
     item->childCount = 0;
+    EPUB3_FREE_AND_NULL(item);
   }
-
-  EPUB3ObjectRelease(item);
 }
 
 void EPUB3TocAddRootItem(EPUB3TocRef toc, EPUB3TocItemRef item)
@@ -606,7 +828,7 @@ void EPUB3MetadataRelease(EPUB3MetadataRef metadata)
 {
   if(metadata == NULL) return;
 
-  if(metadata->_type.refCount == 1) {
+  if(EPUB3ObjectDropReference(metadata)) {
     EPUB3ManifestItemRelease(metadata->ncxItem);
     metadata->ncxItem = NULL;
     EPUB3_FREE_AND_NULL(metadata->title);
@@ -622,8 +844,8 @@ void EPUB3MetadataRelease(EPUB3MetadataRef metadata)
           metadata->metaTable[i] = NULL;
       }
       metadata->itemCount = 0;
+    EPUB3_FREE_AND_NULL(metadata);
   }
-  EPUB3ObjectRelease(metadata);
 }
 
 void EPUB3MetadataMetaItemRetain(EPUB3MetadataMetaItemRef item)
@@ -637,12 +859,11 @@ void EPUB3MetadataMetaItemRelease(EPUB3MetadataMetaItemRef item)
 {
     if(item == NULL) return;
     
-    if(item->_type.refCount == 1) {
+    if(EPUB3ObjectDropReference(item)) {
         EPUB3_FREE_AND_NULL(item->name);
         EPUB3_FREE_AND_NULL(item->content);
+        EPUB3_FREE_AND_NULL(item);
     }
-    
-    EPUB3ObjectRelease(item);
 }
 
 EPUB3MetadataRef EPUB3MetadataCreate()
@@ -779,25 +1000,26 @@ void EPUB3ManifestRetain(EPUB3ManifestRef manifest)
 void EPUB3ManifestRelease(EPUB3ManifestRef manifest)
 {
   if(manifest == NULL) return;
-  for(int i = 0; i < MANIFEST_HASH_SIZE; i++) {
 
-    EPUB3ManifestItemListItemPtr next = manifest->itemTable[i];
-    while(next != NULL) {
+  // Every retain of the manifest retains its items too
+  for(int i = 0; i < MANIFEST_HASH_SIZE; i++) {
+    for(EPUB3ManifestItemListItemPtr next = manifest->itemTable[i]; next != NULL; next = next->next) {
       EPUB3ManifestItemRelease(next->item);
-      EPUB3ManifestItemListItemPtr tmp = next;
-      next = tmp->next;
-      if(manifest->_type.refCount == 1) {
+    }
+  }
+  if(EPUB3ObjectDropReference(manifest)) {
+    for(int i = 0; i < MANIFEST_HASH_SIZE; i++) {
+      EPUB3ManifestItemListItemPtr next = manifest->itemTable[i];
+      while(next != NULL) {
+        EPUB3ManifestItemListItemPtr tmp = next;
+        next = tmp->next;
         EPUB3_FREE_AND_NULL(tmp);
       }
-    }
-    if(manifest->_type.refCount == 1) {
       manifest->itemTable[i] = NULL;
     }
-  }
-  if(manifest->_type.refCount == 1) {
     manifest->itemCount = 0;
+    EPUB3_FREE_AND_NULL(manifest);
   }
-  EPUB3ObjectRelease(manifest);
 }
 
 void EPUB3ManifestItemRetain(EPUB3ManifestItemRef item)
@@ -811,15 +1033,14 @@ void EPUB3ManifestItemRelease(EPUB3ManifestItemRef item)
 {
   if(item == NULL) return;
 
-  if(item->_type.refCount == 1) {
+  if(EPUB3ObjectDropReference(item)) {
     EPUB3_FREE_AND_NULL(item->itemId);
     EPUB3_FREE_AND_NULL(item->href);
     EPUB3_FREE_AND_NULL(item->mediaType);
     EPUB3_FREE_AND_NULL(item->properties);
     EPUB3_FREE_AND_NULL(item->requiredModules);
+    EPUB3_FREE_AND_NULL(item);
   }
-
-  EPUB3ObjectRelease(item);
 }
 
 EPUB3ManifestRef EPUB3ManifestCreate()
@@ -953,7 +1174,7 @@ void EPUB3SpineRetain(EPUB3SpineRef spine)
 void EPUB3SpineRelease(EPUB3SpineRef spine)
 {
   if(spine == NULL) return;
-  if(spine->_type.refCount == 1) {
+  if(EPUB3ObjectDropReference(spine)) {
     EPUB3SpineItemListItemPtr itemPtr = spine->head;
     int totalItemsToFree = spine->itemCount;
     while(itemPtr != NULL) {
@@ -966,8 +1187,8 @@ void EPUB3SpineRelease(EPUB3SpineRef spine)
     }
     spine->itemCount = 0;
     spine->linearItemCount = 0;
+    EPUB3_FREE_AND_NULL(spine);
   }
-  EPUB3ObjectRelease(spine);
 }
 
 EPUB3SpineItemRef EPUB3SpineItemCreate()
@@ -976,6 +1197,7 @@ EPUB3SpineItemRef EPUB3SpineItemCreate()
   memory = EPUB3ObjectInitWithTypeID(memory, kEPUB3SpineItemTypeID);
   memory->isLinear = kEPUB3_NO;
   memory->idref = NULL;
+  memory->properties = NULL;
   memory->manifestItem = NULL;
   return memory;
 }
@@ -990,12 +1212,12 @@ void EPUB3SpineItemRelease(EPUB3SpineItemRef item)
 {
   if(item == NULL) return;
 
-  if(item->_type.refCount == 1) {
+  if(EPUB3ObjectDropReference(item)) {
     item->manifestItem = NULL; // zero weak ref
     EPUB3_FREE_AND_NULL(item->idref);
+    EPUB3_FREE_AND_NULL(item->properties);
+    EPUB3_FREE_AND_NULL(item);
   }
-
-  EPUB3ObjectRelease(item);
 }
 
 void EPUB3SpineItemSetManifestItem(EPUB3SpineItemRef spineItem, EPUB3ManifestItemRef manifestItem)
@@ -1027,12 +1249,9 @@ void EPUB3SpineAppendItem(EPUB3SpineRef spine, EPUB3SpineItemRef item)
 
 #pragma mark - OPF XML Parsing
 
-EPUB3Error EPUB3InitFromOPF(EPUB3Ref epub, const char * opfFilename)
+void EPUB3InitPackageObjects(EPUB3Ref epub)
 {
   assert(epub != NULL);
-  assert(opfFilename != NULL);
-
-  if(epub->archive == NULL) return kEPUB3ArchiveUnavailableError;
 
   if(epub->metadata == NULL) {
     epub->metadata = EPUB3MetadataCreate();
@@ -1049,33 +1268,55 @@ EPUB3Error EPUB3InitFromOPF(EPUB3Ref epub, const char * opfFilename)
   if(epub->toc == NULL) {
     epub->toc = EPUB3TocCreate();
   }
+}
+
+char * EPUB3CopyNCXPath(EPUB3Ref epub, const char * opfFilename)
+{
+  assert(epub != NULL);
+  assert(opfFilename != NULL);
+
+  if(epub->metadata == NULL || epub->metadata->ncxItem == NULL) return NULL;
+
+  char * ncxPath = strdup(epub->metadata->ncxItem->href);
+  if(*ncxPath != '/') {
+    char * opfRoot = EPUB3CopyOfPathByDeletingLastPathComponent(opfFilename);
+    char * fullPath = EPUB3CopyOfPathByAppendingPathComponent(opfRoot, ncxPath);
+    free(ncxPath);
+    free(opfRoot);
+    ncxPath = fullPath;
+  }
+  return ncxPath;
+}
+
+EPUB3Error EPUB3InitFromOPF(EPUB3Ref epub, const char * opfFilename)
+{
+  assert(epub != NULL);
+  assert(opfFilename != NULL);
+
+  if(epub->archive == NULL) return kEPUB3ArchiveUnavailableError;
+
+  EPUB3InitPackageObjects(epub);
 
   void *buffer = NULL;
-  uint32_t bufferSize = 0;
-  uint32_t bytesCopied;
+  uint64_t bufferSize = 0;
+  uint64_t bytesCopied;
 
   EPUB3Error error = kEPUB3Success;
 
   error = EPUB3CopyFileIntoBuffer(epub, &buffer, &bufferSize, &bytesCopied, opfFilename);
   if(error == kEPUB3Success) {
-    error = EPUB3ParseOPFFromData(epub, buffer, bufferSize);
+    // libxml2 takes an int length
+    error = bufferSize <= INT_MAX ? EPUB3ParseOPFFromData(epub, buffer, (uint32_t)bufferSize) : kEPUB3XMLReadFromBufferError;
     EPUB3_FREE_AND_NULL(buffer);
   }
     if(error == kEPUB3Success) { //&& epub->metadata->version == kEPUB3Version_2) {
     // Parse NCX only if this is a v2 epub (per the EPUB 3 spec)
-    if(epub->metadata->ncxItem != NULL) {
-      char * ncxPath = strdup(epub->metadata->ncxItem->href);
-      if(*ncxPath != '/') {
-        char * opfRoot = EPUB3CopyOfPathByDeletingLastPathComponent(opfFilename);
-        char * fullPath = EPUB3CopyOfPathByAppendingPathComponent(opfRoot, ncxPath);
-        free(ncxPath);
-        free(opfRoot);
-        ncxPath = fullPath;
-      }
+    char * ncxPath = EPUB3CopyNCXPath(epub, opfFilename);
+    if(ncxPath != NULL) {
       bufferSize = 0;
       error = EPUB3CopyFileIntoBuffer(epub, &buffer, &bufferSize, &bytesCopied, ncxPath);
       if(error == kEPUB3Success) {
-        error = EPUB3ParseNCXFromData(epub, buffer, bufferSize);
+        error = bufferSize <= INT_MAX ? EPUB3ParseNCXFromData(epub, buffer, (uint32_t)bufferSize) : kEPUB3XMLReadFromBufferError;
       }
       free(ncxPath);
       EPUB3_FREE_AND_NULL(buffer);
@@ -1295,6 +1536,7 @@ EPUB3Error EPUB3ProcessXMLReaderNodeForSpineInOPF(EPUB3Ref epub, xmlTextReaderPt
           }
           EPUB3_XML_FREE_AND_NULL(linear);
           newItem->idref = (char *)xmlTextReaderGetAttribute(reader, BAD_CAST "idref");
+          newItem->properties = (char *)xmlTextReaderGetAttribute(reader, BAD_CAST "properties");
           if(newItem->idref != NULL) {
             EPUB3ManifestItemListItemPtr manifestPtr = EPUB3ManifestFindItemWithId(epub->manifest, newItem->idref);
             if(manifestPtr == NULL) {
@@ -1624,48 +1866,103 @@ EXPORT EPUB3Error EPUB3CopyRootFilePathFromContainer(EPUB3Ref epub, char ** root
   static const char *containerFilename = "META-INF/container.xml";
 
   void *buffer = NULL;
-  uint32_t bufferSize = 0;
-  uint32_t bytesCopied;
-
-  xmlTextReaderPtr reader = NULL;
-  EPUB3Bool foundPath = kEPUB3_NO;
+  uint64_t bufferSize = 0;
+  uint64_t bytesCopied;
 
   EPUB3Error error = kEPUB3Success;
 
   error = EPUB3CopyFileIntoBuffer(epub, &buffer, &bufferSize, &bytesCopied, containerFilename);
   if(error == kEPUB3Success) {
-    reader = xmlReaderForMemory(buffer, bufferSize, "", NULL, XML_PARSE_RECOVER);
-    if(reader != NULL) {
-      int retVal;
-      while((retVal = xmlTextReaderRead(reader)) == 1)
-      {
-        const char *rootFileName = "rootfile";
-        const xmlChar *name = xmlTextReaderConstLocalName(reader);
-
-        if(xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT && xmlStrcmp(name, BAD_CAST rootFileName) == 0) {
-          xmlChar *fullPath = xmlTextReaderGetAttribute(reader, BAD_CAST "full-path");
-          if(fullPath != NULL) {
-            // TODD: validate that the full-path attribute is of the form path-rootless
-            //       see http://idpf.org/epub/30/spec/epub30-ocf.html#sec-container-metainf-container.xml
-            foundPath = kEPUB3_YES;
-            *rootPath = strdup((char *)fullPath);
-          } else {
-            // The spec requires the full-path attribute
-            error = kEPUB3XMLXDocumentInvalidError;
-          }
-          break;
+    error = bufferSize <= INT_MAX ? EPUB3CopyRootFilePathFromContainerData(buffer, (uint32_t)bufferSize, rootPath) : kEPUB3XMLReadFromBufferError;
+    EPUB3_FREE_AND_NULL(buffer);
+  }
+  return error;
+}
+
+// Reads the container the first time only. Threads that race here parse the same container, so whichever
+// publishes first wins; the paths never change after that and are freed with the book
+static EPUB3Error EPUB3LoadRootPaths(EPUB3Ref epub)
+{
+  if(__atomic_load_n(&epub->rootPath, __ATOMIC_ACQUIRE) != NULL) return kEPUB3Success;
+
+  char * rootFilePath = NULL;
+  EPUB3Error error = EPUB3CopyRootFilePathFromContainer(epub, &rootFilePath);
+  if(error != kEPUB3Success) {
+    EPUB3_FREE_AND_NULL(rootFilePath);
+    return error;
+  }
+  char * rootPath = EPUB3CopyOfPathByDeletingLastPathComponent(rootFilePath);
+  // The file path goes first, so a published rootPath means both are there
+  if(!__sync_bool_compare_and_swap(&epub->rootFilePath, NULL, rootFilePath)) {
+    EPUB3_FREE_AND_NULL(rootFilePath);
+  }
+  if(!__sync_bool_compare_and_swap(&epub->rootPath, NULL, rootPath)) {
+    EPUB3_FREE_AND_NULL(rootPath);
+  }
+  return kEPUB3Success;
+}
+
+EPUB3Error EPUB3GetRootFilePath(EPUB3Ref epub, const char ** rootFilePath)
+{
+  assert(epub != NULL);
+  assert(rootFilePath != NULL);
+
+  EPUB3Error error = EPUB3LoadRootPaths(epub);
+  *rootFilePath = error == kEPUB3Success ? __atomic_load_n(&epub->rootFilePath, __ATOMIC_ACQUIRE) : NULL;
+  return error;
+}
+
+EPUB3Error EPUB3GetRootPath(EPUB3Ref epub, const char ** rootPath)
+{
+  assert(epub != NULL);
+  assert(rootPath != NULL);
+
+  EPUB3Error error = EPUB3LoadRootPaths(epub);
+  *rootPath = error == kEPUB3Success ? __atomic_load_n(&epub->rootPath, __ATOMIC_ACQUIRE) : NULL;
+  return error;
+}
+
+EPUB3Error EPUB3CopyRootFilePathFromContainerData(const void * buffer, uint32_t bufferSize, char ** rootPath)
+{
+  assert(buffer != NULL);
+  assert(rootPath != NULL);
+
+  if(bufferSize > INT_MAX) return kEPUB3XMLReadFromBufferError;
+
+  EPUB3Bool foundPath = kEPUB3_NO;
+  EPUB3Error error = kEPUB3Success;
+
+  xmlTextReaderPtr reader = xmlReaderForMemory(buffer, (int)bufferSize, "", NULL, XML_PARSE_RECOVER);
+  if(reader != NULL) {
+    int retVal;
+    while((retVal = xmlTextReaderRead(reader)) == 1)
+    {
+      const char *rootFileName = "rootfile";
+      const xmlChar *name = xmlTextReaderConstLocalName(reader);
+
+      if(xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT && xmlStrcmp(name, BAD_CAST rootFileName) == 0) {
+        xmlChar *fullPath = xmlTextReaderGetAttribute(reader, BAD_CAST "full-path");
+        if(fullPath != NULL) {
+          // TODD: validate that the full-path attribute is of the form path-rootless
+          //       see http://idpf.org/epub/30/spec/epub30-ocf.html#sec-container-metainf-container.xml
+          foundPath = kEPUB3_YES;
+          *rootPath = strdup((char *)fullPath);
+          xmlFree(fullPath);
+        } else {
+          // The spec requires the full-path attribute
+          error = kEPUB3XMLXDocumentInvalidError;
         }
+        break;
       }
-      if(retVal < 0) {
-        error = kEPUB3XMLParseError;
-      }
-      if(!foundPath) {
-        error = kEPUB3XMLXElementNotFoundError;
-      }
-    } else {
-      error = kEPUB3XMLReadFromBufferError;
     }
-    EPUB3_FREE_AND_NULL(buffer);
+    if(retVal < 0) {
+      error = kEPUB3XMLParseError;
+    }
+    if(!foundPath) {
+      error = kEPUB3XMLXElementNotFoundError;
+    }
+  } else {
+    error = kEPUB3XMLReadFromBufferError;
   }
   xmlFreeTextReader(reader);
   return error;
@@ -1679,7 +1976,13 @@ EPUB3Error EPUB3ValidateFileExistsAndSeekInArchive(EPUB3Ref epub, const char * f
   if(epub->archive == NULL) return kEPUB3ArchiveUnavailableError;
 
   EPUB3Error error = kEPUB3FileNotFoundInArchiveError;
-  if(unzLocateFile(epub->archive, filename, 1) == UNZ_OK) {
+  if(epub->archiveIndex != NULL) {
+    EPUB3ArchiveEntryPtr entry = EPUB3ArchiveIndexFindEntry(epub->archiveIndex, filename);
+    if(entry != NULL && unzGoToFilePos(epub->archive, &entry->filePos) == UNZ_OK) {
+      error = kEPUB3Success;
+    }
+  }
+  else if(unzLocateFile(epub->archive, filename, 1) == UNZ_OK) {
     error = kEPUB3Success;
   }
   return error;
@@ -1695,50 +1998,167 @@ EXPORT EPUB3Error EPUB3ExtractArchiveToPath(EPUB3Ref epub, const char * path)
   assert(epub != NULL);
   assert(path != NULL);
 
-  EPUB3Error error = kEPUB3UnknownError;
+  if(epub->archive == NULL || epub->archiveIndex == NULL) return kEPUB3ArchiveUnavailableError;
 
-  char cwd[MAXNAMLEN];
-  (void)getcwd(cwd, MAXNAMLEN);
+  // Everything below is relative to this descriptor, so the process working directory is never touched
+  int directory = EPUB3OpenDirectoryAtPath(path);
+  if(directory < 0) {
+    return kEPUB3UnknownError;
+  }
 
-  EPUB3Bool directoryReady = (chdir(path) >= 0);
+  uint32_t threadCount = epub->extractionThreadCount;
+  if(threadCount == 0) {
+    long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+    threadCount = cpuCount > 0 ? (uint32_t)cpuCount : 1;
+  }
 
-  if(!directoryReady) {
-    if(errno == ENOENT) {
-      if(mkdir(path, 0755) < 0) {
-        fprintf(stderr, "Error [%d] creating directory %s\n", errno, path);
-        error = kEPUB3UnknownError;
-      } else {
-        if(chdir(path) < 0) {
-          fprintf(stderr, "Error [%d] changing to newly created dir %s\n", errno, path);
-        } else {
-          directoryReady = kEPUB3_YES;
+  EPUB3DirectoryCachePtr cache = EPUB3DirectoryCacheCreate();
+  EPUB3Error error = EPUB3ExtractArchiveToDirectory(epub, directory, cache, threadCount);
+  EPUB3DirectoryCacheFree(cache);
+  close(directory);
+  return error;
+}
+
+EXPORT void EPUB3SetExtractionThreadCount(EPUB3Ref epub, uint32_t threadCount)
+{
+  assert(epub != NULL);
+  epub->extractionThreadCount = threadCount;
+}
+
+EXPORT void EPUB3SetExtractionUsesIOURing(EPUB3Ref epub, EPUB3Bool useIOURing)
+{
+  assert(epub != NULL);
+  epub->extractionUsesIOURing = useIOURing;
+}
+
+EXPORT void EPUB3SetIntegrityPolicy(EPUB3Ref epub, EPUB3IntegrityPolicy policy)
+{
+  assert(epub != NULL);
+  epub->integrityPolicy = policy;
+}
+
+// Opens path as a directory, creating it first if it doesn't exist
+int EPUB3OpenDirectoryAtPath(const char * path)
+{
+  assert(path != NULL);
+
+  int directory = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(directory < 0 && errno == ENOENT) {
+    if(mkdir(path, 0755) < 0 && errno != EEXIST) {
+      fprintf(stderr, "Error [%d] creating directory %s\n", errno, path);
+      return -1;
+    }
+    directory = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  }
+  if(directory < 0) {
+    fprintf(stderr, "Error [%d] opening %s\n", errno, path);
+  }
+  return directory;
+}
+
+static void * EPUB3ExtractArchiveWorker(void * info)
+{
+  EPUB3ExtractionContextPtr context = info;
+  EPUB3ArchiveIndexPtr index = context->epub->archiveIndex;
+
+  // Each worker inflates through its own cursor, so no decompression state is shared
+  unzFile cursor = EPUB3CheckOutArchiveCursor(context->epub);
+  if(cursor == NULL) {
+    (void)__sync_bool_compare_and_swap(&context->firstError, kEPUB3Success, kEPUB3ArchiveUnavailableError);
+    return NULL;
+  }
+
+#if EPUB3_HAVE_IO_URING
+  // Falls back to the synchronous writer when the kernel can't give us a ring
+  EPUB3ExtractionRingPtr ring = context->useIOURing ? EPUB3ExtractionRingCreate(context) : NULL;
+#endif
+
+  uint32_t i;
+  while((i = __sync_fetch_and_add(&context->nextEntry, 1)) < index->entryCount) {
+    EPUB3ArchiveEntryPtr entry = &index->entries[i];
+    EPUB3Error error = kEPUB3Success;
+#if EPUB3_HAVE_IO_URING
+    size_t filenameLength = strlen(entry->filename);
+    if(ring != NULL && !EPUB3ArchiveIndexEntryIsShadowed(entry) && entry->uncompressedSize <= EXTRACTION_RING_MAX_FILE_SIZE
+       && filenameLength > 0 && entry->filename[filenameLength - 1] != '/') {
+      // Counted when its close completes
+      error = EPUB3ExtractionRingQueueEntry(ring, cursor, entry);
+      if(error != kEPUB3Success) {
+        (void)__sync_bool_compare_and_swap(&context->firstError, kEPUB3Success, error);
+      }
+      if(ring->abandoned) {
+        // The rest go through the synchronous writer
+        EPUB3ExtractionRingFree(ring);
+        ring = NULL;
+      }
+      continue;
+    }
+#endif
+    // Writing in archive order lets the last of any duplicate names win; skip the others so workers can't race
+    if(!EPUB3ArchiveIndexEntryIsShadowed(entry)) {
+      error = kEPUB3FileReadFromArchiveError;
+      if(unzGoToFilePos(cursor, &entry->filePos) == UNZ_OK) {
+        EPUB3Bool verify = EPUB3ShouldVerifyEntry(context->epub, entry);
+        error = EPUB3WriteCurrentFileOfArchiveToDirectory(cursor, context->directory, context->directoryCache, verify);
+        if(error == kEPUB3Success && verify) {
+          EPUB3MarkEntryVerified(entry);
         }
       }
+    }
+    if(error == kEPUB3Success) {
+      (void)__sync_fetch_and_add(&context->filesWritten, 1);
     } else {
-      fprintf(stderr, "Error [%d] opening %s\n", errno, path);
-      error = kEPUB3UnknownError;
+      (void)__sync_bool_compare_and_swap(&context->firstError, kEPUB3Success, error);
+    }
+  }
+#if EPUB3_HAVE_IO_URING
+  if(ring != NULL) {
+    EPUB3Error error = EPUB3ExtractionRingDrain(ring);
+    if(error != kEPUB3Success) {
+      (void)__sync_bool_compare_and_swap(&context->firstError, kEPUB3Success, error);
     }
+    EPUB3ExtractionRingFree(ring);
+  }
+#endif
+  EPUB3CheckInArchiveCursor(context->epub, cursor);
+  return NULL;
+}
+
+EPUB3Error EPUB3ExtractArchiveToDirectory(EPUB3Ref epub, int directory, EPUB3DirectoryCachePtr cache, uint32_t threadCount)
+{
+  assert(epub != NULL);
+  assert(epub->archiveIndex != NULL);
+
+  EPUB3ExtractionContext context;
+  context.epub = epub;
+  context.directory = directory;
+  context.directoryCache = cache;
+  context.nextEntry = 0;
+  context.filesWritten = 0;
+  context.firstError = kEPUB3Success;
+  context.useIOURing = epub->extractionUsesIOURing;
+
+  if(threadCount > epub->archiveIndex->entryCount) {
+    threadCount = epub->archiveIndex->entryCount;
   }
 
-  if(directoryReady) {
-    if(unzGoToFirstFile(epub->archive) == UNZ_OK) {
-      int fileCount = 0;
-      do {
-        error = EPUB3WriteCurrentArchiveFileToPath(epub, path);
-        if(error == kEPUB3Success) {
-          fileCount++;
-        }
-      } while(unzGoToNextFile(epub->archive) == UNZ_OK);
-      if(fileCount == EPUB3GetFileCountInArchive(epub)) {
-        error = kEPUB3Success;
-      }
+  // The calling thread works too, so spawn one fewer
+  pthread_t threads[threadCount > 1 ? threadCount - 1 : 1];
+  uint32_t spawned = 0;
+  for(uint32_t i = 1; i < threadCount; i++) {
+    if(pthread_create(&threads[spawned], NULL, EPUB3ExtractArchiveWorker, &context) == 0) {
+      spawned++;
     }
   }
+  (void)EPUB3ExtractArchiveWorker(&context);
+  for(uint32_t i = 0; i < spawned; i++) {
+    pthread_join(threads[i], NULL);
+  }
 
-  if(chdir(cwd) < 0) {
-    fprintf(stderr, "Error [%d] changing back to starting dir %s\n", errno, cwd);
+  if(context.filesWritten == epub->archiveFileCount) {
+    return kEPUB3Success;
   }
-  return error;
+  return context.firstError != kEPUB3Success ? context.firstError : kEPUB3UnknownError;
 }
 
 EPUB3Error EPUB3CreateNestedDirectoriesForFileAtPath(const char * path)
@@ -1762,7 +2182,8 @@ EPUB3Error EPUB3CreateNestedDirectoriesForFileAtPath(const char * path)
       if(stat(pathBuildup, &st) < 0) {
         if(errno == ENOENT) {
           //Directory doesn't exist
-          if(mkdir(pathBuildup, 0755) >= 0) {
+          // Another extraction thread may have just made it
+          if(mkdir(pathBuildup, 0755) >= 0 || errno == EEXIST) {
             error = kEPUB3Success;
           } else {
             // Couldn't create dir
@@ -1787,90 +2208,724 @@ EPUB3Error EPUB3CreateNestedDirectoriesForFileAtPath(const char * path)
 
 EPUB3Error EPUB3WriteCurrentArchiveFileToPath(EPUB3Ref epub, const char * path)
 {
-  EPUB3Error error = kEPUB3Success;
-  unz_file_info fileInfo;
-  char filename[MAXNAMLEN];
-  if(unzGetCurrentFileInfo(epub->archive, &fileInfo, filename, MAXNAMLEN, NULL, 0, NULL, 0) == UNZ_OK) {
-    uLong pathlen = strlen(path) + 1U + strlen(filename) + 1U;
-    char fullpath[pathlen];
-    (void)strcpy(fullpath, path);
-    (void)strncat(fullpath, "/", 1U);
-    (void)strncat(fullpath, filename, strlen(filename));
-
-    FILE *destination = fopen(fullpath, "wb");
-    if(destination == NULL) {
-      if(errno == ENOENT) {
-        //We need to create intermediate directories
-        error = EPUB3CreateNestedDirectoriesForFileAtPath(fullpath);
-        if(error == kEPUB3Success) {
-          //Try again
-          if((destination = fopen(fullpath, "wb")) == NULL) {
-            //Failed again can't continue
-            error = kEPUB3UnknownError;
-          }
-        }
-      } else {
+  int directory = EPUB3OpenDirectoryAtPath(path);
+  if(directory < 0) {
+    return kEPUB3UnknownError;
+  }
+  EPUB3Error error = EPUB3WriteCurrentFileOfArchiveToDirectory(epub->archive, directory, NULL, epub->integrityPolicy != kEPUB3IntegritySkip);
+  close(directory);
+  return error;
+}
+
+// Rejects absolute names and any ".." component so an archive can't write outside of the destination
+static EPUB3Bool EPUB3ArchiveFilenameIsContained(const char * filename)
+{
+  if(filename[0] == '/') return kEPUB3_NO;
+
+  const char * component = filename;
+  while(component != NULL) {
+    if(component[0] == '.' && component[1] == '.' && (component[2] == '/' || component[2] == '\0')) {
+      return kEPUB3_NO;
+    }
+    component = strchr(component, '/');
+    if(component != NULL) component++;
+  }
+  return kEPUB3_YES;
+}
+
+static EPUB3Error EPUB3WriteAllBytes(int destination, const void * buffer, size_t length)
+{
+  const char * bytes = buffer;
+  while(length > 0) {
+    ssize_t written = write(destination, bytes, length);
+    if(written < 0) {
+      if(errno == EINTR) continue;
+      return kEPUB3UnknownError;
+    }
+    bytes += written;
+    length -= (size_t)written;
+  }
+  return kEPUB3Success;
+}
+
+EPUB3Error EPUB3WriteCurrentFileOfArchiveToDirectory(unzFile archive, int directory, EPUB3DirectoryCachePtr cache, EPUB3Bool verify)
+{
+  unz_file_info fileInfo;
+  char filename[MAXNAMLEN];
+  if(unzGetCurrentFileInfo(archive, &fileInfo, filename, MAXNAMLEN, NULL, 0, NULL, 0) != UNZ_OK) {
+    return kEPUB3FileReadFromArchiveError;
+  }
+
+  size_t filenameLength = strlen(filename);
+  if(filenameLength == 0 || !EPUB3ArchiveFilenameIsContained(filename)) {
+    fprintf(stderr, "Refusing to extract archive file named \"%s\"\n", filename);
+    return kEPUB3InvalidArgumentError;
+  }
+
+  EPUB3Error error = EPUB3CreateDirectoriesForArchiveFilename(directory, cache, filename);
+  if(error != kEPUB3Success || filename[filenameLength - 1] == '/') {
+    // Directory entries have no data, they only need to exist
+    return error;
+  }
+
+  int destination = openat(directory, filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if(destination < 0) {
+    return kEPUB3UnknownError;
+  }
+
+  void *buffer = malloc(FILE_EXTRACT_BUFFER_SIZE);
+  if(unzOpenCurrentFile(archive) == UNZ_OK) {
+    (void)unzSetCurrentFileCRC32Func(archive, verify ? EPUB3UnzipCRC32 : NULL);
+    int bytesRead;
+    do {
+      bytesRead = unzReadCurrentFile(archive, buffer, FILE_EXTRACT_BUFFER_SIZE);
+      if(bytesRead < 0) {
+        error = kEPUB3FileReadFromArchiveError;
+        break;
+      }
+      error = EPUB3WriteAllBytes(destination, buffer, (size_t)bytesRead);
+    } while(bytesRead > 0 && error == kEPUB3Success);
+    if(unzCloseCurrentFile(archive) == UNZ_CRCERROR && error == kEPUB3Success) {
+      fprintf(stderr, "CRC mismatch extracting %s\n", filename);
+      error = kEPUB3FileReadFromArchiveError;
+    }
+  } else {
+    error = kEPUB3FileReadFromArchiveError;
+  }
+  close(destination);
+  EPUB3_FREE_AND_NULL(buffer);
+  return error;
+}
+
+// Creates every directory above the last '/' in filename, relative to directory
+EPUB3Error EPUB3CreateDirectoriesForArchiveFilename(int directory, EPUB3DirectoryCachePtr cache, const char * filename)
+{
+  const char * lastSlash = strrchr(filename, '/');
+  if(lastSlash == NULL || lastSlash == filename) return kEPUB3Success;
+
+  size_t length = (size_t)(lastSlash - filename);
+  char relativePath[length + 1];
+  memcpy(relativePath, filename, length);
+  relativePath[length] = '\0';
+
+  // Most files land in a directory an earlier file already needed
+  if(EPUB3DirectoryCacheContains(cache, relativePath)) return kEPUB3Success;
+
+  for(size_t i = 1; i <= length; i++) {
+    if(i < length && relativePath[i] != '/') continue;
+
+    char separator = relativePath[i];
+    relativePath[i] = '\0';
+    EPUB3Error error = kEPUB3Success;
+    if(!EPUB3DirectoryCacheContains(cache, relativePath)) {
+      // Another extraction thread may have just made it
+      if(mkdirat(directory, relativePath, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Error [%d] creating directory %s\n", errno, relativePath);
         error = kEPUB3UnknownError;
+      } else {
+        EPUB3DirectoryCacheAdd(cache, relativePath);
       }
     }
-    if(destination != NULL) {
-      void *buffer = malloc(FILE_EXTRACT_BUFFER_SIZE);
-      if(unzOpenCurrentFile(epub->archive) == UNZ_OK) {
-        int bytesRead;
-        do {
-          bytesRead = unzReadCurrentFile(epub->archive, buffer, FILE_EXTRACT_BUFFER_SIZE);
-          if(bytesRead < 0) {
-            error = kEPUB3FileReadFromArchiveError;
-            break;
-          } else {
-            fwrite(buffer, 1, bytesRead, destination);
-          }
-        } while(bytesRead > 0);
-        unzCloseCurrentFile(epub->archive);
+    relativePath[i] = separator;
+    if(error != kEPUB3Success) return error;
+  }
+  return kEPUB3Success;
+}
+
+#if EPUB3_HAVE_IO_URING
+#pragma mark - io_uring Extraction Writer
+
+// user_data carries the slot and which of its three requests completed
+#define EXTRACTION_RING_OP_OPEN (0)
+#define EXTRACTION_RING_OP_WRITE (1)
+#define EXTRACTION_RING_OP_CLOSE (2)
+
+static int EPUB3ExtractionRingEnter(EPUB3ExtractionRingPtr ring, unsigned minComplete)
+{
+  unsigned flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+  for(;;) {
+    int submitted = (int)syscall(__NR_io_uring_enter, ring->fd, ring->pendingSubmissions, minComplete, flags, NULL, 0);
+    if(submitted >= 0) {
+      ring->pendingSubmissions -= (unsigned)submitted;
+      return submitted;
+    }
+    if(errno != EINTR && errno != EAGAIN && errno != EBUSY) return -1;
+    // The completion queue is full or a signal arrived; wait for anything before trying again
+    flags |= IORING_ENTER_GETEVENTS;
+    if(minComplete == 0) minComplete = 1;
+  }
+}
+
+EPUB3ExtractionRingPtr EPUB3ExtractionRingCreate(EPUB3ExtractionContextPtr context)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = (int)syscall(__NR_io_uring_setup, EXTRACTION_RING_ENTRY_COUNT, &params);
+  if(fd < 0) return NULL;
+
+  // Writes and closes refer to the descriptor their linked openat installs, which needs 5.17 or later
+  if((params.features & IORING_FEAT_LINKED_FILE) == 0) {
+    close(fd);
+    return NULL;
+  }
+
+  EPUB3ExtractionRingPtr ring = calloc(1, sizeof(EPUB3ExtractionRing));
+  if(ring == NULL) {
+    close(fd);
+    return NULL;
+  }
+  ring->fd = fd;
+  ring->context = context;
+  ring->sqEntries = params.sq_entries;
+  ring->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if(params.features & IORING_FEAT_SINGLE_MMAP) {
+    if(ring->cqMapSize > ring->sqMapSize) ring->sqMapSize = ring->cqMapSize;
+    ring->cqMapSize = ring->sqMapSize;
+  }
+  ring->sqMap = mmap(NULL, ring->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if(params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cqMap = ring->sqMap;
+  } else {
+    ring->cqMap = mmap(NULL, ring->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  }
+  ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if(ring->sqMap == MAP_FAILED || ring->cqMap == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    EPUB3ExtractionRingFree(ring);
+    return NULL;
+  }
+
+  char * sq = ring->sqMap;
+  char * cq = ring->cqMap;
+  ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+  ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+  ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+  ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  // An empty table of direct descriptors for openat to fill, one per slot
+  int files[EXTRACTION_RING_SLOT_COUNT];
+  for(uint32_t i = 0; i < EXTRACTION_RING_SLOT_COUNT; i++) {
+    files[i] = -1;
+    ring->freeSlots[i] = i;
+  }
+  ring->freeSlotCount = EXTRACTION_RING_SLOT_COUNT;
+  if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, files, EXTRACTION_RING_SLOT_COUNT) < 0) {
+    EPUB3ExtractionRingFree(ring);
+    return NULL;
+  }
+  return ring;
+}
+
+void EPUB3ExtractionRingFree(EPUB3ExtractionRingPtr ring)
+{
+  if(ring == NULL) return;
+
+  if(ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+    munmap(ring->sqes, ring->sqesSize);
+  }
+  if(ring->cqMap != NULL && ring->cqMap != MAP_FAILED && ring->cqMap != ring->sqMap) {
+    munmap(ring->cqMap, ring->cqMapSize);
+  }
+  if(ring->sqMap != NULL && ring->sqMap != MAP_FAILED) {
+    munmap(ring->sqMap, ring->sqMapSize);
+  }
+  close(ring->fd);
+  EPUB3_FREE_AND_NULL(ring);
+}
+
+static struct io_uring_sqe * EPUB3ExtractionRingGetSQE(EPUB3ExtractionRingPtr ring)
+{
+  unsigned tail = *ring->sqTail;
+  if(tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries) {
+    return NULL;
+  }
+  unsigned index = tail & *ring->sqMask;
+  struct io_uring_sqe * sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  ring->sqArray[index] = index;
+  __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+  ring->pendingSubmissions++;
+  return sqe;
+}
+
+static void EPUB3ExtractionRingReap(EPUB3ExtractionRingPtr ring)
+{
+  unsigned head = *ring->cqHead;
+  while(head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe * cqe = &ring->cqes[head & *ring->cqMask];
+    uint32_t slotIndex = (uint32_t)(cqe->user_data >> 2);
+    unsigned op = (unsigned)(cqe->user_data & 0x3);
+    EPUB3ExtractionRingSlot * slot = &ring->slots[slotIndex];
+    if(cqe->res < 0 || (op == EXTRACTION_RING_OP_WRITE && (uint32_t)cqe->res != slot->length)) {
+      slot->failed = kEPUB3_YES;
+    }
+    head++;
+
+    if(--slot->pendingCompletions == 0) {
+      if(slot->failed) {
+        (void)__sync_bool_compare_and_swap(&ring->context->firstError, kEPUB3Success, kEPUB3UnknownError);
+      } else {
+        (void)__sync_fetch_and_add(&ring->context->filesWritten, 1);
       }
-      fclose(destination);
-      EPUB3_FREE_AND_NULL(buffer);
+      EPUB3_FREE_AND_NULL(slot->buffer);
+      ring->freeSlots[ring->freeSlotCount++] = slotIndex;
     }
   }
-  return error;
+  __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+// Gives up on the ring after a failed io_uring_enter. Requests already submitted still run in the kernel and read
+// their slot's buffer, so keep reaping until only the never-submitted ones are left. If even waiting fails,
+// the buffers still in flight are leaked rather than freed under the kernel
+void EPUB3ExtractionRingAbandon(EPUB3ExtractionRingPtr ring)
+{
+  assert(ring != NULL);
+
+  EPUB3Bool settled = kEPUB3_YES;
+  for(;;) {
+    uint32_t outstanding = 0;
+    for(uint32_t i = 0; i < EXTRACTION_RING_SLOT_COUNT; i++) {
+      outstanding += ring->slots[i].pendingCompletions;
+    }
+    if(outstanding <= ring->pendingSubmissions) break;
+    if(syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+      settled = kEPUB3_NO;
+      break;
+    }
+    EPUB3ExtractionRingReap(ring);
+  }
+
+  ring->freeSlotCount = 0;
+  for(uint32_t i = 0; i < EXTRACTION_RING_SLOT_COUNT; i++) {
+    EPUB3ExtractionRingSlot * slot = &ring->slots[i];
+    if(slot->pendingCompletions > 0) {
+      (void)__sync_bool_compare_and_swap(&ring->context->firstError, kEPUB3Success, kEPUB3UnknownError);
+      slot->pendingCompletions = 0;
+      if(!settled) slot->buffer = NULL;
+    }
+    EPUB3_FREE_AND_NULL(slot->buffer);
+    ring->freeSlots[ring->freeSlotCount++] = i;
+  }
+  ring->pendingSubmissions = 0;
+  ring->abandoned = kEPUB3_YES;
+}
+
+EPUB3Error EPUB3ExtractionRingQueueEntry(EPUB3ExtractionRingPtr ring, unzFile cursor, EPUB3ArchiveEntryPtr entry)
+{
+  assert(ring != NULL);
+  assert(entry != NULL);
+
+  EPUB3ExtractionContextPtr context = ring->context;
+  if(!EPUB3ArchiveFilenameIsContained(entry->filename)) {
+    fprintf(stderr, "Refusing to extract archive file named \"%s\"\n", entry->filename);
+    return kEPUB3InvalidArgumentError;
+  }
+  EPUB3Error error = EPUB3CreateDirectoriesForArchiveFilename(context->directory, context->directoryCache, entry->filename);
+  if(error != kEPUB3Success) return error;
+
+  // Inflate the whole file now; the kernel writes it while we inflate the next one
+  uint32_t length = (uint32_t)entry->uncompressedSize; // at most EXTRACTION_RING_MAX_FILE_SIZE
+  void * buffer = malloc(length > 0 ? length : 1);
+  if(buffer == NULL) return kEPUB3UnknownError;
+  error = kEPUB3FileReadFromArchiveError;
+  EPUB3Bool verify = EPUB3ShouldVerifyEntry(context->epub, entry);
+  if(unzGoToFilePos(cursor, &entry->filePos) == UNZ_OK && unzOpenCurrentFile(cursor) == UNZ_OK) {
+    (void)unzSetCurrentFileCRC32Func(cursor, verify ? EPUB3UnzipCRC32 : NULL);
+    uint32_t total = 0;
+    int bytesRead;
+    do {
+      bytesRead = unzReadCurrentFile(cursor, (char *)buffer + total, length - total);
+      if(bytesRead > 0) total += (uint32_t)bytesRead;
+    } while(bytesRead > 0 && total < length);
+    // Closing is what checks the CRC, so the read only counts if that succeeds too
+    if(unzCloseCurrentFile(cursor) == UNZ_OK && bytesRead >= 0 && total == length) {
+      error = kEPUB3Success;
+      if(verify) EPUB3MarkEntryVerified(entry);
+    }
+  }
+  if(error != kEPUB3Success) {
+    free(buffer);
+    return error;
+  }
+
+  while(ring->freeSlotCount == 0) {
+    if(EPUB3ExtractionRingEnter(ring, 1) < 0) {
+      free(buffer);
+      EPUB3ExtractionRingAbandon(ring);
+      return kEPUB3UnknownError;
+    }
+    EPUB3ExtractionRingReap(ring);
+  }
+  uint32_t slotIndex = ring->freeSlots[--ring->freeSlotCount];
+  EPUB3ExtractionRingSlot * slot = &ring->slots[slotIndex];
+  slot->buffer = buffer;
+  slot->length = length;
+  slot->pendingCompletions = 3;
+  slot->failed = kEPUB3_NO;
+
+  // Slots never hold more than three requests each, so the submission queue always has room
+  struct io_uring_sqe * opening = EPUB3ExtractionRingGetSQE(ring);
+  opening->opcode = IORING_OP_OPENAT;
+  opening->fd = context->directory;
+  opening->addr = (uint64_t)(uintptr_t)entry->filename;
+  opening->len = 0666;
+  // Direct descriptors are never inherited, and the kernel refuses O_CLOEXEC for them
+  opening->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+  opening->file_index = slotIndex + 1;
+  opening->flags = IOSQE_IO_LINK;
+  opening->user_data = ((uint64_t)slotIndex << 2) | EXTRACTION_RING_OP_OPEN;
+
+  struct io_uring_sqe * writing = EPUB3ExtractionRingGetSQE(ring);
+  writing->opcode = IORING_OP_WRITE;
+  writing->fd = (int)slotIndex;
+  writing->addr = (uint64_t)(uintptr_t)buffer;
+  writing->len = slot->length;
+  writing->off = 0;
+  // Hard link so the close still runs if the write fails
+  writing->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+  writing->user_data = ((uint64_t)slotIndex << 2) | EXTRACTION_RING_OP_WRITE;
+
+  struct io_uring_sqe * closing = EPUB3ExtractionRingGetSQE(ring);
+  closing->opcode = IORING_OP_CLOSE;
+  closing->file_index = slotIndex + 1;
+  closing->user_data = ((uint64_t)slotIndex << 2) | EXTRACTION_RING_OP_CLOSE;
+
+  if(EPUB3ExtractionRingEnter(ring, 0) < 0) {
+    EPUB3ExtractionRingAbandon(ring);
+    return kEPUB3UnknownError;
+  }
+  EPUB3ExtractionRingReap(ring);
+  return kEPUB3Success;
+}
+
+EPUB3Error EPUB3ExtractionRingDrain(EPUB3ExtractionRingPtr ring)
+{
+  assert(ring != NULL);
+
+  while(ring->freeSlotCount < EXTRACTION_RING_SLOT_COUNT) {
+    if(EPUB3ExtractionRingEnter(ring, 1) < 0) {
+      EPUB3ExtractionRingAbandon(ring);
+      return kEPUB3UnknownError;
+    }
+    EPUB3ExtractionRingReap(ring);
+  }
+  return kEPUB3Success;
+}
+#endif
+
+#pragma mark - Directory Cache
+
+EPUB3DirectoryCachePtr EPUB3DirectoryCacheCreate(void)
+{
+  EPUB3DirectoryCachePtr cache = calloc(1, sizeof(struct EPUB3DirectoryCache));
+  if(cache != NULL) {
+    pthread_mutex_init(&cache->lock, NULL);
+  }
+  return cache;
 }
 
-EPUB3Error EPUB3CopyFileIntoBuffer(EPUB3Ref epub, void **buffer, uint32_t *bufferSize, uint32_t *bytesCopied, const char * filename)
+void EPUB3DirectoryCacheFree(EPUB3DirectoryCachePtr cache)
+{
+  if(cache == NULL) return;
+
+  for(int i = 0; i < DIRECTORY_CACHE_BUCKET_COUNT; i++) {
+    EPUB3DirectoryCacheItemPtr item = cache->buckets[i];
+    while(item != NULL) {
+      EPUB3DirectoryCacheItemPtr next = item->next;
+      EPUB3_FREE_AND_NULL(item->path);
+      EPUB3_FREE_AND_NULL(item);
+      item = next;
+    }
+  }
+  pthread_mutex_destroy(&cache->lock);
+  EPUB3_FREE_AND_NULL(cache);
+}
+
+EPUB3Bool EPUB3DirectoryCacheContains(EPUB3DirectoryCachePtr cache, const char * path)
+{
+  if(cache == NULL) return kEPUB3_NO;
+
+  uint32_t bucket = SuperFastHash(path, (int)strlen(path)) % DIRECTORY_CACHE_BUCKET_COUNT;
+  EPUB3Bool found = kEPUB3_NO;
+  pthread_mutex_lock(&cache->lock);
+  for(EPUB3DirectoryCacheItemPtr item = cache->buckets[bucket]; item != NULL; item = item->next) {
+    if(strcmp(item->path, path) == 0) {
+      found = kEPUB3_YES;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return found;
+}
+
+void EPUB3DirectoryCacheAdd(EPUB3DirectoryCachePtr cache, const char * path)
+{
+  if(cache == NULL) return;
+
+  EPUB3DirectoryCacheItemPtr item = malloc(sizeof(struct EPUB3DirectoryCacheItem));
+  if(item == NULL) return;
+  item->path = strdup(path);
+
+  uint32_t bucket = SuperFastHash(path, (int)strlen(path)) % DIRECTORY_CACHE_BUCKET_COUNT;
+  pthread_mutex_lock(&cache->lock);
+  // Duplicates from two threads racing on the same directory are harmless
+  item->next = cache->buckets[bucket];
+  cache->buckets[bucket] = item;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+#pragma mark - File and Zip Functions
+
+EPUB3Error EPUB3CopyFileIntoBuffer(EPUB3Ref epub, void **buffer, uint64_t *bufferSize, uint64_t *bytesCopied, const char * filename)
 {
   assert(epub != NULL);
   assert(filename != NULL);
   assert(buffer != NULL);
 
+  if(epub->archive == NULL || epub->archiveIndex == NULL) return kEPUB3ArchiveUnavailableError;
+
+  EPUB3ArchiveEntryPtr entry = EPUB3ArchiveIndexFindEntry(epub->archiveIndex, filename);
+  if(entry == NULL) return kEPUB3FileNotFoundInArchiveError;
+  // Files too large to address are left to EPUB3EntryReader
+  if(entry->uncompressedSize > SIZE_MAX) return kEPUB3FileReadFromArchiveError;
+  EPUB3SpinePrefetcherNoteRead(epub, entry);
+
+  uint64_t bufSize = entry->uncompressedSize;
+  uint64_t copied = 0;
+  EPUB3Error error = kEPUB3Success;
+  // With the entry cache on, a repeat read is a copy instead of an inflate
+  EPUB3EntryDataRef data = NULL;
+  uint64_t byteBudget = __atomic_load_n(&epub->entryCache.byteBudget, __ATOMIC_RELAXED);
+  EPUB3Bool useCache = byteBudget > 0 && bufSize <= byteBudget;
+  if(useCache) {
+    data = EPUB3EntryCacheCopyData(epub, entry);
+  }
+  *buffer = malloc(bufSize > 0 ? (size_t)bufSize : 1);
+  if(*buffer == NULL) {
+    EPUB3EntryDataRelease(data);
+    return kEPUB3UnknownError;
+  }
+  if(data != NULL) {
+    copied = data->length < bufSize ? data->length : bufSize;
+    memcpy(*buffer, data->bytes, (size_t)copied);
+    memset((char *)*buffer + copied, 0, (size_t)(bufSize - copied));
+    EPUB3EntryDataRelease(data);
+  } else {
+    // A miss inflates straight into the caller's buffer; the cache only gets a copy of complete files
+    error = EPUB3ReadEntryIntoBuffer(epub, entry, *buffer, &copied);
+    if(error == kEPUB3Success && useCache && copied == bufSize) {
+      data = EPUB3EntryDataCreate(copied);
+      if(data != NULL) {
+        memcpy(data->bytes, *buffer, (size_t)copied);
+        EPUB3EntryCacheAdd(epub, entry, data);
+        EPUB3EntryDataRelease(data);
+      }
+    }
+  }
+  if(error != kEPUB3Success) {
+    EPUB3_FREE_AND_NULL(*buffer);
+    return error;
+  }
+  if(bytesCopied != NULL) {
+    *bytesCopied = copied;
+  }
+  if(bufferSize != NULL) {
+    *bufferSize = bufSize;
+  }
+  return kEPUB3Success;
+}
+
+// Reads a whole file into destination, which must hold entry->uncompressedSize bytes. bytesCopied comes up short
+// only when the archive holds less than its central directory claims
+EPUB3Error EPUB3ReadEntryIntoBuffer(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, void * destination, uint64_t * bytesCopied)
+{
+  assert(epub != NULL);
+  assert(entry != NULL);
+  assert(bytesCopied != NULL);
+
+  // The size is known up front, so most files need neither the cursor nor its staging buffer
+  if(EPUB3CanReadEntryInOneShot(epub, entry)) {
+    EPUB3Error error = EPUB3ReadEntryInOneShot(epub, entry, destination);
+    *bytesCopied = error == kEPUB3Success ? entry->uncompressedSize : 0;
+    return error;
+  }
+
+  // A private cursor keeps this safe to call from several threads at once
+  unzFile cursor = EPUB3CheckOutArchiveCursor(epub);
+  if(cursor == NULL) return kEPUB3ArchiveUnavailableError;
+
+  EPUB3Error error = kEPUB3FileReadFromArchiveError;
+  EPUB3Bool verify = EPUB3ShouldVerifyEntry(epub, entry);
+  if(unzGoToFilePos(cursor, &entry->filePos) == UNZ_OK && unzOpenCurrentFile(cursor) == UNZ_OK) {
+    (void)unzSetCurrentFileCRC32Func(cursor, verify ? EPUB3UnzipCRC32 : NULL);
+    uint64_t bufSize = entry->uncompressedSize;
+    // unzReadCurrentFile returns an int, so larger files come out in pieces
+    uint64_t copied = 0;
+    int32_t copiedThisTime;
+    do {
+      uint64_t remaining = bufSize - copied;
+      copiedThisTime = unzReadCurrentFile(cursor, (char *)destination + copied, remaining > INT_MAX ? INT_MAX : (unsigned)remaining);
+      if(copiedThisTime > 0) copied += (uint64_t)copiedThisTime;
+    } while(copiedThisTime > 0 && copied < bufSize);
+    if(copiedThisTime >= 0) {
+      memset((char *)destination + copied, 0, (size_t)(bufSize - copied));
+      *bytesCopied = copied;
+      error = kEPUB3Success;
+    }
+    if(unzCloseCurrentFile(cursor) == UNZ_CRCERROR) {
+      error = kEPUB3FileReadFromArchiveError;
+    }
+    if(error == kEPUB3Success && verify) {
+      EPUB3MarkEntryVerified(entry);
+    }
+  }
+  EPUB3CheckInArchiveCursor(epub, cursor);
+  return error;
+}
+
+static inline uint32_t EPUB3ReadLittleEndian16(const uint8_t * bytes)
+{
+  return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8);
+}
+
+static inline uint32_t EPUB3ReadLittleEndian32(const uint8_t * bytes)
+{
+  return EPUB3ReadLittleEndian16(bytes) | (EPUB3ReadLittleEndian16(bytes + 2) << 16);
+}
+
+EPUB3Error EPUB3GetDataOffsetOfEntryInArchive(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, uint64_t * dataOffset)
+{
+  assert(epub != NULL);
+  assert(entry != NULL);
+  assert(dataOffset != NULL);
+
+  uint64_t archiveSize;
+  uint64_t headerOffset = entry->localHeaderOffset;
+  uint8_t headerBytes[ZIP_LOCAL_HEADER_SIZE];
+  const uint8_t * header = headerBytes;
+
+  if(epub->archiveMemory.base != NULL) {
+    archiveSize = epub->archiveMemory.size;
+    if(headerOffset + ZIP_LOCAL_HEADER_SIZE > archiveSize) return kEPUB3FileReadFromArchiveError;
+    header = (const uint8_t *)epub->archiveMemory.base + headerOffset;
+  }
+  else if(epub->archiveFile.fd >= 0 || epub->archiveBlockCache != NULL) {
+    archiveSize = epub->archiveBlockCache != NULL ? epub->archiveBlockCache->callbacks.size : epub->archiveFile.size;
+    if(headerOffset + ZIP_LOCAL_HEADER_SIZE > archiveSize) return kEPUB3FileReadFromArchiveError;
+    EPUB3Error error = EPUB3ReadArchiveBytes(epub, headerOffset, headerBytes, ZIP_LOCAL_HEADER_SIZE);
+    if(error != kEPUB3Success) return error;
+  }
+  else {
+    return kEPUB3ArchiveUnavailableError;
+  }
+
+  if(EPUB3ReadLittleEndian32(header) != ZIP_LOCAL_HEADER_SIGNATURE) return kEPUB3FileReadFromArchiveError;
+
+  // The local name and extra field lengths may differ from the central directory's copies
+  uint64_t offset = headerOffset + ZIP_LOCAL_HEADER_SIZE
+    + EPUB3ReadLittleEndian16(header + ZIP_LOCAL_HEADER_FILENAME_LENGTH_OFFSET)
+    + EPUB3ReadLittleEndian16(header + ZIP_LOCAL_HEADER_EXTRA_LENGTH_OFFSET);
+  if(entry->compressedSize > archiveSize || offset > archiveSize - entry->compressedSize) return kEPUB3FileReadFromArchiveError;
+
+  *dataOffset = offset;
+  return kEPUB3Success;
+}
+
+EXPORT EPUB3Error EPUB3GetBytesOfStoredFileInArchive(EPUB3Ref epub, const char * path, const void ** bytes, uint64_t * byteCount)
+{
+  assert(epub != NULL);
+  assert(path != NULL);
+  assert(bytes != NULL);
+  assert(byteCount != NULL);
+
   if(epub->archive == NULL) return kEPUB3ArchiveUnavailableError;
+  if(epub->archiveIndex == NULL || epub->archiveMemory.base == NULL) return kEPUB3FileNotStoredInArchiveError;
 
-  EPUB3Error error = kEPUB3InvalidArgumentError;
-  if(filename != NULL) {
-    uint32_t bufSize = 1;
-    error = EPUB3GetUncompressedSizeOfFileInArchive(epub, &bufSize, filename);
+  EPUB3ArchiveEntryPtr entry = EPUB3ArchiveIndexFindEntry(epub->archiveIndex, path);
+  if(entry == NULL) return kEPUB3FileNotFoundInArchiveError;
+  if(entry->compressionMethod != 0 || (entry->flag & ZIP_FLAG_ENCRYPTED) != 0) return kEPUB3FileNotStoredInArchiveError;
+  // Only the compressed size is checked against the archive, so a stored file has to have the same size both ways
+  if(entry->compressedSize != entry->uncompressedSize) return kEPUB3FileReadFromArchiveError;
+
+  uint64_t dataOffset = 0;
+  EPUB3Error error = EPUB3GetDataOffsetOfEntryInArchive(epub, entry, &dataOffset);
+  if(error == kEPUB3Success) {
+    *bytes = (const uint8_t *)epub->archiveMemory.base + dataOffset;
+    *byteCount = entry->compressedSize;
+  }
+  return error;
+}
+
+EXPORT EPUB3Error EPUB3GetOrCopyBytesOfFileInArchive(EPUB3Ref epub, const char * path, const void ** bytes, uint64_t * byteCount, EPUB3Bool * isCopy)
+{
+  assert(epub != NULL);
+  assert(path != NULL);
+  assert(bytes != NULL);
+  assert(byteCount != NULL);
+  assert(isCopy != NULL);
+
+  *isCopy = kEPUB3_NO;
+  EPUB3Error error = EPUB3GetBytesOfStoredFileInArchive(epub, path, bytes, byteCount);
+  if(error == kEPUB3FileNotStoredInArchiveError) {
+    void * buffer = NULL;
+    uint64_t bufferSize = 0;
+    error = EPUB3CopyFileIntoBuffer(epub, &buffer, &bufferSize, NULL, path);
     if(error == kEPUB3Success) {
-      if(unzOpenCurrentFile(epub->archive) == UNZ_OK) {
-        *buffer = calloc(bufSize, sizeof(char));
-        int32_t copied = unzReadCurrentFile(epub->archive, *buffer, bufSize);
-        if(copied >= 0) {
-          if(bytesCopied != NULL) {
-            *bytesCopied = copied;
-          }
-          if(bufferSize != NULL) {
-            *bufferSize = bufSize;
-          }
-          error = kEPUB3Success;
-        } else {
-          free(*buffer);
-          *buffer = NULL;
-          error = kEPUB3FileReadFromArchiveError;
-        }
-      }
+      *bytes = buffer;
+      *byteCount = bufferSize;
+      *isCopy = kEPUB3_YES;
     }
   }
   return error;
 }
 
-EPUB3Error EPUB3GetUncompressedSizeOfFileInArchive(EPUB3Ref epub, uint32_t *uncompressedSize, const char *filename)
+EXPORT EPUB3Error EPUB3GetOrCopyRawBytesOfFileInArchive(EPUB3Ref epub, const char * path, const void ** bytes, EPUB3ArchiveEntryInfo * info, EPUB3Bool * isCopy)
+{
+  assert(epub != NULL);
+  assert(path != NULL);
+  assert(bytes != NULL);
+  assert(info != NULL);
+  assert(isCopy != NULL);
+
+  *isCopy = kEPUB3_NO;
+  if(epub->archive == NULL || epub->archiveIndex == NULL) return kEPUB3ArchiveUnavailableError;
+
+  EPUB3ArchiveEntryPtr entry = EPUB3ArchiveIndexFindEntry(epub->archiveIndex, path);
+  if(entry == NULL) return kEPUB3FileNotFoundInArchiveError;
+  // Encrypted payloads and methods other than store and deflate are no use to a caller without the archive
+  if((entry->flag & ZIP_FLAG_ENCRYPTED) != 0 || (entry->compressionMethod != 0 && entry->compressionMethod != Z_DEFLATED)) {
+    return kEPUB3FileEncodingNotSupportedError;
+  }
+  if(entry->compressedSize > SIZE_MAX) return kEPUB3FileReadFromArchiveError;
+
+  uint64_t dataOffset = 0;
+  EPUB3Error error = EPUB3GetDataOffsetOfEntryInArchive(epub, entry, &dataOffset);
+  if(error != kEPUB3Success) return error;
+
+  if(epub->archiveMemory.base != NULL) {
+    *bytes = (const uint8_t *)epub->archiveMemory.base + dataOffset;
+  }
+  else {
+    void * buffer = malloc(entry->compressedSize > 0 ? (size_t)entry->compressedSize : 1);
+    if(buffer == NULL) return kEPUB3UnknownError;
+    error = EPUB3ReadArchiveBytes(epub, dataOffset, buffer, (size_t)entry->compressedSize);
+    if(error != kEPUB3Success) {
+      EPUB3_FREE_AND_NULL(buffer);
+      return error;
+    }
+    *bytes = buffer;
+    *isCopy = kEPUB3_YES;
+  }
+  EPUB3ArchiveEntryGetInfo(entry, info);
+  return kEPUB3Success;
+}
+
+EPUB3Error EPUB3GetUncompressedSizeOfFileInArchive(EPUB3Ref epub, uint64_t *uncompressedSize, const char *filename)
 {
   assert(epub != NULL);
   assert(filename != NULL);
@@ -1878,11 +2933,19 @@ EPUB3Error EPUB3GetUncompressedSizeOfFileInArchive(EPUB3Ref epub, uint32_t *unco
 
   if(epub->archive == NULL) return kEPUB3ArchiveUnavailableError;
 
+  if(epub->archiveIndex != NULL) {
+    // Answered from the index without touching the shared cursor
+    EPUB3ArchiveEntryPtr entry = EPUB3ArchiveIndexFindEntry(epub->archiveIndex, filename);
+    if(entry == NULL) return kEPUB3FileNotFoundInArchiveError;
+    *uncompressedSize = entry->uncompressedSize;
+    return kEPUB3Success;
+  }
+
   EPUB3Error error = EPUB3ValidateFileExistsAndSeekInArchive(epub, filename);
   if(error == kEPUB3Success) {
     unz_file_info fileInfo;
     if(unzGetCurrentFileInfo(epub->archive, &fileInfo, NULL, 0, NULL, 0, NULL, 0) == UNZ_OK) {
-      *uncompressedSize = (uint32_t)fileInfo.uncompressed_size;
+      *uncompressedSize = (uint64_t)fileInfo.uncompressed_size;
       error = kEPUB3Success;
     }
   }
@@ -1949,3 +3012,4380 @@ char * EPUB3CopyOfPathByAppendingPathComponent(const char * path, const char * c
   return strdup(fullpath);
 }
 
+#pragma mark - Integrity
+
+EPUB3Bool EPUB3ShouldVerifyEntry(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry)
+{
+  switch(epub->integrityPolicy) {
+    case kEPUB3IntegritySkip:
+      return kEPUB3_NO;
+    case kEPUB3IntegrityVerifyOnce:
+      return __atomic_load_n(&entry->verified, __ATOMIC_ACQUIRE) == 0;
+    default:
+      return kEPUB3_YES;
+  }
+}
+
+void EPUB3MarkEntryVerified(EPUB3ArchiveEntryPtr entry)
+{
+  __atomic_store_n(&entry->verified, 1, __ATOMIC_RELEASE);
+}
+
+#if EPUB3_HAVE_CLMUL_CRC32
+// Folds 64 bytes per iteration with carry-less multiplies and Barrett-reduces the result, after "Fast CRC
+// Computation for Generic Polynomials Using PCLMULQDQ" (Intel, 2009). Takes and returns the crc inverted, and
+// needs length to be a multiple of 16 of at least 64.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t EPUB3CRC32WithCLMUL(uint32_t crc, const uint8_t * bytes, size_t length)
+{
+  static const uint64_t k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+  static const uint64_t k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+  static const uint64_t k5k0[] = { 0x0163cd6124, 0x0000000000 };
+  static const uint64_t poly[] = { 0x01db710641, 0x01f7011641 };
+
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+  x1 = _mm_loadu_si128((const __m128i *)(bytes + 0x00));
+  x2 = _mm_loadu_si128((const __m128i *)(bytes + 0x10));
+  x3 = _mm_loadu_si128((const __m128i *)(bytes + 0x20));
+  x4 = _mm_loadu_si128((const __m128i *)(bytes + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+  x0 = _mm_loadu_si128((const __m128i *)k1k2);
+  bytes += 64;
+  length -= 64;
+
+  while(length >= 64) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(bytes + 0x00)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(bytes + 0x10)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(bytes + 0x20)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(bytes + 0x30)));
+    bytes += 64;
+    length -= 64;
+  }
+
+  // Fold the four lanes into one
+  x0 = _mm_loadu_si128((const __m128i *)k3k4);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  while(length >= 16) {
+    x2 = _mm_loadu_si128((const __m128i *)bytes);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    bytes += 16;
+    length -= 16;
+  }
+
+  // 128 bits down to 64
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+  x1 = _mm_srli_si128(x1, 8);
+  x1 = _mm_xor_si128(x1, x2);
+  x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, x3);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction to 32 bits
+  x0 = _mm_loadu_si128((const __m128i *)poly);
+  x2 = _mm_and_si128(x1, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+  x2 = _mm_and_si128(x2, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+#endif
+
+// The zip CRC-32, continuing from crc like zlib's crc32(). Uses the ARMv8 CRC32 instructions or x86 PCLMULQDQ
+// when they're available and zlib otherwise.
+uint32_t EPUB3CRC32(uint32_t crc, const void * bytes, size_t length)
+{
+  const uint8_t * cursor = bytes;
+#if EPUB3_HAVE_ARM_CRC32
+  crc = ~crc;
+  while(length >= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, cursor, sizeof(word));
+    crc = __crc32d(crc, word);
+    cursor += sizeof(word);
+    length -= sizeof(word);
+  }
+  while(length > 0) {
+    crc = __crc32b(crc, *cursor++);
+    length--;
+  }
+  return ~crc;
+#else
+#if EPUB3_HAVE_CLMUL_CRC32
+  if(length >= 64 && __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+    size_t folded = length & ~(size_t)15;
+    crc = ~EPUB3CRC32WithCLMUL(~crc, cursor, folded);
+    cursor += folded;
+    length -= folded;
+  }
+#endif
+  while(length > 0) {
+    uInt chunk = length > UINT32_MAX ? UINT32_MAX : (uInt)length;
+    crc = (uint32_t)crc32(crc, cursor, chunk);
+    cursor += chunk;
+    length -= chunk;
+  }
+  return crc;
+#endif
+}
+
+// Lets MiniZip check files with EPUB3CRC32 as it inflates them
+uLong EPUB3UnzipCRC32(uLong crc, const Bytef * bytes, uInt length)
+{
+  return EPUB3CRC32((uint32_t)crc, bytes, length);
+}
+
+#pragma mark - Single Shot Inflate
+
+static EPUB3RawInflateFunction EPUB3CurrentRawInflateFunction = EPUB3RawInflateWithZlib;
+
+EXPORT void EPUB3SetRawInflateFunction(EPUB3RawInflateFunction inflateFunction)
+{
+  __atomic_store_n(&EPUB3CurrentRawInflateFunction, inflateFunction != NULL ? inflateFunction : EPUB3RawInflateWithZlib, __ATOMIC_RELEASE);
+}
+
+EPUB3Bool EPUB3RawInflateWithZlib(const void * source, size_t sourceSize, void * destination, size_t destinationSize)
+{
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  // Negative window bits: zip entries are raw deflate with no zlib header
+  if(inflateInit2(&stream, -MAX_WBITS) != Z_OK) return kEPUB3_NO;
+
+  // avail_in and avail_out are only 32 bits wide, so anything over 4 GB is fed through in pieces
+  const Bytef * input = source;
+  Bytef * output = destination;
+  size_t inputLeft = sourceSize;
+  size_t outputLeft = destinationSize;
+  size_t consumed, produced;
+  int status;
+  do {
+    uInt inputChunk = inputLeft > UINT_MAX ? UINT_MAX : (uInt)inputLeft;
+    uInt outputChunk = outputLeft > UINT_MAX ? UINT_MAX : (uInt)outputLeft;
+    stream.next_in = (Bytef *)input;
+    stream.avail_in = inputChunk;
+    stream.next_out = output;
+    stream.avail_out = outputChunk;
+    status = inflate(&stream, Z_NO_FLUSH);
+    consumed = inputChunk - stream.avail_in;
+    produced = outputChunk - stream.avail_out;
+    input += consumed;
+    inputLeft -= consumed;
+    output += produced;
+    outputLeft -= produced;
+  } while(status == Z_OK && (consumed > 0 || produced > 0));
+  EPUB3Bool inflated = (status == Z_STREAM_END && outputLeft == 0);
+  (void)inflateEnd(&stream);
+  return inflated;
+}
+
+// Stored and deflated files in mapped, in-memory or pread-able archives can skip the unzip cursor
+EPUB3Bool EPUB3CanReadEntryInOneShot(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry)
+{
+  if(epub->archiveMemory.base == NULL && epub->archiveFile.fd < 0 && epub->archiveBlockCache == NULL) return kEPUB3_NO;
+  if((entry->flag & ZIP_FLAG_ENCRYPTED) != 0) return kEPUB3_NO;
+  return entry->compressionMethod == 0 || entry->compressionMethod == Z_DEFLATED;
+}
+
+// Reads the whole compressed payload with one copy or pread and inflates it with one call, straight into
+// destination, which must hold entry->uncompressedSize bytes
+EPUB3Error EPUB3ReadEntryInOneShot(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, void * destination)
+{
+  assert(epub != NULL);
+  assert(entry != NULL);
+  assert(destination != NULL || entry->uncompressedSize == 0);
+
+  uint64_t dataOffset = 0;
+  EPUB3Error error = EPUB3GetDataOffsetOfEntryInArchive(epub, entry, &dataOffset);
+  if(error != kEPUB3Success) return error;
+
+  if(entry->compressionMethod == 0 && entry->compressedSize != entry->uncompressedSize) {
+    return kEPUB3FileReadFromArchiveError;
+  }
+  if(entry->compressedSize > SIZE_MAX || entry->uncompressedSize > SIZE_MAX) {
+    return kEPUB3FileReadFromArchiveError;
+  }
+
+  const void * payload = NULL;
+  void * payloadCopy = NULL;
+  if(epub->archiveMemory.base != NULL) {
+    payload = (const uint8_t *)epub->archiveMemory.base + dataOffset;
+    if(entry->compressionMethod == 0) {
+      memcpy(destination, payload, (size_t)entry->uncompressedSize);
+    }
+  }
+  else {
+    // Stored files go straight into the destination, deflated ones need their compressed bytes first
+    void * target = destination;
+    if(entry->compressionMethod != 0) {
+      payloadCopy = malloc(entry->compressedSize > 0 ? (size_t)entry->compressedSize : 1);
+      if(payloadCopy == NULL) return kEPUB3UnknownError;
+      target = payloadCopy;
+    }
+    error = EPUB3ReadArchiveBytes(epub, dataOffset, target, (size_t)entry->compressedSize);
+    if(error != kEPUB3Success) {
+      EPUB3_FREE_AND_NULL(payloadCopy);
+      return error;
+    }
+    payload = payloadCopy;
+  }
+
+  if(entry->compressionMethod != 0) {
+    EPUB3RawInflateFunction inflateFunction = __atomic_load_n(&EPUB3CurrentRawInflateFunction, __ATOMIC_ACQUIRE);
+    if(!inflateFunction(payload, (size_t)entry->compressedSize, destination, (size_t)entry->uncompressedSize)) {
+      error = kEPUB3FileReadFromArchiveError;
+    }
+  }
+  EPUB3_FREE_AND_NULL(payloadCopy);
+
+  if(error == kEPUB3Success && EPUB3ShouldVerifyEntry(epub, entry)) {
+    if(EPUB3CRC32(0, destination, (size_t)entry->uncompressedSize) != entry->crc) {
+      error = kEPUB3FileReadFromArchiveError;
+    } else {
+      EPUB3MarkEntryVerified(entry);
+    }
+  }
+  return error;
+}
+
+#pragma mark - Entry Reader
+
+EXPORT EPUB3Error EPUB3EntryReaderOpen(EPUB3Ref epub, const char * path, EPUB3EntryReaderRef * reader)
+{
+  assert(epub != NULL);
+  assert(path != NULL);
+  assert(reader != NULL);
+
+  *reader = NULL;
+  if(epub->archive == NULL || epub->archiveIndex == NULL) return kEPUB3ArchiveUnavailableError;
+
+  EPUB3ArchiveEntryPtr entry = EPUB3ArchiveIndexFindEntry(epub->archiveIndex, path);
+  if(entry == NULL) return kEPUB3FileNotFoundInArchiveError;
+  EPUB3SpinePrefetcherNoteRead(epub, entry);
+
+  unzFile cursor = EPUB3CheckOutArchiveCursor(epub);
+  if(cursor == NULL) return kEPUB3ArchiveUnavailableError;
+
+  if(unzGoToFilePos(cursor, &entry->filePos) != UNZ_OK || unzOpenCurrentFile(cursor) != UNZ_OK) {
+    EPUB3CheckInArchiveCursor(epub, cursor);
+    return kEPUB3FileReadFromArchiveError;
+  }
+  (void)unzSetCurrentFileCRC32Func(cursor, EPUB3ShouldVerifyEntry(epub, entry) ? EPUB3UnzipCRC32 : NULL);
+
+  EPUB3EntryReaderRef memory = malloc(sizeof(struct EPUB3EntryReader));
+  memory = EPUB3ObjectInitWithTypeID(memory, kEPUB3EntryReaderTypeID);
+  EPUB3Retain(epub);
+  memory->epub = epub;
+  memory->archive = cursor;
+  memory->entry = entry;
+  memory->bytesRemaining = entry->uncompressedSize;
+  *reader = memory;
+  return kEPUB3Success;
+}
+
+EXPORT uint64_t EPUB3EntryReaderGetUncompressedSize(EPUB3EntryReaderRef reader)
+{
+  assert(reader != NULL);
+  return reader->entry->uncompressedSize;
+}
+
+EXPORT EPUB3Error EPUB3EntryReaderRead(EPUB3EntryReaderRef reader, void * buffer, uint32_t bufferSize, uint32_t * bytesRead)
+{
+  assert(reader != NULL);
+  assert(buffer != NULL);
+  assert(bytesRead != NULL);
+
+  *bytesRead = 0;
+  if(bufferSize == 0 || reader->bytesRemaining == 0) return kEPUB3Success;
+
+  // MiniZip counts what it read in an int, so larger requests come back short
+  if(bufferSize > INT_MAX) bufferSize = INT_MAX;
+  int copied = unzReadCurrentFile(reader->archive, buffer, bufferSize);
+  if(copied < 0) {
+    return kEPUB3FileReadFromArchiveError;
+  }
+  *bytesRead = (uint32_t)copied;
+  reader->bytesRemaining -= (uint32_t)copied;
+  return kEPUB3Success;
+}
+
+EXPORT EPUB3Error EPUB3EntryReaderClose(EPUB3EntryReaderRef reader)
+{
+  if(reader == NULL) return kEPUB3InvalidArgumentError;
+
+  EPUB3Error error = kEPUB3Success;
+  if(unzCloseCurrentFile(reader->archive) != UNZ_OK) {
+    error = kEPUB3FileReadFromArchiveError;
+  } else if(reader->bytesRemaining == 0 && EPUB3ShouldVerifyEntry(reader->epub, reader->entry)) {
+    // The CRC is only checked once every byte has been read
+    EPUB3MarkEntryVerified(reader->entry);
+  }
+  EPUB3CheckInArchiveCursor(reader->epub, reader->archive);
+  reader->archive = NULL;
+  reader->entry = NULL;
+  EPUB3Release(reader->epub);
+  reader->epub = NULL;
+  EPUB3ObjectRelease(reader);
+  return error;
+}
+
+#pragma mark - Entry Resolution
+
+static int EPUB3CompareEntryInfoOffsets(const void * a, const void * b)
+{
+  const EPUB3EntryInfo * first = a;
+  const EPUB3EntryInfo * second = b;
+  if(first->found != second->found) return first->found ? -1 : 1;
+  if(first->localHeaderOffset != second->localHeaderOffset) return first->localHeaderOffset < second->localHeaderOffset ? -1 : 1;
+  return first->hrefIndex < second->hrefIndex ? -1 : first->hrefIndex > second->hrefIndex;
+}
+
+EXPORT EPUB3Error EPUB3ResolveEntries(EPUB3Ref epub, const char ** hrefs, uint32_t hrefCount, EPUB3EntryInfo * entries)
+{
+  assert(epub != NULL);
+  assert(hrefs != NULL || hrefCount == 0);
+  assert(entries != NULL || hrefCount == 0);
+
+  if(epub->archive == NULL || epub->archiveIndex == NULL) return kEPUB3ArchiveUnavailableError;
+
+  const char * rootPath = NULL;
+  EPUB3Error error = EPUB3GetRootPath(epub, &rootPath);
+  if(error != kEPUB3Success) return error;
+
+  for(uint32_t i = 0; i < hrefCount; i++) {
+    EPUB3EntryInfo * info = &entries[i];
+    memset(info, 0, sizeof(*info));
+    info->hrefIndex = i;
+    char * path = hrefs[i] != NULL ? EPUB3CopyOfArchivePathForHref(rootPath, hrefs[i]) : NULL;
+    EPUB3ArchiveEntryPtr entry = path != NULL ? EPUB3ArchiveIndexFindEntry(epub->archiveIndex, path) : NULL;
+    EPUB3_FREE_AND_NULL(path);
+    if(entry == NULL) continue;
+    info->found = kEPUB3_YES;
+    info->path = entry->filename;
+    info->compressedSize = entry->compressedSize;
+    info->uncompressedSize = entry->uncompressedSize;
+    info->localHeaderOffset = entry->localHeaderOffset;
+    info->crc = entry->crc;
+    info->compressionMethod = entry->compressionMethod;
+  }
+
+  if(hrefCount > 1) {
+    qsort(entries, hrefCount, sizeof(EPUB3EntryInfo), EPUB3CompareEntryInfoOffsets);
+  }
+  return kEPUB3Success;
+}
+
+static int EPUB3HexDigitValue(char c)
+{
+  if(c >= '0' && c <= '9') return c - '0';
+  if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Joins href onto rootPath, the OPF's directory, the way a reading system resolves it. Returns NULL for URLs with
+// a scheme, for paths that climb out of the archive and for escapes of NUL or '/', which no archive name matches
+char * EPUB3CopyOfArchivePathForHref(const char * rootPath, const char * href)
+{
+  assert(rootPath != NULL);
+  assert(href != NULL);
+
+  size_t schemeLength = strcspn(href, ":/?#");
+  if(href[schemeLength] == ':') return NULL;
+
+  size_t rootLength = href[0] == '/' ? 0 : strlen(rootPath);
+  char * path = malloc(rootLength + strlen(href) + 2U);
+  size_t length = 0;
+  if(rootLength > 0) {
+    memcpy(path, rootPath, rootLength);
+    length = rootLength;
+    if(path[length - 1] != '/') {
+      path[length++] = '/';
+    }
+  }
+  for(const char * c = href; *c != '\0' && *c != '#' && *c != '?'; c++) {
+    int high = *c == '%' ? EPUB3HexDigitValue(c[1]) : -1;
+    int low = high >= 0 ? EPUB3HexDigitValue(c[2]) : -1;
+    if(low >= 0) {
+      char decoded = (char)(high << 4 | low);
+      if(decoded == '\0' || decoded == '/') {
+        EPUB3_FREE_AND_NULL(path);
+        return NULL;
+      }
+      path[length++] = decoded;
+      c += 2;
+    } else {
+      path[length++] = *c;
+    }
+  }
+
+  // Fold the segments in place. The output never gets ahead of the input
+  size_t folded = 0;
+  size_t i = 0;
+  while(i < length) {
+    size_t start = i;
+    while(i < length && path[i] != '/') {
+      i++;
+    }
+    size_t segmentLength = i - start;
+    i++;
+    if(segmentLength == 0 || (segmentLength == 1 && path[start] == '.')) continue;
+    if(segmentLength == 2 && path[start] == '.' && path[start + 1] == '.') {
+      if(folded == 0) {
+        EPUB3_FREE_AND_NULL(path);
+        return NULL;
+      }
+      while(folded > 0 && path[folded - 1] != '/') {
+        folded--;
+      }
+      if(folded > 0) {
+        folded--;
+      }
+      continue;
+    }
+    if(folded > 0) {
+      path[folded++] = '/';
+    }
+    memmove(path + folded, path + start, segmentLength);
+    folded += segmentLength;
+  }
+  if(folded == 0) {
+    EPUB3_FREE_AND_NULL(path);
+    return NULL;
+  }
+  path[folded] = '\0';
+  return path;
+}
+
+#pragma mark - Range Reads
+
+EXPORT EPUB3Error EPUB3ReadEntryRange(EPUB3Ref epub, const char * path, uint64_t offset, uint64_t length, void * buffer, uint64_t * bytesRead)
+{
+  assert(epub != NULL);
+  assert(path != NULL);
+  assert(buffer != NULL || length == 0);
+  assert(bytesRead != NULL);
+
+  *bytesRead = 0;
+  if(epub->archive == NULL || epub->archiveIndex == NULL) return kEPUB3ArchiveUnavailableError;
+
+  EPUB3ArchiveEntryPtr entry = EPUB3ArchiveIndexFindEntry(epub->archiveIndex, path);
+  if(entry == NULL) return kEPUB3FileNotFoundInArchiveError;
+  if(length == 0 || offset >= entry->uncompressedSize) return kEPUB3Success;
+  if(length > entry->uncompressedSize - offset) {
+    length = entry->uncompressedSize - offset;
+  }
+  if(length > SIZE_MAX) return kEPUB3InvalidArgumentError;
+
+  EPUB3Error error = kEPUB3Success;
+  if(!EPUB3CanReadEntryInOneShot(epub, entry)) {
+    // Without direct access to the compressed bytes the only way in is from the start
+    error = EPUB3ReadEntryRangeWithReader(epub, path, offset, length, buffer);
+  } else if(entry->compressionMethod == 0) {
+    error = EPUB3ReadStoredEntryRange(epub, entry, offset, length, buffer);
+  } else {
+    error = EPUB3ReadDeflatedEntryRange(epub, entry, offset, length, buffer);
+  }
+  if(error == kEPUB3Success) {
+    *bytesRead = length;
+  }
+  return error;
+}
+
+EPUB3Error EPUB3ReadStoredEntryRange(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, uint64_t offset, uint64_t length, void * buffer)
+{
+  if(entry->compressedSize != entry->uncompressedSize) return kEPUB3FileReadFromArchiveError;
+
+  uint64_t dataOffset = 0;
+  EPUB3Error error = EPUB3GetDataOffsetOfEntryInArchive(epub, entry, &dataOffset);
+  if(error != kEPUB3Success) return error;
+  if(epub->archiveMemory.base != NULL) {
+    memcpy(buffer, (const uint8_t *)epub->archiveMemory.base + dataOffset + offset, (size_t)length);
+    return kEPUB3Success;
+  }
+  return EPUB3ReadArchiveBytes(epub, dataOffset + offset, buffer, (size_t)length);
+}
+
+// Hands stream the next compressed bytes of entry after position, read into input unless the archive is in memory.
+// Past the end it leaves stream without input, for inflate to finish with or report as cut short
+static EPUB3Error EPUB3RangeFeedInput(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, uint64_t dataOffset, uint64_t * position, z_stream * stream, uint8_t * input)
+{
+  uint64_t remaining = entry->compressedSize - *position;
+  if(remaining == 0) return kEPUB3Success;
+
+  uint32_t size = remaining < RANGE_INPUT_SIZE ? (uint32_t)remaining : RANGE_INPUT_SIZE;
+  if(epub->archiveMemory.base != NULL) {
+    stream->next_in = (Bytef *)epub->archiveMemory.base + dataOffset + *position;
+  } else {
+    EPUB3Error error = EPUB3ReadArchiveBytes(epub, dataOffset + *position, input, size);
+    if(error != kEPUB3Success) return error;
+    stream->next_in = input;
+  }
+  stream->avail_in = size;
+  *position += size;
+  return kEPUB3Success;
+}
+
+EPUB3Error EPUB3ReadDeflatedEntryRange(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, uint64_t offset, uint64_t length, void * buffer)
+{
+  uint64_t dataOffset = 0;
+  EPUB3Error error = EPUB3GetDataOffsetOfEntryInArchive(epub, entry, &dataOffset);
+  if(error != kEPUB3Success) return error;
+
+  // Files under a span are inflated from the start, which is no more than resuming at a checkpoint would cost
+  EPUB3RangeIndexPtr index = __atomic_load_n(&entry->rangeIndex, __ATOMIC_ACQUIRE);
+  if(index == NULL && entry->uncompressedSize > RANGE_CHECKPOINT_SPAN) {
+    index = EPUB3RangeIndexCreate(epub, entry, dataOffset);
+    if(index == NULL) return kEPUB3FileReadFromArchiveError;
+    // Another reader may have built one meanwhile
+    EPUB3RangeIndexPtr published = NULL;
+    if(!__atomic_compare_exchange_n(&entry->rangeIndex, &published, index, kEPUB3_NO, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      EPUB3RangeIndexFree(index);
+      index = published;
+    }
+  }
+  const EPUB3RangeCheckpoint * checkpoint = NULL;
+  if(index != NULL) {
+    uint32_t low = 0;
+    uint32_t high = index->checkpointCount;
+    while(low < high) {
+      uint32_t middle = low + (high - low) / 2;
+      if(index->checkpoints[middle].uncompressedOffset <= offset) {
+        low = middle + 1;
+      } else {
+        high = middle;
+      }
+    }
+    checkpoint = low > 0 ? &index->checkpoints[low - 1] : NULL;
+  }
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if(inflateInit2(&stream, -MAX_WBITS) != Z_OK) return kEPUB3UnknownError;
+  uint8_t * scratch = malloc(RANGE_INPUT_SIZE + RANGE_WINDOW_SIZE);
+  if(scratch == NULL) {
+    (void)inflateEnd(&stream);
+    return kEPUB3UnknownError;
+  }
+  uint8_t * input = scratch;
+  uint8_t * discard = scratch + RANGE_INPUT_SIZE;
+
+  uint64_t position = 0;
+  uint64_t skip = offset;
+  if(checkpoint != NULL) {
+    position = checkpoint->compressedOffset;
+    skip = offset - checkpoint->uncompressedOffset;
+    if(checkpoint->bits > 0) {
+      uint8_t byte = 0;
+      if(epub->archiveMemory.base != NULL) {
+        byte = ((const uint8_t *)epub->archiveMemory.base)[dataOffset + position - 1];
+      } else {
+        error = EPUB3ReadArchiveBytes(epub, dataOffset + position - 1, &byte, 1);
+      }
+      if(error == kEPUB3Success && inflatePrime(&stream, checkpoint->bits, byte >> (8 - checkpoint->bits)) != Z_OK) {
+        error = kEPUB3FileReadFromArchiveError;
+      }
+    }
+    if(error == kEPUB3Success && inflateSetDictionary(&stream, checkpoint->window, RANGE_WINDOW_SIZE) != Z_OK) {
+      error = kEPUB3FileReadFromArchiveError;
+    }
+  }
+
+  uint64_t copied = 0;
+  while(copied < length && error == kEPUB3Success) {
+    if(stream.avail_in == 0) {
+      error = EPUB3RangeFeedInput(epub, entry, dataOffset, &position, &stream, input);
+      if(error != kEPUB3Success) break;
+    }
+    if(skip > 0) {
+      stream.next_out = discard;
+      stream.avail_out = skip < RANGE_WINDOW_SIZE ? (uInt)skip : RANGE_WINDOW_SIZE;
+    } else {
+      stream.next_out = (Bytef *)buffer + copied;
+      stream.avail_out = length - copied < UINT32_MAX ? (uInt)(length - copied) : UINT32_MAX;
+    }
+    uInt availableOut = stream.avail_out;
+    int status = inflate(&stream, Z_NO_FLUSH);
+    uInt produced = availableOut - stream.avail_out;
+    if(skip > 0) {
+      skip -= produced;
+    } else {
+      copied += produced;
+    }
+    if(status == Z_STREAM_END) {
+      if(copied < length) {
+        error = kEPUB3FileReadFromArchiveError;
+      }
+      break;
+    }
+    // Z_BUF_ERROR only means no progress, which with every compressed byte used means a truncated stream
+    if(status != Z_OK && (status != Z_BUF_ERROR || stream.avail_in == 0)) {
+      error = kEPUB3FileReadFromArchiveError;
+    }
+  }
+  (void)inflateEnd(&stream);
+  EPUB3_FREE_AND_NULL(scratch);
+  return error;
+}
+
+// Inflates the whole file once, saving a checkpoint at the first block boundary past every span. The pass checks
+// the file's CRC on the way, so a damaged file gets no index
+EPUB3RangeIndexPtr EPUB3RangeIndexCreate(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, uint64_t dataOffset)
+{
+  EPUB3RangeIndexPtr index = calloc(1, sizeof(struct EPUB3RangeIndex));
+  uint8_t * input = malloc(RANGE_INPUT_SIZE);
+  uint8_t * window = malloc(RANGE_WINDOW_SIZE);
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if(index == NULL || input == NULL || window == NULL || inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+    EPUB3_FREE_AND_NULL(window);
+    EPUB3_FREE_AND_NULL(input);
+    EPUB3_FREE_AND_NULL(index);
+    return NULL;
+  }
+
+  EPUB3Bool verify = EPUB3ShouldVerifyEntry(epub, entry);
+  uint32_t crc = 0;
+  uint32_t capacity = 0;
+  uint64_t position = 0;
+  uint64_t totalIn = 0;
+  uint64_t totalOut = 0;
+  uint64_t lastCheckpoint = 0;
+  EPUB3Error error = kEPUB3Success;
+  int status = Z_OK;
+  while(status != Z_STREAM_END && error == kEPUB3Success) {
+    if(stream.avail_in == 0) {
+      error = EPUB3RangeFeedInput(epub, entry, dataOffset, &position, &stream, input);
+      if(error != kEPUB3Success) break;
+    }
+    // The window is filled round and round, so it always ends with the latest 32K of output
+    if(stream.avail_out == 0) {
+      stream.next_out = window;
+      stream.avail_out = RANGE_WINDOW_SIZE;
+    }
+    uInt availableIn = stream.avail_in;
+    uInt availableOut = stream.avail_out;
+    Bytef * output = stream.next_out;
+    status = inflate(&stream, Z_BLOCK);
+    totalIn += availableIn - stream.avail_in;
+    totalOut += availableOut - stream.avail_out;
+    if(verify) {
+      crc = EPUB3CRC32(crc, output, availableOut - stream.avail_out);
+    }
+    if(status != Z_OK && status != Z_STREAM_END && (status != Z_BUF_ERROR || stream.avail_in == 0)) {
+      error = kEPUB3FileReadFromArchiveError;
+      break;
+    }
+
+    // Bit 7 of data_type marks the end of a block, bit 6 the end of the last one
+    if(status == Z_OK && (stream.data_type & 128) != 0 && (stream.data_type & 64) == 0 && totalOut - lastCheckpoint > RANGE_CHECKPOINT_SPAN) {
+      if(index->checkpointCount == capacity) {
+        capacity = capacity > 0 ? capacity * 2 : 8;
+        EPUB3RangeCheckpoint * checkpoints = realloc(index->checkpoints, capacity * sizeof(EPUB3RangeCheckpoint));
+        if(checkpoints == NULL) {
+          error = kEPUB3UnknownError;
+          break;
+        }
+        index->checkpoints = checkpoints;
+      }
+      EPUB3RangeCheckpoint * checkpoint = &index->checkpoints[index->checkpointCount++];
+      checkpoint->uncompressedOffset = totalOut;
+      checkpoint->compressedOffset = totalIn;
+      checkpoint->bits = stream.data_type & 7;
+      uInt left = stream.avail_out;
+      if(left > 0) {
+        memcpy(checkpoint->window, window + RANGE_WINDOW_SIZE - left, left);
+      }
+      if(left < RANGE_WINDOW_SIZE) {
+        memcpy(checkpoint->window + left, window, RANGE_WINDOW_SIZE - left);
+      }
+      lastCheckpoint = totalOut;
+    }
+  }
+  (void)inflateEnd(&stream);
+  EPUB3_FREE_AND_NULL(window);
+  EPUB3_FREE_AND_NULL(input);
+
+  if(error == kEPUB3Success && totalOut != entry->uncompressedSize) {
+    error = kEPUB3FileReadFromArchiveError;
+  }
+  if(error == kEPUB3Success && verify) {
+    if(crc != entry->crc) {
+      error = kEPUB3FileReadFromArchiveError;
+    } else {
+      EPUB3MarkEntryVerified(entry);
+    }
+  }
+  if(error != kEPUB3Success) {
+    EPUB3RangeIndexFree(index);
+    return NULL;
+  }
+  return index;
+}
+
+void EPUB3RangeIndexFree(EPUB3RangeIndexPtr index)
+{
+  if(index == NULL) return;
+
+  EPUB3_FREE_AND_NULL(index->checkpoints);
+  EPUB3_FREE_AND_NULL(index);
+}
+
+// Skips to offset the way a reader has to without direct access to the archive
+EPUB3Error EPUB3ReadEntryRangeWithReader(EPUB3Ref epub, const char * path, uint64_t offset, uint64_t length, void * buffer)
+{
+  EPUB3EntryReaderRef reader = NULL;
+  EPUB3Error error = EPUB3EntryReaderOpen(epub, path, &reader);
+  if(error != kEPUB3Success) return error;
+
+  uint8_t discard[RANGE_INPUT_SIZE];
+  uint64_t skipped = 0;
+  while(skipped < offset && error == kEPUB3Success) {
+    uint32_t bytesRead = 0;
+    uint32_t size = offset - skipped < sizeof(discard) ? (uint32_t)(offset - skipped) : (uint32_t)sizeof(discard);
+    error = EPUB3EntryReaderRead(reader, discard, size, &bytesRead);
+    if(error == kEPUB3Success && bytesRead == 0) {
+      error = kEPUB3FileReadFromArchiveError;
+    }
+    skipped += bytesRead;
+  }
+  uint64_t copied = 0;
+  while(copied < length && error == kEPUB3Success) {
+    uint32_t bytesRead = 0;
+    uint32_t size = length - copied < INT_MAX ? (uint32_t)(length - copied) : INT_MAX;
+    error = EPUB3EntryReaderRead(reader, (uint8_t *)buffer + copied, size, &bytesRead);
+    if(error == kEPUB3Success && bytesRead == 0) {
+      error = kEPUB3FileReadFromArchiveError;
+    }
+    copied += bytesRead;
+  }
+  EPUB3Error closeError = EPUB3EntryReaderClose(reader);
+  return error != kEPUB3Success ? error : closeError;
+}
+
+#pragma mark - Entry Cache
+
+EXPORT void EPUB3SetEntryCacheByteBudget(EPUB3Ref epub, uint64_t byteBudget)
+{
+  assert(epub != NULL);
+
+  pthread_mutex_lock(&epub->entryCache.lock);
+  __atomic_store_n(&epub->entryCache.byteBudget, byteBudget, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&epub->entryCache.lock);
+  EPUB3EntryCacheTrimToBudget(epub, byteBudget);
+}
+
+EXPORT void EPUB3GetEntryCacheStatistics(EPUB3Ref epub, EPUB3EntryCacheStatistics * statistics)
+{
+  assert(epub != NULL);
+  assert(statistics != NULL);
+
+  pthread_mutex_lock(&epub->entryCache.lock);
+  statistics->hits = epub->entryCache.hits;
+  statistics->misses = epub->entryCache.misses;
+  statistics->evictions = epub->entryCache.evictions;
+  statistics->bytesCached = epub->entryCache.bytesCached;
+  statistics->entriesCached = epub->entryCache.entriesCached;
+  pthread_mutex_unlock(&epub->entryCache.lock);
+}
+
+EXPORT EPUB3Error EPUB3CopyEntryData(EPUB3Ref epub, const char * path, EPUB3EntryDataRef * data)
+{
+  assert(epub != NULL);
+  assert(path != NULL);
+  assert(data != NULL);
+
+  *data = NULL;
+  if(epub->archive == NULL || epub->archiveIndex == NULL) return kEPUB3ArchiveUnavailableError;
+
+  EPUB3ArchiveEntryPtr entry = EPUB3ArchiveIndexFindEntry(epub->archiveIndex, path);
+  if(entry == NULL) return kEPUB3FileNotFoundInArchiveError;
+  EPUB3SpinePrefetcherNoteRead(epub, entry);
+  return EPUB3CopyDataOfEntry(epub, entry, data);
+}
+
+EXPORT const void * EPUB3EntryDataGetBytes(EPUB3EntryDataRef data)
+{
+  assert(data != NULL);
+  return data->bytes;
+}
+
+EXPORT uint64_t EPUB3EntryDataGetLength(EPUB3EntryDataRef data)
+{
+  assert(data != NULL);
+  return data->length;
+}
+
+EXPORT void EPUB3EntryDataRetain(EPUB3EntryDataRef data)
+{
+  EPUB3ObjectRetain(data);
+}
+
+EXPORT void EPUB3EntryDataRelease(EPUB3EntryDataRef data)
+{
+  EPUB3ObjectRelease(data);
+}
+
+EPUB3EntryDataRef EPUB3EntryDataCreate(uint64_t length)
+{
+  if(length > SIZE_MAX - sizeof(struct EPUB3EntryData)) return NULL;
+  EPUB3EntryDataRef memory = malloc(sizeof(struct EPUB3EntryData) + (size_t)length);
+  if(memory == NULL) return NULL;
+  memory = EPUB3ObjectInitWithTypeID(memory, kEPUB3EntryDataTypeID);
+  memory->length = length;
+  return memory;
+}
+
+// Serves the entry from the cache when it can, and inflates it into a new object otherwise, adding it to the cache
+// when that is on. Two threads missing on the same entry both inflate; the cache keeps the first
+EPUB3Error EPUB3CopyDataOfEntry(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, EPUB3EntryDataRef * data)
+{
+  assert(epub != NULL);
+  assert(entry != NULL);
+  assert(data != NULL);
+
+  *data = EPUB3EntryCacheCopyData(epub, entry);
+  if(*data != NULL) return kEPUB3Success;
+
+  EPUB3EntryDataRef memory = EPUB3EntryDataCreate(entry->uncompressedSize);
+  if(memory == NULL) return kEPUB3UnknownError;
+  uint64_t copied = 0;
+  EPUB3Error error = EPUB3ReadEntryIntoBuffer(epub, entry, memory->bytes, &copied);
+  if(error != kEPUB3Success) {
+    EPUB3EntryDataRelease(memory);
+    return error;
+  }
+  memory->length = copied;
+  if(copied == entry->uncompressedSize) {
+    EPUB3EntryCacheAdd(epub, entry, memory);
+  }
+  *data = memory;
+  return kEPUB3Success;
+}
+
+static void EPUB3EntryCacheUnlink(EPUB3EntryCache * cache, EPUB3ArchiveEntryPtr entry)
+{
+  if(entry->newerCached != NULL) entry->newerCached->olderCached = entry->olderCached;
+  else cache->newest = entry->olderCached;
+  if(entry->olderCached != NULL) entry->olderCached->newerCached = entry->newerCached;
+  else cache->oldest = entry->newerCached;
+  entry->newerCached = NULL;
+  entry->olderCached = NULL;
+}
+
+static void EPUB3EntryCacheLinkAsNewest(EPUB3EntryCache * cache, EPUB3ArchiveEntryPtr entry)
+{
+  entry->olderCached = cache->newest;
+  entry->newerCached = NULL;
+  if(cache->newest != NULL) cache->newest->newerCached = entry;
+  cache->newest = entry;
+  if(cache->oldest == NULL) cache->oldest = entry;
+}
+
+// Returns a new reference to the cached data, or NULL on a miss or when the cache is off
+EPUB3EntryDataRef EPUB3EntryCacheCopyData(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry)
+{
+  EPUB3EntryCache * cache = &epub->entryCache;
+  EPUB3EntryDataRef data = NULL;
+  pthread_mutex_lock(&cache->lock);
+  if(cache->byteBudget > 0) {
+    data = entry->cachedData;
+    if(data != NULL) {
+      EPUB3EntryDataRetain(data);
+      EPUB3EntryCacheUnlink(cache, entry);
+      EPUB3EntryCacheLinkAsNewest(cache, entry);
+      cache->hits++;
+    } else {
+      cache->misses++;
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return data;
+}
+
+void EPUB3EntryCacheAdd(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, EPUB3EntryDataRef data)
+{
+  EPUB3EntryCache * cache = &epub->entryCache;
+  pthread_mutex_lock(&cache->lock);
+  if(entry->cachedData == NULL && data->length <= cache->byteBudget) {
+    EPUB3EntryDataRetain(data);
+    entry->cachedData = data;
+    EPUB3EntryCacheLinkAsNewest(cache, entry);
+    cache->bytesCached += data->length;
+    cache->entriesCached++;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  EPUB3EntryCacheTrimToBudget(epub, __atomic_load_n(&cache->byteBudget, __ATOMIC_RELAXED));
+}
+
+void EPUB3EntryCacheTrimToBudget(EPUB3Ref epub, uint64_t byteBudget)
+{
+  EPUB3EntryCache * cache = &epub->entryCache;
+  pthread_mutex_lock(&cache->lock);
+  while(cache->oldest != NULL && (cache->bytesCached > byteBudget || byteBudget == 0)) {
+    EPUB3ArchiveEntryPtr entry = cache->oldest;
+    EPUB3EntryCacheUnlink(cache, entry);
+    cache->bytesCached -= entry->cachedData->length;
+    cache->entriesCached--;
+    cache->evictions++;
+    EPUB3EntryDataRelease(entry->cachedData);
+    entry->cachedData = NULL;
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+#pragma mark - Spine Prefetch
+
+EXPORT EPUB3Error EPUB3SetSpinePrefetchCount(EPUB3Ref epub, uint32_t count)
+{
+  assert(epub != NULL);
+
+  // Two threads turning prefetch on at once must not both start a worker
+  pthread_mutex_lock(&epub->spinePrefetcherLock);
+  EPUB3SpinePrefetcherPtr prefetcher = epub->spinePrefetcher;
+  if(prefetcher == NULL && count > 0) {
+    if(epub->spine == NULL || epub->manifest == NULL || epub->archiveIndex == NULL) {
+      pthread_mutex_unlock(&epub->spinePrefetcherLock);
+      return kEPUB3ArchiveUnavailableError;
+    }
+    prefetcher = EPUB3SpinePrefetcherCreate(epub);
+  }
+  pthread_mutex_unlock(&epub->spinePrefetcherLock);
+  if(prefetcher == NULL) return count == 0 ? kEPUB3Success : kEPUB3UnknownError;
+
+  pthread_mutex_lock(&prefetcher->lock);
+  prefetcher->count = count;
+  if(count == 0) {
+    prefetcher->nextPosition = prefetcher->endPosition;
+  }
+  pthread_mutex_unlock(&prefetcher->lock);
+  return kEPUB3Success;
+}
+
+static void * EPUB3SpinePrefetchWorker(void * argument)
+{
+  EPUB3Ref epub = argument;
+  EPUB3SpinePrefetcherPtr prefetcher = epub->spinePrefetcher;
+
+  pthread_mutex_lock(&prefetcher->lock);
+  while(!prefetcher->stopping) {
+    if(prefetcher->nextPosition >= prefetcher->endPosition) {
+      prefetcher->busy = kEPUB3_NO;
+      pthread_cond_broadcast(&prefetcher->idle);
+      pthread_cond_wait(&prefetcher->wake, &prefetcher->lock);
+      continue;
+    }
+    prefetcher->busy = kEPUB3_YES;
+    EPUB3ArchiveEntryPtr entry = prefetcher->linearEntries[prefetcher->nextPosition++];
+    pthread_mutex_unlock(&prefetcher->lock);
+    if(entry != NULL) {
+      EPUB3EntryCachePrefetch(epub, entry);
+    }
+    pthread_mutex_lock(&prefetcher->lock);
+  }
+  prefetcher->busy = kEPUB3_NO;
+  pthread_cond_broadcast(&prefetcher->idle);
+  pthread_mutex_unlock(&prefetcher->lock);
+  return NULL;
+}
+
+// Resolves spine items, in spine order, to their archive entries. Entries are NULL where an item's href is not in
+// the archive
+EPUB3Error EPUB3CopySpineEntries(EPUB3Ref epub, EPUB3Bool linearOnly, EPUB3ArchiveEntryPtr ** entries, uint32_t * count)
+{
+  assert(epub != NULL);
+  assert(epub->spine != NULL);
+  assert(entries != NULL);
+  assert(count != NULL);
+
+  *entries = NULL;
+  *count = 0;
+  const char * rootPath = NULL;
+  EPUB3Error error = EPUB3GetRootPath(epub, &rootPath);
+  if(error != kEPUB3Success) return error;
+
+  int32_t itemCount = linearOnly ? epub->spine->linearItemCount : epub->spine->itemCount;
+  uint32_t capacity = itemCount > 0 ? (uint32_t)itemCount : 0;
+  EPUB3ArchiveEntryPtr * spineEntries = calloc(capacity > 0 ? capacity : 1, sizeof(EPUB3ArchiveEntryPtr));
+  uint32_t spineEntryCount = 0;
+  for(EPUB3SpineItemListItemPtr itemPtr = epub->spine->head; itemPtr != NULL && spineEntryCount < capacity; itemPtr = itemPtr->next) {
+    if(linearOnly && !itemPtr->item->isLinear) continue;
+    EPUB3ArchiveEntryPtr entry = NULL;
+    if(itemPtr->item->manifestItem != NULL && itemPtr->item->manifestItem->href != NULL) {
+      char * path = EPUB3CopyOfPathByAppendingPathComponent(rootPath, itemPtr->item->manifestItem->href);
+      entry = EPUB3ArchiveIndexFindEntry(epub->archiveIndex, path);
+      EPUB3_FREE_AND_NULL(path);
+    }
+    spineEntries[spineEntryCount++] = entry;
+  }
+
+  *entries = spineEntries;
+  *count = spineEntryCount;
+  return kEPUB3Success;
+}
+
+// Resolves every linear spine item to its archive entry and starts the worker, idle until the first read
+EPUB3SpinePrefetcherPtr EPUB3SpinePrefetcherCreate(EPUB3Ref epub)
+{
+  assert(epub != NULL);
+  assert(epub->spine != NULL);
+
+  EPUB3SpinePrefetcherPtr prefetcher = calloc(1, sizeof(struct EPUB3SpinePrefetcher));
+  if(EPUB3CopySpineEntries(epub, kEPUB3_YES, &prefetcher->linearEntries, &prefetcher->linearEntryCount) != kEPUB3Success) {
+    free(prefetcher);
+    return NULL;
+  }
+  for(uint32_t i = 0; i < prefetcher->linearEntryCount; i++) {
+    EPUB3ArchiveEntryPtr entry = prefetcher->linearEntries[i];
+    // A file listed twice prefetches from its first position
+    if(entry != NULL && entry->linearSpinePosition == 0) {
+      entry->linearSpinePosition = i + 1;
+    }
+  }
+
+  pthread_mutex_init(&prefetcher->lock, NULL);
+  pthread_cond_init(&prefetcher->wake, NULL);
+  pthread_cond_init(&prefetcher->idle, NULL);
+  // The worker reads the prefetcher through the book, so it has to be visible before the thread starts. Readers
+  // on other threads look at the entries' spine positions once they see it
+  __atomic_store_n(&epub->spinePrefetcher, prefetcher, __ATOMIC_RELEASE);
+  if(pthread_create(&prefetcher->thread, NULL, EPUB3SpinePrefetchWorker, epub) != 0) {
+    epub->spinePrefetcher = NULL;
+    pthread_cond_destroy(&prefetcher->idle);
+    pthread_cond_destroy(&prefetcher->wake);
+    pthread_mutex_destroy(&prefetcher->lock);
+    free(prefetcher->linearEntries);
+    free(prefetcher);
+    return NULL;
+  }
+  return prefetcher;
+}
+
+void EPUB3SpinePrefetcherFree(EPUB3SpinePrefetcherPtr prefetcher)
+{
+  if(prefetcher == NULL) return;
+
+  pthread_mutex_lock(&prefetcher->lock);
+  prefetcher->stopping = kEPUB3_YES;
+  pthread_cond_signal(&prefetcher->wake);
+  pthread_mutex_unlock(&prefetcher->lock);
+  pthread_join(prefetcher->thread, NULL);
+
+  pthread_cond_destroy(&prefetcher->idle);
+  pthread_cond_destroy(&prefetcher->wake);
+  pthread_mutex_destroy(&prefetcher->lock);
+  free(prefetcher->linearEntries);
+  free(prefetcher);
+}
+
+// Called by the read functions. A read of a linear spine item replaces whatever was queued with the items after it
+void EPUB3SpinePrefetcherNoteRead(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry)
+{
+  EPUB3SpinePrefetcherPtr prefetcher = __atomic_load_n(&epub->spinePrefetcher, __ATOMIC_ACQUIRE);
+  if(prefetcher == NULL || entry->linearSpinePosition == 0) return;
+
+  pthread_mutex_lock(&prefetcher->lock);
+  if(prefetcher->count > 0) {
+    uint32_t next = entry->linearSpinePosition; // the 1-based position of entry is the 0-based one after it
+    uint32_t end = prefetcher->linearEntryCount - next > prefetcher->count ? next + prefetcher->count : prefetcher->linearEntryCount;
+    prefetcher->nextPosition = next;
+    prefetcher->endPosition = end;
+    if(next < end) {
+      prefetcher->busy = kEPUB3_YES;
+      pthread_cond_signal(&prefetcher->wake);
+    }
+  }
+  pthread_mutex_unlock(&prefetcher->lock);
+}
+
+// For tests: returns once the worker has nothing queued
+void EPUB3SpinePrefetcherWaitUntilIdle(EPUB3Ref epub)
+{
+  EPUB3SpinePrefetcherPtr prefetcher = __atomic_load_n(&epub->spinePrefetcher, __ATOMIC_ACQUIRE);
+  if(prefetcher == NULL) return;
+
+  pthread_mutex_lock(&prefetcher->lock);
+  while(prefetcher->busy) {
+    pthread_cond_wait(&prefetcher->idle, &prefetcher->lock);
+  }
+  pthread_mutex_unlock(&prefetcher->lock);
+}
+
+// Inflates entry into the cache unless it is there already or could never fit. Unlike a foreground read, this
+// counts as neither a hit nor a miss
+void EPUB3EntryCachePrefetch(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry)
+{
+  EPUB3EntryCache * cache = &epub->entryCache;
+  pthread_mutex_lock(&cache->lock);
+  EPUB3Bool wanted = entry->cachedData == NULL && entry->uncompressedSize <= cache->byteBudget ? kEPUB3_YES : kEPUB3_NO;
+  pthread_mutex_unlock(&cache->lock);
+  if(!wanted) return;
+
+  EPUB3EntryDataRef data = EPUB3EntryDataCreate(entry->uncompressedSize);
+  if(data == NULL) return;
+  uint64_t copied = 0;
+  if(EPUB3ReadEntryIntoBuffer(epub, entry, data->bytes, &copied) == kEPUB3Success && copied == entry->uncompressedSize) {
+    EPUB3EntryCacheAdd(epub, entry, data);
+  }
+  EPUB3EntryDataRelease(data);
+}
+
+#pragma mark - Block Cache
+
+EPUB3BlockCachePtr EPUB3BlockCacheCreate(const EPUB3IOCallbacks * callbacks, void * context)
+{
+  assert(callbacks != NULL);
+
+  uint32_t blockSize = callbacks->blockSize > 0 ? callbacks->blockSize : IO_BLOCK_CACHE_DEFAULT_BLOCK_SIZE;
+  uint32_t blockCount = callbacks->blockCount > 0 ? callbacks->blockCount : IO_BLOCK_CACHE_DEFAULT_BLOCK_COUNT;
+  if(callbacks->read == NULL || callbacks->size == 0) return NULL;
+  if(blockSize < IO_BLOCK_CACHE_MIN_BLOCK_SIZE || (blockSize & (blockSize - 1)) != 0) return NULL;
+  if((size_t)blockCount > SIZE_MAX / blockSize) return NULL;
+
+  EPUB3BlockCachePtr cache = calloc(1, sizeof(struct EPUB3BlockCache));
+  if(cache == NULL) return NULL;
+  cache->blocks = malloc(sizeof(EPUB3IOBlock) * blockCount);
+  cache->storage = malloc((size_t)blockCount * blockSize);
+  if(cache->blocks == NULL || cache->storage == NULL) {
+    free(cache->blocks);
+    free(cache->storage);
+    free(cache);
+    return NULL;
+  }
+  cache->callbacks = *callbacks;
+  cache->context = context;
+  pthread_mutex_init(&cache->lock, NULL);
+  cache->blockSize = blockSize;
+  cache->blockCount = blockCount;
+  // Keep half the cache for blocks that are actually being read
+  cache->readAheadBlocks = callbacks->readAheadBlocks < blockCount / 2 ? callbacks->readAheadBlocks : blockCount / 2;
+  cache->nextSequentialBlock = UINT64_MAX;
+  for(uint32_t i = 0; i < blockCount; i++) {
+    cache->blocks[i].index = UINT64_MAX;
+    cache->blocks[i].lastUse = 0;
+    cache->blocks[i].length = 0;
+  }
+  return cache;
+}
+
+void EPUB3BlockCacheFree(EPUB3BlockCachePtr cache)
+{
+  if(cache == NULL) return;
+
+  if(cache->callbacks.close != NULL) cache->callbacks.close(cache->context);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->blocks);
+  free(cache->storage);
+  free(cache);
+}
+
+// Straight to the callbacks, for reads the cache can't help with and for filling it
+static EPUB3Error EPUB3BlockCacheReadThrough(EPUB3BlockCachePtr cache, uint64_t offset, uint8_t * bytes, size_t length)
+{
+  size_t done = 0;
+  while(done < length) {
+    int64_t got = cache->callbacks.read(cache->context, offset + done, bytes + done, length - done);
+    if(got <= 0 || (uint64_t)got > length - done) return kEPUB3FileReadFromArchiveError;
+    done += (size_t)got;
+  }
+  return kEPUB3Success;
+}
+
+// Call with the lock held
+static EPUB3IOBlock * EPUB3BlockCacheFindBlock(EPUB3BlockCachePtr cache, uint64_t index)
+{
+  if(cache->blocks[cache->mostRecentBlock].index == index) return &cache->blocks[cache->mostRecentBlock];
+  for(uint32_t i = 0; i < cache->blockCount; i++) {
+    if(cache->blocks[i].index == index) {
+      cache->mostRecentBlock = i;
+      return &cache->blocks[i];
+    }
+  }
+  return NULL;
+}
+
+// Reads the block at index, plus the read-ahead when the miss continues the previous one, in a single call. The
+// lock is not held while the callbacks run, so two threads may fetch the same block; the second copy is dropped
+static EPUB3Error EPUB3BlockCacheFill(EPUB3BlockCachePtr cache, uint64_t index)
+{
+  uint64_t archiveSize = cache->callbacks.size;
+  uint64_t lastIndex = (archiveSize - 1) / cache->blockSize;
+
+  pthread_mutex_lock(&cache->lock);
+  uint64_t runLength = 1;
+  if(index == cache->nextSequentialBlock) runLength += cache->readAheadBlocks;
+  cache->nextSequentialBlock = index + runLength;
+  pthread_mutex_unlock(&cache->lock);
+  if(runLength > lastIndex - index + 1) runLength = lastIndex - index + 1;
+
+  uint64_t runOffset = index * cache->blockSize;
+  uint64_t runSize = runLength * cache->blockSize;
+  if(runSize > archiveSize - runOffset) runSize = archiveSize - runOffset;
+  uint8_t * run = malloc((size_t)runSize);
+  if(run == NULL) return kEPUB3UnknownError;
+  EPUB3Error error = EPUB3BlockCacheReadThrough(cache, runOffset, run, (size_t)runSize);
+  if(error != kEPUB3Success) {
+    free(run);
+    return error;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  // Fill in reverse so the block asked for is the most recently used
+  for(uint64_t i = runLength; i-- > 0; ) {
+    if(EPUB3BlockCacheFindBlock(cache, index + i) != NULL) continue;
+    uint32_t victim = 0;
+    for(uint32_t slot = 1; slot < cache->blockCount; slot++) {
+      if(cache->blocks[slot].lastUse < cache->blocks[victim].lastUse) victim = slot;
+    }
+    uint64_t blockOffset = i * cache->blockSize;
+    uint32_t length = (uint32_t)(runSize - blockOffset < cache->blockSize ? runSize - blockOffset : cache->blockSize);
+    memcpy(cache->storage + (size_t)victim * cache->blockSize, run + blockOffset, length);
+    cache->blocks[victim].index = index + i;
+    cache->blocks[victim].length = length;
+    cache->blocks[victim].lastUse = ++cache->useClock;
+    cache->mostRecentBlock = victim;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  free(run);
+  return kEPUB3Success;
+}
+
+EPUB3Error EPUB3BlockCacheRead(EPUB3BlockCachePtr cache, uint64_t offset, void * bytes, size_t length)
+{
+  assert(cache != NULL);
+  assert(bytes != NULL || length == 0);
+
+  if(offset > cache->callbacks.size || length > cache->callbacks.size - offset) return kEPUB3FileReadFromArchiveError;
+  // A read of a block or more is already as large as a fill, and would only push out cached blocks
+  if(length >= cache->blockSize) return EPUB3BlockCacheReadThrough(cache, offset, bytes, length);
+
+  uint8_t * cursor = bytes;
+  while(length > 0) {
+    uint64_t index = offset / cache->blockSize;
+    size_t blockOffset = (size_t)(offset % cache->blockSize);
+    size_t chunkLength = cache->blockSize - blockOffset < length ? cache->blockSize - blockOffset : length;
+
+    pthread_mutex_lock(&cache->lock);
+    EPUB3IOBlock * block = EPUB3BlockCacheFindBlock(cache, index);
+    if(block == NULL) {
+      pthread_mutex_unlock(&cache->lock);
+      EPUB3Error error = EPUB3BlockCacheFill(cache, index);
+      if(error != kEPUB3Success) return error;
+      continue;
+    }
+    memcpy(cursor, cache->storage + (size_t)(block - cache->blocks) * cache->blockSize + blockOffset, chunkLength);
+    block->lastUse = ++cache->useClock;
+    pthread_mutex_unlock(&cache->lock);
+
+    cursor += chunkLength;
+    offset += chunkLength;
+    length -= chunkLength;
+  }
+  return kEPUB3Success;
+}
+
+// read_at function for the MiniZip streams; they have already clamped the read to the end of the archive
+uLong EPUB3BlockCacheReadAt(voidpf opaque, uLong offset, void * bytes, uLong length, int * error)
+{
+  if(EPUB3BlockCacheRead(opaque, offset, bytes, (size_t)length) != kEPUB3Success) {
+    *error = EIO;
+    return 0;
+  }
+  return length;
+}
+
+// Reads from whichever positioned backend the archive has: its descriptor or its block cache
+EPUB3Error EPUB3ReadArchiveBytes(EPUB3Ref epub, uint64_t offset, void * bytes, size_t length)
+{
+  assert(epub != NULL);
+
+  if(epub->archiveBlockCache != NULL) return EPUB3BlockCacheRead(epub->archiveBlockCache, offset, bytes, length);
+  if(epub->archiveFile.fd < 0) return kEPUB3ArchiveUnavailableError;
+
+  size_t done = 0;
+  while(done < length) {
+    ssize_t got = pread(epub->archiveFile.fd, (char *)bytes + done, length - done, (off_t)(offset + done));
+    if(got < 0 && errno == EINTR) continue;
+    if(got <= 0) return kEPUB3FileReadFromArchiveError;
+    done += (size_t)got;
+  }
+  return kEPUB3Success;
+}
+
+#pragma mark - Archive Cursors
+
+unzFile EPUB3CheckOutArchiveCursor(EPUB3Ref epub)
+{
+  assert(epub != NULL);
+
+  unzFile cursor = NULL;
+  pthread_mutex_lock(&epub->archiveCursorLock);
+  if(epub->idleArchiveCursorCount > 0) {
+    cursor = epub->idleArchiveCursors[--epub->idleArchiveCursorCount];
+  }
+  pthread_mutex_unlock(&epub->archiveCursorLock);
+
+  if(cursor == NULL) {
+    cursor = unzOpen2(epub->archivePath, &epub->archiveCursorFileFuncs);
+  }
+  return cursor;
+}
+
+void EPUB3CheckInArchiveCursor(EPUB3Ref epub, unzFile cursor)
+{
+  assert(epub != NULL);
+
+  if(cursor == NULL) return;
+
+  pthread_mutex_lock(&epub->archiveCursorLock);
+  if(epub->idleArchiveCursorCount < EPUB3_MAX_IDLE_ARCHIVE_CURSORS) {
+    epub->idleArchiveCursors[epub->idleArchiveCursorCount++] = cursor;
+    cursor = NULL;
+  }
+  pthread_mutex_unlock(&epub->archiveCursorLock);
+
+  if(cursor != NULL) {
+    unzClose(cursor);
+  }
+}
+
+#pragma mark - Archive Index
+
+// Names longer than this are read into a heap buffer instead
+#define ARCHIVE_INDEX_NAME_BUFFER_SIZE (256)
+
+EPUB3ArchiveIndexPtr EPUB3ArchiveIndexCreateWithArchive(unzFile archive)
+{
+  assert(archive != NULL);
+
+  unz_global_info gi;
+  if(unzGetGlobalInfo(archive, &gi) != UNZ_OK) return NULL;
+
+  EPUB3ArchiveIndexPtr index = calloc(1, sizeof(struct EPUB3ArchiveIndex));
+  if(index == NULL) return NULL;
+  // number_entry is only 16 bits wide in the end of central dir record, so treat it as a hint
+  uint32_t capacity = gi.number_entry > 0 ? (uint32_t)gi.number_entry : 16U;
+  index->entries = calloc(capacity, sizeof(struct EPUB3ArchiveEntry));
+  if(index->entries == NULL) {
+    EPUB3ArchiveIndexFree(index);
+    return NULL;
+  }
+
+  int err = unzGoToFirstFile(archive);
+  while(err == UNZ_OK) {
+    unz_file_info fileInfo;
+    char nameBuffer[ARCHIVE_INDEX_NAME_BUFFER_SIZE];
+    err = unzGetCurrentFileInfo(archive, &fileInfo, nameBuffer, sizeof(nameBuffer), NULL, 0, NULL, 0);
+    if(err != UNZ_OK) break;
+
+    if(index->entryCount == capacity) {
+      EPUB3ArchiveEntryPtr entries = realloc(index->entries, capacity * 2 * sizeof(struct EPUB3ArchiveEntry));
+      if(entries == NULL) {
+        EPUB3ArchiveIndexFree(index);
+        return NULL;
+      }
+      index->entries = entries;
+      capacity *= 2;
+    }
+    EPUB3ArchiveEntryPtr entry = &index->entries[index->entryCount];
+    if(fileInfo.size_filename < sizeof(nameBuffer)) {
+      entry->filename = strdup(nameBuffer);
+    } else {
+      entry->filename = malloc(fileInfo.size_filename + 1U);
+      if(entry->filename != NULL) {
+        err = unzGetCurrentFileInfo(archive, NULL, entry->filename, fileInfo.size_filename + 1U, NULL, 0, NULL, 0);
+      }
+    }
+    if(entry->filename == NULL) {
+      EPUB3ArchiveIndexFree(index);
+      return NULL;
+    }
+    (void)unzGetFilePos(archive, &entry->filePos);
+    entry->crc = (uint32_t)fileInfo.crc;
+    entry->compressedSize = (uint64_t)fileInfo.compressed_size;
+    entry->uncompressedSize = (uint64_t)fileInfo.uncompressed_size;
+    entry->compressionMethod = (uint16_t)fileInfo.compression_method;
+    entry->flag = (uint16_t)fileInfo.flag;
+    entry->localHeaderOffset = (uint64_t)unzGetCurrentFileLocalHeaderOffset(archive);
+    entry->verified = 0; // realloc leaves the tail of the array uninitialized
+    entry->next = NULL;
+    entry->cachedData = NULL;
+    entry->newerCached = NULL;
+    entry->olderCached = NULL;
+    entry->linearSpinePosition = 0;
+    entry->rangeIndex = NULL;
+    index->entryCount++;
+
+    if(err == UNZ_OK) {
+      err = unzGoToNextFile(archive);
+    }
+  }
+  (void)unzGoToFirstFile(archive);
+
+  if(err != UNZ_END_OF_LIST_OF_FILE || !EPUB3ArchiveIndexBuildEntryTable(index)) {
+    EPUB3ArchiveIndexFree(index);
+    return NULL;
+  }
+  return index;
+}
+
+EPUB3Bool EPUB3ArchiveIndexBuildEntryTable(EPUB3ArchiveIndexPtr index)
+{
+  index->bucketCount = 16U;
+  while(index->bucketCount < index->entryCount) {
+    index->bucketCount <<= 1;
+  }
+  index->entryTable = calloc(index->bucketCount, sizeof(EPUB3ArchiveEntryPtr));
+  if(index->entryTable == NULL) return kEPUB3_NO;
+
+  // Insert back to front so the first of any duplicate names wins, as it does with unzLocateFile
+  for(uint32_t i = index->entryCount; i > 0; i--) {
+    EPUB3ArchiveEntryPtr entry = &index->entries[i - 1];
+    uint32_t bucket = SuperFastHash(entry->filename, (int)strlen(entry->filename)) & (index->bucketCount - 1);
+    entry->next = index->entryTable[bucket];
+    index->entryTable[bucket] = entry;
+  }
+  return kEPUB3_YES;
+}
+
+void EPUB3ArchiveIndexFree(EPUB3ArchiveIndexPtr index)
+{
+  if(index == NULL) return;
+
+  if(index->entries != NULL) {
+    for(uint32_t i = 0; i < index->entryCount; i++) {
+      EPUB3RangeIndexFree(index->entries[i].rangeIndex);
+      index->entries[i].rangeIndex = NULL;
+      if(index->sharedImage == NULL) {
+        EPUB3_FREE_AND_NULL(index->entries[i].filename);
+      }
+    }
+  }
+  if(index->sharedImage != NULL) {
+    munmap((void *)index->sharedImage, index->sharedImageSize);
+  }
+  EPUB3_FREE_AND_NULL(index->entries);
+  EPUB3_FREE_AND_NULL(index->entryTable);
+  EPUB3_FREE_AND_NULL(index);
+}
+
+EXPORT EPUB3Error EPUB3EnumerateArchiveEntries(EPUB3Ref epub, EPUB3ArchiveEntryFunction function, void * context)
+{
+  assert(epub != NULL);
+  assert(function != NULL);
+
+  if(epub->archiveIndex == NULL) return kEPUB3ArchiveUnavailableError;
+
+  for(uint32_t i = 0; i < epub->archiveIndex->entryCount; i++) {
+    EPUB3ArchiveEntryInfo info;
+    EPUB3ArchiveEntryGetInfo(&epub->archiveIndex->entries[i], &info);
+    if(!function(&info, context)) break;
+  }
+  return kEPUB3Success;
+}
+
+void EPUB3ArchiveEntryGetInfo(EPUB3ArchiveEntryPtr entry, EPUB3ArchiveEntryInfo * info)
+{
+  info->name = entry->filename;
+  info->uncompressedSize = entry->uncompressedSize;
+  info->compressedSize = entry->compressedSize;
+  info->localHeaderOffset = entry->localHeaderOffset;
+  info->crc = entry->crc;
+  info->compressionMethod = entry->compressionMethod;
+  info->flag = entry->flag;
+}
+
+EPUB3ArchiveEntryPtr EPUB3ArchiveIndexFindEntry(EPUB3ArchiveIndexPtr index, const char * filename)
+{
+  assert(index != NULL);
+  assert(filename != NULL);
+
+  uint32_t bucket = SuperFastHash(filename, (int)strlen(filename)) & (index->bucketCount - 1);
+  EPUB3ArchiveEntryPtr entry = index->entryTable[bucket];
+  while(entry != NULL) {
+    if(strcmp(filename, entry->filename) == 0) {
+      return entry;
+    }
+    entry = entry->next;
+  }
+  return NULL;
+}
+
+// Hash chains keep central directory order, so any later entry with the same name follows this one
+EPUB3Bool EPUB3ArchiveIndexEntryIsShadowed(EPUB3ArchiveEntryPtr entry)
+{
+  assert(entry != NULL);
+
+  for(EPUB3ArchiveEntryPtr later = entry->next; later != NULL; later = later->next) {
+    if(strcmp(entry->filename, later->filename) == 0) {
+      return kEPUB3_YES;
+    }
+  }
+  return kEPUB3_NO;
+}
+
+#pragma mark - Shared Archive Index
+
+static EPUB3Bool EPUB3SharedArchiveIndexCacheEnabled = kEPUB3_NO;
+
+EXPORT void EPUB3SetSharedArchiveIndexCacheEnabled(EPUB3Bool enabled)
+{
+  __atomic_store_n(&EPUB3SharedArchiveIndexCacheEnabled, enabled, __ATOMIC_RELEASE);
+}
+
+EPUB3Bool EPUB3SharedArchiveIndexCacheIsEnabled(void)
+{
+  return __atomic_load_n(&EPUB3SharedArchiveIndexCacheEnabled, __ATOMIC_ACQUIRE);
+}
+
+EXPORT EPUB3Error EPUB3RemoveSharedArchiveIndexForPath(const char * path)
+{
+  assert(path != NULL);
+
+  struct stat st;
+  if(stat(path, &st) != 0) return kEPUB3InvalidArgumentError;
+  char name[SHARED_ARCHIVE_INDEX_NAME_SIZE];
+  EPUB3SharedArchiveIndexNameForPath(name, sizeof(name), path, &st);
+  if(shm_unlink(name) != 0 && errno != ENOENT) return kEPUB3UnknownError;
+  return kEPUB3Success;
+}
+
+static uint64_t EPUB3FNV1a(uint64_t hash, const void * bytes, size_t length)
+{
+  const uint8_t * cursor = bytes;
+  for(size_t i = 0; i < length; i++) {
+    hash ^= cursor[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// Short enough for the 31 character limit some systems put on shared memory names
+void EPUB3SharedArchiveIndexNameForPath(char * name, size_t nameSize, const char * path, const struct stat * st)
+{
+  uint64_t key[5] = { (uint64_t)st->st_dev, (uint64_t)st->st_ino, (uint64_t)st->st_size,
+                      (uint64_t)st->st_mtime, (uint64_t)EPUB3_STAT_MTIME_NSEC(st) };
+  uint64_t hash = EPUB3FNV1a(0xcbf29ce484222325ULL, path, strlen(path));
+  hash = EPUB3FNV1a(hash, key, sizeof(key));
+  (void)snprintf(name, nameSize, "/epub3-index-%016llx", (unsigned long long)hash);
+}
+
+static EPUB3Bool EPUB3SharedArchiveIndexHeaderMatches(const EPUB3SharedArchiveIndexHeader * header, size_t imageSize, const char * path, const struct stat * st)
+{
+  if(imageSize < sizeof(EPUB3SharedArchiveIndexHeader)) return kEPUB3_NO;
+  if(header->magic != SHARED_ARCHIVE_INDEX_MAGIC || header->version != SHARED_ARCHIVE_INDEX_VERSION) return kEPUB3_NO;
+  if(__atomic_load_n(&header->complete, __ATOMIC_ACQUIRE) == 0 || header->imageSize != imageSize) return kEPUB3_NO;
+  // The name is only a hash, so make sure this really is the same file
+  if(header->device != (uint64_t)st->st_dev || header->inode != (uint64_t)st->st_ino || header->size != (uint64_t)st->st_size
+     || header->modificationTime != (int64_t)st->st_mtime || header->modificationTimeNanoseconds != (int64_t)EPUB3_STAT_MTIME_NSEC(st)) {
+    return kEPUB3_NO;
+  }
+  size_t pathLength = strlen(path);
+  if(header->pathLength != pathLength || sizeof(EPUB3SharedArchiveIndexHeader) + pathLength > imageSize
+     || memcmp((const char *)(header + 1), path, pathLength) != 0) {
+    return kEPUB3_NO;
+  }
+  if(header->entriesOffset > imageSize || header->entryCount > (imageSize - header->entriesOffset) / sizeof(EPUB3SharedArchiveEntry)) {
+    return kEPUB3_NO;
+  }
+  return kEPUB3_YES;
+}
+
+// Maps the index another process published for this file, or builds it from the central directory and publishes it
+EPUB3ArchiveIndexPtr EPUB3ArchiveIndexCreateWithSharedCache(unzFile archive, const char * path, const struct stat * st)
+{
+  assert(archive != NULL);
+  assert(path != NULL);
+  assert(st != NULL);
+
+  char name[SHARED_ARCHIVE_INDEX_NAME_SIZE];
+  EPUB3SharedArchiveIndexNameForPath(name, sizeof(name), path, st);
+
+  int fd = shm_open(name, O_RDONLY, 0);
+  if(fd >= 0) {
+    struct stat imageStat;
+    void * image = MAP_FAILED;
+    // The name is predictable, so only trust an image this user published and nobody else can write
+    if(fstat(fd, &imageStat) == 0 && imageStat.st_size > 0 && imageStat.st_uid == geteuid()
+       && (imageStat.st_mode & (S_IRWXG | S_IRWXO)) == 0) {
+      image = mmap(NULL, (size_t)imageStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if(image != MAP_FAILED) {
+      EPUB3ArchiveIndexPtr index = EPUB3ArchiveIndexCreateWithSharedImage(image, (size_t)imageStat.st_size, path, st);
+      unz_global_info gi;
+      if(index != NULL && unzGetGlobalInfo(archive, &gi) == UNZ_OK && gi.number_entry == index->entryCount) {
+        return index;
+      }
+      if(index != NULL) {
+        EPUB3ArchiveIndexFree(index);
+      } else {
+        const EPUB3SharedArchiveIndexHeader * header = image;
+        // A builder that died half way would otherwise keep everyone else from publishing
+        EPUB3Bool stale = (size_t)imageStat.st_size >= sizeof(EPUB3SharedArchiveIndexHeader)
+          && __atomic_load_n(&header->complete, __ATOMIC_ACQUIRE) == 0
+          && kill(header->builderPid, 0) != 0 && errno == ESRCH;
+        munmap(image, (size_t)imageStat.st_size);
+        if(stale) {
+          (void)shm_unlink(name);
+        }
+      }
+    }
+  }
+
+  EPUB3ArchiveIndexPtr index = EPUB3ArchiveIndexCreateWithArchive(archive);
+  if(index != NULL) {
+    EPUB3ArchiveIndexPublish(index, name, path, st);
+  }
+  return index;
+}
+
+// Wraps a published image. Entries and their hash table are private to this process; only the names are shared
+EPUB3ArchiveIndexPtr EPUB3ArchiveIndexCreateWithSharedImage(const void * image, size_t imageSize, const char * path, const struct stat * st)
+{
+  assert(image != NULL);
+
+  const EPUB3SharedArchiveIndexHeader * header = image;
+  if(!EPUB3SharedArchiveIndexHeaderMatches(header, imageSize, path, st)) return NULL;
+
+  const EPUB3SharedArchiveEntry * sharedEntries = (const EPUB3SharedArchiveEntry *)((const uint8_t *)image + header->entriesOffset);
+  for(uint32_t i = 0; i < header->entryCount; i++) {
+    const EPUB3SharedArchiveEntry * sharedEntry = &sharedEntries[i];
+    // Names must end inside the image, and files inside the archive
+    if(sharedEntry->filenameOffset >= imageSize || memchr((const uint8_t *)image + sharedEntry->filenameOffset, '\0', imageSize - sharedEntry->filenameOffset) == NULL
+       || sharedEntry->localHeaderOffset >= header->size || sharedEntry->compressedSize > header->size - sharedEntry->localHeaderOffset
+       || sharedEntry->posInCentralDirectory >= header->size) {
+      return NULL;
+    }
+  }
+
+  // The caller still owns the image if this fails, so nothing here goes through EPUB3ArchiveIndexFree
+  EPUB3ArchiveIndexPtr index = calloc(1, sizeof(struct EPUB3ArchiveIndex));
+  if(index == NULL) return NULL;
+  index->entries = calloc(header->entryCount > 0 ? header->entryCount : 1, sizeof(struct EPUB3ArchiveEntry));
+  if(index->entries == NULL) {
+    EPUB3_FREE_AND_NULL(index);
+    return NULL;
+  }
+  for(uint32_t i = 0; i < header->entryCount; i++) {
+    const EPUB3SharedArchiveEntry * sharedEntry = &sharedEntries[i];
+    EPUB3ArchiveEntryPtr entry = &index->entries[i];
+    entry->filename = (char *)image + sharedEntry->filenameOffset;
+    entry->filePos.pos_in_zip_directory = (uLong)sharedEntry->posInCentralDirectory;
+    entry->filePos.num_of_file = (uLong)sharedEntry->fileNumber;
+    entry->crc = sharedEntry->crc;
+    entry->compressedSize = sharedEntry->compressedSize;
+    entry->uncompressedSize = sharedEntry->uncompressedSize;
+    entry->compressionMethod = sharedEntry->compressionMethod;
+    entry->flag = sharedEntry->flag;
+    entry->localHeaderOffset = sharedEntry->localHeaderOffset;
+    index->entryCount++;
+  }
+  if(!EPUB3ArchiveIndexBuildEntryTable(index)) {
+    EPUB3_FREE_AND_NULL(index->entries);
+    EPUB3_FREE_AND_NULL(index);
+    return NULL;
+  }
+  index->sharedImage = image;
+  index->sharedImageSize = imageSize;
+  return index;
+}
+
+void EPUB3ArchiveIndexPublish(EPUB3ArchiveIndexPtr index, const char * name, const char * path, const struct stat * st)
+{
+  assert(index != NULL);
+  assert(name != NULL);
+
+  size_t pathLength = strlen(path);
+  uint64_t entriesOffset = (sizeof(EPUB3SharedArchiveIndexHeader) + pathLength + 7U) & ~(uint64_t)7U;
+  uint64_t imageSize = entriesOffset + (uint64_t)index->entryCount * sizeof(EPUB3SharedArchiveEntry);
+  for(uint32_t i = 0; i < index->entryCount; i++) {
+    imageSize += strlen(index->entries[i].filename) + 1U;
+  }
+
+  // Only one process gets to build it; everyone else carries on with their private index
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if(fd < 0) return;
+  void * image = MAP_FAILED;
+  if(ftruncate(fd, (off_t)imageSize) == 0) {
+    image = mmap(NULL, (size_t)imageSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if(image == MAP_FAILED) {
+    (void)shm_unlink(name);
+    return;
+  }
+
+  EPUB3SharedArchiveIndexHeader * header = image;
+  header->magic = SHARED_ARCHIVE_INDEX_MAGIC;
+  header->version = SHARED_ARCHIVE_INDEX_VERSION;
+  header->builderPid = (int32_t)getpid();
+  header->device = (uint64_t)st->st_dev;
+  header->inode = (uint64_t)st->st_ino;
+  header->size = (uint64_t)st->st_size;
+  header->modificationTime = (int64_t)st->st_mtime;
+  header->modificationTimeNanoseconds = (int64_t)EPUB3_STAT_MTIME_NSEC(st);
+  header->imageSize = imageSize;
+  header->entryCount = index->entryCount;
+  header->pathLength = (uint32_t)pathLength;
+  header->entriesOffset = entriesOffset;
+  memcpy(header + 1, path, pathLength);
+
+  EPUB3SharedArchiveEntry * sharedEntries = (EPUB3SharedArchiveEntry *)((uint8_t *)image + entriesOffset);
+  uint64_t filenameOffset = entriesOffset + (uint64_t)index->entryCount * sizeof(EPUB3SharedArchiveEntry);
+  for(uint32_t i = 0; i < index->entryCount; i++) {
+    EPUB3ArchiveEntryPtr entry = &index->entries[i];
+    EPUB3SharedArchiveEntry * sharedEntry = &sharedEntries[i];
+    sharedEntry->posInCentralDirectory = entry->filePos.pos_in_zip_directory;
+    sharedEntry->fileNumber = entry->filePos.num_of_file;
+    sharedEntry->compressedSize = entry->compressedSize;
+    sharedEntry->uncompressedSize = entry->uncompressedSize;
+    sharedEntry->localHeaderOffset = entry->localHeaderOffset;
+    sharedEntry->filenameOffset = filenameOffset;
+    sharedEntry->crc = entry->crc;
+    sharedEntry->compressionMethod = entry->compressionMethod;
+    sharedEntry->flag = entry->flag;
+    size_t filenameSize = strlen(entry->filename) + 1U;
+    memcpy((uint8_t *)image + filenameOffset, entry->filename, filenameSize);
+    filenameOffset += filenameSize;
+  }
+  __atomic_store_n(&header->complete, 1U, __ATOMIC_RELEASE);
+  munmap(image, (size_t)imageSize);
+}
+
+#pragma mark - Probe
+
+static inline uint64_t EPUB3ReadLittleEndian64(const uint8_t * bytes)
+{
+  return (uint64_t)EPUB3ReadLittleEndian32(bytes) | ((uint64_t)EPUB3ReadLittleEndian32(bytes + 4) << 32);
+}
+
+// Serves small reads from a window over the archive, so walking the central directory costs one pread per window
+static EPUB3Error EPUB3ProbeRead(EPUB3ProbeArchive * probe, uint64_t offset, void * bytes, size_t length)
+{
+  if(offset > probe->size || length > probe->size - offset) return kEPUB3FileReadFromArchiveError;
+  if(length > sizeof(probe->buffer)) {
+    return pread(probe->fd, bytes, length, (off_t)offset) == (ssize_t)length ? kEPUB3Success : kEPUB3FileReadFromArchiveError;
+  }
+  if(offset < probe->bufferOffset || offset + length > probe->bufferOffset + probe->bufferLength) {
+    uint64_t available = probe->size - offset;
+    size_t fillLength = available < sizeof(probe->buffer) ? (size_t)available : sizeof(probe->buffer);
+    ssize_t bytesRead = pread(probe->fd, probe->buffer, fillLength, (off_t)offset);
+    if(bytesRead < (ssize_t)length) {
+      probe->bufferLength = 0;
+      return kEPUB3FileReadFromArchiveError;
+    }
+    probe->bufferOffset = offset;
+    probe->bufferLength = (size_t)bytesRead;
+  }
+  memcpy(bytes, probe->buffer + (offset - probe->bufferOffset), length);
+  return kEPUB3Success;
+}
+
+static EPUB3Error EPUB3ProbeLocateCentralDirectory(EPUB3ProbeArchive * probe)
+{
+  if(probe->size < ZIP_END_OF_CENTRAL_DIRECTORY_SIZE) return kEPUB3ArchiveUnavailableError;
+
+  // The end record sits before a comment of at most 64K. Walk backwards in windows that overlap by three bytes, so a
+  // signature split across two windows is still seen
+  const uint64_t searchLimit = ZIP_MAX_COMMENT_SIZE + ZIP_END_OF_CENTRAL_DIRECTORY_SIZE;
+  uint64_t searchStart = probe->size > searchLimit ? probe->size - searchLimit : 0;
+  uint64_t windowEnd = probe->size;
+  uint64_t endRecordOffset = UINT64_MAX;
+  uint8_t window[1024];
+  while(endRecordOffset == UINT64_MAX && windowEnd > searchStart) {
+    uint64_t windowStart = windowEnd - searchStart > sizeof(window) - 3 ? windowEnd - (sizeof(window) - 3) : searchStart;
+    uint64_t available = probe->size - windowStart;
+    size_t windowLength = available < sizeof(window) ? (size_t)available : sizeof(window);
+    EPUB3Error error = EPUB3ProbeRead(probe, windowStart, window, windowLength);
+    if(error != kEPUB3Success) return error;
+    for(size_t i = windowLength - 3; i-- > 0; ) {
+      if(windowStart + i + ZIP_END_OF_CENTRAL_DIRECTORY_SIZE <= probe->size
+         && EPUB3ReadLittleEndian32(window + i) == ZIP_END_OF_CENTRAL_DIRECTORY_SIGNATURE) {
+        endRecordOffset = windowStart + i;
+        break;
+      }
+    }
+    windowEnd = windowStart;
+  }
+  if(endRecordOffset == UINT64_MAX) return kEPUB3ArchiveUnavailableError;
+
+  uint8_t record[ZIP64_END_OF_CENTRAL_DIRECTORY_SIZE];
+  EPUB3Error error = EPUB3ProbeRead(probe, endRecordOffset, record, ZIP_END_OF_CENTRAL_DIRECTORY_SIZE);
+  if(error != kEPUB3Success) return error;
+  uint64_t entryCount = EPUB3ReadLittleEndian16(record + 10);
+  uint64_t centralDirectorySize = EPUB3ReadLittleEndian32(record + 12);
+  uint64_t centralDirectoryOffset = EPUB3ReadLittleEndian32(record + 16);
+  uint64_t recordOffset = endRecordOffset;
+
+  uint8_t locator[ZIP64_END_OF_CENTRAL_DIRECTORY_LOCATOR_SIZE];
+  if(endRecordOffset >= sizeof(locator)
+     && EPUB3ProbeRead(probe, endRecordOffset - sizeof(locator), locator, sizeof(locator)) == kEPUB3Success
+     && EPUB3ReadLittleEndian32(locator) == ZIP64_END_OF_CENTRAL_DIRECTORY_LOCATOR_SIGNATURE) {
+    // Like unzOpen, fall back to the record just before the locator when data was prepended to the archive
+    uint64_t zip64RecordOffset = EPUB3ReadLittleEndian64(locator + 8);
+    if(EPUB3ProbeRead(probe, zip64RecordOffset, record, sizeof(record)) != kEPUB3Success
+       || EPUB3ReadLittleEndian32(record) != ZIP64_END_OF_CENTRAL_DIRECTORY_SIGNATURE) {
+      if(endRecordOffset < sizeof(locator) + sizeof(record)) return kEPUB3ArchiveUnavailableError;
+      zip64RecordOffset = endRecordOffset - sizeof(locator) - sizeof(record);
+      if(EPUB3ProbeRead(probe, zip64RecordOffset, record, sizeof(record)) != kEPUB3Success
+         || EPUB3ReadLittleEndian32(record) != ZIP64_END_OF_CENTRAL_DIRECTORY_SIGNATURE) {
+        return kEPUB3ArchiveUnavailableError;
+      }
+    }
+    entryCount = EPUB3ReadLittleEndian64(record + 32);
+    centralDirectorySize = EPUB3ReadLittleEndian64(record + 40);
+    centralDirectoryOffset = EPUB3ReadLittleEndian64(record + 48);
+    recordOffset = zip64RecordOffset;
+  }
+
+  if(centralDirectorySize > recordOffset || centralDirectoryOffset > recordOffset - centralDirectorySize) {
+    return kEPUB3ArchiveUnavailableError;
+  }
+  probe->byteBeforeArchive = recordOffset - centralDirectorySize - centralDirectoryOffset;
+  probe->centralDirectoryOffset = centralDirectoryOffset + probe->byteBeforeArchive;
+  probe->entryCount = entryCount;
+  return kEPUB3Success;
+}
+
+static EPUB3Error EPUB3ProbeFillEntry(EPUB3ProbeArchive * probe, const uint8_t * header, uint64_t extraOffset, uint32_t extraLength, EPUB3ProbeEntry * entry)
+{
+  entry->flag = (uint16_t)EPUB3ReadLittleEndian16(header + 8);
+  entry->compressionMethod = (uint16_t)EPUB3ReadLittleEndian16(header + 10);
+  entry->compressedSize = EPUB3ReadLittleEndian32(header + 20);
+  entry->uncompressedSize = EPUB3ReadLittleEndian32(header + 24);
+  entry->localHeaderOffset = EPUB3ReadLittleEndian32(header + 42);
+
+  // ZIP64 keeps the real values, in this order, for the fields that are saturated
+  if(entry->compressedSize == 0xFFFFFFFFU || entry->uncompressedSize == 0xFFFFFFFFU || entry->localHeaderOffset == 0xFFFFFFFFU) {
+    uint64_t extraEnd = extraOffset + extraLength;
+    while(extraOffset + 4 <= extraEnd) {
+      uint8_t field[4];
+      EPUB3Error error = EPUB3ProbeRead(probe, extraOffset, field, sizeof(field));
+      if(error != kEPUB3Success) return error;
+      uint32_t fieldSize = EPUB3ReadLittleEndian16(field + 2);
+      if(EPUB3ReadLittleEndian16(field) == ZIP64_EXTRA_FIELD_ID) {
+        uint8_t values[24];
+        size_t valuesLength = fieldSize < sizeof(values) ? fieldSize : sizeof(values);
+        error = EPUB3ProbeRead(probe, extraOffset + 4, values, valuesLength);
+        if(error != kEPUB3Success) return error;
+        size_t cursor = 0;
+        if(entry->uncompressedSize == 0xFFFFFFFFU && cursor + 8 <= valuesLength) {
+          entry->uncompressedSize = EPUB3ReadLittleEndian64(values + cursor);
+          cursor += 8;
+        }
+        if(entry->compressedSize == 0xFFFFFFFFU && cursor + 8 <= valuesLength) {
+          entry->compressedSize = EPUB3ReadLittleEndian64(values + cursor);
+          cursor += 8;
+        }
+        if(entry->localHeaderOffset == 0xFFFFFFFFU && cursor + 8 <= valuesLength) {
+          entry->localHeaderOffset = EPUB3ReadLittleEndian64(values + cursor);
+        }
+        break;
+      }
+      extraOffset += 4 + fieldSize;
+    }
+  }
+  entry->localHeaderOffset += probe->byteBeforeArchive;
+  entry->found = kEPUB3_YES;
+  return kEPUB3Success;
+}
+
+// Walks the central directory, handing every entry to function until it returns kEPUB3_NO. Names are read into
+// the caller's buffer, so nothing is allocated; entries with names that don't fit are skipped
+static EPUB3Error EPUB3ProbeEnumerateEntries(EPUB3ProbeArchive * probe, char * filename, size_t filenameSize, EPUB3ArchiveEntryFunction function, void * context)
+{
+  uint64_t offset = probe->centralDirectoryOffset;
+  uint8_t header[ZIP_CENTRAL_HEADER_SIZE];
+  for(uint64_t i = 0; i < probe->entryCount; i++) {
+    EPUB3Error error = EPUB3ProbeRead(probe, offset, header, sizeof(header));
+    if(error != kEPUB3Success) return error;
+    if(EPUB3ReadLittleEndian32(header) != ZIP_CENTRAL_HEADER_SIGNATURE) return kEPUB3ArchiveUnavailableError;
+    uint32_t filenameLength = EPUB3ReadLittleEndian16(header + 28);
+    uint32_t extraLength = EPUB3ReadLittleEndian16(header + 30);
+    uint32_t commentLength = EPUB3ReadLittleEndian16(header + 32);
+    uint64_t filenameOffset = offset + ZIP_CENTRAL_HEADER_SIZE;
+    uint64_t nextOffset = filenameOffset + filenameLength + extraLength + commentLength;
+    if(filenameLength >= filenameSize) {
+      offset = nextOffset;
+      continue;
+    }
+
+    error = EPUB3ProbeRead(probe, filenameOffset, filename, filenameLength);
+    if(error != kEPUB3Success) return error;
+    filename[filenameLength] = '\0';
+    EPUB3ProbeEntry entry;
+    error = EPUB3ProbeFillEntry(probe, header, filenameOffset + filenameLength, extraLength, &entry);
+    if(error != kEPUB3Success) return error;
+
+    EPUB3ArchiveEntryInfo info;
+    info.name = filename;
+    info.uncompressedSize = entry.uncompressedSize;
+    info.compressedSize = entry.compressedSize;
+    info.localHeaderOffset = entry.localHeaderOffset;
+    info.crc = EPUB3ReadLittleEndian32(header + 16);
+    info.compressionMethod = entry.compressionMethod;
+    info.flag = entry.flag;
+    if(!function(&info, context)) break;
+    offset = nextOffset;
+  }
+  return kEPUB3Success;
+}
+
+static EPUB3Bool EPUB3ProbeMatchEntry(const EPUB3ArchiveEntryInfo * info, void * context)
+{
+  EPUB3ProbeSearch * search = context;
+  for(uint32_t n = 0; n < search->nameCount; n++) {
+    EPUB3ProbeEntry * entry = &search->entries[n];
+    if(!entry->found && strcmp(info->name, search->names[n]) == 0) {
+      entry->found = kEPUB3_YES;
+      entry->compressionMethod = info->compressionMethod;
+      entry->flag = info->flag;
+      entry->compressedSize = info->compressedSize;
+      entry->uncompressedSize = info->uncompressedSize;
+      entry->localHeaderOffset = info->localHeaderOffset;
+    }
+  }
+  return kEPUB3_YES;
+}
+
+// Looks up several names in one pass over the central directory. Names that are not there are left with found unset.
+// None of them come near PROBE_NAME_SIZE, so skipping longer names loses nothing
+static EPUB3Error EPUB3ProbeFindEntries(EPUB3ProbeArchive * probe, const char * const * names, EPUB3ProbeEntry * entries, uint32_t nameCount)
+{
+  char filename[PROBE_NAME_SIZE];
+  EPUB3ProbeSearch search;
+  search.names = names;
+  search.entries = entries;
+  search.nameCount = nameCount;
+  return EPUB3ProbeEnumerateEntries(probe, filename, sizeof(filename), EPUB3ProbeMatchEntry, &search);
+}
+
+static voidpf EPUB3ProbeArenaAlloc(voidpf opaque, uInt items, uInt size)
+{
+  EPUB3ProbeArena * arena = opaque;
+  size_t byteCount = ((size_t)items * size + 15U) & ~(size_t)15U;
+  if(byteCount > sizeof(arena->bytes) - arena->used) return Z_NULL;
+  voidpf allocation = arena->bytes + arena->used;
+  arena->used += byteCount;
+  return allocation;
+}
+
+static void EPUB3ProbeArenaFree(voidpf opaque, voidpf address)
+{
+  // The arena goes away with the stack frame that owns it
+  (void)opaque;
+  (void)address;
+}
+
+// Reads up to capacity bytes from the start of an entry. There is no CRC check, since most entries are only read in part
+static EPUB3Error EPUB3ProbeReadEntryPrefix(EPUB3ProbeArchive * probe, const EPUB3ProbeEntry * entry, char * bytes, size_t capacity, size_t * length)
+{
+  *length = 0;
+  if((entry->flag & ZIP_FLAG_ENCRYPTED) != 0) return kEPUB3FileReadFromArchiveError;
+
+  uint8_t header[ZIP_LOCAL_HEADER_SIZE];
+  EPUB3Error error = EPUB3ProbeRead(probe, entry->localHeaderOffset, header, sizeof(header));
+  if(error != kEPUB3Success) return error;
+  if(EPUB3ReadLittleEndian32(header) != ZIP_LOCAL_HEADER_SIGNATURE) return kEPUB3FileReadFromArchiveError;
+  uint64_t dataOffset = entry->localHeaderOffset + ZIP_LOCAL_HEADER_SIZE
+    + EPUB3ReadLittleEndian16(header + ZIP_LOCAL_HEADER_FILENAME_LENGTH_OFFSET)
+    + EPUB3ReadLittleEndian16(header + ZIP_LOCAL_HEADER_EXTRA_LENGTH_OFFSET);
+  size_t wanted = entry->uncompressedSize < capacity ? (size_t)entry->uncompressedSize : capacity;
+
+  if(entry->compressionMethod == 0) {
+    if(entry->compressedSize < wanted) return kEPUB3FileReadFromArchiveError;
+    error = EPUB3ProbeRead(probe, dataOffset, bytes, wanted);
+    if(error == kEPUB3Success) *length = wanted;
+    return error;
+  }
+  if(entry->compressionMethod != Z_DEFLATED) return kEPUB3FileReadFromArchiveError;
+
+  EPUB3ProbeArena arena;
+  arena.used = 0;
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  stream.zalloc = EPUB3ProbeArenaAlloc;
+  stream.zfree = EPUB3ProbeArenaFree;
+  stream.opaque = &arena;
+  if(inflateInit2(&stream, -MAX_WBITS) != Z_OK) return kEPUB3FileReadFromArchiveError;
+
+  uint8_t input[PROBE_IO_BUFFER_SIZE];
+  uint64_t consumed = 0;
+  int status = Z_OK;
+  stream.next_out = (Bytef *)bytes;
+  stream.avail_out = (uInt)wanted;
+  while(stream.avail_out > 0 && status == Z_OK) {
+    if(stream.avail_in == 0) {
+      if(consumed == entry->compressedSize) break;
+      uint64_t remaining = entry->compressedSize - consumed;
+      size_t chunkLength = remaining < sizeof(input) ? (size_t)remaining : sizeof(input);
+      if(pread(probe->fd, input, chunkLength, (off_t)(dataOffset + consumed)) != (ssize_t)chunkLength) {
+        status = Z_ERRNO;
+        break;
+      }
+      consumed += chunkLength;
+      stream.next_in = input;
+      stream.avail_in = (uInt)chunkLength;
+    }
+    status = inflate(&stream, Z_NO_FLUSH);
+  }
+  *length = wanted - stream.avail_out;
+  (void)inflateEnd(&stream);
+  return (status == Z_OK || status == Z_STREAM_END) ? kEPUB3Success : kEPUB3FileReadFromArchiveError;
+}
+
+static inline EPUB3Bool EPUB3ProbeIsSpace(char c)
+{
+  return (c == ' ' || c == '\t' || c == '\r' || c == '\n') ? kEPUB3_YES : kEPUB3_NO;
+}
+
+static const char * EPUB3ProbeFindString(const char * cursor, const char * end, const char * string)
+{
+  size_t length = strlen(string);
+  for(; (size_t)(end - cursor) >= length; cursor++) {
+    if(memcmp(cursor, string, length) == 0) return cursor;
+  }
+  return NULL;
+}
+
+// A deliberately small tokenizer: enough to find elements and attributes in the head of an OPF or container, which
+// libxml2 could only do by allocating. Returns the position after the tag, or NULL once no complete tag remains
+static const char * EPUB3ProbeNextTag(const char * cursor, const char * end, EPUB3ProbeTag * tag)
+{
+  while(cursor < end) {
+    const char * open = memchr(cursor, '<', (size_t)(end - cursor));
+    if(open == NULL) return NULL;
+    if(end - open >= 4 && memcmp(open, "<!--", 4) == 0) {
+      const char * commentEnd = EPUB3ProbeFindString(open + 4, end, "-->");
+      if(commentEnd == NULL) return NULL;
+      cursor = commentEnd + 3;
+      continue;
+    }
+    const char * close = memchr(open, '>', (size_t)(end - open));
+    if(close == NULL) return NULL;
+    const char * name = open + 1;
+    tag->isEndTag = (*name == '/') ? kEPUB3_YES : kEPUB3_NO;
+    if(tag->isEndTag) name++;
+    const char * nameEnd = name;
+    while(nameEnd < close && !EPUB3ProbeIsSpace(*nameEnd) && *nameEnd != '/') nameEnd++;
+    const char * colon = memchr(name, ':', (size_t)(nameEnd - name));
+    tag->localName = (colon != NULL) ? colon + 1 : name;
+    tag->localNameLength = (size_t)(nameEnd - tag->localName);
+    tag->start = open;
+    tag->end = close;
+    return close + 1;
+  }
+  return NULL;
+}
+
+static EPUB3Bool EPUB3ProbeTagIs(const EPUB3ProbeTag * tag, const char * localName)
+{
+  size_t length = strlen(localName);
+  return (tag->localNameLength == length && memcmp(tag->localName, localName, length) == 0) ? kEPUB3_YES : kEPUB3_NO;
+}
+
+static size_t EPUB3ProbeEncodeUTF8(uint32_t codepoint, char * bytes)
+{
+  if(codepoint < 0x80) {
+    bytes[0] = (char)codepoint;
+    return 1;
+  }
+  if(codepoint < 0x800) {
+    bytes[0] = (char)(0xC0 | (codepoint >> 6));
+    bytes[1] = (char)(0x80 | (codepoint & 0x3F));
+    return 2;
+  }
+  if(codepoint < 0x10000) {
+    bytes[0] = (char)(0xE0 | (codepoint >> 12));
+    bytes[1] = (char)(0x80 | ((codepoint >> 6) & 0x3F));
+    bytes[2] = (char)(0x80 | (codepoint & 0x3F));
+    return 3;
+  }
+  if(codepoint < 0x110000) {
+    bytes[0] = (char)(0xF0 | (codepoint >> 18));
+    bytes[1] = (char)(0x80 | ((codepoint >> 12) & 0x3F));
+    bytes[2] = (char)(0x80 | ((codepoint >> 6) & 0x3F));
+    bytes[3] = (char)(0x80 | (codepoint & 0x3F));
+    return 4;
+  }
+  return 0;
+}
+
+// Decodes the predefined and numeric entities. Returns the decoded length, or 0 to copy the '&' through as it is
+static size_t EPUB3ProbeDecodeEntity(const char * entity, size_t entityLength, char * bytes)
+{
+  static const struct { const char * name; char value; } predefined[] = {
+    { "amp", '&' }, { "lt", '<' }, { "gt", '>' }, { "quot", '"' }, { "apos", '\'' },
+  };
+  for(size_t i = 0; i < sizeof(predefined) / sizeof(predefined[0]); i++) {
+    if(strlen(predefined[i].name) == entityLength && memcmp(predefined[i].name, entity, entityLength) == 0) {
+      bytes[0] = predefined[i].value;
+      return 1;
+    }
+  }
+  if(entityLength < 2 || entity[0] != '#') return 0;
+  uint32_t codepoint = 0;
+  EPUB3Bool isHex = (entity[1] == 'x') ? kEPUB3_YES : kEPUB3_NO;
+  for(size_t i = isHex ? 2 : 1; i < entityLength; i++) {
+    char c = entity[i];
+    uint32_t digit;
+    if(c >= '0' && c <= '9') digit = (uint32_t)(c - '0');
+    else if(isHex && c >= 'a' && c <= 'f') digit = (uint32_t)(c - 'a' + 10);
+    else if(isHex && c >= 'A' && c <= 'F') digit = (uint32_t)(c - 'A' + 10);
+    else return 0;
+    codepoint = codepoint * (isHex ? 16 : 10) + digit;
+    if(codepoint >= 0x110000) return 0;
+  }
+  return EPUB3ProbeEncodeUTF8(codepoint, bytes);
+}
+
+// Copies character data, decoding entities and trimming surrounding whitespace. Truncation never splits a UTF-8 sequence
+static void EPUB3ProbeCopyText(const char * start, const char * end, char * text, size_t textSize)
+{
+  while(start < end && EPUB3ProbeIsSpace(*start)) start++;
+  while(end > start && EPUB3ProbeIsSpace(end[-1])) end--;
+
+  size_t length = 0;
+  EPUB3Bool truncated = kEPUB3_NO;
+  while(start < end) {
+    char decoded[4];
+    size_t decodedLength = 0;
+    const char * next = start + 1;
+    if(*start == '&') {
+      const char * semicolon = memchr(start, ';', (size_t)(end - start));
+      if(semicolon != NULL && (decodedLength = EPUB3ProbeDecodeEntity(start + 1, (size_t)(semicolon - start - 1), decoded)) > 0) {
+        next = semicolon + 1;
+      }
+    }
+    if(decodedLength == 0) {
+      decoded[0] = *start;
+      decodedLength = 1;
+    }
+    if(length + decodedLength >= textSize) {
+      truncated = kEPUB3_YES;
+      break;
+    }
+    memcpy(text + length, decoded, decodedLength);
+    length += decodedLength;
+    start = next;
+  }
+
+  if(truncated) {
+    size_t leadByte = length;
+    while(leadByte > 0 && ((uint8_t)text[leadByte - 1] & 0xC0) == 0x80) leadByte--;
+    if(leadByte > 0) {
+      uint8_t lead = (uint8_t)text[leadByte - 1];
+      size_t sequenceLength = (lead >= 0xF0) ? 4 : (lead >= 0xE0) ? 3 : (lead >= 0xC0) ? 2 : 1;
+      if(length - (leadByte - 1) < sequenceLength) length = leadByte - 1;
+    }
+  }
+  text[length] = '\0';
+}
+
+static EPUB3Bool EPUB3ProbeCopyAttribute(const EPUB3ProbeTag * tag, const char * name, char * value, size_t valueSize)
+{
+  size_t nameLength = strlen(name);
+  const char * cursor = tag->localName + tag->localNameLength;
+  while(cursor < tag->end) {
+    while(cursor < tag->end && EPUB3ProbeIsSpace(*cursor)) cursor++;
+    const char * attributeName = cursor;
+    while(cursor < tag->end && *cursor != '=' && *cursor != '/' && !EPUB3ProbeIsSpace(*cursor)) cursor++;
+    size_t attributeNameLength = (size_t)(cursor - attributeName);
+    while(cursor < tag->end && EPUB3ProbeIsSpace(*cursor)) cursor++;
+    if(cursor >= tag->end || *cursor != '=') {
+      if(attributeNameLength == 0) cursor++;
+      continue;
+    }
+    cursor++;
+    while(cursor < tag->end && EPUB3ProbeIsSpace(*cursor)) cursor++;
+    if(cursor >= tag->end || (*cursor != '"' && *cursor != '\'')) return kEPUB3_NO;
+    const char * valueEnd = memchr(cursor + 1, *cursor, (size_t)(tag->end - cursor - 1));
+    if(valueEnd == NULL) return kEPUB3_NO;
+    if(attributeNameLength == nameLength && memcmp(attributeName, name, nameLength) == 0) {
+      EPUB3ProbeCopyText(cursor + 1, valueEnd, value, valueSize);
+      return kEPUB3_YES;
+    }
+    cursor = valueEnd + 1;
+  }
+  return kEPUB3_NO;
+}
+
+static EPUB3Error EPUB3ProbeParsePackage(const char * opf, size_t length, EPUB3ProbeResult * result)
+{
+  const char * cursor = opf;
+  const char * end = opf + length;
+  EPUB3ProbeTag tag;
+  EPUB3Bool foundPackage = kEPUB3_NO;
+  EPUB3Bool inMetadata = kEPUB3_NO;
+  while((cursor = EPUB3ProbeNextTag(cursor, end, &tag)) != NULL) {
+    if(!foundPackage) {
+      if(tag.isEndTag || !EPUB3ProbeTagIs(&tag, "package")) continue;
+      foundPackage = kEPUB3_YES;
+      char version[16];
+      if(EPUB3ProbeCopyAttribute(&tag, "version", version, sizeof(version))) {
+        const char * digit = version;
+        for(; *digit >= '0' && *digit <= '9'; digit++) result->versionMajor = (uint16_t)(result->versionMajor * 10 + (*digit - '0'));
+        if(*digit == '.') {
+          for(digit++; *digit >= '0' && *digit <= '9'; digit++) result->versionMinor = (uint16_t)(result->versionMinor * 10 + (*digit - '0'));
+        }
+      }
+      continue;
+    }
+    if(EPUB3ProbeTagIs(&tag, "metadata")) {
+      if(tag.isEndTag) break;
+      inMetadata = kEPUB3_YES;
+      continue;
+    }
+    if(inMetadata && !tag.isEndTag && EPUB3ProbeTagIs(&tag, "title") && tag.end[-1] != '/') {
+      // A title cut off by the end of the prefix is still worth returning
+      const char * textEnd = memchr(cursor, '<', (size_t)(end - cursor));
+      EPUB3ProbeCopyText(cursor, (textEnd != NULL) ? textEnd : end, result->title, sizeof(result->title));
+      break;
+    }
+  }
+  return foundPackage ? kEPUB3Success : kEPUB3XMLXDocumentInvalidError;
+}
+
+static EPUB3Error EPUB3ProbeArchiveContents(EPUB3ProbeArchive * probe, EPUB3ProbeResult * result)
+{
+  EPUB3Error error = EPUB3ProbeLocateCentralDirectory(probe);
+  if(error != kEPUB3Success) return error;
+  result->fileCount = probe->entryCount > UINT32_MAX ? UINT32_MAX : (uint32_t)probe->entryCount;
+
+  static const char * const names[] = { "mimetype", "META-INF/container.xml", "META-INF/encryption.xml" };
+  EPUB3ProbeEntry entries[3];
+  memset(entries, 0, sizeof(entries));
+  error = EPUB3ProbeFindEntries(probe, names, entries, 3);
+  if(error != kEPUB3Success) return error;
+  result->hasEncryption = entries[2].found;
+
+  static const char * requiredMimetype = "application/epub+zip";
+  char mimetype[32];
+  size_t length = 0;
+  if(!entries[0].found) return kEPUB3InvalidMimetypeError;
+  error = EPUB3ProbeReadEntryPrefix(probe, &entries[0], mimetype, strlen(requiredMimetype), &length);
+  if(error != kEPUB3Success || length != strlen(requiredMimetype) || memcmp(mimetype, requiredMimetype, length) != 0) {
+    return kEPUB3InvalidMimetypeError;
+  }
+
+  if(!entries[1].found) return kEPUB3FileNotFoundInArchiveError;
+  char container[PROBE_CONTAINER_PREFIX_SIZE];
+  error = EPUB3ProbeReadEntryPrefix(probe, &entries[1], container, sizeof(container), &length);
+  if(error != kEPUB3Success) return error;
+  char rootPath[PROBE_NAME_SIZE];
+  rootPath[0] = '\0';
+  const char * cursor = container;
+  EPUB3ProbeTag tag;
+  while(rootPath[0] == '\0' && (cursor = EPUB3ProbeNextTag(cursor, container + length, &tag)) != NULL) {
+    if(!tag.isEndTag && EPUB3ProbeTagIs(&tag, "rootfile")) {
+      (void)EPUB3ProbeCopyAttribute(&tag, "full-path", rootPath, sizeof(rootPath));
+    }
+  }
+  if(rootPath[0] == '\0') return kEPUB3XMLXElementNotFoundError;
+
+  const char * rootNames[] = { rootPath };
+  EPUB3ProbeEntry rootEntry;
+  memset(&rootEntry, 0, sizeof(rootEntry));
+  error = EPUB3ProbeFindEntries(probe, rootNames, &rootEntry, 1);
+  if(error != kEPUB3Success) return error;
+  if(!rootEntry.found) return kEPUB3FileNotFoundInArchiveError;
+  char opf[PROBE_OPF_PREFIX_SIZE];
+  error = EPUB3ProbeReadEntryPrefix(probe, &rootEntry, opf, sizeof(opf), &length);
+  if(error != kEPUB3Success) return error;
+  return EPUB3ProbeParsePackage(opf, length, result);
+}
+
+static EPUB3Error EPUB3ProbeOpen(EPUB3ProbeArchive * probe, const char * path)
+{
+  probe->fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(probe->fd < 0) return kEPUB3ArchiveUnavailableError;
+  struct stat st;
+  if(fstat(probe->fd, &st) != 0) {
+    (void)close(probe->fd);
+    return kEPUB3ArchiveUnavailableError;
+  }
+  probe->size = (uint64_t)st.st_size;
+  probe->byteBeforeArchive = 0;
+  probe->centralDirectoryOffset = 0;
+  probe->entryCount = 0;
+  probe->bufferOffset = 0;
+  probe->bufferLength = 0;
+  return kEPUB3Success;
+}
+
+EXPORT EPUB3Error EPUB3Probe(const char * path, EPUB3ProbeResult * result)
+{
+  assert(path != NULL);
+  assert(result != NULL);
+
+  memset(result, 0, sizeof(*result));
+  EPUB3ProbeArchive probe;
+  EPUB3Error error = EPUB3ProbeOpen(&probe, path);
+  if(error != kEPUB3Success) return error;
+  error = EPUB3ProbeArchiveContents(&probe, result);
+  (void)close(probe.fd);
+  return error;
+}
+
+EXPORT EPUB3Error EPUB3EnumerateArchiveEntriesAtPath(const char * path, EPUB3ArchiveEntryFunction function, void * context)
+{
+  assert(path != NULL);
+  assert(function != NULL);
+
+  // Large enough for any name a central directory can hold, so every entry is listed
+  char filename[ZIP_MAX_FILENAME_SIZE + 1];
+  EPUB3ProbeArchive probe;
+  EPUB3Error error = EPUB3ProbeOpen(&probe, path);
+  if(error != kEPUB3Success) return error;
+  error = EPUB3ProbeLocateCentralDirectory(&probe);
+  if(error == kEPUB3Success) {
+    error = EPUB3ProbeEnumerateEntries(&probe, filename, sizeof(filename), function, context);
+  }
+  (void)close(probe.fd);
+  return error;
+}
+
+#pragma mark - Writer
+
+// Hands out the next chunk in file order, so the file at the head of the queue finishes first. Called locked
+static EPUB3Bool EPUB3WriterClaimChunk(EPUB3WriterRef writer, EPUB3WriterFilePtr * file, uint32_t * index)
+{
+  if(writer->nextFile == NULL) return kEPUB3_NO;
+
+  *file = writer->nextFile;
+  *index = writer->nextChunk++;
+  if(writer->nextChunk == (*file)->chunkCount) {
+    EPUB3WriterFilePtr next = (*file)->next;
+    while(next != NULL && next->chunkCount == 0) {
+      next = next->next;
+    }
+    writer->nextFile = next;
+    writer->nextChunk = 0;
+  }
+  return kEPUB3_YES;
+}
+
+// Called locked
+static void EPUB3WriterFinishChunk(EPUB3WriterRef writer, EPUB3WriterFilePtr file)
+{
+  file->chunksDone++;
+  if(file->chunksDone == file->chunkCount) {
+    pthread_cond_signal(&writer->chunkDone);
+  }
+}
+
+static void * EPUB3WriterWorker(void * argument)
+{
+  EPUB3WriterRef writer = argument;
+  z_stream stream;
+  EPUB3Bool streamReady = kEPUB3_NO;
+
+  pthread_mutex_lock(&writer->lock);
+  for(;;) {
+    EPUB3WriterFilePtr file = NULL;
+    uint32_t index = 0;
+    if(EPUB3WriterClaimChunk(writer, &file, &index)) {
+      pthread_mutex_unlock(&writer->lock);
+      EPUB3WriterCompressChunk(file, index, &stream, &streamReady);
+      pthread_mutex_lock(&writer->lock);
+      EPUB3WriterFinishChunk(writer, file);
+      continue;
+    }
+    if(writer->stopping) break;
+    pthread_cond_wait(&writer->workAvailable, &writer->lock);
+  }
+  pthread_mutex_unlock(&writer->lock);
+
+  if(streamReady) {
+    (void)deflateEnd(&stream);
+  }
+  return NULL;
+}
+
+EXPORT EPUB3WriterRef EPUB3WriterCreateAtPath(const char * path, uint32_t threadCount, EPUB3Error * error)
+{
+  assert(path != NULL);
+  assert(error != NULL);
+
+  zipFile archive = zipOpen(path, APPEND_STATUS_CREATE);
+  if(archive == NULL) {
+    *error = kEPUB3ArchiveUnavailableError;
+    return NULL;
+  }
+
+  EPUB3WriterRef memory = malloc(sizeof(struct EPUB3Writer));
+  memory = EPUB3ObjectInitWithTypeID(memory, kEPUB3WriterTypeID);
+  memory->path = strdup(path);
+  memory->archive = archive;
+  memset(&memory->fileInfo, 0, sizeof(memory->fileInfo));
+  time_t now = time(NULL);
+  struct tm local;
+  if(localtime_r(&now, &local) != NULL) {
+    memory->fileInfo.tmz_date.tm_sec = (uInt)local.tm_sec;
+    memory->fileInfo.tmz_date.tm_min = (uInt)local.tm_min;
+    memory->fileInfo.tmz_date.tm_hour = (uInt)local.tm_hour;
+    memory->fileInfo.tmz_date.tm_mday = (uInt)local.tm_mday;
+    memory->fileInfo.tmz_date.tm_mon = (uInt)local.tm_mon;
+    memory->fileInfo.tmz_date.tm_year = (uInt)local.tm_year + 1900;
+  }
+  memory->archiveSize = 0;
+  memory->error = kEPUB3Success;
+  pthread_mutex_init(&memory->lock, NULL);
+  pthread_cond_init(&memory->workAvailable, NULL);
+  pthread_cond_init(&memory->chunkDone, NULL);
+  memory->head = NULL;
+  memory->tail = NULL;
+  memory->nextFile = NULL;
+  memory->nextChunk = 0;
+  memory->stopping = kEPUB3_NO;
+  memory->streamReady = kEPUB3_NO;
+
+  if(threadCount == 0) {
+    long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+    threadCount = cpuCount > 0 ? (uint32_t)cpuCount : 1;
+  }
+  // The thread that closes the writer compresses too, so spawn one fewer
+  memory->threads = calloc(threadCount, sizeof(pthread_t));
+  memory->threadCount = 0;
+  for(uint32_t i = 1; i < threadCount; i++) {
+    if(pthread_create(&memory->threads[memory->threadCount], NULL, EPUB3WriterWorker, memory) == 0) {
+      memory->threadCount++;
+    }
+  }
+
+  // OCF wants the mimetype first, stored and without an extra field, so it sits at a fixed offset for sniffing
+  static const char mimetype[] = "application/epub+zip";
+  *error = EPUB3WriterQueueFile(memory, "mimetype", mimetype, sizeof(mimetype) - 1, kEPUB3_NO);
+  if(*error != kEPUB3Success) {
+    memory->error = *error;
+    (void)EPUB3WriterClose(memory);
+    return NULL;
+  }
+  return memory;
+}
+
+EXPORT EPUB3Error EPUB3WriterAddFile(EPUB3WriterRef writer, const char * path, const void * bytes, uint64_t byteCount, EPUB3Bool compress)
+{
+  assert(writer != NULL);
+  assert(path != NULL);
+  assert(bytes != NULL || byteCount == 0);
+
+  if(path[0] == '\0' || path[0] == '/' || strcmp(path, "mimetype") == 0) return kEPUB3InvalidArgumentError;
+  if(byteCount > UINT32_MAX) return kEPUB3InvalidArgumentError;
+  if(writer->error != kEPUB3Success) return writer->error;
+
+  EPUB3Error error = EPUB3WriterQueueFile(writer, path, bytes, (uint32_t)byteCount, compress);
+  if(error != kEPUB3Success) return error;
+  // Writing out whatever is finished already hands memory back while the rest of the book is added
+  return EPUB3WriterWriteFinishedFiles(writer, kEPUB3_NO);
+}
+
+EXPORT EPUB3Error EPUB3WriterAddFileFromArchive(EPUB3WriterRef writer, const char * path, EPUB3Ref epub, const char * sourcePath)
+{
+  assert(writer != NULL);
+  assert(path != NULL);
+  assert(epub != NULL);
+  assert(sourcePath != NULL);
+
+  if(path[0] == '\0' || path[0] == '/' || strcmp(path, "mimetype") == 0) return kEPUB3InvalidArgumentError;
+  if(writer->error != kEPUB3Success) return writer->error;
+  if(epub->archiveIndex == NULL) return kEPUB3ArchiveUnavailableError;
+
+  EPUB3ArchiveEntryPtr entry = EPUB3ArchiveIndexFindEntry(epub->archiveIndex, sourcePath);
+  if(entry == NULL) return kEPUB3FileNotFoundInArchiveError;
+  EPUB3Error error = EPUB3WriterQueueRawFile(writer, path, epub, entry);
+  if(error != kEPUB3Success) return error;
+  return EPUB3WriterWriteFinishedFiles(writer, kEPUB3_NO);
+}
+
+EXPORT EPUB3Error EPUB3WriterClose(EPUB3WriterRef writer)
+{
+  if(writer == NULL) return kEPUB3InvalidArgumentError;
+
+  EPUB3Error error = EPUB3WriterWriteFinishedFiles(writer, kEPUB3_YES);
+
+  pthread_mutex_lock(&writer->lock);
+  writer->stopping = kEPUB3_YES;
+  pthread_cond_broadcast(&writer->workAvailable);
+  pthread_mutex_unlock(&writer->lock);
+  for(uint32_t i = 0; i < writer->threadCount; i++) {
+    pthread_join(writer->threads[i], NULL);
+  }
+  EPUB3_FREE_AND_NULL(writer->threads);
+  if(writer->streamReady) {
+    (void)deflateEnd(&writer->stream);
+  }
+
+  if(zipClose(writer->archive, NULL) != ZIP_OK && error == kEPUB3Success) {
+    error = kEPUB3UnknownError;
+  }
+  writer->archive = NULL;
+  if(error != kEPUB3Success) {
+    (void)unlink(writer->path);
+  }
+  pthread_cond_destroy(&writer->chunkDone);
+  pthread_cond_destroy(&writer->workAvailable);
+  pthread_mutex_destroy(&writer->lock);
+  EPUB3_FREE_AND_NULL(writer->path);
+  EPUB3ObjectRelease(writer);
+  return error;
+}
+
+EPUB3Error EPUB3WriterQueueFile(EPUB3WriterRef writer, const char * path, const void * bytes, uint32_t byteCount, EPUB3Bool compress)
+{
+  EPUB3WriterFilePtr file = calloc(1, sizeof(struct EPUB3WriterFile));
+  if(file == NULL) return kEPUB3UnknownError;
+  file->path = strdup(path);
+  file->bytes = malloc(byteCount > 0 ? byteCount : 1);
+  file->byteCount = byteCount;
+  file->compress = compress && byteCount > 0 ? kEPUB3_YES : kEPUB3_NO;
+  file->chunkCount = (uint32_t)(((uint64_t)byteCount + WRITER_CHUNK_SIZE - 1) / WRITER_CHUNK_SIZE);
+  file->chunks = calloc(file->chunkCount > 0 ? file->chunkCount : 1, sizeof(EPUB3WriterChunk));
+  if(file->path == NULL || file->bytes == NULL || file->chunks == NULL) {
+    EPUB3WriterFileFree(file);
+    return kEPUB3UnknownError;
+  }
+  if(byteCount > 0) {
+    memcpy(file->bytes, bytes, byteCount);
+  }
+
+  pthread_mutex_lock(&writer->lock);
+  if(writer->tail != NULL) {
+    writer->tail->next = file;
+  } else {
+    writer->head = file;
+  }
+  writer->tail = file;
+  if(file->chunkCount > 0 && writer->nextFile == NULL) {
+    writer->nextFile = file;
+    writer->nextChunk = 0;
+  }
+  pthread_cond_broadcast(&writer->workAvailable);
+  pthread_mutex_unlock(&writer->lock);
+  return kEPUB3Success;
+}
+
+// Queues an entry of epub with its compressed bytes as they are, borrowed from a mapped or in-memory archive and
+// read with one positioned read otherwise. It needs no chunks, so it is written as soon as it reaches the head
+EPUB3Error EPUB3WriterQueueRawFile(EPUB3WriterRef writer, const char * path, EPUB3Ref epub, EPUB3ArchiveEntryPtr entry)
+{
+  // MiniZip 1.01h can only write stored and deflated entries, without encryption or 64 bit sizes
+  if((entry->flag & ZIP_FLAG_ENCRYPTED) != 0 || (entry->compressionMethod != 0 && entry->compressionMethod != Z_DEFLATED)) {
+    return kEPUB3FileEncodingNotSupportedError;
+  }
+  if(entry->compressedSize > UINT32_MAX || entry->uncompressedSize > UINT32_MAX) return kEPUB3InvalidArgumentError;
+
+  const void * bytes = NULL;
+  EPUB3ArchiveEntryInfo info;
+  EPUB3Bool isCopy = kEPUB3_NO;
+  EPUB3Error error = EPUB3GetOrCopyRawBytesOfFileInArchive(epub, entry->filename, &bytes, &info, &isCopy);
+  if(error != kEPUB3Success) return error;
+
+  EPUB3WriterFilePtr file = calloc(1, sizeof(struct EPUB3WriterFile));
+  if(file == NULL) {
+    if(isCopy) free((void *)bytes);
+    return kEPUB3UnknownError;
+  }
+  file->path = strdup(path);
+  file->bytes = (uint8_t *)bytes;
+  file->byteCount = (uint32_t)entry->compressedSize;
+  file->compress = entry->compressionMethod == Z_DEFLATED ? kEPUB3_YES : kEPUB3_NO;
+  file->raw = kEPUB3_YES;
+  file->rawCRC = entry->crc;
+  file->rawUncompressedSize = (uint32_t)entry->uncompressedSize;
+  if(!isCopy) {
+    EPUB3Retain(epub);
+    file->source = epub;
+  }
+  if(file->path == NULL) {
+    EPUB3WriterFileFree(file);
+    return kEPUB3UnknownError;
+  }
+
+  pthread_mutex_lock(&writer->lock);
+  if(writer->tail != NULL) {
+    writer->tail->next = file;
+  } else {
+    writer->head = file;
+  }
+  writer->tail = file;
+  pthread_mutex_unlock(&writer->lock);
+  return kEPUB3Success;
+}
+
+// Takes the CRC of one chunk and, for compressed files, deflates it as a piece of the file's stream: primed with
+// the 32K before it, ended on a sync flush so the next piece starts on a byte boundary, the last one finished
+void EPUB3WriterCompressChunk(EPUB3WriterFilePtr file, uint32_t index, z_stream * stream, EPUB3Bool * streamReady)
+{
+  EPUB3WriterChunk * chunk = &file->chunks[index];
+  uint32_t start = index * WRITER_CHUNK_SIZE;
+  uint32_t length = file->byteCount - start < WRITER_CHUNK_SIZE ? file->byteCount - start : WRITER_CHUNK_SIZE;
+  chunk->crc = EPUB3CRC32(0, file->bytes + start, length);
+  if(!file->compress) return;
+
+  int status = Z_OK;
+  if(!*streamReady) {
+    memset(stream, 0, sizeof(*stream));
+    status = deflateInit2(stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    *streamReady = status == Z_OK ? kEPUB3_YES : kEPUB3_NO;
+  } else {
+    status = deflateReset(stream);
+  }
+  if(status == Z_OK && start > 0) {
+    uint32_t dictionaryLength = start < WRITER_DICTIONARY_SIZE ? start : WRITER_DICTIONARY_SIZE;
+    status = deflateSetDictionary(stream, file->bytes + start - dictionaryLength, dictionaryLength);
+  }
+  // A sync flush adds an empty stored block on top of the bound
+  uLong capacity = status == Z_OK ? deflateBound(stream, length) + 16 : 0;
+  chunk->compressed = status == Z_OK ? malloc(capacity) : NULL;
+  if(chunk->compressed == NULL) {
+    chunk->failed = kEPUB3_YES;
+    return;
+  }
+
+  EPUB3Bool last = index + 1 == file->chunkCount ? kEPUB3_YES : kEPUB3_NO;
+  stream->next_in = file->bytes + start;
+  stream->avail_in = length;
+  stream->next_out = chunk->compressed;
+  stream->avail_out = (uInt)capacity;
+  status = deflate(stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+  EPUB3Bool complete = last ? status == Z_STREAM_END : status == Z_OK && stream->avail_in == 0 && stream->avail_out > 0;
+  if(!complete) {
+    EPUB3_FREE_AND_NULL(chunk->compressed);
+    chunk->failed = kEPUB3_YES;
+    return;
+  }
+  chunk->compressedSize = (uint32_t)(capacity - stream->avail_out);
+}
+
+// Writes a file whose chunks are all done as one raw entry, its CRC combined from the chunks'
+EPUB3Error EPUB3WriterWriteFile(EPUB3WriterRef writer, EPUB3WriterFilePtr file)
+{
+  uint64_t compressedSize = file->raw ? file->byteCount : 0;
+  uint32_t crc = file->raw ? file->rawCRC : 0;
+  for(uint32_t i = 0; i < file->chunkCount; i++) {
+    EPUB3WriterChunk * chunk = &file->chunks[i];
+    if(chunk->failed) return kEPUB3UnknownError;
+    uint32_t length = i + 1 < file->chunkCount ? WRITER_CHUNK_SIZE : file->byteCount - i * WRITER_CHUNK_SIZE;
+    compressedSize += file->compress ? chunk->compressedSize : length;
+    crc = i == 0 ? chunk->crc : (uint32_t)crc32_combine(crc, chunk->crc, (z_off_t)length);
+  }
+
+  uint64_t pathLength = strlen(file->path);
+  uint64_t entrySize = ZIP_LOCAL_HEADER_SIZE + pathLength + compressedSize + ZIP_CENTRAL_HEADER_SIZE + pathLength;
+  if(writer->archiveSize + entrySize + ZIP_END_OF_CENTRAL_DIRECTORY_SIZE > WRITER_MAX_ARCHIVE_SIZE) {
+    return kEPUB3UnknownError;
+  }
+
+  int method = file->compress ? Z_DEFLATED : 0;
+  int level = file->compress ? Z_DEFAULT_COMPRESSION : 0;
+  if(zipOpenNewFileInZip2(writer->archive, file->path, &writer->fileInfo, NULL, 0, NULL, 0, NULL, method, level, 1) != ZIP_OK) {
+    return kEPUB3UnknownError;
+  }
+  int status = ZIP_OK;
+  if(file->raw && file->byteCount > 0) {
+    status = zipWriteInFileInZip(writer->archive, file->bytes, file->byteCount);
+  }
+  for(uint32_t i = 0; i < file->chunkCount && status == ZIP_OK; i++) {
+    EPUB3WriterChunk * chunk = &file->chunks[i];
+    if(file->compress) {
+      status = zipWriteInFileInZip(writer->archive, chunk->compressed, chunk->compressedSize);
+    } else {
+      uint32_t length = i + 1 < file->chunkCount ? WRITER_CHUNK_SIZE : file->byteCount - i * WRITER_CHUNK_SIZE;
+      status = zipWriteInFileInZip(writer->archive, file->bytes + i * WRITER_CHUNK_SIZE, length);
+    }
+  }
+  uLong uncompressedSize = file->raw ? file->rawUncompressedSize : file->byteCount;
+  if(zipCloseFileInZipRaw(writer->archive, uncompressedSize, crc) != ZIP_OK || status != ZIP_OK) {
+    return kEPUB3UnknownError;
+  }
+  writer->archiveSize += entrySize;
+  return kEPUB3Success;
+}
+
+// Writes files from the head of the queue while they are done. With wait, the calling thread compresses chunks
+// itself until the queue is empty
+EPUB3Error EPUB3WriterWriteFinishedFiles(EPUB3WriterRef writer, EPUB3Bool wait)
+{
+  pthread_mutex_lock(&writer->lock);
+  while(writer->head != NULL) {
+    EPUB3WriterFilePtr file = writer->head;
+    if(file->chunksDone < file->chunkCount) {
+      if(!wait) break;
+      EPUB3WriterFilePtr claimedFile = NULL;
+      uint32_t index = 0;
+      if(EPUB3WriterClaimChunk(writer, &claimedFile, &index)) {
+        pthread_mutex_unlock(&writer->lock);
+        EPUB3WriterCompressChunk(claimedFile, index, &writer->stream, &writer->streamReady);
+        pthread_mutex_lock(&writer->lock);
+        EPUB3WriterFinishChunk(writer, claimedFile);
+      } else {
+        pthread_cond_wait(&writer->chunkDone, &writer->lock);
+      }
+      continue;
+    }
+    writer->head = file->next;
+    if(writer->head == NULL) {
+      writer->tail = NULL;
+    }
+    pthread_mutex_unlock(&writer->lock);
+    if(writer->error == kEPUB3Success) {
+      writer->error = EPUB3WriterWriteFile(writer, file);
+    }
+    EPUB3WriterFileFree(file);
+    pthread_mutex_lock(&writer->lock);
+  }
+  pthread_mutex_unlock(&writer->lock);
+  return writer->error;
+}
+
+void EPUB3WriterFileFree(EPUB3WriterFilePtr file)
+{
+  if(file == NULL) return;
+
+  if(file->chunks != NULL) {
+    for(uint32_t i = 0; i < file->chunkCount; i++) {
+      EPUB3_FREE_AND_NULL(file->chunks[i].compressed);
+    }
+  }
+  EPUB3_FREE_AND_NULL(file->chunks);
+  if(file->source != NULL) {
+    file->bytes = NULL;
+    EPUB3Release(file->source);
+    file->source = NULL;
+  }
+  EPUB3_FREE_AND_NULL(file->bytes);
+  EPUB3_FREE_AND_NULL(file->path);
+  EPUB3_FREE_AND_NULL(file);
+}
+
+#pragma mark - Optimizer
+
+EXPORT EPUB3Error EPUB3GetReadCost(EPUB3Ref epub, EPUB3ReadCost * cost)
+{
+  assert(epub != NULL);
+  assert(cost != NULL);
+
+  memset(cost, 0, sizeof(*cost));
+  if(epub->archiveIndex == NULL) return kEPUB3ArchiveUnavailableError;
+
+  for(uint32_t i = 0; i < epub->archiveIndex->entryCount; i++) {
+    EPUB3ArchiveEntryPtr entry = &epub->archiveIndex->entries[i];
+    cost->bytesRead += entry->compressedSize;
+    if(entry->compressionMethod != 0) {
+      cost->bytesInflated += entry->uncompressedSize;
+    }
+  }
+  if(epub->spine == NULL) return kEPUB3Success;
+
+  EPUB3ArchiveEntryPtr * spineEntries = NULL;
+  uint32_t spineEntryCount = 0;
+  EPUB3Error error = EPUB3CopySpineEntries(epub, kEPUB3_YES, &spineEntries, &spineEntryCount);
+  if(error != kEPUB3Success) return error;
+
+  EPUB3ArchiveEntryPtr previous = NULL;
+  uint64_t previousEnd = 0;
+  for(uint32_t i = 0; i < spineEntryCount && error == kEPUB3Success; i++) {
+    EPUB3ArchiveEntryPtr entry = spineEntries[i];
+    if(entry == NULL) continue;
+    if(previous != NULL) {
+      uint64_t offset = entry->localHeaderOffset;
+      // Reading on over a data descriptor is not a seek
+      uint64_t slack = (previous->flag & ZIP_FLAG_DATA_DESCRIPTOR) != 0 ? ZIP_DATA_DESCRIPTOR_MAX_SIZE : 0;
+      if(offset < previousEnd || offset > previousEnd + slack) {
+        cost->spineSeeks++;
+        cost->spineSeekDistance += offset < previousEnd ? previousEnd - offset : offset - previousEnd;
+      }
+    }
+    uint64_t dataOffset = 0;
+    error = EPUB3GetDataOffsetOfEntryInArchive(epub, entry, &dataOffset);
+    previous = entry;
+    previousEnd = dataOffset + entry->compressedSize;
+  }
+  EPUB3_FREE_AND_NULL(spineEntries);
+  return error;
+}
+
+EXPORT EPUB3Error EPUB3OptimizeArchiveToPath(EPUB3Ref epub, const char * path, uint32_t threadCount, EPUB3ReadCost * before, EPUB3ReadCost * after)
+{
+  assert(epub != NULL);
+  assert(path != NULL);
+
+  if(epub->archiveIndex == NULL || epub->spine == NULL || epub->manifest == NULL) return kEPUB3ArchiveUnavailableError;
+  if(EPUB3PathIsArchiveOfBook(epub, path)) return kEPUB3InvalidArgumentError;
+
+  EPUB3Error error = kEPUB3Success;
+  if(before != NULL) {
+    error = EPUB3GetReadCost(epub, before);
+    if(error != kEPUB3Success) return error;
+  }
+
+  const char * rootFilePath = NULL;
+  const char * rootPath = NULL;
+  error = EPUB3GetRootFilePath(epub, &rootFilePath);
+  if(error == kEPUB3Success) {
+    error = EPUB3GetRootPath(epub, &rootPath);
+  }
+  if(error != kEPUB3Success) return error;
+  uint32_t * order = NULL;
+  uint32_t orderCount = 0;
+  error = EPUB3CopyOptimizedEntryOrder(epub, rootFilePath, &order, &orderCount);
+  const char ** mediaTypes = error == kEPUB3Success ? EPUB3CopyMediaTypesOfEntries(epub, rootPath) : NULL;
+  if(error != kEPUB3Success) return error;
+
+  EPUB3WriterRef writer = EPUB3WriterCreateAtPath(path, threadCount, &error);
+  for(uint32_t i = 0; i < orderCount && error == kEPUB3Success; i++) {
+    EPUB3ArchiveEntryPtr entry = &epub->archiveIndex->entries[order[i]];
+    if(entry->uncompressedSize > UINT32_MAX) {
+      error = kEPUB3InvalidArgumentError;
+      break;
+    }
+    void * buffer = malloc(entry->uncompressedSize > 0 ? (size_t)entry->uncompressedSize : 1);
+    if(buffer == NULL) {
+      error = kEPUB3UnknownError;
+      break;
+    }
+    uint64_t bytesCopied = 0;
+    error = EPUB3ReadEntryIntoBuffer(epub, entry, buffer, &bytesCopied);
+    if(error == kEPUB3Success) {
+      EPUB3Bool compress = EPUB3ShouldDeflateEntry(mediaTypes[order[i]], entry->filename);
+      error = EPUB3WriterAddFile(writer, entry->filename, buffer, bytesCopied, compress);
+    }
+    EPUB3_FREE_AND_NULL(buffer);
+  }
+  EPUB3_FREE_AND_NULL(order);
+  EPUB3_FREE_AND_NULL(mediaTypes);
+  if(writer != NULL) {
+    // Closing a writer that already failed deletes the partial archive
+    if(error != kEPUB3Success && writer->error == kEPUB3Success) {
+      writer->error = error;
+    }
+    EPUB3Error closeError = EPUB3WriterClose(writer);
+    if(error == kEPUB3Success) {
+      error = closeError;
+    }
+  }
+
+  if(error == kEPUB3Success && after != NULL) {
+    EPUB3Ref optimized = EPUB3CreateWithArchiveAtPath(path, &error);
+    if(optimized != NULL) {
+      error = EPUB3GetReadCost(optimized, after);
+      EPUB3Release(optimized);
+    }
+  }
+  return error;
+}
+
+// Appends entry to the order unless it is missing or placed already
+static void EPUB3PlaceEntry(EPUB3ArchiveIndexPtr index, EPUB3ArchiveEntryPtr entry, EPUB3Bool * placed, uint32_t * indexes, uint32_t * count)
+{
+  if(entry == NULL) return;
+
+  uint32_t position = (uint32_t)(entry - index->entries);
+  if(!placed[position]) {
+    placed[position] = kEPUB3_YES;
+    indexes[(*count)++] = position;
+  }
+}
+
+// The container and everything else in META-INF, then the OPF, so a reader opens the book from the front of the
+// file. Then the spine in spine order, then the rest of the archive in its original order. The mimetype is left
+// out for the writer to put first
+EPUB3Error EPUB3CopyOptimizedEntryOrder(EPUB3Ref epub, const char * rootFilePath, uint32_t ** order, uint32_t * orderCount)
+{
+  assert(epub != NULL);
+  assert(rootFilePath != NULL);
+
+  EPUB3ArchiveIndexPtr index = epub->archiveIndex;
+  EPUB3ArchiveEntryPtr * spineEntries = NULL;
+  uint32_t spineEntryCount = 0;
+  EPUB3Error error = EPUB3CopySpineEntries(epub, kEPUB3_NO, &spineEntries, &spineEntryCount);
+  if(error != kEPUB3Success) return error;
+
+  uint32_t * indexes = malloc((index->entryCount > 0 ? index->entryCount : 1) * sizeof(uint32_t));
+  EPUB3Bool * placed = calloc(index->entryCount > 0 ? index->entryCount : 1, sizeof(EPUB3Bool));
+  uint32_t count = 0;
+
+  EPUB3ArchiveEntryPtr mimetype = EPUB3ArchiveIndexFindEntry(index, "mimetype");
+  if(mimetype != NULL) {
+    placed[mimetype - index->entries] = kEPUB3_YES;
+  }
+  EPUB3PlaceEntry(index, EPUB3ArchiveIndexFindEntry(index, "META-INF/container.xml"), placed, indexes, &count);
+  for(uint32_t i = 0; i < index->entryCount; i++) {
+    if(strncmp(index->entries[i].filename, "META-INF/", 9) == 0) {
+      EPUB3PlaceEntry(index, &index->entries[i], placed, indexes, &count);
+    }
+  }
+  EPUB3PlaceEntry(index, EPUB3ArchiveIndexFindEntry(index, rootFilePath), placed, indexes, &count);
+  for(uint32_t i = 0; i < spineEntryCount; i++) {
+    EPUB3PlaceEntry(index, spineEntries[i], placed, indexes, &count);
+  }
+  for(uint32_t i = 0; i < index->entryCount; i++) {
+    EPUB3PlaceEntry(index, &index->entries[i], placed, indexes, &count);
+  }
+
+  EPUB3_FREE_AND_NULL(placed);
+  EPUB3_FREE_AND_NULL(spineEntries);
+  *order = indexes;
+  *orderCount = count;
+  return kEPUB3Success;
+}
+
+// The manifest media type of every archive entry, by central directory position. NULL for files the manifest
+// does not list. The strings belong to the manifest
+const char ** EPUB3CopyMediaTypesOfEntries(EPUB3Ref epub, const char * rootPath)
+{
+  assert(epub != NULL);
+  assert(epub->manifest != NULL);
+  assert(rootPath != NULL);
+
+  EPUB3ArchiveIndexPtr index = epub->archiveIndex;
+  const char ** mediaTypes = calloc(index->entryCount > 0 ? index->entryCount : 1, sizeof(const char *));
+  for(int i = 0; i < MANIFEST_HASH_SIZE; i++) {
+    for(EPUB3ManifestItemListItemPtr itemPtr = epub->manifest->itemTable[i]; itemPtr != NULL; itemPtr = itemPtr->next) {
+      EPUB3ManifestItemRef item = itemPtr->item;
+      if(item->href == NULL || item->mediaType == NULL) continue;
+      char * path = EPUB3CopyOfPathByAppendingPathComponent(rootPath, item->href);
+      EPUB3ArchiveEntryPtr entry = EPUB3ArchiveIndexFindEntry(index, path);
+      EPUB3_FREE_AND_NULL(path);
+      if(entry != NULL) {
+        mediaTypes[entry - index->entries] = item->mediaType;
+      }
+    }
+  }
+  return mediaTypes;
+}
+
+// Formats that are compressed already gain nothing from deflate and would cost an inflate on every read. Files
+// the manifest does not list go by extension
+EPUB3Bool EPUB3ShouldDeflateEntry(const char * mediaType, const char * path)
+{
+  static const char * storedMediaTypes[] = {
+    "image/jpeg", "image/png", "image/gif", "image/webp",
+    "font/woff", "font/woff2", "application/font-woff", "application/x-font-woff",
+  };
+  static const char * storedExtensions[] = {
+    ".jpg", ".jpeg", ".png", ".gif", ".webp", ".mp3", ".mp4", ".m4a", ".m4v", ".ogg", ".woff", ".woff2",
+  };
+
+  if(mediaType != NULL) {
+    if(strncmp(mediaType, "audio/", 6) == 0 || strncmp(mediaType, "video/", 6) == 0) return kEPUB3_NO;
+    for(size_t i = 0; i < sizeof(storedMediaTypes) / sizeof(storedMediaTypes[0]); i++) {
+      if(strcmp(mediaType, storedMediaTypes[i]) == 0) return kEPUB3_NO;
+    }
+    return kEPUB3_YES;
+  }
+
+  const char * extension = strrchr(path, '.');
+  if(extension == NULL || strchr(extension, '/') != NULL) return kEPUB3_YES;
+  for(size_t i = 0; i < sizeof(storedExtensions) / sizeof(storedExtensions[0]); i++) {
+    if(strcasecmp(extension, storedExtensions[i]) == 0) return kEPUB3_NO;
+  }
+  return kEPUB3_YES;
+}
+
+#pragma mark - Repackaging
+
+EXPORT EPUB3Error EPUB3RepackageArchivesToPath(const EPUB3RepackagePart * parts, uint32_t partCount, const char * title, const char * identifier, const char * path, uint32_t threadCount)
+{
+  assert(parts != NULL || partCount == 0);
+  assert(path != NULL);
+
+  if(partCount == 0) return kEPUB3InvalidArgumentError;
+  for(uint32_t i = 0; i < partCount; i++) {
+    EPUB3Ref epub = parts[i].epub;
+    if(epub == NULL) return kEPUB3InvalidArgumentError;
+    if(epub->archiveIndex == NULL || epub->metadata == NULL || epub->manifest == NULL || epub->spine == NULL) {
+      return kEPUB3ArchiveUnavailableError;
+    }
+    if(EPUB3PathIsArchiveOfBook(epub, path)) return kEPUB3InvalidArgumentError;
+  }
+
+  EPUB3RepackagePlanPtr plans = calloc(partCount, sizeof(struct EPUB3RepackagePlan));
+  if(plans == NULL) return kEPUB3UnknownError;
+  EPUB3Error error = kEPUB3Success;
+  for(uint32_t i = 0; i < partCount && error == kEPUB3Success; i++) {
+    error = EPUB3RepackagePlanInit(&plans[i], &parts[i], partCount > 1 ? i + 1 : 0);
+  }
+  uint32_t spineItemCount = 0;
+  for(uint32_t i = 0; i < partCount && error == kEPUB3Success; i++) {
+    spineItemCount += plans[i].spineItemCount;
+  }
+  if(error == kEPUB3Success && spineItemCount == 0) {
+    error = kEPUB3InvalidArgumentError;
+  }
+  EPUB3RepackageNavMap navMap = { NULL, 0, 0 };
+  for(uint32_t i = 0; i < partCount && error == kEPUB3Success; i++) {
+    error = EPUB3RepackageAddNavPoints(&plans[i], 0, &navMap);
+  }
+
+  // The package only replaces what the caller asked to; the NCX and nav document always need a title
+  const char * packageTitle = title;
+  const char * packageIdentifier = identifier;
+  EPUB3MetadataRef metadata = parts[0].epub->metadata;
+  if(title == NULL) {
+    title = metadata->title != NULL ? metadata->title : "";
+  }
+  if(identifier == NULL) {
+    identifier = metadata->identifier != NULL ? metadata->identifier : "";
+  }
+  EPUB3Bool hasNav = metadata->version == kEPUB3Version_3 ? kEPUB3_YES : kEPUB3_NO;
+
+  EPUB3WriterRef writer = NULL;
+  if(error == kEPUB3Success) {
+    writer = EPUB3WriterCreateAtPath(path, threadCount, &error);
+  }
+  xmlInitParser();
+  if(error == kEPUB3Success) {
+    error = EPUB3RepackageAddDocument(writer, REPACKAGE_CONTAINER_PATH, EPUB3RepackageCopyContainer());
+  }
+  if(error == kEPUB3Success) {
+    error = EPUB3RepackageAddDocument(writer, REPACKAGE_PACKAGE_PATH, EPUB3RepackageCopyPackage(plans, partCount, packageTitle, packageIdentifier));
+  }
+  if(error == kEPUB3Success) {
+    error = EPUB3RepackageAddDocument(writer, REPACKAGE_NCX_PATH, EPUB3RepackageCopyNCX(&navMap, title, identifier));
+  }
+  if(error == kEPUB3Success && hasNav) {
+    error = EPUB3RepackageAddDocument(writer, REPACKAGE_NAV_PATH, EPUB3RepackageCopyNav(&navMap, title));
+  }
+  EPUB3RepackageNavMapClear(&navMap);
+
+  // Each part's spine in spine order, then the rest of its files in their original order
+  for(uint32_t i = 0; i < partCount && error == kEPUB3Success; i++) {
+    EPUB3RepackagePlanPtr plan = &plans[i];
+    EPUB3ArchiveIndexPtr index = plan->epub->archiveIndex;
+    EPUB3Bool * copied = calloc(index->entryCount > 0 ? index->entryCount : 1, sizeof(EPUB3Bool));
+    if(copied == NULL) {
+      error = kEPUB3UnknownError;
+      break;
+    }
+    for(uint32_t j = 0; j < plan->spineItemCount + plan->itemCount && error == kEPUB3Success; j++) {
+      EPUB3ArchiveEntryPtr entry = j < plan->spineItemCount ? plan->spineEntries[j] : plan->items[j - plan->spineItemCount].entry;
+      if(entry == NULL || copied[entry - index->entries]) continue;
+      copied[entry - index->entries] = kEPUB3_YES;
+      EPUB3RepackageItem * item = &plan->items[plan->itemOfEntry[entry - index->entries]];
+      error = EPUB3WriterQueueRawFile(writer, item->path, plan->epub, entry);
+      if(error == kEPUB3Success) {
+        error = EPUB3WriterWriteFinishedFiles(writer, kEPUB3_NO);
+      }
+    }
+    EPUB3_FREE_AND_NULL(copied);
+  }
+  for(uint32_t i = 0; i < partCount; i++) {
+    EPUB3RepackagePlanClear(&plans[i]);
+  }
+  EPUB3_FREE_AND_NULL(plans);
+
+  if(writer != NULL) {
+    // Closing a writer that already failed deletes the partial archive
+    if(error != kEPUB3Success && writer->error == kEPUB3Success) {
+      writer->error = error;
+    }
+    EPUB3Error closeError = EPUB3WriterClose(writer);
+    if(error == kEPUB3Success) {
+      error = closeError;
+    }
+  }
+  return error;
+}
+
+// The writer truncates its path, which must not be a book being read
+EPUB3Bool EPUB3PathIsArchiveOfBook(EPUB3Ref epub, const char * path)
+{
+  assert(epub != NULL);
+  assert(path != NULL);
+
+  struct stat source;
+  struct stat destination;
+  return epub->archivePath != NULL && stat(epub->archivePath, &source) == 0 && stat(path, &destination) == 0 &&
+    source.st_dev == destination.st_dev && source.st_ino == destination.st_ino;
+}
+
+static int EPUB3CompareRepackageItems(const void * a, const void * b)
+{
+  const EPUB3RepackageItem * itemA = a;
+  const EPUB3RepackageItem * itemB = b;
+  if(itemA->entry != NULL && itemB->entry != NULL) {
+    return itemA->entry < itemB->entry ? -1 : itemA->entry > itemB->entry ? 1 : 0;
+  }
+  if(itemA->entry != NULL || itemB->entry != NULL) return itemA->entry != NULL ? -1 : 1;
+  return strcmp(itemA->manifestItem->itemId, itemB->manifestItem->itemId);
+}
+
+static EPUB3Bool EPUB3ManifestItemHasProperty(EPUB3ManifestItemRef item, const char * property)
+{
+  if(item->properties == NULL) return kEPUB3_NO;
+
+  size_t length = strlen(property);
+  for(const char * cursor = item->properties; *cursor != '\0'; ) {
+    while(*cursor == ' ' || *cursor == '\t' || *cursor == '\n' || *cursor == '\r') cursor++;
+    size_t tokenLength = strcspn(cursor, " \t\n\r");
+    if(tokenLength == length && strncmp(cursor, property, length) == 0) return kEPUB3_YES;
+    cursor += tokenLength;
+  }
+  return kEPUB3_NO;
+}
+
+// The NCX and nav document are written anew, so their items, and spine references to them, are left out
+static EPUB3Bool EPUB3RepackageReplacesManifestItem(EPUB3Ref epub, EPUB3ManifestItemRef item)
+{
+  if(item == epub->metadata->ncxItem || EPUB3ManifestItemHasProperty(item, "nav")) return kEPUB3_YES;
+  return item->mediaType != NULL && strcmp(item->mediaType, "application/x-dtbncx+xml") == 0;
+}
+
+// The archive entry of a manifest href, NULL when it is not in the archive. remote is set for hrefs with a scheme
+static EPUB3ArchiveEntryPtr EPUB3FindEntryForHref(EPUB3Ref epub, const char * rootPath, const char * href, EPUB3Bool * remote)
+{
+  char * path = EPUB3CopyOfArchivePathForHref(rootPath, href);
+  EPUB3ArchiveEntryPtr entry = path != NULL ? EPUB3ArchiveIndexFindEntry(epub->archiveIndex, path) : NULL;
+  EPUB3_FREE_AND_NULL(path);
+  if(remote != NULL) {
+    size_t schemeLength = strcspn(href, ":/?#");
+    *remote = schemeLength > 0 && href[schemeLength] == ':' ? kEPUB3_YES : kEPUB3_NO;
+  }
+  return entry;
+}
+
+// Picks the part's run of the spine and the manifest items that go with it: everything but the NCX, the nav
+// document and spine items outside the run
+EPUB3Error EPUB3RepackagePlanInit(EPUB3RepackagePlanPtr plan, const EPUB3RepackagePart * part, uint32_t partNumber)
+{
+  assert(plan != NULL);
+  assert(part != NULL);
+
+  EPUB3Ref epub = part->epub;
+  EPUB3ArchiveIndexPtr index = epub->archiveIndex;
+  plan->epub = epub;
+  // Encrypted and obfuscated files are listed by path and keyed to the identifier, neither of which survives
+  if(EPUB3ArchiveIndexFindEntry(index, "META-INF/encryption.xml") != NULL) return kEPUB3FileEncodingNotSupportedError;
+  if(partNumber > 0) {
+    (void)snprintf(plan->prefix, sizeof(plan->prefix), "part%u/", partNumber);
+    (void)snprintf(plan->idPrefix, sizeof(plan->idPrefix), "p%u-", partNumber);
+  }
+
+  const char * rootPath = NULL;
+  EPUB3Error error = EPUB3GetRootPath(epub, &rootPath);
+  if(error != kEPUB3Success) return error;
+
+  uint32_t spineCount = epub->spine->itemCount > 0 ? (uint32_t)epub->spine->itemCount : 0;
+  if(part->firstSpineItem > spineCount) return kEPUB3InvalidArgumentError;
+  uint32_t runEnd = spineCount;
+  if(part->spineItemCount > 0) {
+    if(part->spineItemCount > spineCount - part->firstSpineItem) return kEPUB3InvalidArgumentError;
+    runEnd = part->firstSpineItem + part->spineItemCount;
+  }
+
+  // Spine files outside the run are left out unless the run lists them too
+  enum { kEntryUnseen = 0, kEntryInRun, kEntryOutsideRun };
+  uint8_t * entryStates = calloc(index->entryCount > 0 ? index->entryCount : 1, sizeof(uint8_t));
+  plan->itemOfEntry = malloc((index->entryCount > 0 ? index->entryCount : 1) * sizeof(uint32_t));
+  plan->spineItems = calloc(runEnd - part->firstSpineItem > 0 ? runEnd - part->firstSpineItem : 1, sizeof(EPUB3SpineItemRef));
+  plan->spineEntries = calloc(runEnd - part->firstSpineItem > 0 ? runEnd - part->firstSpineItem : 1, sizeof(EPUB3ArchiveEntryPtr));
+  int32_t manifestCount = epub->manifest->itemCount;
+  plan->items = calloc(manifestCount > 0 ? (size_t)manifestCount : 1, sizeof(EPUB3RepackageItem));
+  if(entryStates == NULL || plan->itemOfEntry == NULL || plan->spineItems == NULL || plan->spineEntries == NULL || plan->items == NULL) {
+    EPUB3_FREE_AND_NULL(entryStates);
+    return kEPUB3UnknownError;
+  }
+  for(uint32_t i = 0; i < index->entryCount; i++) {
+    plan->itemOfEntry[i] = UINT32_MAX;
+  }
+
+  uint32_t position = 0;
+  for(EPUB3SpineItemListItemPtr itemPtr = epub->spine->head; itemPtr != NULL; itemPtr = itemPtr->next, position++) {
+    EPUB3ManifestItemRef manifestItem = itemPtr->item->manifestItem;
+    if(manifestItem == NULL || manifestItem->href == NULL || EPUB3RepackageReplacesManifestItem(epub, manifestItem)) continue;
+    EPUB3ArchiveEntryPtr entry = EPUB3FindEntryForHref(epub, rootPath, manifestItem->href, NULL);
+    EPUB3Bool inRun = position >= part->firstSpineItem && position < runEnd ? kEPUB3_YES : kEPUB3_NO;
+    if(inRun) {
+      if(entry == NULL) {
+        error = kEPUB3FileNotFoundInArchiveError;
+        break;
+      }
+      plan->spineItems[plan->spineItemCount] = itemPtr->item;
+      plan->spineEntries[plan->spineItemCount++] = entry;
+    }
+    if(entry != NULL && entryStates[entry - index->entries] != kEntryInRun) {
+      entryStates[entry - index->entries] = inRun ? kEntryInRun : kEntryOutsideRun;
+    }
+  }
+
+  for(int32_t i = 0; i < MANIFEST_HASH_SIZE && error == kEPUB3Success; i++) {
+    for(EPUB3ManifestItemListItemPtr itemPtr = epub->manifest->itemTable[i]; itemPtr != NULL; itemPtr = itemPtr->next) {
+      EPUB3ManifestItemRef manifestItem = itemPtr->item;
+      if(manifestItem->itemId == NULL || manifestItem->href == NULL || EPUB3RepackageReplacesManifestItem(epub, manifestItem)) continue;
+      EPUB3Bool remote = kEPUB3_NO;
+      EPUB3ArchiveEntryPtr entry = EPUB3FindEntryForHref(epub, rootPath, manifestItem->href, &remote);
+      if(entry == NULL && !remote) {
+        error = kEPUB3FileNotFoundInArchiveError;
+        break;
+      }
+      if(entry != NULL && entryStates[entry - index->entries] == kEntryOutsideRun) continue;
+      EPUB3RepackageItem * item = &plan->items[plan->itemCount++];
+      item->manifestItem = manifestItem;
+      item->entry = entry;
+      if(entry != NULL) {
+        size_t pathSize = strlen(plan->prefix) + strlen(entry->filename) + 1;
+        item->path = malloc(pathSize);
+        if(item->path == NULL) {
+          error = kEPUB3UnknownError;
+          break;
+        }
+        (void)snprintf(item->path, pathSize, "%s%s", plan->prefix, entry->filename);
+        // The generated files take these names
+        if(strcmp(item->path, REPACKAGE_PACKAGE_PATH) == 0 || strcmp(item->path, REPACKAGE_NCX_PATH) == 0 ||
+           strcmp(item->path, REPACKAGE_NAV_PATH) == 0 || strcmp(item->path, REPACKAGE_CONTAINER_PATH) == 0) {
+          error = kEPUB3InvalidArgumentError;
+          break;
+        }
+      }
+    }
+  }
+  EPUB3_FREE_AND_NULL(entryStates);
+  if(error != kEPUB3Success) return error;
+
+  qsort(plan->items, plan->itemCount, sizeof(EPUB3RepackageItem), EPUB3CompareRepackageItems);
+  for(uint32_t i = 0; i < plan->itemCount; i++) {
+    EPUB3ArchiveEntryPtr entry = plan->items[i].entry;
+    if(entry != NULL && plan->itemOfEntry[entry - index->entries] == UINT32_MAX) {
+      plan->itemOfEntry[entry - index->entries] = i;
+    }
+  }
+  return kEPUB3Success;
+}
+
+void EPUB3RepackagePlanClear(EPUB3RepackagePlanPtr plan)
+{
+  if(plan == NULL) return;
+
+  if(plan->items != NULL) {
+    for(uint32_t i = 0; i < plan->itemCount; i++) {
+      EPUB3_FREE_AND_NULL(plan->items[i].path);
+    }
+  }
+  EPUB3_FREE_AND_NULL(plan->items);
+  EPUB3_FREE_AND_NULL(plan->spineItems);
+  EPUB3_FREE_AND_NULL(plan->spineEntries);
+  EPUB3_FREE_AND_NULL(plan->itemOfEntry);
+}
+
+// The href of a file in the new archive from the root, where the generated documents sit. fragment may be NULL
+static char * EPUB3RepackageCopyHref(const char * path, const char * fragment)
+{
+  xmlChar * escaped = xmlURIEscapeStr(BAD_CAST path, BAD_CAST "/@!$&'()*+,;=");
+  if(escaped == NULL) return NULL;
+  size_t hrefSize = strlen((const char *)escaped) + (fragment != NULL ? strlen(fragment) : 0) + 1;
+  char * href = malloc(hrefSize);
+  if(href != NULL) {
+    (void)snprintf(href, hrefSize, "%s%s", (const char *)escaped, fragment != NULL ? fragment : "");
+  }
+  xmlFree(escaped);
+  return href;
+}
+
+static EPUB3Error EPUB3RepackageAddNavPoint(EPUB3RepackageNavMap * navMap, const char * title, char * src, uint32_t depth)
+{
+  if(src == NULL) return kEPUB3UnknownError;
+  if(navMap->count == navMap->capacity) {
+    uint32_t capacity = navMap->capacity > 0 ? navMap->capacity * 2 : 16;
+    EPUB3RepackageNavPoint * points = realloc(navMap->points, capacity * sizeof(EPUB3RepackageNavPoint));
+    if(points == NULL) {
+      EPUB3_FREE_AND_NULL(src);
+      return kEPUB3UnknownError;
+    }
+    navMap->points = points;
+    navMap->capacity = capacity;
+  }
+  EPUB3RepackageNavPoint * point = &navMap->points[navMap->count++];
+  point->title = title != NULL ? title : "";
+  point->src = src;
+  point->depth = depth;
+  return kEPUB3Success;
+}
+
+// Keeps the TOC items whose file is in the new archive. Items that point elsewhere are dropped and their children
+// take their place
+static EPUB3Error EPUB3RepackageAddTocItems(EPUB3RepackagePlanPtr plan, const char * tocPath, EPUB3TocItemChildListItemPtr items, uint32_t depth, EPUB3RepackageNavMap * navMap)
+{
+  EPUB3Error error = kEPUB3Success;
+  EPUB3ArchiveIndexPtr index = plan->epub->archiveIndex;
+  for(EPUB3TocItemChildListItemPtr itemPtr = items; itemPtr != NULL && error == kEPUB3Success; itemPtr = itemPtr->next) {
+    EPUB3TocItemRef tocItem = itemPtr->item;
+    EPUB3ArchiveEntryPtr entry = tocItem->href != NULL ? EPUB3FindEntryForHref(plan->epub, tocPath, tocItem->href, NULL) : NULL;
+    uint32_t childDepth = depth;
+    if(entry != NULL && plan->itemOfEntry[entry - index->entries] != UINT32_MAX) {
+      EPUB3RepackageItem * item = &plan->items[plan->itemOfEntry[entry - index->entries]];
+      error = EPUB3RepackageAddNavPoint(navMap, tocItem->title, EPUB3RepackageCopyHref(item->path, strchr(tocItem->href, '#')), depth);
+      childDepth = depth + 1;
+    }
+    if(error == kEPUB3Success) {
+      error = EPUB3RepackageAddTocItems(plan, tocPath, tocItem->childrenHead, childDepth, navMap);
+    }
+  }
+  return error;
+}
+
+// A merged part gets a point of its own, over its TOC, at the start of its spine. A book with an empty TOC still
+// needs one point for the NCX to be valid
+EPUB3Error EPUB3RepackageAddNavPoints(EPUB3RepackagePlanPtr plan, uint32_t depth, EPUB3RepackageNavMap * navMap)
+{
+  assert(plan != NULL);
+  assert(navMap != NULL);
+
+  if(plan->spineItemCount == 0) return kEPUB3Success;
+
+  EPUB3Ref epub = plan->epub;
+  EPUB3ArchiveIndexPtr index = epub->archiveIndex;
+  EPUB3RepackageItem * firstItem = &plan->items[plan->itemOfEntry[plan->spineEntries[0] - index->entries]];
+  uint32_t firstPoint = navMap->count;
+  EPUB3Error error = kEPUB3Success;
+  if(plan->prefix[0] != '\0') {
+    error = EPUB3RepackageAddNavPoint(navMap, epub->metadata->title, EPUB3RepackageCopyHref(firstItem->path, NULL), depth);
+    depth++;
+  }
+  if(error == kEPUB3Success && epub->toc != NULL) {
+    // NCX hrefs are relative to the NCX
+    const char * rootPath = NULL;
+    error = EPUB3GetRootPath(epub, &rootPath);
+    if(error != kEPUB3Success) return error;
+    EPUB3ManifestItemRef ncxItem = epub->metadata->ncxItem;
+    EPUB3ArchiveEntryPtr ncxEntry = ncxItem != NULL && ncxItem->href != NULL ? EPUB3FindEntryForHref(epub, rootPath, ncxItem->href, NULL) : NULL;
+    char * tocPath = ncxEntry != NULL ? EPUB3CopyOfPathByDeletingLastPathComponent(ncxEntry->filename) : strdup(rootPath);
+    error = EPUB3RepackageAddTocItems(plan, tocPath, epub->toc->rootItemsHead, depth, navMap);
+    EPUB3_FREE_AND_NULL(tocPath);
+  }
+  if(error == kEPUB3Success && navMap->count == firstPoint) {
+    error = EPUB3RepackageAddNavPoint(navMap, epub->metadata->title, EPUB3RepackageCopyHref(firstItem->path, NULL), depth);
+  }
+  return error;
+}
+
+void EPUB3RepackageNavMapClear(EPUB3RepackageNavMap * navMap)
+{
+  if(navMap == NULL) return;
+
+  if(navMap->points != NULL) {
+    for(uint32_t i = 0; i < navMap->count; i++) {
+      EPUB3_FREE_AND_NULL(navMap->points[i].src);
+    }
+  }
+  EPUB3_FREE_AND_NULL(navMap->points);
+  navMap->count = 0;
+  navMap->capacity = 0;
+}
+
+xmlDocPtr EPUB3RepackageCopyContainer(void)
+{
+  xmlDocPtr document = xmlNewDoc(BAD_CAST "1.0");
+  xmlNodePtr container = xmlNewNode(NULL, BAD_CAST "container");
+  xmlNsPtr ns = xmlNewNs(container, BAD_CAST "urn:oasis:names:tc:opendocument:xmlns:container", NULL);
+  xmlSetNs(container, ns);
+  xmlNewProp(container, BAD_CAST "version", BAD_CAST "1.0");
+  xmlDocSetRootElement(document, container);
+  xmlNodePtr rootfiles = xmlNewChild(container, ns, BAD_CAST "rootfiles", NULL);
+  xmlNodePtr rootfile = xmlNewChild(rootfiles, ns, BAD_CAST "rootfile", NULL);
+  xmlNewProp(rootfile, BAD_CAST "full-path", BAD_CAST REPACKAGE_PACKAGE_PATH);
+  xmlNewProp(rootfile, BAD_CAST "media-type", BAD_CAST "application/oebps-package+xml");
+  return document;
+}
+
+static void EPUB3RepackageAddManifestItem(xmlNodePtr manifest, xmlNsPtr ns, const char * idPrefix, const char * itemId, const char * href, const char * mediaType, const char * properties)
+{
+  char id[strlen(idPrefix) + strlen(itemId) + 1];
+  (void)snprintf(id, sizeof(id), "%s%s", idPrefix, itemId);
+  xmlNodePtr node = xmlNewChild(manifest, ns, BAD_CAST "item", NULL);
+  xmlNewProp(node, BAD_CAST "id", BAD_CAST id);
+  xmlNewProp(node, BAD_CAST "href", BAD_CAST href);
+  xmlNewProp(node, BAD_CAST "media-type", BAD_CAST (mediaType != NULL ? mediaType : "application/octet-stream"));
+  if(properties != NULL) {
+    xmlNewProp(node, BAD_CAST "properties", BAD_CAST properties);
+  }
+}
+
+static xmlNodePtr EPUB3FirstChildElementNamed(xmlNodePtr parent, const char * name)
+{
+  for(xmlNodePtr node = parent->children; node != NULL; node = node->next) {
+    if(node->type == XML_ELEMENT_NODE && xmlStrcmp(node->name, BAD_CAST name) == 0) return node;
+  }
+  return NULL;
+}
+
+// The book's OPF, parsed again so its metadata can be copied whole. rootPath receives the OPF's directory
+static xmlDocPtr EPUB3RepackageCopySourcePackage(EPUB3Ref epub, const char ** rootPath)
+{
+  *rootPath = NULL;
+  const char * rootFilePath = NULL;
+  if(EPUB3GetRootFilePath(epub, &rootFilePath) != kEPUB3Success) return NULL;
+  void * buffer = NULL;
+  uint64_t bytesCopied = 0;
+  EPUB3Error error = EPUB3CopyFileIntoBuffer(epub, &buffer, NULL, &bytesCopied, rootFilePath);
+  xmlDocPtr document = NULL;
+  if(error == kEPUB3Success && bytesCopied <= INT_MAX) {
+    document = xmlReadMemory(buffer, (int)bytesCopied, NULL, NULL, XML_PARSE_RECOVER | XML_PARSE_NONET);
+  }
+  EPUB3_FREE_AND_NULL(buffer);
+  if(document != NULL && EPUB3GetRootPath(epub, rootPath) != kEPUB3Success) {
+    xmlFreeDoc(document);
+    document = NULL;
+  }
+  return document;
+}
+
+static EPUB3Bool EPUB3RepackagePlanKeepsItemWithId(EPUB3RepackagePlanPtr plan, const char * itemId)
+{
+  for(uint32_t i = 0; i < plan->itemCount; i++) {
+    if(strcmp(plan->items[i].manifestItem->itemId, itemId) == 0) return kEPUB3_YES;
+  }
+  return kEPUB3_NO;
+}
+
+// Points attribute, which names a manifest item of the plan's part, at the item's id in the new package. Returns
+// kEPUB3_NO when the item was left out. fragment is set for IRIs like refines, which start with '#'
+static EPUB3Bool EPUB3RepackageRenameItemReference(xmlNodePtr node, const char * attribute, EPUB3RepackagePlanPtr plan, EPUB3Bool fragment)
+{
+  xmlChar * value = xmlGetProp(node, BAD_CAST attribute);
+  if(value == NULL) return kEPUB3_YES;
+  EPUB3Bool kept = kEPUB3_YES;
+  const char * itemId = (const char *)value + (fragment && value[0] == '#' ? 1 : 0);
+  if(EPUB3ManifestFindItemWithId(plan->epub->manifest, itemId) != NULL) {
+    kept = EPUB3RepackagePlanKeepsItemWithId(plan, itemId);
+    if(kept && plan->idPrefix[0] != '\0') {
+      char renamed[strlen(plan->idPrefix) + strlen(itemId) + 2];
+      (void)snprintf(renamed, sizeof(renamed), "%s%s%s", itemId != (const char *)value ? "#" : "", plan->idPrefix, itemId);
+      xmlSetProp(node, BAD_CAST attribute, BAD_CAST renamed);
+    }
+  }
+  xmlFree(value);
+  return kept;
+}
+
+// A local link's href from the new package, or NULL when its file was left out. Remote links keep theirs
+static EPUB3Bool EPUB3RepackageRenameLink(xmlNodePtr link, EPUB3RepackagePlanPtr plan, const char * rootPath)
+{
+  xmlChar * href = xmlGetProp(link, BAD_CAST "href");
+  if(href == NULL) return kEPUB3_YES;
+  EPUB3Bool remote = kEPUB3_NO;
+  EPUB3ArchiveEntryPtr entry = EPUB3FindEntryForHref(plan->epub, rootPath, (const char *)href, &remote);
+  xmlFree(href);
+  if(remote) return kEPUB3_YES;
+  EPUB3ArchiveIndexPtr index = plan->epub->archiveIndex;
+  if(entry == NULL || plan->itemOfEntry[entry - index->entries] == UINT32_MAX) return kEPUB3_NO;
+  char * renamed = EPUB3RepackageCopyHref(plan->items[plan->itemOfEntry[entry - index->entries]].path, NULL);
+  if(renamed == NULL) return kEPUB3_NO;
+  xmlSetProp(link, BAD_CAST "href", BAD_CAST renamed);
+  EPUB3_FREE_AND_NULL(renamed);
+  return kEPUB3_YES;
+}
+
+static void EPUB3SetElementText(xmlNodePtr node, const char * text)
+{
+  xmlNodeSetContent(node, NULL);
+  xmlNodeAddContent(node, BAD_CAST text);
+}
+
+// Fits the first part's metadata, copied whole, to the new package: title and identifier replaced when not NULL,
+// references to its manifest items and files renamed or, when those were left out, dropped, and for EPUB 3 a new
+// modification date
+static void EPUB3RepackageFixMetadata(xmlNodePtr metadataNode, xmlNsPtr ns, EPUB3RepackagePlanPtr plan, const char * rootPath, const char * uniqueId, const char * title, const char * identifier, EPUB3Bool isEPUB3)
+{
+  static const char * dcHref = "http://purl.org/dc/elements/1.1/";
+  EPUB3MetadataRef metadata = plan->epub->metadata;
+  xmlNodePtr identifierNode = NULL;
+  xmlNodePtr titleNode = NULL;
+  EPUB3Bool hasLanguage = kEPUB3_NO;
+  EPUB3Bool hasModified = kEPUB3_NO;
+  char modified[32] = "";
+  time_t now = time(NULL);
+  struct tm utc;
+  if(gmtime_r(&now, &utc) != NULL) {
+    (void)strftime(modified, sizeof(modified), "%Y-%m-%dT%H:%M:%SZ", &utc);
+  }
+
+  for(xmlNodePtr node = metadataNode->children, next = NULL; node != NULL; node = next) {
+    next = node->next;
+    if(node->type != XML_ELEMENT_NODE) continue;
+    EPUB3Bool isDC = node->ns != NULL && xmlStrcmp(node->ns->href, BAD_CAST dcHref) == 0 ? kEPUB3_YES : kEPUB3_NO;
+    EPUB3Bool keep = kEPUB3_YES;
+    xmlChar * id = xmlGetProp(node, BAD_CAST "id");
+    if(id != NULL && identifierNode == NULL && xmlStrcmp(id, BAD_CAST uniqueId) == 0) {
+      identifierNode = node;
+      if(identifier != NULL) {
+        EPUB3SetElementText(node, identifier);
+      }
+    } else if(isDC && xmlStrcmp(node->name, BAD_CAST "title") == 0) {
+      if(titleNode == NULL) {
+        titleNode = node;
+        if(title != NULL) {
+          EPUB3SetElementText(node, title);
+        }
+      }
+    } else if(isDC && xmlStrcmp(node->name, BAD_CAST "language") == 0) {
+      hasLanguage = kEPUB3_YES;
+    } else if(xmlStrcmp(node->name, BAD_CAST "meta") == 0) {
+      xmlChar * name = xmlGetProp(node, BAD_CAST "name");
+      xmlChar * property = xmlGetProp(node, BAD_CAST "property");
+      xmlChar * refines = xmlGetProp(node, BAD_CAST "refines");
+      if(name != NULL && xmlStrcmp(name, BAD_CAST "cover") == 0) {
+        keep = EPUB3RepackageRenameItemReference(node, "content", plan, kEPUB3_NO);
+      } else if(isEPUB3 && refines == NULL && property != NULL && xmlStrcmp(property, BAD_CAST "dcterms:modified") == 0) {
+        EPUB3SetElementText(node, modified);
+        hasModified = kEPUB3_YES;
+      }
+      EPUB3_XML_FREE_AND_NULL(name);
+      EPUB3_XML_FREE_AND_NULL(property);
+      EPUB3_XML_FREE_AND_NULL(refines);
+    } else if(xmlStrcmp(node->name, BAD_CAST "link") == 0) {
+      keep = EPUB3RepackageRenameLink(node, plan, rootPath);
+    }
+    EPUB3_XML_FREE_AND_NULL(id);
+    if(!keep) {
+      xmlUnlinkNode(node);
+      xmlFreeNode(node);
+    }
+  }
+
+  // Refinements follow what they refine: renamed with a manifest item, and dropped with it or a replaced title
+  for(xmlNodePtr node = metadataNode->children, next = NULL; node != NULL; node = next) {
+    next = node->next;
+    if(node->type != XML_ELEMENT_NODE) continue;
+    xmlChar * refines = xmlGetProp(node, BAD_CAST "refines");
+    if(refines == NULL) continue;
+    EPUB3Bool keep = EPUB3RepackageRenameItemReference(node, "refines", plan, kEPUB3_YES);
+    if(keep && title != NULL && refines[0] == '#') {
+      for(xmlNodePtr target = metadataNode->children; target != NULL; target = target->next) {
+        if(target->type != XML_ELEMENT_NODE || target->ns == NULL || xmlStrcmp(target->ns->href, BAD_CAST dcHref) != 0
+           || xmlStrcmp(target->name, BAD_CAST "title") != 0) continue;
+        xmlChar * id = xmlGetProp(target, BAD_CAST "id");
+        if(id != NULL && xmlStrcmp(id, refines + 1) == 0) keep = kEPUB3_NO;
+        EPUB3_XML_FREE_AND_NULL(id);
+      }
+    }
+    EPUB3_XML_FREE_AND_NULL(refines);
+    if(!keep) {
+      xmlUnlinkNode(node);
+      xmlFreeNode(node);
+    }
+  }
+
+  // A new title replaces all of the old ones
+  for(xmlNodePtr node = metadataNode->children, next = NULL; node != NULL && title != NULL; node = next) {
+    next = node->next;
+    if(node != titleNode && node->type == XML_ELEMENT_NODE && node->ns != NULL && xmlStrcmp(node->ns->href, BAD_CAST dcHref) == 0
+       && xmlStrcmp(node->name, BAD_CAST "title") == 0) {
+      xmlUnlinkNode(node);
+      xmlFreeNode(node);
+    }
+  }
+
+  xmlNsPtr dc = xmlSearchNsByHref(metadataNode->doc, metadataNode, BAD_CAST dcHref);
+  if(dc == NULL) {
+    dc = xmlNewNs(metadataNode, BAD_CAST dcHref, BAD_CAST "dc");
+  }
+  if(identifierNode == NULL) {
+    const char * text = identifier != NULL ? identifier : metadata->identifier != NULL ? metadata->identifier : "";
+    identifierNode = xmlNewTextChild(metadataNode, dc, BAD_CAST "identifier", BAD_CAST text);
+    xmlNewProp(identifierNode, BAD_CAST "id", BAD_CAST uniqueId);
+  }
+  if(titleNode == NULL) {
+    const char * text = title != NULL ? title : metadata->title != NULL ? metadata->title : "";
+    xmlNewTextChild(metadataNode, dc, BAD_CAST "title", BAD_CAST text);
+  }
+  if(!hasLanguage) {
+    xmlNewTextChild(metadataNode, dc, BAD_CAST "language", BAD_CAST "und");
+  }
+  if(isEPUB3 && !hasModified && modified[0] != '\0') {
+    xmlNodePtr meta = xmlNewTextChild(metadataNode, ns, BAD_CAST "meta", BAD_CAST modified);
+    xmlNewProp(meta, BAD_CAST "property", BAD_CAST "dcterms:modified");
+  }
+}
+
+// The package takes the first part's version and metadata. Properties, which EPUB 2 does not have, are dropped
+// from the other parts' items when it is EPUB 2
+xmlDocPtr EPUB3RepackageCopyPackage(EPUB3RepackagePlanPtr plans, uint32_t planCount, const char * title, const char * identifier)
+{
+  assert(plans != NULL);
+  assert(planCount > 0);
+
+  EPUB3MetadataRef metadata = plans[0].epub->metadata;
+  EPUB3Bool isEPUB3 = metadata->version == kEPUB3Version_3 ? kEPUB3_YES : kEPUB3_NO;
+  const char * rootPath = NULL;
+  xmlDocPtr source = EPUB3RepackageCopySourcePackage(plans[0].epub, &rootPath);
+  xmlNodePtr sourcePackage = source != NULL ? xmlDocGetRootElement(source) : NULL;
+  xmlNodePtr sourceMetadata = sourcePackage != NULL ? EPUB3FirstChildElementNamed(sourcePackage, "metadata") : NULL;
+  if(sourceMetadata == NULL) {
+    if(source != NULL) xmlFreeDoc(source);
+    return NULL;
+  }
+
+  xmlDocPtr document = xmlNewDoc(BAD_CAST "1.0");
+  xmlNodePtr package = xmlNewNode(NULL, BAD_CAST "package");
+  xmlNsPtr ns = xmlNewNs(package, BAD_CAST "http://www.idpf.org/2007/opf", NULL);
+  xmlSetNs(package, ns);
+  xmlDocSetRootElement(document, package);
+  // The metadata may use prefixes declared on the package, in attribute values as well as names
+  for(xmlNsPtr sourceNs = sourcePackage->nsDef; sourceNs != NULL; sourceNs = sourceNs->next) {
+    if(sourceNs->prefix != NULL && xmlSearchNs(document, package, sourceNs->prefix) == NULL) {
+      xmlNewNs(package, sourceNs->href, sourceNs->prefix);
+    }
+  }
+  xmlNewProp(package, BAD_CAST "version", BAD_CAST (isEPUB3 ? "3.0" : "2.0"));
+  xmlChar * uniqueId = xmlGetProp(sourcePackage, BAD_CAST "unique-identifier");
+  xmlNewProp(package, BAD_CAST "unique-identifier", uniqueId != NULL ? uniqueId : BAD_CAST "bookid");
+  xmlChar * pageProgression = NULL;
+  if(isEPUB3) {
+    static const char * packageAttributes[] = { "prefix", "dir" };
+    for(size_t i = 0; i < sizeof(packageAttributes) / sizeof(packageAttributes[0]); i++) {
+      xmlChar * value = xmlGetProp(sourcePackage, BAD_CAST packageAttributes[i]);
+      if(value != NULL) xmlNewProp(package, BAD_CAST packageAttributes[i], value);
+      EPUB3_XML_FREE_AND_NULL(value);
+    }
+    xmlChar * language = xmlNodeGetLang(sourcePackage);
+    if(language != NULL) xmlNodeSetLang(package, language);
+    EPUB3_XML_FREE_AND_NULL(language);
+    xmlNodePtr sourceSpine = EPUB3FirstChildElementNamed(sourcePackage, "spine");
+    pageProgression = sourceSpine != NULL ? xmlGetProp(sourceSpine, BAD_CAST "page-progression-direction") : NULL;
+  }
+
+  xmlNodePtr metadataNode = NULL;
+  if(xmlDOMWrapCloneNode(NULL, source, sourceMetadata, &metadataNode, document, package, 1, 0) != 0 || metadataNode == NULL) {
+    EPUB3_XML_FREE_AND_NULL(uniqueId);
+    EPUB3_XML_FREE_AND_NULL(pageProgression);
+    xmlFreeDoc(source);
+    xmlFreeDoc(document);
+    return NULL;
+  }
+  xmlAddChild(package, metadataNode);
+  xmlFreeDoc(source);
+  // Elements in the package's namespace may have been matched to a prefix; attributes need theirs, elements don't
+  metadataNode->ns = ns;
+  for(xmlNodePtr node = metadataNode->children; node != NULL; node = node->next) {
+    if(node->type == XML_ELEMENT_NODE && node->ns != NULL && xmlStrcmp(node->ns->href, ns->href) == 0) {
+      node->ns = ns;
+    }
+  }
+  EPUB3RepackageFixMetadata(metadataNode, ns, &plans[0], rootPath, uniqueId != NULL ? (const char *)uniqueId : "bookid", title, identifier, isEPUB3);
+  EPUB3_XML_FREE_AND_NULL(uniqueId);
+
+  xmlNodePtr manifest = xmlNewChild(package, ns, BAD_CAST "manifest", NULL);
+  EPUB3RepackageAddManifestItem(manifest, ns, "", "ncx", REPACKAGE_NCX_PATH, "application/x-dtbncx+xml", NULL);
+  if(isEPUB3) {
+    EPUB3RepackageAddManifestItem(manifest, ns, "", "nav", REPACKAGE_NAV_PATH, "application/xhtml+xml", "nav");
+  }
+  for(uint32_t i = 0; i < planCount; i++) {
+    EPUB3RepackagePlanPtr plan = &plans[i];
+    for(uint32_t j = 0; j < plan->itemCount; j++) {
+      EPUB3RepackageItem * item = &plan->items[j];
+      EPUB3ManifestItemRef manifestItem = item->manifestItem;
+      char * href = item->path != NULL ? EPUB3RepackageCopyHref(item->path, NULL) : strdup(manifestItem->href);
+      if(href == NULL) continue;
+      EPUB3RepackageAddManifestItem(manifest, ns, plan->idPrefix, manifestItem->itemId, href, manifestItem->mediaType, isEPUB3 ? manifestItem->properties : NULL);
+      EPUB3_FREE_AND_NULL(href);
+    }
+  }
+
+  xmlNodePtr spine = xmlNewChild(package, ns, BAD_CAST "spine", NULL);
+  xmlNewProp(spine, BAD_CAST "toc", BAD_CAST "ncx");
+  if(pageProgression != NULL) {
+    xmlNewProp(spine, BAD_CAST "page-progression-direction", pageProgression);
+    EPUB3_XML_FREE_AND_NULL(pageProgression);
+  }
+  for(uint32_t i = 0; i < planCount; i++) {
+    EPUB3RepackagePlanPtr plan = &plans[i];
+    for(uint32_t j = 0; j < plan->spineItemCount; j++) {
+      EPUB3SpineItemRef spineItem = plan->spineItems[j];
+      EPUB3ManifestItemRef manifestItem = spineItem->manifestItem;
+      char idref[strlen(plan->idPrefix) + strlen(manifestItem->itemId) + 1];
+      (void)snprintf(idref, sizeof(idref), "%s%s", plan->idPrefix, manifestItem->itemId);
+      xmlNodePtr itemref = xmlNewChild(spine, ns, BAD_CAST "itemref", NULL);
+      xmlNewProp(itemref, BAD_CAST "idref", BAD_CAST idref);
+      if(!spineItem->isLinear) {
+        xmlNewProp(itemref, BAD_CAST "linear", BAD_CAST "no");
+      }
+      if(isEPUB3 && spineItem->properties != NULL) {
+        xmlNewProp(itemref, BAD_CAST "properties", BAD_CAST spineItem->properties);
+      }
+    }
+  }
+  return document;
+}
+
+xmlDocPtr EPUB3RepackageCopyNCX(const EPUB3RepackageNavMap * navMap, const char * title, const char * identifier)
+{
+  assert(navMap != NULL);
+
+  xmlDocPtr document = xmlNewDoc(BAD_CAST "1.0");
+  xmlNodePtr ncx = xmlNewNode(NULL, BAD_CAST "ncx");
+  xmlNsPtr ns = xmlNewNs(ncx, BAD_CAST "http://www.daisy.org/z3986/2005/ncx/", NULL);
+  xmlSetNs(ncx, ns);
+  xmlNewProp(ncx, BAD_CAST "version", BAD_CAST "2005-1");
+  xmlDocSetRootElement(document, ncx);
+  xmlNodePtr head = xmlNewChild(ncx, ns, BAD_CAST "head", NULL);
+  xmlNodePtr meta = xmlNewChild(head, ns, BAD_CAST "meta", NULL);
+  xmlNewProp(meta, BAD_CAST "name", BAD_CAST "dtb:uid");
+  xmlNewProp(meta, BAD_CAST "content", BAD_CAST identifier);
+  xmlNodePtr docTitle = xmlNewChild(ncx, ns, BAD_CAST "docTitle", NULL);
+  xmlNewTextChild(docTitle, ns, BAD_CAST "text", BAD_CAST title);
+
+  xmlNodePtr navMapNode = xmlNewChild(ncx, ns, BAD_CAST "navMap", NULL);
+  // parents[d] is the last point at depth d - 1, or the nav map for d == 0. Points never skip a level
+  xmlNodePtr * parents = malloc((navMap->count + 1) * sizeof(xmlNodePtr));
+  if(parents == NULL) {
+    xmlFreeDoc(document);
+    return NULL;
+  }
+  parents[0] = navMapNode;
+  for(uint32_t i = 0; i < navMap->count; i++) {
+    const EPUB3RepackageNavPoint * point = &navMap->points[i];
+    char id[32];
+    char playOrder[16];
+    (void)snprintf(id, sizeof(id), "navpoint-%u", i + 1);
+    (void)snprintf(playOrder, sizeof(playOrder), "%u", i + 1);
+    xmlNodePtr navPoint = xmlNewChild(parents[point->depth], ns, BAD_CAST "navPoint", NULL);
+    xmlNewProp(navPoint, BAD_CAST "id", BAD_CAST id);
+    xmlNewProp(navPoint, BAD_CAST "playOrder", BAD_CAST playOrder);
+    xmlNodePtr navLabel = xmlNewChild(navPoint, ns, BAD_CAST "navLabel", NULL);
+    xmlNewTextChild(navLabel, ns, BAD_CAST "text", BAD_CAST point->title);
+    xmlNodePtr content = xmlNewChild(navPoint, ns, BAD_CAST "content", NULL);
+    xmlNewProp(content, BAD_CAST "src", BAD_CAST point->src);
+    parents[point->depth + 1] = navPoint;
+  }
+  EPUB3_FREE_AND_NULL(parents);
+  return document;
+}
+
+xmlDocPtr EPUB3RepackageCopyNav(const EPUB3RepackageNavMap * navMap, const char * title)
+{
+  assert(navMap != NULL);
+
+  xmlDocPtr document = xmlNewDoc(BAD_CAST "1.0");
+  xmlNodePtr html = xmlNewNode(NULL, BAD_CAST "html");
+  xmlNsPtr ns = xmlNewNs(html, BAD_CAST "http://www.w3.org/1999/xhtml", NULL);
+  xmlNsPtr epubNs = xmlNewNs(html, BAD_CAST "http://www.idpf.org/2007/ops", BAD_CAST "epub");
+  xmlSetNs(html, ns);
+  xmlDocSetRootElement(document, html);
+  xmlNodePtr head = xmlNewChild(html, ns, BAD_CAST "head", NULL);
+  xmlNewTextChild(head, ns, BAD_CAST "title", BAD_CAST title);
+  xmlNodePtr body = xmlNewChild(html, ns, BAD_CAST "body", NULL);
+  xmlNodePtr nav = xmlNewChild(body, ns, BAD_CAST "nav", NULL);
+  xmlNewNsProp(nav, epubNs, BAD_CAST "type", BAD_CAST "toc");
+  xmlNewTextChild(nav, ns, BAD_CAST "h1", BAD_CAST title);
+
+  // lists[d] is the list points at depth d go in, made when the first of them arrives under its parent item
+  xmlNodePtr * items = malloc((navMap->count + 1) * sizeof(xmlNodePtr));
+  xmlNodePtr * lists = malloc((navMap->count + 1) * sizeof(xmlNodePtr));
+  if(items == NULL || lists == NULL) {
+    EPUB3_FREE_AND_NULL(items);
+    EPUB3_FREE_AND_NULL(lists);
+    xmlFreeDoc(document);
+    return NULL;
+  }
+  lists[0] = xmlNewChild(nav, ns, BAD_CAST "ol", NULL);
+  for(uint32_t i = 0; i < navMap->count; i++) {
+    const EPUB3RepackageNavPoint * point = &navMap->points[i];
+    if(point->depth > 0 && (i == 0 || navMap->points[i - 1].depth < point->depth)) {
+      lists[point->depth] = xmlNewChild(items[point->depth - 1], ns, BAD_CAST "ol", NULL);
+    }
+    items[point->depth] = xmlNewChild(lists[point->depth], ns, BAD_CAST "li", NULL);
+    xmlNodePtr anchor = xmlNewTextChild(items[point->depth], ns, BAD_CAST "a", BAD_CAST point->title);
+    xmlNewProp(anchor, BAD_CAST "href", BAD_CAST point->src);
+  }
+  EPUB3_FREE_AND_NULL(items);
+  EPUB3_FREE_AND_NULL(lists);
+  return document;
+}
+
+// Serializes and frees document, then queues it deflated
+EPUB3Error EPUB3RepackageAddDocument(EPUB3WriterRef writer, const char * path, xmlDocPtr document)
+{
+  assert(writer != NULL);
+  assert(path != NULL);
+
+  if(document == NULL) return kEPUB3UnknownError;
+  xmlChar * bytes = NULL;
+  int byteCount = 0;
+  xmlDocDumpFormatMemoryEnc(document, &bytes, &byteCount, "UTF-8", 1);
+  xmlFreeDoc(document);
+  if(bytes == NULL || byteCount <= 0) return kEPUB3UnknownError;
+  EPUB3Error error = EPUB3WriterAddFile(writer, path, bytes, (uint64_t)byteCount, kEPUB3_YES);
+  xmlFree(bytes);
+  return error;
+}
+
+#pragma mark - Ingest
+
+static const char * kEPUB3IngestContainerPath = "META-INF/container.xml";
+
+EXPORT EPUB3IngestRef EPUB3IngestCreate(const char * spoolPath, EPUB3IngestFileFunction function, void * context, EPUB3Error * error)
+{
+  assert(error != NULL);
+
+  int spoolFd = -1;
+  if(spoolPath != NULL) {
+    spoolFd = open(spoolPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(spoolFd < 0) {
+      *error = kEPUB3ArchiveUnavailableError;
+      return NULL;
+    }
+  }
+
+  EPUB3IngestRef memory = calloc(1, sizeof(struct EPUB3Ingest));
+  if(memory == NULL) {
+    if(spoolFd >= 0) close(spoolFd);
+    *error = kEPUB3UnknownError;
+    return NULL;
+  }
+  memory = EPUB3ObjectInitWithTypeID(memory, kEPUB3IngestTypeID);
+  memory->spoolFd = spoolFd;
+  memory->spoolPath = spoolPath != NULL ? strdup(spoolPath) : NULL;
+  memory->spoolError = kEPUB3Success;
+  memory->function = function;
+  memory->context = context;
+  memory->error = kEPUB3Success;
+  memory->state = kEPUB3IngestStateHeader;
+  // Room for the longest name and extra field, and a NUL after the name
+  memory->header = malloc(ZIP_LOCAL_HEADER_SIZE + 2 * 0xFFFF + 1);
+  memory->headerNeeded = sizeof(uint32_t);
+  memory->output = malloc(INGEST_OUTPUT_BUFFER_SIZE);
+  if(memory->header == NULL || memory->output == NULL || (spoolPath != NULL && memory->spoolPath == NULL)) {
+    memory->spoolError = kEPUB3UnknownError;
+    (void)EPUB3IngestClose(memory, NULL);
+    *error = kEPUB3UnknownError;
+    return NULL;
+  }
+  *error = kEPUB3Success;
+  return memory;
+}
+
+EXPORT EPUB3Error EPUB3IngestWrite(EPUB3IngestRef ingest, const void * bytes, size_t length)
+{
+  assert(ingest != NULL);
+  assert(bytes != NULL || length == 0);
+
+  if(ingest->spoolError != kEPUB3Success) return ingest->spoolError;
+  if(ingest->spoolFd >= 0) {
+    ingest->spoolError = EPUB3WriteAllBytes(ingest->spoolFd, bytes, length);
+    if(ingest->spoolError != kEPUB3Success) return ingest->spoolError;
+  }
+  if(ingest->error == kEPUB3Success && ingest->state != kEPUB3IngestStateTrailer) {
+    ingest->error = EPUB3IngestConsume(ingest, bytes, length);
+  }
+  // With a spool the archive can still be opened once it is complete
+  return ingest->spoolFd >= 0 ? kEPUB3Success : ingest->error;
+}
+
+EXPORT EPUB3Ref EPUB3IngestGetBook(EPUB3IngestRef ingest)
+{
+  assert(ingest != NULL);
+  return ingest->book;
+}
+
+EXPORT EPUB3Error EPUB3IngestClose(EPUB3IngestRef ingest, EPUB3Ref * epub)
+{
+  if(ingest == NULL) return kEPUB3InvalidArgumentError;
+  if(epub != NULL) *epub = NULL;
+
+  EPUB3Error error = ingest->spoolError;
+  if(ingest->spoolFd >= 0) {
+    if(close(ingest->spoolFd) != 0 && error == kEPUB3Success) {
+      error = kEPUB3UnknownError;
+    }
+    ingest->spoolFd = -1;
+  }
+  // A parse that stopped early cannot tell where the stream ended; the spooled archive can
+  if(error == kEPUB3Success && ingest->error == kEPUB3Success && ingest->state != kEPUB3IngestStateTrailer) {
+    error = kEPUB3FileReadFromArchiveError;
+  }
+  if(error == kEPUB3Success && ingest->spoolPath == NULL) {
+    error = ingest->error;
+  }
+  if(error == kEPUB3Success && epub != NULL) {
+    if(ingest->spoolPath != NULL) {
+      *epub = EPUB3CreateWithArchiveAtPath(ingest->spoolPath, &error);
+    } else {
+      *epub = ingest->book;
+      ingest->book = NULL;
+    }
+  }
+  if(error != kEPUB3Success && ingest->spoolPath != NULL) {
+    (void)unlink(ingest->spoolPath);
+  }
+
+  if(ingest->streamReady) {
+    (void)inflateEnd(&ingest->stream);
+  }
+  EPUB3Release(ingest->book);
+  EPUB3IngestFreeDocuments(ingest->pending);
+  EPUB3_FREE_AND_NULL(ingest->ncxPath);
+  EPUB3_FREE_AND_NULL(ingest->rootFilePath);
+  EPUB3_FREE_AND_NULL(ingest->document);
+  EPUB3_FREE_AND_NULL(ingest->output);
+  EPUB3_FREE_AND_NULL(ingest->header);
+  EPUB3_FREE_AND_NULL(ingest->spoolPath);
+  EPUB3ObjectRelease(ingest);
+  return error;
+}
+
+// Runs the bytes through the state machine: local header, file data, data descriptor, and so on to the central
+// directory, where parsing ends
+EPUB3Error EPUB3IngestConsume(EPUB3IngestRef ingest, const uint8_t * bytes, size_t length)
+{
+  assert(ingest != NULL);
+
+  EPUB3Error error = kEPUB3Success;
+  while(length > 0 && error == kEPUB3Success && ingest->state != kEPUB3IngestStateTrailer) {
+    size_t used = 0;
+    switch(ingest->state) {
+      case kEPUB3IngestStateHeader: {
+        uint32_t wanted = ingest->headerNeeded - ingest->headerLength;
+        used = length < wanted ? length : wanted;
+        memcpy(ingest->header + ingest->headerLength, bytes, used);
+        ingest->headerLength += (uint32_t)used;
+        if(ingest->headerLength < ingest->headerNeeded) break;
+
+        if(ingest->headerNeeded == sizeof(uint32_t)) {
+          uint32_t signature = EPUB3ReadLittleEndian32(ingest->header);
+          if(signature == ZIP_LOCAL_HEADER_SIGNATURE) {
+            ingest->headerNeeded = ZIP_LOCAL_HEADER_SIZE;
+          } else if(signature == ZIP_CENTRAL_HEADER_SIGNATURE || signature == ZIP_END_OF_CENTRAL_DIRECTORY_SIGNATURE
+                    || signature == ZIP64_END_OF_CENTRAL_DIRECTORY_SIGNATURE) {
+            ingest->state = kEPUB3IngestStateTrailer;
+          } else {
+            error = kEPUB3FileReadFromArchiveError;
+          }
+        } else if(ingest->headerNeeded == ZIP_LOCAL_HEADER_SIZE) {
+          uint32_t variableLength = EPUB3ReadLittleEndian16(ingest->header + ZIP_LOCAL_HEADER_FILENAME_LENGTH_OFFSET)
+            + EPUB3ReadLittleEndian16(ingest->header + ZIP_LOCAL_HEADER_EXTRA_LENGTH_OFFSET);
+          ingest->headerNeeded += variableLength;
+          if(variableLength == 0) {
+            error = EPUB3IngestBeginFile(ingest);
+          }
+        } else {
+          error = EPUB3IngestBeginFile(ingest);
+        }
+        break;
+      }
+      case kEPUB3IngestStateData:
+        if(ingest->inflating) {
+          error = EPUB3IngestInflate(ingest, bytes, length, &used);
+          break;
+        }
+        used = length < ingest->compressedRemaining ? length : (size_t)ingest->compressedRemaining;
+        // Stored bytes are the file's; deflated ones nobody wants are skipped by size
+        if(ingest->complete) {
+          error = EPUB3IngestTakeOutput(ingest, bytes, (uint32_t)used);
+        }
+        ingest->compressedRemaining -= used;
+        if(error == kEPUB3Success && ingest->compressedRemaining == 0) {
+          error = EPUB3IngestEndFile(ingest);
+        }
+        break;
+      case kEPUB3IngestStateDataDescriptor: {
+        uint32_t wanted = ingest->descriptorNeeded - ingest->descriptorLength;
+        used = length < wanted ? length : wanted;
+        memcpy(ingest->descriptor + ingest->descriptorLength, bytes, used);
+        ingest->descriptorLength += (uint32_t)used;
+        if(ingest->descriptorLength < ingest->descriptorNeeded) break;
+
+        // CRC and both sizes, which are 64 bit when the local header had a ZIP64 extra field
+        uint32_t fieldsLength = ingest->zip64 ? 20 : 12;
+        if(ingest->descriptorNeeded == sizeof(uint32_t)) {
+          // The signature is optional
+          EPUB3Bool hasSignature = EPUB3ReadLittleEndian32(ingest->descriptor) == INGEST_DATA_DESCRIPTOR_SIGNATURE;
+          ingest->descriptorNeeded = (hasSignature ? sizeof(uint32_t) : 0) + fieldsLength;
+        } else {
+          const uint8_t * fields = ingest->descriptor + ingest->descriptorNeeded - fieldsLength;
+          ingest->crc = EPUB3ReadLittleEndian32(fields);
+          ingest->compressedSize = ingest->zip64 ? EPUB3ReadLittleEndian64(fields + 4) : EPUB3ReadLittleEndian32(fields + 4);
+          ingest->uncompressedSize = ingest->zip64 ? EPUB3ReadLittleEndian64(fields + 12) : EPUB3ReadLittleEndian32(fields + 8);
+          error = EPUB3IngestFinishFile(ingest);
+        }
+        break;
+      }
+      case kEPUB3IngestStateTrailer:
+        break;
+    }
+    bytes += used;
+    length -= used;
+  }
+  return error;
+}
+
+EPUB3Error EPUB3IngestBeginFile(EPUB3IngestRef ingest)
+{
+  assert(ingest != NULL);
+
+  uint8_t * header = ingest->header;
+  uint32_t nameLength = EPUB3ReadLittleEndian16(header + ZIP_LOCAL_HEADER_FILENAME_LENGTH_OFFSET);
+  uint32_t extraLength = EPUB3ReadLittleEndian16(header + ZIP_LOCAL_HEADER_EXTRA_LENGTH_OFFSET);
+  if(nameLength == 0) return kEPUB3FileReadFromArchiveError;
+
+  ingest->flag = (uint16_t)EPUB3ReadLittleEndian16(header + ZIP_LOCAL_HEADER_FLAG_OFFSET);
+  ingest->method = (uint16_t)EPUB3ReadLittleEndian16(header + ZIP_LOCAL_HEADER_METHOD_OFFSET);
+  ingest->crc = EPUB3ReadLittleEndian32(header + ZIP_LOCAL_HEADER_CRC_OFFSET);
+  ingest->compressedSize = EPUB3ReadLittleEndian32(header + ZIP_LOCAL_HEADER_COMPRESSED_SIZE_OFFSET);
+  ingest->uncompressedSize = EPUB3ReadLittleEndian32(header + ZIP_LOCAL_HEADER_UNCOMPRESSED_SIZE_OFFSET);
+  ingest->sizeKnown = (ingest->flag & ZIP_FLAG_DATA_DESCRIPTOR) == 0;
+  ingest->zip64 = kEPUB3_NO;
+
+  // A local ZIP64 extra field holds the sizes that do not fit, uncompressed first
+  const uint8_t * extra = header + ZIP_LOCAL_HEADER_SIZE + nameLength;
+  const uint8_t * extraEnd = extra + extraLength;
+  while(extra + 4 <= extraEnd) {
+    uint32_t fieldID = EPUB3ReadLittleEndian16(extra);
+    uint32_t fieldLength = EPUB3ReadLittleEndian16(extra + 2);
+    const uint8_t * field = extra + 4;
+    if(field + fieldLength > extraEnd) break;
+    if(fieldID == ZIP64_EXTRA_FIELD_ID) {
+      ingest->zip64 = kEPUB3_YES;
+      const uint8_t * cursor = field;
+      if(ingest->uncompressedSize == 0xFFFFFFFF && cursor + 8 <= field + fieldLength) {
+        ingest->uncompressedSize = EPUB3ReadLittleEndian64(cursor);
+        cursor += 8;
+      }
+      if(ingest->compressedSize == 0xFFFFFFFF && cursor + 8 <= field + fieldLength) {
+        ingest->compressedSize = EPUB3ReadLittleEndian64(cursor);
+      }
+      break;
+    }
+    extra = field + fieldLength;
+  }
+
+  // The extra field has been read, so the name can be terminated over it
+  header[ZIP_LOCAL_HEADER_SIZE + nameLength] = '\0';
+  ingest->path = (char *)header + ZIP_LOCAL_HEADER_SIZE;
+
+  EPUB3Bool readable = (ingest->flag & ZIP_FLAG_ENCRYPTED) == 0 && (ingest->method == 0 || ingest->method == Z_DEFLATED);
+  EPUB3Bool isDirectory = ingest->path[nameLength - 1] == '/';
+  ingest->delivering = ingest->function != NULL && readable && !isDirectory;
+  ingest->buffering = readable && !isDirectory && EPUB3IngestWantsDocument(ingest, ingest->path);
+  ingest->compressedRemaining = ingest->compressedSize;
+  ingest->uncompressedLength = 0;
+  ingest->runningCRC = 0;
+
+  if(!readable) {
+    // Skipped, which needs the size up front
+    if(!ingest->sizeKnown) return kEPUB3FileReadFromArchiveError;
+    ingest->inflating = kEPUB3_NO;
+    ingest->complete = kEPUB3_NO;
+  } else if(ingest->method == 0) {
+    // Nothing marks the end of stored data but its size
+    if(!ingest->sizeKnown || ingest->compressedSize != ingest->uncompressedSize) return kEPUB3FileReadFromArchiveError;
+    ingest->inflating = kEPUB3_NO;
+    ingest->complete = ingest->delivering || ingest->buffering;
+  } else {
+    // Without a size the deflate stream has to be inflated to find its end
+    ingest->inflating = ingest->delivering || ingest->buffering || !ingest->sizeKnown;
+    ingest->complete = ingest->inflating;
+    if(ingest->inflating) {
+      if(ingest->streamReady) {
+        (void)inflateReset(&ingest->stream);
+      } else {
+        memset(&ingest->stream, 0, sizeof(ingest->stream));
+        if(inflateInit2(&ingest->stream, -MAX_WBITS) != Z_OK) return kEPUB3UnknownError;
+        ingest->streamReady = kEPUB3_YES;
+      }
+    }
+  }
+
+  if(ingest->buffering) {
+    if(ingest->sizeKnown && ingest->uncompressedSize > INGEST_MAX_DOCUMENT_SIZE) return kEPUB3XMLReadFromBufferError;
+    ingest->documentCapacity = ingest->sizeKnown ? (uint32_t)ingest->uncompressedSize + 1 : INGEST_OUTPUT_BUFFER_SIZE;
+    ingest->documentLength = 0;
+    ingest->document = malloc(ingest->documentCapacity);
+    if(ingest->document == NULL) return kEPUB3UnknownError;
+  }
+
+  ingest->state = kEPUB3IngestStateData;
+  if(!ingest->inflating && ingest->compressedRemaining == 0) {
+    return EPUB3IngestEndFile(ingest);
+  }
+  return kEPUB3Success;
+}
+
+EPUB3Error EPUB3IngestInflate(EPUB3IngestRef ingest, const uint8_t * bytes, size_t length, size_t * used)
+{
+  assert(ingest != NULL);
+  assert(used != NULL);
+
+  size_t available = length;
+  if(ingest->sizeKnown && available > ingest->compressedRemaining) {
+    available = (size_t)ingest->compressedRemaining;
+  }
+  if(available > UINT_MAX) {
+    available = UINT_MAX;
+  }
+  ingest->stream.next_in = (Bytef *)bytes;
+  ingest->stream.avail_in = (uInt)available;
+
+  EPUB3Error error = kEPUB3Success;
+  int status;
+  for(;;) {
+    ingest->stream.next_out = ingest->output;
+    ingest->stream.avail_out = INGEST_OUTPUT_BUFFER_SIZE;
+    status = inflate(&ingest->stream, Z_NO_FLUSH);
+    if(status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+      error = kEPUB3FileReadFromArchiveError;
+      break;
+    }
+    uint32_t produced = INGEST_OUTPUT_BUFFER_SIZE - ingest->stream.avail_out;
+    if(produced > 0) {
+      error = EPUB3IngestTakeOutput(ingest, ingest->output, produced);
+      if(error != kEPUB3Success) break;
+    }
+    // Room left over means inflate ran out of input
+    if(status == Z_STREAM_END || !ingest->inflating || ingest->stream.avail_out > 0) break;
+  }
+
+  *used = available - ingest->stream.avail_in;
+  if(ingest->sizeKnown) {
+    ingest->compressedRemaining -= *used;
+  }
+  if(error != kEPUB3Success) return error;
+
+  if(status == Z_STREAM_END) {
+    if(ingest->sizeKnown && ingest->compressedRemaining != 0) return kEPUB3FileReadFromArchiveError;
+    return EPUB3IngestEndFile(ingest);
+  }
+  if(!ingest->inflating) {
+    // The rest is skipped by size
+    return ingest->compressedRemaining == 0 ? EPUB3IngestEndFile(ingest) : kEPUB3Success;
+  }
+  if(ingest->sizeKnown && ingest->compressedRemaining == 0) return kEPUB3FileReadFromArchiveError;
+  if(*used == 0) return kEPUB3FileReadFromArchiveError;
+  return kEPUB3Success;
+}
+
+EPUB3Error EPUB3IngestTakeOutput(EPUB3IngestRef ingest, const uint8_t * bytes, uint32_t length)
+{
+  assert(ingest != NULL);
+
+  ingest->runningCRC = EPUB3CRC32(ingest->runningCRC, bytes, length);
+  ingest->uncompressedLength += length;
+  if(ingest->sizeKnown && ingest->uncompressedLength > ingest->uncompressedSize) return kEPUB3FileReadFromArchiveError;
+
+  if(ingest->buffering) {
+    if(length > INGEST_MAX_DOCUMENT_SIZE - ingest->documentLength) return kEPUB3XMLReadFromBufferError;
+    if(ingest->documentLength + length > ingest->documentCapacity) {
+      uint32_t capacity = ingest->documentCapacity * 2;
+      if(capacity < ingest->documentLength + length) {
+        capacity = ingest->documentLength + length;
+      }
+      if(capacity > INGEST_MAX_DOCUMENT_SIZE) {
+        capacity = INGEST_MAX_DOCUMENT_SIZE;
+      }
+      uint8_t * document = realloc(ingest->document, capacity);
+      if(document == NULL) return kEPUB3UnknownError;
+      ingest->document = document;
+      ingest->documentCapacity = capacity;
+    }
+    memcpy(ingest->document + ingest->documentLength, bytes, length);
+    ingest->documentLength += length;
+  }
+
+  if(ingest->delivering && !ingest->function(ingest->path, bytes, length, kEPUB3_NO, ingest->context)) {
+    ingest->delivering = kEPUB3_NO;
+    if(!ingest->buffering && ingest->sizeKnown) {
+      // Nobody wants the rest, so skip it by size instead
+      ingest->inflating = kEPUB3_NO;
+      ingest->complete = kEPUB3_NO;
+    }
+  }
+  return kEPUB3Success;
+}
+
+EPUB3Error EPUB3IngestEndFile(EPUB3IngestRef ingest)
+{
+  assert(ingest != NULL);
+
+  if((ingest->flag & ZIP_FLAG_DATA_DESCRIPTOR) != 0) {
+    ingest->state = kEPUB3IngestStateDataDescriptor;
+    ingest->descriptorLength = 0;
+    ingest->descriptorNeeded = sizeof(uint32_t);
+    return kEPUB3Success;
+  }
+  return EPUB3IngestFinishFile(ingest);
+}
+
+EPUB3Error EPUB3IngestFinishFile(EPUB3IngestRef ingest)
+{
+  assert(ingest != NULL);
+
+  EPUB3Error error = kEPUB3Success;
+  if(ingest->complete && (ingest->uncompressedLength != ingest->uncompressedSize || ingest->runningCRC != ingest->crc)) {
+    fprintf(stderr, "CRC mismatch ingesting %s\n", ingest->path);
+    error = kEPUB3FileReadFromArchiveError;
+  }
+  if(error == kEPUB3Success && ingest->delivering) {
+    (void)ingest->function(ingest->path, NULL, 0, kEPUB3_YES, ingest->context);
+  }
+
+  uint8_t * document = ingest->document;
+  ingest->document = NULL;
+  if(error == kEPUB3Success && ingest->buffering) {
+    error = EPUB3IngestParseDocument(ingest, ingest->path, document, ingest->documentLength);
+  } else {
+    EPUB3_FREE_AND_NULL(document);
+  }
+
+  ingest->buffering = kEPUB3_NO;
+  ingest->delivering = kEPUB3_NO;
+  ingest->path = NULL;
+  ingest->state = kEPUB3IngestStateHeader;
+  ingest->headerLength = 0;
+  ingest->headerNeeded = sizeof(uint32_t);
+  return error;
+}
+
+// The container, then the OPF it points at, then the NCX the OPF points at. Until the container has arrived,
+// anything that may be the OPF is held on to. An NCX is only wanted once the OPF has named it
+EPUB3Bool EPUB3IngestWantsDocument(EPUB3IngestRef ingest, const char * path)
+{
+  assert(ingest != NULL);
+  assert(path != NULL);
+
+  if(strcmp(path, kEPUB3IngestContainerPath) == 0) return ingest->rootFilePath == NULL;
+  if(ingest->rootFilePath == NULL) {
+    const char * extension = strrchr(path, '.');
+    return extension != NULL && strcasecmp(extension, ".opf") == 0;
+  }
+  if(ingest->book == NULL) return strcmp(path, ingest->rootFilePath) == 0;
+  return ingest->ncxPath != NULL && strcmp(path, ingest->ncxPath) == 0;
+}
+
+// Takes ownership of bytes
+EPUB3Error EPUB3IngestParseDocument(EPUB3IngestRef ingest, const char * path, uint8_t * bytes, uint32_t length)
+{
+  assert(ingest != NULL);
+  assert(path != NULL);
+  assert(bytes != NULL);
+
+  EPUB3Error error = kEPUB3Success;
+  EPUB3IngestDocumentPtr pending = NULL;
+  if(strcmp(path, kEPUB3IngestContainerPath) == 0) {
+    error = EPUB3CopyRootFilePathFromContainerData(bytes, length, &ingest->rootFilePath);
+    EPUB3_FREE_AND_NULL(bytes);
+    if(error == kEPUB3Success) {
+      pending = EPUB3IngestTakePendingDocument(ingest, ingest->rootFilePath);
+    }
+    // The other candidates were not the OPF after all
+    EPUB3IngestFreeDocuments(ingest->pending);
+    ingest->pending = NULL;
+    ingest->pendingCount = 0;
+    ingest->pendingLength = 0;
+  }
+  else if(ingest->rootFilePath != NULL && ingest->book == NULL && strcmp(path, ingest->rootFilePath) == 0) {
+    error = EPUB3IngestParsePackage(ingest, bytes, length);
+  }
+  else if(ingest->ncxPath != NULL && strcmp(path, ingest->ncxPath) == 0) {
+    error = EPUB3ParseNCXFromData(ingest->book, bytes, length);
+    EPUB3_FREE_AND_NULL(bytes);
+    EPUB3_FREE_AND_NULL(ingest->ncxPath);
+  }
+  else if(ingest->rootFilePath == NULL) {
+    // A stream of would-be OPFs ahead of the container must not hold on to unbounded memory
+    if(ingest->pendingCount >= INGEST_MAX_PENDING_DOCUMENTS || length > INGEST_MAX_PENDING_SIZE - ingest->pendingLength) {
+      EPUB3_FREE_AND_NULL(bytes);
+      return kEPUB3XMLReadFromBufferError;
+    }
+    EPUB3IngestDocumentPtr document = malloc(sizeof(struct EPUB3IngestDocument));
+    if(document == NULL) {
+      EPUB3_FREE_AND_NULL(bytes);
+      return kEPUB3UnknownError;
+    }
+    document->path = strdup(path);
+    document->bytes = bytes;
+    document->length = length;
+    document->next = ingest->pending;
+    ingest->pending = document;
+    ingest->pendingCount++;
+    ingest->pendingLength += length;
+  }
+  else {
+    EPUB3_FREE_AND_NULL(bytes);
+  }
+
+  if(pending != NULL) {
+    if(error == kEPUB3Success) {
+      error = EPUB3IngestParseDocument(ingest, pending->path, pending->bytes, pending->length);
+    } else {
+      EPUB3_FREE_AND_NULL(pending->bytes);
+    }
+    EPUB3_FREE_AND_NULL(pending->path);
+    EPUB3_FREE_AND_NULL(pending);
+  }
+  return error;
+}
+
+// Takes ownership of bytes
+EPUB3Error EPUB3IngestParsePackage(EPUB3IngestRef ingest, uint8_t * bytes, uint32_t length)
+{
+  assert(ingest != NULL);
+  assert(ingest->rootFilePath != NULL);
+
+  EPUB3Ref book = EPUB3Create();
+  EPUB3InitPackageObjects(book);
+  EPUB3Error error = EPUB3ParseOPFFromData(book, bytes, length);
+  EPUB3_FREE_AND_NULL(bytes);
+  if(error != kEPUB3Success) {
+    EPUB3Release(book);
+    return error;
+  }
+  ingest->book = book;
+
+  ingest->ncxPath = EPUB3CopyNCXPath(book, ingest->rootFilePath);
+  return kEPUB3Success;
+}
+
+EPUB3IngestDocumentPtr EPUB3IngestTakePendingDocument(EPUB3IngestRef ingest, const char * path)
+{
+  assert(ingest != NULL);
+  assert(path != NULL);
+
+  EPUB3IngestDocumentPtr * link = &ingest->pending;
+  while(*link != NULL) {
+    EPUB3IngestDocumentPtr document = *link;
+    if(strcmp(document->path, path) == 0) {
+      *link = document->next;
+      document->next = NULL;
+      ingest->pendingCount--;
+      ingest->pendingLength -= document->length;
+      return document;
+    }
+    link = &document->next;
+  }
+  return NULL;
+}
+
+void EPUB3IngestFreeDocuments(EPUB3IngestDocumentPtr document)
+{
+  while(document != NULL) {
+    EPUB3IngestDocumentPtr next = document->next;
+    EPUB3_FREE_AND_NULL(document->path);
+    EPUB3_FREE_AND_NULL(document->bytes);
+    EPUB3_FREE_AND_NULL(document);
+    document = next;
+  }
+}
@@ -6,6 +6,7 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
 
 typedef enum _EPUB3Error {
   kEPUB3Success = 0,
@@ -20,15 +21,132 @@ typedef enum _EPUB3Error {
   kEPUB3XMLXElementNotFoundError = 1009,
   kEPUB3XMLXDocumentInvalidError = 1010,
   kEPUB3NCXNavMapEnd = 1011,
+  kEPUB3FileNotStoredInArchiveError = 1012,
+  kEPUB3FileEncodingNotSupportedError = 1013,
 } EPUB3Error;
 
 typedef enum { kEPUB3_NO = 0 , kEPUB3_YES = 1 } EPUB3Bool;
 
+typedef enum {
+  kEPUB3IntegrityVerify = 0, // check the CRC-32 of every file read from the archive
+  kEPUB3IntegrityVerifyOnce = 1, // check each file the first time it is read, trust it afterwards
+  kEPUB3IntegritySkip = 2, // never check, for books that were verified before
+} EPUB3IntegrityPolicy;
+
+#define EPUB3_PROBE_TITLE_SIZE (256)
+
+typedef struct EPUB3ProbeResult {
+  uint32_t fileCount; // entries in the central directory
+  uint16_t versionMajor; // from the package version attribute, 0 when it is missing
+  uint16_t versionMinor;
+  EPUB3Bool hasEncryption; // META-INF/encryption.xml is present
+  char title[EPUB3_PROBE_TITLE_SIZE]; // first dc:title as UTF-8, truncated to fit, empty when there is none
+} EPUB3ProbeResult;
+
+/* Reads an archive from storage the library cannot open itself, such as a network filesystem. read returns the
+   number of bytes read at offset, short only at the end of the archive, or -1 on error, and is called from every
+   thread that reads the book. close, if set, runs once the library is done with context.
+   Reads go through a block cache of blockCount blocks of blockSize bytes (a power of two), so the many small reads
+   zip parsing makes become a few aligned ones. A miss on the block after the previous miss also fetches
+   readAheadBlocks more blocks in the same read. Zero picks the default block size (64K) and count (64); read-ahead
+   is off when readAheadBlocks is zero */
+typedef struct EPUB3IOCallbacks {
+  int64_t (*read)(void * context, uint64_t offset, void * bytes, size_t length);
+  void (*close)(void * context);
+  uint64_t size;
+  uint32_t blockSize;
+  uint32_t blockCount;
+  uint32_t readAheadBlocks;
+} EPUB3IOCallbacks;
+
 typedef struct EPUB3 * EPUB3Ref;
 typedef struct EPUB3TocItem * EPUB3TocItemRef;
+typedef struct EPUB3EntryReader * EPUB3EntryReaderRef;
+typedef struct EPUB3EntryData * EPUB3EntryDataRef;
+typedef struct EPUB3Writer * EPUB3WriterRef;
+typedef struct EPUB3Ingest * EPUB3IngestRef;
+
+/* What reading a book costs: bytes fetched from storage, bytes that have to be inflated rather than copied, and
+   the jumps between consecutive linear spine items, which defeat sequential read-ahead */
+typedef struct EPUB3ReadCost {
+  uint64_t bytesRead;
+  uint64_t bytesInflated;
+  uint32_t spineSeeks;
+  uint64_t spineSeekDistance;
+} EPUB3ReadCost;
+
+/* A run of one book's spine for EPUB3RepackageArchivesToPath. Counts every spine item, linear or not */
+typedef struct EPUB3RepackagePart {
+  EPUB3Ref epub;
+  uint32_t firstSpineItem;
+  uint32_t spineItemCount; /* 0 for every item from firstSpineItem on */
+} EPUB3RepackagePart;
+
+/* Where a file sits in the archive, as found by EPUB3ResolveEntries */
+typedef struct EPUB3EntryInfo {
+  uint32_t hrefIndex; // position of the href this describes in the array passed in
+  EPUB3Bool found; // everything below is 0 when not
+  const char * path; // archive path, valid as long as the EPUB3Ref
+  uint64_t compressedSize;
+  uint64_t uncompressedSize;
+  uint64_t localHeaderOffset;
+  uint32_t crc;
+  uint16_t compressionMethod;
+} EPUB3EntryInfo;
+
+/* A central directory entry. name is borrowed and only valid until the function it is passed to returns */
+typedef struct EPUB3ArchiveEntryInfo {
+  const char * name;
+  uint64_t uncompressedSize;
+  uint64_t compressedSize;
+  uint64_t localHeaderOffset;
+  uint32_t crc;
+  uint16_t compressionMethod;
+  uint16_t flag;
+} EPUB3ArchiveEntryInfo;
+
+/* Called for each entry in central directory order. Return kEPUB3_NO to stop */
+typedef EPUB3Bool (*EPUB3ArchiveEntryFunction)(const EPUB3ArchiveEntryInfo * entry, void * context);
+
+/* Called with each file's decompressed bytes as they arrive, then once more with length 0 and last set after the
+   CRC has been checked. Return kEPUB3_NO to skip the rest of the file */
+typedef EPUB3Bool (*EPUB3IngestFileFunction)(const char * path, const void * bytes, uint32_t length, EPUB3Bool last, void * context);
+
+typedef struct EPUB3EntryCacheStatistics {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t bytesCached;
+  uint32_t entriesCached;
+} EPUB3EntryCacheStatistics;
 
 /* Creates and returns reference to an EPUB stored at path */
 EPUB3Ref EPUB3CreateWithArchiveAtPath(const char * path, EPUB3Error *error);
+/* Same as above, but the archive is memory mapped and read without stdio */
+EPUB3Ref EPUB3CreateWithMappedArchiveAtPath(const char * path, EPUB3Error *error);
+/* Creates and returns reference to an EPUB held in memory. The bytes are borrowed, not copied,
+   and must stay valid until the EPUB3Ref is released */
+EPUB3Ref EPUB3CreateWithArchiveInMemory(const void * bytes, size_t byteCount, EPUB3Error *error);
+/* Creates and returns reference to an EPUB read through callbacks, which are copied. close runs when the
+   EPUB3Ref is freed, or before returning if this fails */
+EPUB3Ref EPUB3CreateWithIO(const EPUB3IOCallbacks * callbacks, void * context, EPUB3Error *error);
+
+/* Classifies the archive at path without creating an EPUB3Ref: reads the mimetype, the central directory and the
+   OPF up to the end of its metadata into fixed buffers, with no heap allocation. Returns kEPUB3Success when the
+   archive looks like an EPUB, otherwise the error that stopped the probe, with result filled in as far as it got */
+EPUB3Error EPUB3Probe(const char * path, EPUB3ProbeResult * result);
+/* Lists the central directory of the archive at path without creating an EPUB3Ref or allocating */
+EPUB3Error EPUB3EnumerateArchiveEntriesAtPath(const char * path, EPUB3ArchiveEntryFunction function, void * context);
+
+/* How reads and extraction check file CRCs. Defaults to kEPUB3IntegrityVerify */
+void EPUB3SetIntegrityPolicy(EPUB3Ref epub, EPUB3IntegrityPolicy policy);
+
+/* Lets processes share central directory indexes through POSIX shared memory, keyed by path, device, inode, size
+   and modification time, so opening a book another process has opened skips the central directory scan. Only
+   indexes published by processes of the same effective user are mapped. Off by default. Applies to every EPUB3Ref opened from a path afterwards */
+void EPUB3SetSharedArchiveIndexCacheEnabled(EPUB3Bool enabled);
+/* Drops the shared index published for the archive at path, e.g. before deleting or replacing it */
+EPUB3Error EPUB3RemoveSharedArchiveIndexForPath(const char * path);
 
 /* Memory management */
 void EPUB3Retain(EPUB3Ref epub);
@@ -46,17 +164,122 @@ char * EPUB3CopyMetaElementContentWithName(EPUB3Ref epub, const char * name);
 void EPUB3ManifestFindItemsMatchingRequiredModuleWithName(EPUB3Ref epub, const char * moduleName, char ** matchingItems, int32_t matchSize);
     
 /* locates cover image in epub and copies to bytes */
-EPUB3Error EPUB3CopyCoverImage(EPUB3Ref epub, void ** bytes, uint32_t * byteCount);
+EPUB3Error EPUB3CopyCoverImage(EPUB3Ref epub, void ** bytes, uint64_t * byteCount);
     
+/* Archive file access. Paths are relative to the root of the archive */
+/* Lists every file in the archive, directories included, without allocating */
+EPUB3Error EPUB3EnumerateArchiveEntries(EPUB3Ref epub, EPUB3ArchiveEntryFunction function, void * context);
+/* Points bytes straight into a mapped or in-memory archive for a file stored without compression. Anything
+   else fails with kEPUB3FileNotStoredInArchiveError. The bytes are not CRC checked and stay valid until the
+   EPUB3Ref is released */
+EPUB3Error EPUB3GetBytesOfStoredFileInArchive(EPUB3Ref epub, const char * path, const void ** bytes, uint64_t * byteCount);
+/* Borrows the bytes like the above when possible, copies them otherwise. Free bytes only when isCopy is set */
+EPUB3Error EPUB3GetOrCopyBytesOfFileInArchive(EPUB3Ref epub, const char * path, const void ** bytes, uint64_t * byteCount, EPUB3Bool * isCopy);
+/* Hands out a file as it sits in the archive, without inflating it: a raw deflate stream (no zlib or gzip header)
+   when info->compressionMethod is 8, the file itself when it is 0. The stream is info->compressedSize bytes long
+   and info carries the CRC and uncompressed size; the stream is not checked against the CRC. Borrowed from mapped
+   and in-memory archives, copied otherwise; free bytes only when isCopy is set. Encrypted files, and any other
+   method, fail with kEPUB3FileEncodingNotSupportedError */
+EPUB3Error EPUB3GetOrCopyRawBytesOfFileInArchive(EPUB3Ref epub, const char * path, const void ** bytes, EPUB3ArchiveEntryInfo * info, EPUB3Bool * isCopy);
+
+/* Inflates a raw deflate stream (no zlib or gzip header) that must produce exactly destinationSize bytes.
+   Returns kEPUB3_YES on success */
+typedef EPUB3Bool (*EPUB3RawInflateFunction)(const void * source, size_t sourceSize, void * destination, size_t destinationSize);
+/* Replaces zlib for whole-file inflates, e.g. with a faster library, for every EPUB3Ref. NULL restores zlib */
+void EPUB3SetRawInflateFunction(EPUB3RawInflateFunction inflateFunction);
+
+/* Streams a file out of the archive in caller sized chunks. Every reader has its own archive cursor, so
+   readers on the same EPUB3Ref may run on different threads. A single reader is not thread safe */
+EPUB3Error EPUB3EntryReaderOpen(EPUB3Ref epub, const char * path, EPUB3EntryReaderRef * reader);
+uint64_t EPUB3EntryReaderGetUncompressedSize(EPUB3EntryReaderRef reader);
+/* May read fewer than bufferSize bytes, and never more than INT_MAX at once. Sets bytesRead to 0 at the end of the file */
+EPUB3Error EPUB3EntryReaderRead(EPUB3EntryReaderRef reader, void * buffer, uint32_t bufferSize, uint32_t * bytesRead);
+/* Fails with kEPUB3FileReadFromArchiveError if the whole file was read and its CRC did not match */
+EPUB3Error EPUB3EntryReaderClose(EPUB3EntryReaderRef reader);
+/* Resolves hrefCount OPF-relative hrefs, as a manifest or a chapter in the OPF's directory writes them, in one
+   pass: fragments are dropped, %XX escapes decoded and . and .. segments folded. entries, which holds
+   hrefCount, comes back sorted by local header offset, missing files last, so reads can walk the archive in order */
+EPUB3Error EPUB3ResolveEntries(EPUB3Ref epub, const char ** hrefs, uint32_t hrefCount, EPUB3EntryInfo * entries);
+/* Copies up to length bytes of a file from offset on into buffer and sets bytesRead, 0 past the end. Stored files
+   are read in place; large deflated ones resume from a checkpoint at most 1MB before offset, the index of which
+   is built by the first range read of the file. Ranges are not checked against the file's CRC */
+EPUB3Error EPUB3ReadEntryRange(EPUB3Ref epub, const char * path, uint64_t offset, uint64_t length, void * buffer, uint64_t * bytesRead);
+
+/* Keeps up to byteBudget bytes of decompressed files per book, evicting the least recently used, so repeat reads
+   skip the inflate. Files larger than the budget are never kept. 0, the default, turns the cache off and empties it */
+void EPUB3SetEntryCacheByteBudget(EPUB3Ref epub, uint64_t byteBudget);
+void EPUB3GetEntryCacheStatistics(EPUB3Ref epub, EPUB3EntryCacheStatistics * statistics);
+/* Returns a reference to the decompressed contents of a file. The data is immutable and shared with the entry
+   cache, when it is on, and with other callers; it stays valid until released, even after the EPUB3Ref is */
+EPUB3Error EPUB3CopyEntryData(EPUB3Ref epub, const char * path, EPUB3EntryDataRef * data);
+const void * EPUB3EntryDataGetBytes(EPUB3EntryDataRef data);
+uint64_t EPUB3EntryDataGetLength(EPUB3EntryDataRef data);
+void EPUB3EntryDataRetain(EPUB3EntryDataRef data);
+void EPUB3EntryDataRelease(EPUB3EntryDataRef data);
+/* Prefetch mode: reading a linear spine item starts a background thread inflating the next count linear spine
+   items into the entry cache, so the next page turn finds them there. The entry cache budget bounds what is
+   prefetched, so it should hold count + 1 chapters. 0, the default, stops prefetching */
+EPUB3Error EPUB3SetSpinePrefetchCount(EPUB3Ref epub, uint32_t count);
+
 /* Returns count of linear items in OPF spine */
 int32_t EPUB3CountOfSequentialResources(EPUB3Ref epub);
 /* Adds the href attribute of linear spine resource to array of resources */
 EPUB3Error EPUB3GetPathsOfSequentialResources(EPUB3Ref epub, const char ** resources);
 /* Extracts epub archive to path  */
 EPUB3Error EPUB3ExtractArchiveToPath(EPUB3Ref epub, const char * path);
+/* Number of threads EPUB3ExtractArchiveToPath spreads files across. Defaults to 1, 0 uses one per online CPU */
+void EPUB3SetExtractionThreadCount(EPUB3Ref epub, uint32_t threadCount);
+/* Batches extraction writes through io_uring where the kernel supports it. Ignored elsewhere */
+void EPUB3SetExtractionUsesIOURing(EPUB3Ref epub, EPUB3Bool useIOURing);
 /* in container.xml copied rootfile element full-path attribute into rootPath */
 EPUB3Error EPUB3CopyRootFilePathFromContainer(EPUB3Ref epub, char ** rootPath);
 
+/* Writer functions */
+/* Starts an OCF archive at path, replacing any file there, with the stored mimetype entry already first. Files
+   are deflated in 128K chunks across threadCount threads, 0 for one per online CPU */
+EPUB3WriterRef EPUB3WriterCreateAtPath(const char * path, uint32_t threadCount, EPUB3Error * error);
+/* Queues a copy of bytes as the file at path, relative to the root of the archive. Files are written in the order
+   they are added. Anything over 4GB fails with kEPUB3InvalidArgumentError */
+EPUB3Error EPUB3WriterAddFile(EPUB3WriterRef writer, const char * path, const void * bytes, uint64_t byteCount, EPUB3Bool compress);
+/* Queues the file at sourcePath in epub as the file at path, copying its compressed bytes as they are. Only
+   stored and deflated files under 4GB can be copied; others fail with kEPUB3FileEncodingNotSupportedError */
+EPUB3Error EPUB3WriterAddFileFromArchive(EPUB3WriterRef writer, const char * path, EPUB3Ref epub, const char * sourcePath);
+/* Writes the remaining files and the central directory, then releases the writer. On failure the partial archive
+   is deleted */
+EPUB3Error EPUB3WriterClose(EPUB3WriterRef writer);
+/* Measures the read cost of the archive. Spine seeks are only counted for a book opened with its OPF */
+EPUB3Error EPUB3GetReadCost(EPUB3Ref epub, EPUB3ReadCost * cost);
+/* Rewrites the book at path: container and OPF first, then the spine in spine order, then everything else.
+   Already compressed media (images, audio, video, WOFF) is stored and the rest deflated on threadCount threads.
+   before and after, when not NULL, receive the read cost of the original and of the rewritten archive */
+EPUB3Error EPUB3OptimizeArchiveToPath(EPUB3Ref epub, const char * path, uint32_t threadCount, EPUB3ReadCost * before, EPUB3ReadCost * after);
+/* Writes a book made of the parts' spine runs, in order, to path: a box set from several whole books, or one
+   volume split out of an omnibus. Each part keeps its run of the spine and every manifest item that is not a
+   spine item, under partN/ when there is more than one part. Their files are copied compressed, without an
+   inflate; only the container, OPF, NCX and, when the first part is EPUB 3, nav document are written anew. The
+   OPF has the first part's version and all of its metadata; under EPUB 2 the other parts' items lose their
+   properties. title and identifier replace the first part's when not NULL. Parts with a
+   META-INF/encryption.xml fail with kEPUB3FileEncodingNotSupportedError */
+EPUB3Error EPUB3RepackageArchivesToPath(const EPUB3RepackagePart * parts, uint32_t partCount, const char * title, const char * identifier, const char * path, uint32_t threadCount);
+
+/* Ingest functions */
+/* Reads an archive front to back from its local file headers, as it arrives from a stream that cannot seek, e.g.
+   an upload. Every byte is appended to the file at spoolPath when it is not NULL, and function, when not NULL,
+   gets every stored or deflated file. Stored files with a data descriptor cannot be told apart from what follows
+   them in a stream, so only the spooled archive has them. Up to 16 possible OPFs, 32MB in all, are held on to
+   until the container arrives; beyond that the parse fails with kEPUB3XMLReadFromBufferError */
+EPUB3IngestRef EPUB3IngestCreate(const char * spoolPath, EPUB3IngestFileFunction function, void * context, EPUB3Error * error);
+/* Feeds the next length bytes of the stream. Parse failures stop the parse but, with a spool, not the spooling,
+   and are only returned without one */
+EPUB3Error EPUB3IngestWrite(EPUB3IngestRef ingest, const void * bytes, size_t length);
+/* The book, with its metadata, manifest, spine and, once the NCX has arrived, table of contents, but no archive.
+   NULL until the OPF has been parsed. An NCX that arrives before the OPF is not parsed. Owned by the ingest */
+EPUB3Ref EPUB3IngestGetBook(EPUB3IngestRef ingest);
+/* Ends the stream and releases the ingest. When epub is not NULL it receives the spooled archive opened as a
+   book, or without a spool the book above. Fails with kEPUB3FileReadFromArchiveError if the stream ended before
+   the central directory */
+EPUB3Error EPUB3IngestClose(EPUB3IngestRef ingest, EPUB3Ref * epub);
+
 /* TOC functions */
 int32_t EPUB3CountOfTocRootItems(EPUB3Ref epub);
 EPUB3Error EPUB3GetTocRootItems(EPUB3Ref epub, EPUB3TocItemRef *tocItems);
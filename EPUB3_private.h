@@ -4,15 +4,38 @@
 #include <libxml/xmlreader.h>
 #include <libxml/xpath.h>
 #include <libxml/xpathInternals.h>
+#include <libxml/uri.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define EPUB3_HAVE_IO_URING 1
+#endif
+#endif
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define EPUB3_HAVE_ARM_CRC32 1
+#elif defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define EPUB3_HAVE_CLMUL_CRC32 1
+#endif
 #include "unzip.h"
+#include "zip.h"
 #include "EPUB3.h"
 
 #ifndef EPUB3_private_h
@@ -29,6 +52,8 @@ typedef struct EPUB3Manifest * EPUB3ManifestRef;
 typedef struct EPUB3Spine * EPUB3SpineRef;
 typedef struct EPUB3SpineItem * EPUB3SpineItemRef;
 typedef struct EPUB3Toc * EPUB3TocRef;
+typedef struct EPUB3ArchiveEntry * EPUB3ArchiveEntryPtr;
+typedef struct EPUB3ArchiveIndex * EPUB3ArchiveIndexPtr;
 
 const char * kEPUB3TypeID;
 const char * kEPUB3MetadataTypeID;
@@ -39,6 +64,10 @@ const char * kEPUB3SpineTypeID;
 const char * kEPUB3SpineItemTypeID;
 const char * kEPUB3TocTypeID;
 const char * kEPUB3TocItemTypeID;
+const char * kEPUB3EntryReaderTypeID;
+const char * kEPUB3EntryDataTypeID;
+const char * kEPUB3WriterTypeID;
+const char * kEPUB3IngestTypeID;
 
 
 #pragma mark - Internal XML Parsing State
@@ -63,6 +92,76 @@ typedef struct _EPUB3OPFParseContext {
 
 typedef EPUB3XMLParseContext * EPUB3XMLParseContextPtr;
 
+// Directories made during one extraction, relative to its destination
+#define DIRECTORY_CACHE_BUCKET_COUNT (64)
+
+typedef struct EPUB3DirectoryCacheItem * EPUB3DirectoryCacheItemPtr;
+
+struct EPUB3DirectoryCacheItem {
+  char * path;
+  EPUB3DirectoryCacheItemPtr next;
+};
+
+typedef struct EPUB3DirectoryCache {
+  pthread_mutex_t lock;
+  EPUB3DirectoryCacheItemPtr buckets[DIRECTORY_CACHE_BUCKET_COUNT];
+} * EPUB3DirectoryCachePtr;
+
+// Shared by the extraction workers; entries are claimed one at a time in central directory order
+typedef struct _EPUB3ExtractionContext {
+  EPUB3Ref epub;
+  int directory;
+  EPUB3DirectoryCachePtr directoryCache;
+  uint32_t nextEntry;
+  uint32_t filesWritten;
+  EPUB3Error firstError;
+  EPUB3Bool useIOURing;
+} EPUB3ExtractionContext;
+
+typedef EPUB3ExtractionContext * EPUB3ExtractionContextPtr;
+
+#if EPUB3_HAVE_IO_URING
+// Each extraction worker owns one ring. A file takes one slot from openat until its close completes.
+#define EXTRACTION_RING_ENTRY_COUNT (64)
+#define EXTRACTION_RING_SLOT_COUNT (EXTRACTION_RING_ENTRY_COUNT / 4)
+// Larger files stream through the synchronous writer rather than being inflated into memory whole
+#define EXTRACTION_RING_MAX_FILE_SIZE (16U * 1024U * 1024U)
+
+typedef struct EPUB3ExtractionRingSlot {
+  void * buffer;
+  uint32_t length;
+  uint32_t pendingCompletions;
+  EPUB3Bool failed;
+} EPUB3ExtractionRingSlot;
+
+typedef struct EPUB3ExtractionRing {
+  int fd;
+  EPUB3ExtractionContextPtr context;
+  void * sqMap;
+  size_t sqMapSize;
+  void * cqMap;
+  size_t cqMapSize;
+  struct io_uring_sqe * sqes;
+  size_t sqesSize;
+  unsigned sqEntries;
+  unsigned * sqHead;
+  unsigned * sqTail;
+  unsigned * sqMask;
+  unsigned * sqArray;
+  unsigned * cqHead;
+  unsigned * cqTail;
+  unsigned * cqMask;
+  struct io_uring_cqe * cqes;
+  unsigned pendingSubmissions;
+  EPUB3ExtractionRingSlot slots[EXTRACTION_RING_SLOT_COUNT];
+  uint32_t freeSlots[EXTRACTION_RING_SLOT_COUNT];
+  uint32_t freeSlotCount;
+  EPUB3Bool abandoned; // io_uring_enter failed, so nothing more is submitted
+} EPUB3ExtractionRing;
+
+typedef EPUB3ExtractionRing * EPUB3ExtractionRingPtr;
+#endif
+
 #pragma mark - Type definitions
 
 typedef struct EPUB3Type {
@@ -81,6 +180,83 @@ typedef enum {
   kEPUB3Version_3 = 300,
 } EPUB3Version;
 
+// Caches fixed, aligned blocks of an archive read through EPUB3IOCallbacks. Lookups scan the blocks, most recent
+// first; misses evict the least recently used one
+#define IO_BLOCK_CACHE_DEFAULT_BLOCK_SIZE (64U * 1024U)
+#define IO_BLOCK_CACHE_DEFAULT_BLOCK_COUNT (64U)
+#define IO_BLOCK_CACHE_MIN_BLOCK_SIZE (512U)
+
+typedef struct EPUB3IOBlock {
+  uint64_t index; // block number in the archive, UINT64_MAX while empty
+  uint64_t lastUse;
+  uint32_t length; // short for the last block of the archive
+} EPUB3IOBlock;
+
+typedef struct EPUB3BlockCache {
+  EPUB3IOCallbacks callbacks;
+  void * context;
+  pthread_mutex_t lock;
+  uint32_t blockSize;
+  uint32_t blockCount;
+  uint32_t readAheadBlocks;
+  uint32_t mostRecentBlock;
+  uint64_t useClock;
+  uint64_t nextSequentialBlock; // the block after the last miss, which makes the next miss sequential
+  EPUB3IOBlock * blocks;
+  uint8_t * storage; // block slot i holds its bytes at i * blockSize
+} * EPUB3BlockCachePtr;
+
+// Decompressed files kept per book. The recency list runs through the archive entries themselves, so a lookup is
+// the index lookup the read does anyway
+typedef struct EPUB3EntryCache {
+  pthread_mutex_t lock;
+  uint64_t byteBudget; // 0 when off
+  uint64_t bytesCached;
+  uint32_t entriesCached;
+  EPUB3ArchiveEntryPtr newest;
+  EPUB3ArchiveEntryPtr oldest;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+} EPUB3EntryCache;
+
+// One background thread per book that inflates the linear spine items after the one last read into the entry
+// cache. It lives until the book is released; a count of 0 only leaves it idle
+typedef struct EPUB3SpinePrefetcher {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake; // work arrived or the book is going away
+  pthread_cond_t idle;
+  uint32_t count;
+  EPUB3ArchiveEntryPtr * linearEntries; // NULL where an item's href is not in the archive
+  uint32_t linearEntryCount;
+  uint32_t nextPosition; // 0-based range of linearEntries still to fetch
+  uint32_t endPosition;
+  EPUB3Bool busy;
+  EPUB3Bool stopping;
+} * EPUB3SpinePrefetcherPtr;
+
+// Inflate state saved every RANGE_CHECKPOINT_SPAN bytes of a large deflated file, as in zlib's examples/zran.c,
+// so a range read resumes at the checkpoint before it instead of inflating from the start of the file
+#define RANGE_CHECKPOINT_SPAN (1024U * 1024U)
+#define RANGE_WINDOW_SIZE (32768U)
+#define RANGE_INPUT_SIZE (16384U)
+
+typedef struct EPUB3RangeCheckpoint {
+  uint64_t uncompressedOffset;
+  uint64_t compressedOffset; // relative to the file data, at the first byte not wholly consumed
+  int bits; // how many low bits of the byte before compressedOffset are still to be read, 0-7
+  uint8_t window[RANGE_WINDOW_SIZE]; // the 32K of output before uncompressedOffset
+} EPUB3RangeCheckpoint;
+
+typedef struct EPUB3RangeIndex {
+  uint32_t checkpointCount;
+  EPUB3RangeCheckpoint * checkpoints; // ascending, none at offset 0
+} * EPUB3RangeIndexPtr;
+
+// Readers each take their own unzFile so they can run on different threads
+#define EPUB3_MAX_IDLE_ARCHIVE_CURSORS (8)
+
 struct EPUB3 {
   EPUB3Type _type;
   EPUB3MetadataRef metadata;
@@ -90,8 +266,194 @@ struct EPUB3 {
   char * archivePath;
   unzFile archive;
   uint32_t archiveFileCount;
+  EPUB3ArchiveIndexPtr archiveIndex;
+  zlib_mem_desc archiveMemory; // base is NULL unless the archive is read from memory
+  EPUB3Bool archiveIsMapped; // archiveMemory is our own mapping of archivePath
+  zlib_fd_desc archiveFile; // fd is -1 unless cursors pread from archivePath
+  EPUB3BlockCachePtr archiveBlockCache; // NULL unless the archive is read through EPUB3IOCallbacks
+  zlib_read_at_desc archiveReadAt;
+  zlib_filefunc_def archiveCursorFileFuncs;
+  pthread_mutex_t archiveCursorLock;
+  unzFile idleArchiveCursors[EPUB3_MAX_IDLE_ARCHIVE_CURSORS];
+  uint32_t idleArchiveCursorCount;
+  uint32_t extractionThreadCount;
+  EPUB3Bool extractionUsesIOURing;
+  EPUB3IntegrityPolicy integrityPolicy;
+  EPUB3EntryCache entryCache;
+  pthread_mutex_t spinePrefetcherLock; // held while the prefetcher is created, so only one ever starts
+  EPUB3SpinePrefetcherPtr spinePrefetcher;
+  char * rootFilePath; // the OPF's path, read from the container once and then never changed
+  char * rootPath; // its directory, which the OPF's hrefs are relative to
+};
+
+// One central directory record, captured once when the archive is opened
+struct EPUB3ArchiveEntry {
+  char * filename;
+  unz_file_pos filePos; // for unzGoToFilePos
+  uint32_t crc;
+  uint64_t compressedSize;
+  uint64_t uncompressedSize;
+  uint16_t compressionMethod;
+  uint16_t flag;
+  uint64_t localHeaderOffset;
+  uint32_t verified; // set once a read has matched crc, for kEPUB3IntegrityVerifyOnce
+  EPUB3ArchiveEntryPtr next; // hash chain
+  EPUB3EntryDataRef cachedData; // the entry cache's reference, guarded by its lock
+  EPUB3ArchiveEntryPtr newerCached; // entry cache recency list
+  EPUB3ArchiveEntryPtr olderCached;
+  uint32_t linearSpinePosition; // 1-based among the linear spine items once prefetching is on, 0 otherwise
+  EPUB3RangeIndexPtr rangeIndex; // built by the first range read of a large deflated file, then immutable
+};
+
+struct EPUB3ArchiveIndex {
+  uint32_t entryCount;
+  struct EPUB3ArchiveEntry * entries; // central directory order
+  uint32_t bucketCount; // power of two
+  EPUB3ArchiveEntryPtr * entryTable;
+  const void * sharedImage; // when set, the filenames point into this read-only mapping
+  size_t sharedImageSize;
 };
 
+// Layout of an index published to shared memory. Offsets are from the start of the image, so every process can
+// map it wherever it likes
+#define SHARED_ARCHIVE_INDEX_MAGIC (0x58444933U) // "3IDX"
+#define SHARED_ARCHIVE_INDEX_VERSION (1U)
+#define SHARED_ARCHIVE_INDEX_NAME_SIZE (32)
+
+#if defined(__APPLE__)
+#define EPUB3_STAT_MTIME_NSEC(st) ((st)->st_mtimespec.tv_nsec)
+#else
+#define EPUB3_STAT_MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+#endif
+
+typedef struct EPUB3SharedArchiveIndexHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t complete; // set last, once the builder has filled in everything else
+  int32_t builderPid;
+  uint64_t device;
+  uint64_t inode;
+  uint64_t size;
+  int64_t modificationTime;
+  int64_t modificationTimeNanoseconds;
+  uint64_t imageSize;
+  uint32_t entryCount;
+  uint32_t pathLength; // the path follows the header
+  uint64_t entriesOffset;
+} EPUB3SharedArchiveIndexHeader;
+
+typedef struct EPUB3SharedArchiveEntry {
+  uint64_t posInCentralDirectory;
+  uint64_t fileNumber;
+  uint64_t compressedSize;
+  uint64_t uncompressedSize;
+  uint64_t localHeaderOffset;
+  uint64_t filenameOffset;
+  uint32_t crc;
+  uint16_t compressionMethod;
+  uint16_t flag;
+} EPUB3SharedArchiveEntry;
+
+struct EPUB3EntryData {
+  EPUB3Type _type;
+  uint64_t length;
+  uint8_t bytes[]; // allocated with the object, so releasing it frees both
+};
+
+struct EPUB3EntryReader {
+  EPUB3Type _type;
+  EPUB3Ref epub;
+  unzFile archive; // checked out of epub until the reader is closed
+  EPUB3ArchiveEntryPtr entry; // weak ref into epub->archiveIndex
+  uint64_t bytesRemaining;
+};
+
+// Files are deflated in independent chunks, each primed with the tail of the one before, and written back in
+// order. Every chunk but the last ends on a sync flush, so the chunks concatenate into one deflate stream
+#define WRITER_CHUNK_SIZE (128U * 1024U)
+#define WRITER_DICTIONARY_SIZE (32U * 1024U)
+#define WRITER_MAX_ARCHIVE_SIZE (0xFFFFFFFFULL) // MiniZip 1.01h writes 32 bit sizes and offsets
+
+typedef struct EPUB3WriterChunk {
+  uint8_t * compressed; // NULL for stored files, which are written from the file's bytes
+  uint32_t compressedSize;
+  uint32_t crc;
+  EPUB3Bool failed;
+} EPUB3WriterChunk;
+
+typedef struct EPUB3WriterFile {
+  char * path;
+  uint8_t * bytes;
+  uint32_t byteCount;
+  EPUB3Bool compress;
+  EPUB3Bool raw; // bytes are another archive's compressed data, written out as they are, in no chunks
+  uint32_t rawCRC;
+  uint32_t rawUncompressedSize;
+  EPUB3Ref source; // retained while bytes point into its archive, which bytes are then not freed with the file
+  uint32_t chunkCount;
+  uint32_t chunksDone;
+  EPUB3WriterChunk * chunks;
+  struct EPUB3WriterFile * next;
+} * EPUB3WriterFilePtr;
+
+struct EPUB3Writer {
+  EPUB3Type _type;
+  char * path;
+  zipFile archive; // only touched by the thread calling the writer functions
+  zip_fileinfo fileInfo;
+  uint64_t archiveSize;
+  EPUB3Error error; // the first failure, after which nothing more is written
+  pthread_mutex_t lock;
+  pthread_cond_t workAvailable;
+  pthread_cond_t chunkDone;
+  pthread_t * threads;
+  uint32_t threadCount;
+  EPUB3WriterFilePtr head; // the oldest file not yet in the archive
+  EPUB3WriterFilePtr tail;
+  EPUB3WriterFilePtr nextFile; // the first file with a chunk nobody has claimed, NULL when there is none
+  uint32_t nextChunk;
+  EPUB3Bool stopping;
+  z_stream stream; // for the calling thread, which compresses too while it waits in close
+  EPUB3Bool streamReady;
+};
+
+// A book assembled from parts of others. Unchanged files are copied compressed; the container, OPF, NCX and, for
+// EPUB 3, nav document are written anew at the root of the archive
+#define REPACKAGE_CONTAINER_PATH "META-INF/container.xml"
+#define REPACKAGE_PACKAGE_PATH "content.opf"
+#define REPACKAGE_NCX_PATH "toc.ncx"
+#define REPACKAGE_NAV_PATH "nav.xhtml"
+
+typedef struct EPUB3RepackageItem {
+  EPUB3ManifestItemRef manifestItem; // weak ref into the part's manifest
+  EPUB3ArchiveEntryPtr entry; // NULL for remote resources, which keep their href
+  char * path; // in the new archive
+} EPUB3RepackageItem;
+
+typedef struct EPUB3RepackagePlan {
+  EPUB3Ref epub;
+  char prefix[16]; // directory of the part in the new archive, empty for a single part
+  char idPrefix[16];
+  EPUB3RepackageItem * items; // central directory order, remote resources last
+  uint32_t itemCount;
+  EPUB3SpineItemRef * spineItems; // weak refs to the part's range of the spine
+  EPUB3ArchiveEntryPtr * spineEntries;
+  uint32_t spineItemCount;
+  uint32_t * itemOfEntry; // index into items by central directory position, UINT32_MAX for files left out
+} * EPUB3RepackagePlanPtr;
+
+typedef struct EPUB3RepackageNavPoint {
+  const char * title; // weak ref
+  char * src; // relative to the root of the new archive
+  uint32_t depth;
+} EPUB3RepackageNavPoint;
+
+typedef struct EPUB3RepackageNavMap {
+  EPUB3RepackageNavPoint * points; // document order
+  uint32_t count;
+  uint32_t capacity;
+} EPUB3RepackageNavMap;
+
 struct EPUB3MetadataMetaItem {
     EPUB3Type _type;
     char * name;
@@ -152,6 +514,7 @@ struct EPUB3SpineItem {
   EPUB3Type _type;
   EPUB3Bool isLinear;
   char * idref;
+  char * properties; // EPUB3
   EPUB3ManifestItemRef manifestItem; //weak ref
 };
 
@@ -182,12 +545,17 @@ struct EPUB3TocItem {
 
 void EPUB3ObjectRelease(void *object);
 void EPUB3ObjectRetain(void *object);
+EPUB3Bool EPUB3ObjectDropReference(void *object);
 void * EPUB3ObjectInitWithTypeID(void *object, const char *typeID);
 
 #pragma mark - Main EPUB3 Object
 
 EPUB3Ref EPUB3Create();
 EPUB3Error EPUB3PrepareArchiveAtPath(EPUB3Ref epub, const char * path);
+EPUB3Error EPUB3PrepareArchiveAtPathWithFileFuncs(EPUB3Ref epub, const char * path, zlib_filefunc_def * fileFuncs);
+EPUB3Error EPUB3PrepareMappedArchiveAtPath(EPUB3Ref epub, const char * path);
+EPUB3Error EPUB3PrepareArchiveInMemory(EPUB3Ref epub, const void * bytes, size_t byteCount);
+EPUB3Error EPUB3PrepareArchiveWithIO(EPUB3Ref epub, const EPUB3IOCallbacks * callbacks, void * context);
 EPUB3Error EPUB3InitAndValidate(EPUB3Ref epub);
 void EPUB3SetStringValue(char ** location, const char *value);
 char * EPUB3CopyStringValue(char ** location);
@@ -249,6 +617,8 @@ void EPUB3TocItemAppendChild(EPUB3TocItemRef parent, EPUB3TocItemRef child);
 
 #pragma mark - XML Parsing
 
+void EPUB3InitPackageObjects(EPUB3Ref epub);
+char * EPUB3CopyNCXPath(EPUB3Ref epub, const char * opfFilename);
 EPUB3Error EPUB3InitFromOPF(EPUB3Ref epub, const char * opfFilename);
 void EPUB3SaveParseContext(EPUB3XMLParseContextPtr *ctxPtr, EPUB3XMLParseState state, const xmlChar * tagName, int32_t attrCount, char ** attrs, EPUB3Bool shouldParseTextNode, void * userInfo);
 void EPUB3PopAndFreeParseContext(EPUB3XMLParseContextPtr *contextPtr);
@@ -268,17 +638,288 @@ EPUB3Error EPUB3ProcessXMLReaderNodeForNavMapInNCX(EPUB3Ref epub, xmlTextReaderP
 
 EPUB3Error EPUB3ValidateMimetype(EPUB3Ref epub);
 EPUB3Error EPUB3ValidateFileExistsAndSeekInArchive(EPUB3Ref epub, const char * filename);
+EPUB3Error EPUB3CopyRootFilePathFromContainerData(const void * buffer, uint32_t bufferSize, char ** rootPath);
+EPUB3Error EPUB3GetRootFilePath(EPUB3Ref epub, const char ** rootFilePath);
+EPUB3Error EPUB3GetRootPath(EPUB3Ref epub, const char ** rootPath);
 
 #pragma mark - File and Zip Functions
 
-EPUB3Error EPUB3CopyFileIntoBuffer(EPUB3Ref epub, void **buffer, uint32_t *bufferSize, uint32_t *bytesCopied, const char * filename);
+EPUB3Error EPUB3CopyFileIntoBuffer(EPUB3Ref epub, void **buffer, uint64_t *bufferSize, uint64_t *bytesCopied, const char * filename);
 uint32_t EPUB3GetFileCountInArchive(EPUB3Ref epub);
-EPUB3Error EPUB3GetUncompressedSizeOfFileInArchive(EPUB3Ref epub, uint32_t *uncompressedSize, const char *filename);
+EPUB3Error EPUB3GetUncompressedSizeOfFileInArchive(EPUB3Ref epub, uint64_t *uncompressedSize, const char *filename);
 EPUB3Error EPUB3WriteCurrentArchiveFileToPath(EPUB3Ref epub, const char * path);
+EPUB3Error EPUB3WriteCurrentFileOfArchiveToDirectory(unzFile archive, int directory, EPUB3DirectoryCachePtr cache, EPUB3Bool verify);
+EPUB3Error EPUB3ExtractArchiveToDirectory(EPUB3Ref epub, int directory, EPUB3DirectoryCachePtr cache, uint32_t threadCount);
+EPUB3Error EPUB3CreateDirectoriesForArchiveFilename(int directory, EPUB3DirectoryCachePtr cache, const char * filename);
+int EPUB3OpenDirectoryAtPath(const char * path);
+#if EPUB3_HAVE_IO_URING
+EPUB3ExtractionRingPtr EPUB3ExtractionRingCreate(EPUB3ExtractionContextPtr context);
+void EPUB3ExtractionRingFree(EPUB3ExtractionRingPtr ring);
+EPUB3Error EPUB3ExtractionRingQueueEntry(EPUB3ExtractionRingPtr ring, unzFile cursor, EPUB3ArchiveEntryPtr entry);
+EPUB3Error EPUB3ExtractionRingDrain(EPUB3ExtractionRingPtr ring);
+void EPUB3ExtractionRingAbandon(EPUB3ExtractionRingPtr ring);
+#endif
 EPUB3Error EPUB3CreateNestedDirectoriesForFileAtPath(const char * path);
 char * EPUB3CopyOfPathByAppendingPathComponent(const char * path, const char * componentToAppend);
 char * EPUB3CopyOfPathByDeletingLastPathComponent(const char * path);
 
+#pragma mark - Archive Index
+
+EPUB3ArchiveIndexPtr EPUB3ArchiveIndexCreateWithArchive(unzFile archive);
+EPUB3Bool EPUB3ArchiveIndexBuildEntryTable(EPUB3ArchiveIndexPtr index);
+void EPUB3ArchiveIndexFree(EPUB3ArchiveIndexPtr index);
+EPUB3ArchiveEntryPtr EPUB3ArchiveIndexFindEntry(EPUB3ArchiveIndexPtr index, const char * filename);
+void EPUB3ArchiveEntryGetInfo(EPUB3ArchiveEntryPtr entry, EPUB3ArchiveEntryInfo * info);
+EPUB3Bool EPUB3ArchiveIndexEntryIsShadowed(EPUB3ArchiveEntryPtr entry);
+EPUB3Bool EPUB3SharedArchiveIndexCacheIsEnabled(void);
+EPUB3ArchiveIndexPtr EPUB3ArchiveIndexCreateWithSharedCache(unzFile archive, const char * path, const struct stat * st);
+EPUB3ArchiveIndexPtr EPUB3ArchiveIndexCreateWithSharedImage(const void * image, size_t imageSize, const char * path, const struct stat * st);
+void EPUB3ArchiveIndexPublish(EPUB3ArchiveIndexPtr index, const char * name, const char * path, const struct stat * st);
+void EPUB3SharedArchiveIndexNameForPath(char * name, size_t nameSize, const char * path, const struct stat * st);
+EPUB3Error EPUB3GetDataOffsetOfEntryInArchive(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, uint64_t * dataOffset);
+unzFile EPUB3CheckOutArchiveCursor(EPUB3Ref epub);
+void EPUB3CheckInArchiveCursor(EPUB3Ref epub, unzFile cursor);
+
+#pragma mark - Entry Resolution
+
+char * EPUB3CopyOfArchivePathForHref(const char * rootPath, const char * href);
+
+#pragma mark - Range Reads
+
+EPUB3Error EPUB3ReadStoredEntryRange(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, uint64_t offset, uint64_t length, void * buffer);
+EPUB3Error EPUB3ReadDeflatedEntryRange(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, uint64_t offset, uint64_t length, void * buffer);
+EPUB3Error EPUB3ReadEntryRangeWithReader(EPUB3Ref epub, const char * path, uint64_t offset, uint64_t length, void * buffer);
+EPUB3RangeIndexPtr EPUB3RangeIndexCreate(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, uint64_t dataOffset);
+void EPUB3RangeIndexFree(EPUB3RangeIndexPtr index);
+
+#pragma mark - Entry Cache
+
+EPUB3Error EPUB3ReadEntryIntoBuffer(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, void * destination, uint64_t * bytesCopied);
+EPUB3EntryDataRef EPUB3EntryDataCreate(uint64_t length);
+EPUB3Error EPUB3CopyDataOfEntry(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, EPUB3EntryDataRef * data);
+EPUB3EntryDataRef EPUB3EntryCacheCopyData(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry);
+void EPUB3EntryCacheAdd(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, EPUB3EntryDataRef data);
+void EPUB3EntryCacheTrimToBudget(EPUB3Ref epub, uint64_t byteBudget);
+
+#pragma mark - Spine Prefetch
+
+EPUB3Error EPUB3CopySpineEntries(EPUB3Ref epub, EPUB3Bool linearOnly, EPUB3ArchiveEntryPtr ** entries, uint32_t * count);
+EPUB3SpinePrefetcherPtr EPUB3SpinePrefetcherCreate(EPUB3Ref epub);
+void EPUB3SpinePrefetcherFree(EPUB3SpinePrefetcherPtr prefetcher);
+void EPUB3SpinePrefetcherNoteRead(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry);
+void EPUB3SpinePrefetcherWaitUntilIdle(EPUB3Ref epub);
+void EPUB3EntryCachePrefetch(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry);
+
+#pragma mark - Block Cache
+
+EPUB3BlockCachePtr EPUB3BlockCacheCreate(const EPUB3IOCallbacks * callbacks, void * context);
+void EPUB3BlockCacheFree(EPUB3BlockCachePtr cache);
+EPUB3Error EPUB3BlockCacheRead(EPUB3BlockCachePtr cache, uint64_t offset, void * bytes, size_t length);
+uLong EPUB3BlockCacheReadAt(voidpf opaque, uLong offset, void * bytes, uLong length, int * error);
+EPUB3Error EPUB3ReadArchiveBytes(EPUB3Ref epub, uint64_t offset, void * bytes, size_t length);
+
+#pragma mark - Integrity
+
+uint32_t EPUB3CRC32(uint32_t crc, const void * bytes, size_t length);
+uLong EPUB3UnzipCRC32(uLong crc, const Bytef * bytes, uInt length);
+EPUB3Bool EPUB3ShouldVerifyEntry(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry);
+void EPUB3MarkEntryVerified(EPUB3ArchiveEntryPtr entry);
+
+#pragma mark - Single Shot Inflate
+
+EPUB3Bool EPUB3RawInflateWithZlib(const void * source, size_t sourceSize, void * destination, size_t destinationSize);
+EPUB3Bool EPUB3CanReadEntryInOneShot(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry);
+EPUB3Error EPUB3ReadEntryInOneShot(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, void * destination);
+
+#pragma mark - Directory Cache
+
+EPUB3DirectoryCachePtr EPUB3DirectoryCacheCreate(void);
+void EPUB3DirectoryCacheFree(EPUB3DirectoryCachePtr cache);
+EPUB3Bool EPUB3DirectoryCacheContains(EPUB3DirectoryCachePtr cache, const char * path);
+void EPUB3DirectoryCacheAdd(EPUB3DirectoryCachePtr cache, const char * path);
+
+#pragma mark - Writer
+
+EPUB3Error EPUB3WriterQueueFile(EPUB3WriterRef writer, const char * path, const void * bytes, uint32_t byteCount, EPUB3Bool compress);
+EPUB3Error EPUB3WriterQueueRawFile(EPUB3WriterRef writer, const char * path, EPUB3Ref epub, EPUB3ArchiveEntryPtr entry);
+void EPUB3WriterCompressChunk(EPUB3WriterFilePtr file, uint32_t index, z_stream * stream, EPUB3Bool * streamReady);
+EPUB3Error EPUB3WriterWriteFile(EPUB3WriterRef writer, EPUB3WriterFilePtr file);
+EPUB3Error EPUB3WriterWriteFinishedFiles(EPUB3WriterRef writer, EPUB3Bool wait);
+void EPUB3WriterFileFree(EPUB3WriterFilePtr file);
+
+#pragma mark - Optimizer
+
+EPUB3Error EPUB3CopyOptimizedEntryOrder(EPUB3Ref epub, const char * rootFilePath, uint32_t ** order, uint32_t * orderCount);
+const char ** EPUB3CopyMediaTypesOfEntries(EPUB3Ref epub, const char * rootPath);
+EPUB3Bool EPUB3ShouldDeflateEntry(const char * mediaType, const char * path);
+
+#pragma mark - Repackaging
+
+EPUB3Bool EPUB3PathIsArchiveOfBook(EPUB3Ref epub, const char * path);
+EPUB3Error EPUB3RepackagePlanInit(EPUB3RepackagePlanPtr plan, const EPUB3RepackagePart * part, uint32_t partNumber);
+void EPUB3RepackagePlanClear(EPUB3RepackagePlanPtr plan);
+EPUB3Error EPUB3RepackageAddNavPoints(EPUB3RepackagePlanPtr plan, uint32_t depth, EPUB3RepackageNavMap * navMap);
+void EPUB3RepackageNavMapClear(EPUB3RepackageNavMap * navMap);
+xmlDocPtr EPUB3RepackageCopyContainer(void);
+xmlDocPtr EPUB3RepackageCopyPackage(EPUB3RepackagePlanPtr plans, uint32_t planCount, const char * title, const char * identifier);
+xmlDocPtr EPUB3RepackageCopyNCX(const EPUB3RepackageNavMap * navMap, const char * title, const char * identifier);
+xmlDocPtr EPUB3RepackageCopyNav(const EPUB3RepackageNavMap * navMap, const char * title);
+EPUB3Error EPUB3RepackageAddDocument(EPUB3WriterRef writer, const char * path, xmlDocPtr document);
+
+// Zip local file header layout (see APPNOTE.TXT 4.3.7)
+#define ZIP_LOCAL_HEADER_SIGNATURE (0x04034b50)
+#define ZIP_LOCAL_HEADER_SIZE (30)
+#define ZIP_LOCAL_HEADER_FLAG_OFFSET (6)
+#define ZIP_LOCAL_HEADER_METHOD_OFFSET (8)
+#define ZIP_LOCAL_HEADER_CRC_OFFSET (14)
+#define ZIP_LOCAL_HEADER_COMPRESSED_SIZE_OFFSET (18)
+#define ZIP_LOCAL_HEADER_UNCOMPRESSED_SIZE_OFFSET (22)
+#define ZIP_LOCAL_HEADER_FILENAME_LENGTH_OFFSET (26)
+#define ZIP_LOCAL_HEADER_EXTRA_LENGTH_OFFSET (28)
+#define ZIP_FLAG_ENCRYPTED (0x1)
+#define ZIP_FLAG_DATA_DESCRIPTOR (0x8)
+#define ZIP_DATA_DESCRIPTOR_MAX_SIZE (24) // signature, CRC and ZIP64 sizes
+
+// Zip central directory and end records (see APPNOTE.TXT 4.3.12 - 4.3.16)
+#define ZIP_CENTRAL_HEADER_SIGNATURE (0x02014b50)
+#define ZIP_CENTRAL_HEADER_SIZE (46)
+#define ZIP_END_OF_CENTRAL_DIRECTORY_SIGNATURE (0x06054b50)
+#define ZIP_END_OF_CENTRAL_DIRECTORY_SIZE (22)
+#define ZIP_MAX_COMMENT_SIZE (0xFFFF)
+#define ZIP_MAX_FILENAME_SIZE (0xFFFF)
+#define ZIP64_END_OF_CENTRAL_DIRECTORY_LOCATOR_SIGNATURE (0x07064b50)
+#define ZIP64_END_OF_CENTRAL_DIRECTORY_LOCATOR_SIZE (20)
+#define ZIP64_END_OF_CENTRAL_DIRECTORY_SIGNATURE (0x06064b50)
+#define ZIP64_END_OF_CENTRAL_DIRECTORY_SIZE (56)
+#define ZIP64_EXTRA_FIELD_ID (0x0001)
+
+// EPUB3Probe works from these fixed buffers, all on the stack
+#define PROBE_IO_BUFFER_SIZE (4096)
+#define PROBE_NAME_SIZE (512)
+#define PROBE_CONTAINER_PREFIX_SIZE (4096)
+#define PROBE_OPF_PREFIX_SIZE (16384)
+#define PROBE_INFLATE_ARENA_SIZE (48 * 1024) // inflate state plus a 32K window
+
+typedef struct EPUB3ProbeArchive {
+  int fd;
+  uint64_t size;
+  uint64_t byteBeforeArchive; // for archives with data prepended, like MiniZip's byte_before_the_zipfile
+  uint64_t centralDirectoryOffset;
+  uint64_t entryCount;
+  uint64_t bufferOffset;
+  size_t bufferLength;
+  uint8_t buffer[PROBE_IO_BUFFER_SIZE];
+} EPUB3ProbeArchive;
+
+typedef struct EPUB3ProbeEntry {
+  EPUB3Bool found;
+  uint16_t compressionMethod;
+  uint16_t flag;
+  uint64_t compressedSize;
+  uint64_t uncompressedSize;
+  uint64_t localHeaderOffset;
+} EPUB3ProbeEntry;
+
+typedef struct EPUB3ProbeSearch {
+  const char * const * names;
+  EPUB3ProbeEntry * entries; // one per name
+  uint32_t nameCount;
+} EPUB3ProbeSearch;
+
+typedef struct EPUB3ProbeArena {
+  size_t used;
+  uint8_t bytes[PROBE_INFLATE_ARENA_SIZE] __attribute__((aligned(16)));
+} EPUB3ProbeArena;
+
+typedef struct EPUB3ProbeTag {
+  const char * start; // the '<'
+  const char * end; // the '>'
+  const char * localName; // after any namespace prefix
+  size_t localNameLength;
+  EPUB3Bool isEndTag;
+} EPUB3ProbeTag;
+
+// An archive read front to back from its local file headers, for streams that cannot seek to the central directory
+#define INGEST_MAX_DOCUMENT_SIZE (16U * 1024U * 1024U) // container, OPF and NCX are held whole to be parsed
+#define INGEST_MAX_PENDING_DOCUMENTS (16U)
+#define INGEST_MAX_PENDING_SIZE (2U * INGEST_MAX_DOCUMENT_SIZE)
+#define INGEST_OUTPUT_BUFFER_SIZE (64U * 1024U)
+#define INGEST_DATA_DESCRIPTOR_SIGNATURE (0x08074b50)
+
+typedef enum {
+  kEPUB3IngestStateHeader = 0,
+  kEPUB3IngestStateData,
+  kEPUB3IngestStateDataDescriptor,
+  kEPUB3IngestStateTrailer, // central directory reached, nothing more to parse
+} EPUB3IngestState;
+
+typedef struct EPUB3IngestDocument {
+  char * path;
+  uint8_t * bytes;
+  uint32_t length;
+  struct EPUB3IngestDocument * next;
+} * EPUB3IngestDocumentPtr;
+
+struct EPUB3Ingest {
+  EPUB3Type _type;
+  int spoolFd; // -1 without a spool
+  char * spoolPath;
+  EPUB3Error spoolError;
+  EPUB3IngestFileFunction function;
+  void * context;
+  EPUB3Ref book; // NULL until the OPF has been parsed
+  EPUB3Error error; // the first parse failure, after which nothing more is parsed
+  EPUB3IngestState state;
+  uint8_t * header; // the local header being read, NUL terminated after the name
+  uint32_t headerLength;
+  uint32_t headerNeeded;
+  // The current file
+  char * path; // points into header
+  uint16_t flag;
+  uint16_t method;
+  uint32_t crc;
+  uint64_t compressedSize;
+  uint64_t uncompressedSize;
+  uint64_t compressedRemaining;
+  uint64_t uncompressedLength; // bytes produced so far
+  EPUB3Bool sizeKnown; // NO when the sizes follow the data in a descriptor
+  EPUB3Bool zip64;
+  EPUB3Bool inflating; // NO for stored files and for deflated ones skipped over by size
+  EPUB3Bool delivering; // passing the bytes to function
+  EPUB3Bool buffering; // collecting the bytes into document
+  EPUB3Bool complete; // every byte was produced, so the CRC can be checked
+  uint32_t runningCRC;
+  z_stream stream;
+  EPUB3Bool streamReady;
+  uint8_t * output;
+  uint8_t * document;
+  uint32_t documentLength;
+  uint32_t documentCapacity;
+  uint8_t descriptor[ZIP_DATA_DESCRIPTOR_MAX_SIZE];
+  uint32_t descriptorLength;
+  uint32_t descriptorNeeded;
+  // What to parse
+  char * rootFilePath; // NULL until the container has been parsed
+  char * ncxPath;
+  EPUB3IngestDocumentPtr pending; // OPF candidates that arrived before the container
+  uint32_t pendingCount;
+  uint32_t pendingLength;
+};
+
+#pragma mark - Ingest
+
+EPUB3Error EPUB3IngestConsume(EPUB3IngestRef ingest, const uint8_t * bytes, size_t length);
+EPUB3Error EPUB3IngestBeginFile(EPUB3IngestRef ingest);
+EPUB3Error EPUB3IngestInflate(EPUB3IngestRef ingest, const uint8_t * bytes, size_t length, size_t * used);
+EPUB3Error EPUB3IngestTakeOutput(EPUB3IngestRef ingest, const uint8_t * bytes, uint32_t length);
+EPUB3Error EPUB3IngestEndFile(EPUB3IngestRef ingest);
+EPUB3Error EPUB3IngestFinishFile(EPUB3IngestRef ingest);
+EPUB3Bool EPUB3IngestWantsDocument(EPUB3IngestRef ingest, const char * path);
+EPUB3Error EPUB3IngestParseDocument(EPUB3IngestRef ingest, const char * path, uint8_t * bytes, uint32_t length);
+EPUB3Error EPUB3IngestParsePackage(EPUB3IngestRef ingest, uint8_t * bytes, uint32_t length);
+EPUB3IngestDocumentPtr EPUB3IngestTakePendingDocument(EPUB3IngestRef ingest, const char * path);
+void EPUB3IngestFreeDocuments(EPUB3IngestDocumentPtr document);
+
 
 #define EPUB3_FREE_AND_NULL(__epub3_ptr_to_null) do { \
   if(__epub3_ptr_to_null != NULL) { \
@@ -377,7 +377,7 @@ START_TEST(test_epub3_copy_cover_image)
   free(testImageBytes);
 
   void *bytes = NULL;
-  uint32_t byteCount = 0;
+  uint64_t byteCount = 0;
 
   EPUB3Error error = EPUB3CopyCoverImage(epub, &bytes, &byteCount);
   fail_unless(error == kEPUB3Success);
@@ -504,6 +504,192 @@ START_TEST(test_epub3_extract_archive)
 }
 END_TEST
 
+static EPUB3Bool EPUB3TestFilesMatch(const char * path1, const char * path2)
+{
+  FILE *file1 = fopen(path1, "rb");
+  FILE *file2 = fopen(path2, "rb");
+  EPUB3Bool match = (file1 != NULL && file2 != NULL);
+  while(match) {
+    char buffer1[4096];
+    char buffer2[4096];
+    size_t read1 = fread(buffer1, 1, sizeof(buffer1), file1);
+    size_t read2 = fread(buffer2, 1, sizeof(buffer2), file2);
+    if(read1 != read2 || memcmp(buffer1, buffer2, read1) != 0) {
+      match = kEPUB3_NO;
+    }
+    if(read1 == 0) break;
+  }
+  if(file1 != NULL) fclose(file1);
+  if(file2 != NULL) fclose(file2);
+  return match;
+}
+
+static void EPUB3TestAssertExtractionsMatch(const char * path1, const char * path2)
+{
+  for(uint32_t i = 0; i < epub->archiveIndex->entryCount; i++) {
+    const char * filename = epub->archiveIndex->entries[i].filename;
+    if(filename[strlen(filename) - 1] == '/') continue;
+    char file1[strlen(path1) + 1U + strlen(filename) + 1U];
+    char file2[strlen(path2) + 1U + strlen(filename) + 1U];
+    (void)sprintf(file1, "%s/%s", path1, filename);
+    (void)sprintf(file2, "%s/%s", path2, filename);
+    fail_unless(EPUB3TestFilesMatch(file1, file2), "%s differs between %s and %s.", filename, path1, path2);
+  }
+}
+
+#pragma mark test_epub3_extract_archive_in_parallel
+START_TEST(test_epub3_extract_archive_in_parallel)
+{
+  char serialPath[strlen(tmpDirname) + sizeof("/serial")];
+  char parallelPath[strlen(tmpDirname) + sizeof("/parallel")];
+  (void)sprintf(serialPath, "%s/serial", tmpDirname);
+  (void)sprintf(parallelPath, "%s/parallel", tmpDirname);
+
+  EPUB3Error error = EPUB3ExtractArchiveToPath(epub, serialPath);
+  fail_unless(error == kEPUB3Success, "Unable to extract epub serially");
+
+  EPUB3SetExtractionThreadCount(epub, 4);
+  error = EPUB3ExtractArchiveToPath(epub, parallelPath);
+  fail_unless(error == kEPUB3Success, "Unable to extract epub in parallel (error %d)", error);
+
+  EPUB3TestAssertExtractionsMatch(serialPath, parallelPath);
+}
+END_TEST
+
+#pragma mark test_epub3_extract_archive_with_io_uring
+START_TEST(test_epub3_extract_archive_with_io_uring)
+{
+  char serialPath[strlen(tmpDirname) + sizeof("/serial")];
+  char ringPath[strlen(tmpDirname) + sizeof("/ring")];
+  (void)sprintf(serialPath, "%s/serial", tmpDirname);
+  (void)sprintf(ringPath, "%s/ring", tmpDirname);
+
+  EPUB3Error error = EPUB3ExtractArchiveToPath(epub, serialPath);
+  fail_unless(error == kEPUB3Success, "Unable to extract epub serially");
+
+  // Falls back to plain writes where io_uring isn't available, so this holds everywhere
+  EPUB3SetExtractionUsesIOURing(epub, kEPUB3_YES);
+  EPUB3SetExtractionThreadCount(epub, 2);
+  error = EPUB3ExtractArchiveToPath(epub, ringPath);
+  fail_unless(error == kEPUB3Success, "Unable to extract epub through io_uring (error %d)", error);
+
+  EPUB3TestAssertExtractionsMatch(serialPath, ringPath);
+}
+END_TEST
+
+#if EPUB3_HAVE_IO_URING
+#pragma mark test_epub3_extraction_ring_abandon
+START_TEST(test_epub3_extraction_ring_abandon)
+{
+  char serialPath[strlen(tmpDirname) + sizeof("/serial")];
+  char ringPath[strlen(tmpDirname) + sizeof("/ring")];
+  (void)sprintf(serialPath, "%s/serial", tmpDirname);
+  (void)sprintf(ringPath, "%s/ring", tmpDirname);
+
+  EPUB3Error error = EPUB3ExtractArchiveToPath(epub, serialPath);
+  fail_unless(error == kEPUB3Success, "Unable to extract epub serially");
+
+  int directory = EPUB3OpenDirectoryAtPath(ringPath);
+  fail_if(directory < 0);
+  EPUB3ExtractionContext context;
+  memset(&context, 0, sizeof(context));
+  context.epub = epub;
+  context.directory = directory;
+  context.firstError = kEPUB3Success;
+
+  EPUB3ExtractionRingPtr ring = EPUB3ExtractionRingCreate(&context);
+  if(ring == NULL) {
+    // Nothing to abandon where the kernel can't give us a ring
+    close(directory);
+    return;
+  }
+  unzFile cursor = EPUB3CheckOutArchiveCursor(epub);
+  fail_if(cursor == NULL);
+
+  // Abandon with every write still in flight; it has to wait them out before the buffers go
+  uint32_t queued = 0;
+  EPUB3ArchiveEntryPtr queuedEntry = NULL;
+  for(uint32_t i = 0; i < epub->archiveIndex->entryCount; i++) {
+    EPUB3ArchiveEntryPtr entry = &epub->archiveIndex->entries[i];
+    size_t filenameLength = strlen(entry->filename);
+    if(EPUB3ArchiveIndexEntryIsShadowed(entry) || entry->uncompressedSize > EXTRACTION_RING_MAX_FILE_SIZE
+       || filenameLength == 0 || entry->filename[filenameLength - 1] == '/') continue;
+    error = EPUB3ExtractionRingQueueEntry(ring, cursor, entry);
+    fail_unless(error == kEPUB3Success, "Unable to queue %s (error %d)", entry->filename, error);
+    queued++;
+    queuedEntry = entry;
+  }
+  EPUB3ExtractionRingAbandon(ring);
+  fail_unless(ring->abandoned);
+  for(uint32_t i = 0; i < EXTRACTION_RING_SLOT_COUNT; i++) {
+    fail_unless(ring->slots[i].pendingCompletions == 0);
+    fail_unless(ring->slots[i].buffer == NULL);
+  }
+  fail_unless(context.firstError == kEPUB3Success, "Abandoning lost a submitted write (error %d)", context.firstError);
+  ck_assert_int_eq(context.filesWritten, queued);
+  EPUB3ExtractionRingFree(ring);
+  EPUB3TestAssertExtractionsMatch(serialPath, ringPath);
+
+  // A ring the kernel refuses abandons itself from the queue call
+  ring = EPUB3ExtractionRingCreate(&context);
+  fail_if(ring == NULL);
+  int ringDescriptor = ring->fd;
+  ring->fd = -1;
+  error = EPUB3ExtractionRingQueueEntry(ring, cursor, queuedEntry);
+  fail_unless(error == kEPUB3UnknownError, "Expected the queue call to fail, but got error %d", error);
+  fail_unless(ring->abandoned);
+  fail_unless(ring->freeSlotCount == EXTRACTION_RING_SLOT_COUNT);
+  ring->fd = ringDescriptor;
+  EPUB3ExtractionRingFree(ring);
+
+  EPUB3CheckInArchiveCursor(epub, cursor);
+  close(directory);
+}
+END_TEST
+#endif
+
+typedef struct {
+  const char * path;
+  EPUB3Error error;
+} ConcurrentExtraction;
+
+static void * ConcurrentExtractionThread(void * info)
+{
+  ConcurrentExtraction * extraction = info;
+  extraction->error = EPUB3ExtractArchiveToPath(epub, extraction->path);
+  return NULL;
+}
+
+#pragma mark test_epub3_extract_archive_concurrently
+START_TEST(test_epub3_extract_archive_concurrently)
+{
+  char cwd[MAXNAMLEN];
+  (void)getcwd(cwd, MAXNAMLEN);
+
+  char firstPath[strlen(tmpDirname) + sizeof("/first")];
+  char secondPath[strlen(tmpDirname) + sizeof("/second")];
+  (void)sprintf(firstPath, "%s/first", tmpDirname);
+  (void)sprintf(secondPath, "%s/second", tmpDirname);
+
+  EPUB3SetExtractionThreadCount(epub, 2);
+  ConcurrentExtraction extractions[2] = { { firstPath, kEPUB3UnknownError }, { secondPath, kEPUB3UnknownError } };
+  pthread_t threads[2];
+  for(int i = 0; i < 2; i++) {
+    int created = pthread_create(&threads[i], NULL, ConcurrentExtractionThread, &extractions[i]);
+    ck_assert_int_eq(created, 0);
+  }
+  for(int i = 0; i < 2; i++) {
+    pthread_join(threads[i], NULL);
+    fail_unless(extractions[i].error == kEPUB3Success, "Concurrent extraction to %s failed (error %d)", extractions[i].path, extractions[i].error);
+  }
+  EPUB3TestAssertExtractionsMatch(firstPath, secondPath);
+
+  char cwd2[MAXNAMLEN];
+  (void)getcwd(cwd2, MAXNAMLEN);
+  ck_assert_str_eq(cwd, cwd2);
+}
+END_TEST
+
 #pragma mark -
 TEST_EXPORT TCase * check_EPUB3_make_tcase(void)
 {
@@ -525,5 +711,11 @@ TEST_EXPORT TCase * check_EPUB3_make_tcase(void)
   tcase_add_test(test_case, test_epub3_write_current_archive_file_to_path);
   tcase_add_test(test_case, test_epub3_create_nested_directories);
   tcase_add_test(test_case, test_epub3_extract_archive);
+  tcase_add_test(test_case, test_epub3_extract_archive_in_parallel);
+  tcase_add_test(test_case, test_epub3_extract_archive_concurrently);
+  tcase_add_test(test_case, test_epub3_extract_archive_with_io_uring);
+#if EPUB3_HAVE_IO_URING
+  tcase_add_test(test_case, test_epub3_extraction_ring_abandon);
+#endif
   return test_case;
 }
@@ -1,8 +1,10 @@
 #include <config.h>
 #include <check.h>
+#include <sys/wait.h>
 #include "test_common.h"
 #include "EPUB3.h"
 #include "EPUB3_private.h"
+#include "zip.h"
 
 static EPUB3Ref epub;
 
@@ -43,11 +45,11 @@ START_TEST(test_epub3_get_file_size_in_archive)
 {
   const char * filename = "META-INF/container.xml";
   uint32_t expectedSize = 250U;
-  uint32_t size;
+  uint64_t size;
   EPUB3Error error = EPUB3GetUncompressedSizeOfFileInArchive(epub, &size, filename);
   fail_if(error == kEPUB3FileNotFoundInArchiveError, "Expected, but couldn't find %s in %s.", filename, epub->archivePath);
   fail_unless(error == kEPUB3Success, "Something went wrong when looking for %s in %s.", filename, epub->archivePath);
-  fail_unless(size == expectedSize, "Expected size of %u, but got %u for %s.", expectedSize, size, filename);
+  fail_unless(size == expectedSize, "Expected size of %u, but got %" PRIu64 " for %s.", expectedSize, size, filename);
 
   TEST_PATH_VAR_FOR_FILENAME(path, "bad_metadata.epub");
   TEST_DATA_FILE_SIZE_SANITY_CHECK(path, 182);
@@ -59,7 +61,7 @@ START_TEST(test_epub3_get_file_size_in_archive)
   error = EPUB3GetUncompressedSizeOfFileInArchive(badMetadataEpub, &size, filename);
   fail_if(error == kEPUB3FileNotFoundInArchiveError, "Expected, but couldn't find %s in %s.", filename, badMetadataEpub->archivePath);
   fail_unless(error == kEPUB3Success, "Something went wrong when looking for %s in %s.", filename, badMetadataEpub->archivePath);
-  fail_unless(size == expectedSize, "Expected size of %u, but got %u for %s.", expectedSize, size, badMetadataEpub);
+  fail_unless(size == expectedSize, "Expected size of %u, but got %" PRIu64 " for %s.", expectedSize, size, badMetadataEpub);
   EPUB3Release(badMetadataEpub);
 
   EPUB3Ref archiveless = EPUB3Create();
@@ -98,19 +100,1752 @@ START_TEST(test_epub3_validate_file_exists_in_zip)
 }
 END_TEST
 
+#pragma mark test_epub3_archive_index
+START_TEST(test_epub3_archive_index)
+{
+  fail_if(epub->archiveIndex == NULL, "No central directory index was built for %s.", epub->archivePath);
+  ck_assert_int_eq(epub->archiveIndex->entryCount, 117);
+
+  EPUB3ArchiveEntryPtr entry = EPUB3ArchiveIndexFindEntry(epub->archiveIndex, "100/toc.ncx");
+  fail_if(entry == NULL, "Expected, but couldn't find 100/toc.ncx in the index.");
+  ck_assert_int_eq(entry->uncompressedSize, 199337);
+  ck_assert_int_eq(entry->compressedSize, 17335);
+  ck_assert_int_eq(entry->compressionMethod, Z_DEFLATED);
+  ck_assert_str_eq(entry->filename, "100/toc.ncx");
+
+  entry = EPUB3ArchiveIndexFindEntry(epub->archiveIndex, "mimetype");
+  fail_unless(entry == &epub->archiveIndex->entries[0], "The first central directory entry should be mimetype.");
+  ck_assert_int_eq(entry->compressionMethod, 0);
+
+  fail_unless(EPUB3ArchiveIndexFindEntry(epub->archiveIndex, "100/TOC.NCX") == NULL, "Lookups should be case sensitive.");
+  fail_unless(EPUB3ArchiveIndexFindEntry(epub->archiveIndex, "doesnotexist") == NULL);
+  fail_unless(EPUB3ValidateFileExistsAndSeekInArchive(epub, "doesnotexist") == kEPUB3FileNotFoundInArchiveError);
+
+  // The seek should land on the indexed entry
+  fail_unless(EPUB3ValidateFileExistsAndSeekInArchive(epub, "100/toc.ncx") == kEPUB3Success);
+  unz_file_info fileInfo;
+  char filename[MAXNAMLEN];
+  fail_unless(unzGetCurrentFileInfo(epub->archive, &fileInfo, filename, MAXNAMLEN, NULL, 0, NULL, 0) == UNZ_OK);
+  ck_assert_str_eq(filename, "100/toc.ncx");
+}
+END_TEST
+
+#pragma mark test_epub3_shared_archive_index
+START_TEST(test_epub3_shared_archive_index)
+{
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  fail_unless(EPUB3RemoveSharedArchiveIndexForPath(path) == kEPUB3Success);
+  EPUB3SetSharedArchiveIndexCacheEnabled(kEPUB3_YES);
+
+  // The first open scans the central directory and publishes what it found
+  EPUB3Ref publisher = EPUB3Create();
+  fail_unless(EPUB3PrepareArchiveAtPath(publisher, path) == kEPUB3Success);
+  fail_unless(publisher->archiveIndex->sharedImage == NULL);
+
+  // Later ones, here or in other processes, map it instead
+  pid_t child = fork();
+  if(child == 0) {
+    EPUB3Ref reader = EPUB3Create();
+    int mapped = EPUB3PrepareArchiveAtPath(reader, path) == kEPUB3Success && reader->archiveIndex->sharedImage != NULL;
+    _exit(mapped ? 0 : 1);
+  }
+  int status = 0;
+  fail_unless(waitpid(child, &status, 0) == child);
+  fail_unless(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Another process should have mapped the published index.");
+
+  EPUB3Ref reader = EPUB3Create();
+  fail_unless(EPUB3PrepareArchiveAtPath(reader, path) == kEPUB3Success);
+  EPUB3ArchiveIndexPtr index = reader->archiveIndex;
+  fail_if(index->sharedImage == NULL, "The published index should have been mapped.");
+  ck_assert_int_eq(index->entryCount, publisher->archiveIndex->entryCount);
+  for(uint32_t i = 0; i < index->entryCount; i++) {
+    EPUB3ArchiveEntryPtr mapped = &index->entries[i];
+    EPUB3ArchiveEntryPtr scanned = &publisher->archiveIndex->entries[i];
+    ck_assert_str_eq(mapped->filename, scanned->filename);
+    fail_unless(mapped->filePos.pos_in_zip_directory == scanned->filePos.pos_in_zip_directory);
+    fail_unless(mapped->crc == scanned->crc && mapped->uncompressedSize == scanned->uncompressedSize);
+    fail_unless(mapped->localHeaderOffset == scanned->localHeaderOffset);
+  }
+  void * buffer = NULL;
+  uint64_t bufferSize = 0;
+  fail_unless(EPUB3CopyFileIntoBuffer(reader, &buffer, &bufferSize, NULL, "100/toc.ncx") == kEPUB3Success);
+  ck_assert_int_eq(bufferSize, 199337);
+  free(buffer);
+  EPUB3EntryReaderRef entryReader = NULL;
+  fail_unless(EPUB3EntryReaderOpen(reader, "META-INF/container.xml", &entryReader) == kEPUB3Success);
+  fail_unless(EPUB3EntryReaderClose(entryReader) == kEPUB3Success);
+  EPUB3Release(reader);
+  EPUB3Release(publisher);
+
+  // The name is predictable, so an image others can write to is not trusted
+  struct stat st;
+  fail_unless(stat(path, &st) == 0);
+  char name[SHARED_ARCHIVE_INDEX_NAME_SIZE];
+  EPUB3SharedArchiveIndexNameForPath(name, sizeof(name), path, &st);
+  int fd = shm_open(name, O_RDWR, 0);
+  fail_unless(fd >= 0);
+  struct stat imageStat;
+  fail_unless(fstat(fd, &imageStat) == 0);
+  ck_assert_int_eq(imageStat.st_mode & 0777, 0600);
+  fail_unless(fchmod(fd, 0666) == 0);
+  reader = EPUB3Create();
+  fail_unless(EPUB3PrepareArchiveAtPath(reader, path) == kEPUB3Success);
+  fail_unless(reader->archiveIndex->sharedImage == NULL);
+  EPUB3Release(reader);
+
+  // Nor are entries that point past the end of the archive
+  fail_unless(fchmod(fd, 0600) == 0);
+  uint8_t * image = mmap(NULL, (size_t)imageStat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  fail_unless(image != MAP_FAILED);
+  close(fd);
+  EPUB3SharedArchiveIndexHeader * header = (EPUB3SharedArchiveIndexHeader *)image;
+  EPUB3SharedArchiveEntry * sharedEntries = (EPUB3SharedArchiveEntry *)(image + header->entriesOffset);
+  sharedEntries[header->entryCount - 1].compressedSize = header->size;
+  reader = EPUB3Create();
+  fail_unless(EPUB3PrepareArchiveAtPath(reader, path) == kEPUB3Success);
+  fail_unless(reader->archiveIndex->sharedImage == NULL);
+  EPUB3Release(reader);
+  munmap(image, (size_t)imageStat.st_size);
+
+  // Once removed, the next open scans again
+  fail_unless(EPUB3RemoveSharedArchiveIndexForPath(path) == kEPUB3Success);
+  EPUB3SetSharedArchiveIndexCacheEnabled(kEPUB3_NO);
+  reader = EPUB3Create();
+  fail_unless(EPUB3PrepareArchiveAtPath(reader, path) == kEPUB3Success);
+  fail_unless(reader->archiveIndex->sharedImage == NULL);
+  EPUB3Release(reader);
+}
+END_TEST
+
+#pragma mark test_epub3_create_with_mapped_archive
+START_TEST(test_epub3_create_with_mapped_archive)
+{
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  EPUB3Error error = kEPUB3UnknownError;
+  EPUB3Ref mappedEpub = EPUB3CreateWithMappedArchiveAtPath(path, &error);
+  fail_unless(error == kEPUB3Success, "Unable to open %s through a mapping (error %d).", path, error);
+  fail_if(mappedEpub == NULL);
+  fail_unless(mappedEpub->archiveIsMapped == kEPUB3_YES);
+  ck_assert_int_eq(mappedEpub->archiveMemory.size, 2376236);
+  ck_assert_int_eq(mappedEpub->archiveIndex->entryCount, 117);
+
+  char * title = EPUB3CopyTitle(mappedEpub);
+  ck_assert_str_eq(title, "The Complete Works of William Shakespeare");
+  free(title);
+
+  void *mappedBuffer = NULL;
+  void *buffer = NULL;
+  uint64_t mappedSize = 0;
+  uint64_t size = 0;
+  const char * filename = "100/toc.ncx";
+  fail_unless(EPUB3CopyFileIntoBuffer(mappedEpub, &mappedBuffer, &mappedSize, NULL, filename) == kEPUB3Success);
+  fail_unless(EPUB3CopyFileIntoBuffer(epub, &buffer, &size, NULL, filename) == kEPUB3Success);
+  ck_assert_int_eq(mappedSize, size);
+  fail_unless(memcmp(mappedBuffer, buffer, size) == 0, "%s differs when read through a mapping.", filename);
+  free(mappedBuffer);
+  free(buffer);
+  EPUB3Release(mappedEpub);
+
+  TEST_PATH_VAR_FOR_FILENAME(missingPath, "doesnotexist.epub");
+  mappedEpub = EPUB3CreateWithMappedArchiveAtPath(missingPath, &error);
+  fail_unless(mappedEpub == NULL);
+  fail_unless(error == kEPUB3UnknownError);
+}
+END_TEST
+
+#pragma mark test_epub3_create_with_archive_in_memory
+START_TEST(test_epub3_create_with_archive_in_memory)
+{
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  struct stat st;
+  fail_unless(stat(path, &st) == 0, "Error stat'ing %s", path);
+  size_t byteCount = (size_t)st.st_size;
+  void * bytes = malloc(byteCount);
+  FILE * fp = fopen(path, "rb");
+  size_t bytesRead = fread(bytes, 1, byteCount, fp);
+  fclose(fp);
+  ck_assert_int_eq(bytesRead, byteCount);
+
+  EPUB3Error error = kEPUB3UnknownError;
+  EPUB3Ref memoryEpub = EPUB3CreateWithArchiveInMemory(bytes, byteCount, &error);
+  fail_unless(error == kEPUB3Success, "Unable to open %s from memory (error %d).", path, error);
+  fail_if(memoryEpub == NULL);
+  fail_unless(memoryEpub->archivePath == NULL);
+  fail_unless(memoryEpub->archiveMemory.base == bytes, "The archive bytes should be borrowed, not copied.");
+  fail_unless(memoryEpub->archiveIsMapped == kEPUB3_NO);
+
+  char * title = EPUB3CopyTitle(memoryEpub);
+  ck_assert_str_eq(title, "The Complete Works of William Shakespeare");
+  free(title);
+  ck_assert_int_eq(EPUB3CountOfSequentialResources(memoryEpub), 108);
+  EPUB3Release(memoryEpub);
+
+  // Not a zip at all
+  memset(bytes, 0, 1024);
+  memoryEpub = EPUB3CreateWithArchiveInMemory(bytes, 1024, &error);
+  fail_unless(memoryEpub == NULL);
+  fail_if(error == kEPUB3Success);
+  free(bytes);
+}
+END_TEST
+
+#pragma mark test_epub3_zip64_archive
+// Every size and offset in zip64.epub lives in ZIP64 extra fields, and its counts in a ZIP64 end of central directory
+static void AssertZip64BookReads(EPUB3Ref zip64Epub)
+{
+  ck_assert_int_eq(EPUB3GetFileCountInArchive(zip64Epub), 4);
+  char * title = EPUB3CopyTitle(zip64Epub);
+  ck_assert_str_eq(title, "A ZIP64 Book");
+  free(title);
+
+  uint64_t size = 0;
+  fail_unless(EPUB3GetUncompressedSizeOfFileInArchive(zip64Epub, &size, "OEBPS/chapter.xhtml") == kEPUB3Success);
+  fail_unless(size == 17430, "Expected 17430 bytes, got %" PRIu64 ".", size);
+
+  void * buffer = NULL;
+  uint64_t bufferSize = 0;
+  fail_unless(EPUB3CopyFileIntoBuffer(zip64Epub, &buffer, &bufferSize, NULL, "OEBPS/chapter.xhtml") == kEPUB3Success);
+  fail_unless(bufferSize == 17430);
+  fail_unless(memcmp((char *)buffer + bufferSize - 15, "</body></html>\n", 15) == 0);
+
+  EPUB3EntryReaderRef reader = NULL;
+  fail_unless(EPUB3EntryReaderOpen(zip64Epub, "OEBPS/chapter.xhtml", &reader) == kEPUB3Success);
+  fail_unless(EPUB3EntryReaderGetUncompressedSize(reader) == 17430);
+  char * streamed = malloc(bufferSize);
+  uint32_t totalRead = 0;
+  uint32_t bytesRead = 0;
+  do {
+    fail_unless(EPUB3EntryReaderRead(reader, streamed + totalRead, (uint32_t)bufferSize - totalRead, &bytesRead) == kEPUB3Success);
+    totalRead += bytesRead;
+  } while(bytesRead > 0 && totalRead < bufferSize);
+  fail_unless(EPUB3EntryReaderClose(reader) == kEPUB3Success);
+  fail_unless(totalRead == bufferSize && memcmp(streamed, buffer, bufferSize) == 0);
+  free(streamed);
+  free(buffer);
+}
+
+START_TEST(test_epub3_zip64_archive)
+{
+  TEST_PATH_VAR_FOR_FILENAME(path, "zip64.epub");
+  TEST_DATA_FILE_SIZE_SANITY_CHECK(path, 1978);
+
+  EPUB3Error error = kEPUB3UnknownError;
+  EPUB3Ref zip64Epub = EPUB3CreateWithArchiveAtPath(path, &error);
+  fail_unless(error == kEPUB3Success, "Unable to open %s (error %d).", path, error);
+  AssertZip64BookReads(zip64Epub);
+  EPUB3Release(zip64Epub);
+
+  zip64Epub = EPUB3CreateWithMappedArchiveAtPath(path, &error);
+  fail_unless(error == kEPUB3Success, "Unable to map %s (error %d).", path, error);
+  AssertZip64BookReads(zip64Epub);
+
+  EPUB3Release(zip64Epub);
+
+  // Plain stdio has no single shot path, so this goes through the unzip cursor
+  zlib_filefunc_def fileFuncs;
+  fill_fopen_filefunc(&fileFuncs);
+  zip64Epub = EPUB3Create();
+  fail_unless(EPUB3PrepareArchiveAtPathWithFileFuncs(zip64Epub, path, &fileFuncs) == kEPUB3Success);
+  void * buffer = NULL;
+  uint64_t bufferSize = 0;
+  fail_unless(EPUB3CopyFileIntoBuffer(zip64Epub, &buffer, &bufferSize, NULL, "OEBPS/content.opf") == kEPUB3Success);
+  fail_unless(bufferSize == 528);
+  fail_unless(memcmp(buffer, "<?xml", 5) == 0);
+  free(buffer);
+  EPUB3Release(zip64Epub);
+}
+END_TEST
+
+#pragma mark test_epub3_create_with_io
+typedef struct CountingIOContext {
+  int fd;
+  uint32_t readCount;
+  uint32_t closeCount;
+} CountingIOContext;
+
+static int64_t CountingIORead(void * context, uint64_t offset, void * bytes, size_t length)
+{
+  CountingIOContext * io = context;
+  __atomic_add_fetch(&io->readCount, 1, __ATOMIC_RELAXED);
+  return (int64_t)pread(io->fd, bytes, length, (off_t)offset);
+}
+
+static void CountingIOClose(void * context)
+{
+  ((CountingIOContext *)context)->closeCount++;
+}
+
+START_TEST(test_epub3_create_with_io)
+{
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  struct stat st;
+  fail_unless(stat(path, &st) == 0);
+  CountingIOContext io = { open(path, O_RDONLY), 0, 0 };
+  fail_unless(io.fd >= 0);
+
+  EPUB3IOCallbacks callbacks;
+  memset(&callbacks, 0, sizeof(callbacks));
+  callbacks.read = CountingIORead;
+  callbacks.close = CountingIOClose;
+  callbacks.size = (uint64_t)st.st_size;
+  callbacks.blockSize = 1000;
+  EPUB3Error error = kEPUB3UnknownError;
+  fail_unless(EPUB3CreateWithIO(&callbacks, &io, &error) == NULL);
+  ck_assert_int_eq(error, kEPUB3InvalidArgumentError);
+  ck_assert_int_eq(io.closeCount, 1);
+
+  // The central directory and the OPF are parsed from a few thousand small reads; the cache turns them into a handful
+  io.closeCount = 0;
+  callbacks.blockSize = 0;
+  callbacks.readAheadBlocks = 4;
+  EPUB3Ref ioEpub = EPUB3CreateWithIO(&callbacks, &io, &error);
+  fail_unless(error == kEPUB3Success, "Unable to open %s through callbacks (error %d).", path, error);
+  fail_unless(io.readCount < 10, "Opening took %u reads.", io.readCount);
+  char * title = EPUB3CopyTitle(ioEpub);
+  ck_assert_str_eq(title, "The Complete Works of William Shakespeare");
+  free(title);
+
+  EPUB3Ref pathEpub = EPUB3CreateWithArchiveAtPath(path, &error);
+  fail_unless(error == kEPUB3Success);
+  const char * name = "100/@public@vhost@g@gutenberg@html@dirs@etext94@shaks12-0.txt.html";
+  void * expected = NULL;
+  uint64_t expectedSize = 0;
+  fail_unless(EPUB3CopyFileIntoBuffer(pathEpub, &expected, &expectedSize, NULL, name) == kEPUB3Success);
+
+  void * buffer = NULL;
+  uint64_t bufferSize = 0;
+  fail_unless(EPUB3CopyFileIntoBuffer(ioEpub, &buffer, &bufferSize, NULL, name) == kEPUB3Success);
+  fail_unless(bufferSize == expectedSize && memcmp(buffer, expected, (size_t)bufferSize) == 0);
+  free(buffer);
+
+  // Streaming goes through the MiniZip cursor, and so through the cache as well
+  EPUB3EntryReaderRef reader = NULL;
+  fail_unless(EPUB3EntryReaderOpen(ioEpub, name, &reader) == kEPUB3Success);
+  char chunk[1024];
+  uint32_t bytesRead = 0;
+  fail_unless(EPUB3EntryReaderRead(reader, chunk, sizeof(chunk), &bytesRead) == kEPUB3Success);
+  fail_unless(bytesRead == sizeof(chunk) && memcmp(chunk, expected, sizeof(chunk)) == 0);
+  fail_unless(EPUB3EntryReaderClose(reader) == kEPUB3Success);
+  free(expected);
+
+  EPUB3Release(pathEpub);
+  ck_assert_int_eq(io.closeCount, 0);
+  EPUB3Release(ioEpub);
+  ck_assert_int_eq(io.closeCount, 1);
+  close(io.fd);
+}
+END_TEST
+
+#pragma mark test_epub3_entry_cache
+START_TEST(test_epub3_entry_cache)
+{
+  const char * first = "100/@public@vhost@g@gutenberg@html@dirs@etext94@shaks12-0.txt.html"; // 65602 bytes
+  const char * second = "100/@public@vhost@g@gutenberg@html@dirs@etext94@shaks12-1.txt.html"; // 64268 bytes
+  EPUB3EntryCacheStatistics statistics;
+
+  // Off by default: every call inflates into data of its own
+  EPUB3EntryDataRef data = NULL;
+  EPUB3EntryDataRef again = NULL;
+  fail_unless(EPUB3CopyEntryData(epub, first, &data) == kEPUB3Success);
+  fail_unless(EPUB3CopyEntryData(epub, first, &again) == kEPUB3Success);
+  fail_unless(data != again);
+  fail_unless(EPUB3EntryDataGetLength(data) == 65602);
+  fail_unless(memcmp(EPUB3EntryDataGetBytes(data), EPUB3EntryDataGetBytes(again), 65602) == 0);
+  EPUB3EntryDataRelease(again);
+  EPUB3GetEntryCacheStatistics(epub, &statistics);
+  fail_unless(statistics.hits == 0 && statistics.misses == 0 && statistics.entriesCached == 0);
+
+  EPUB3SetEntryCacheByteBudget(epub, 100000);
+  EPUB3EntryDataRef cached = NULL;
+  fail_unless(EPUB3CopyEntryData(epub, first, &cached) == kEPUB3Success);
+  fail_unless(EPUB3CopyEntryData(epub, first, &again) == kEPUB3Success);
+  fail_unless(cached == again, "A repeat read should share the cached data.");
+  fail_unless(memcmp(EPUB3EntryDataGetBytes(cached), EPUB3EntryDataGetBytes(data), 65602) == 0);
+  EPUB3EntryDataRelease(again);
+  EPUB3EntryDataRelease(data);
+
+  void * buffer = NULL;
+  uint64_t bufferSize = 0;
+  fail_unless(EPUB3CopyFileIntoBuffer(epub, &buffer, &bufferSize, NULL, first) == kEPUB3Success);
+  fail_unless(bufferSize == 65602 && memcmp(buffer, EPUB3EntryDataGetBytes(cached), 65602) == 0);
+  free(buffer);
+  EPUB3GetEntryCacheStatistics(epub, &statistics);
+  fail_unless(statistics.misses == 1 && statistics.hits == 2, "%llu misses, %llu hits.",
+              (unsigned long long)statistics.misses, (unsigned long long)statistics.hits);
+  fail_unless(statistics.bytesCached == 65602 && statistics.entriesCached == 1);
+
+  // Both files don't fit, so the older one goes. Evicted data lives on while it is referenced
+  fail_unless(EPUB3CopyEntryData(epub, second, &data) == kEPUB3Success);
+  EPUB3GetEntryCacheStatistics(epub, &statistics);
+  fail_unless(statistics.evictions == 1 && statistics.entriesCached == 1 && statistics.bytesCached == 64268);
+  fail_unless(EPUB3CopyEntryData(epub, first, &again) == kEPUB3Success);
+  fail_unless(again != cached);
+  fail_unless(memcmp(EPUB3EntryDataGetBytes(cached), EPUB3EntryDataGetBytes(again), 65602) == 0);
+  EPUB3EntryDataRelease(again);
+
+  // A buffer read that misses fills the cache too, and reports what it produced either way
+  uint64_t bytesCopied = 0;
+  fail_unless(EPUB3CopyFileIntoBuffer(epub, &buffer, &bufferSize, &bytesCopied, second) == kEPUB3Success);
+  fail_unless(bufferSize == 64268 && bytesCopied == 64268);
+  fail_unless(memcmp(buffer, EPUB3EntryDataGetBytes(data), 64268) == 0);
+  free(buffer);
+  EPUB3GetEntryCacheStatistics(epub, &statistics);
+  fail_unless(statistics.entriesCached == 1 && statistics.bytesCached == 64268);
+  bytesCopied = 0;
+  fail_unless(EPUB3CopyFileIntoBuffer(epub, &buffer, &bufferSize, &bytesCopied, second) == kEPUB3Success);
+  fail_unless(bytesCopied == 64268 && memcmp(buffer, EPUB3EntryDataGetBytes(data), 64268) == 0);
+  free(buffer);
+  EPUB3EntryDataRelease(data);
+
+  EPUB3SetEntryCacheByteBudget(epub, 0);
+  EPUB3GetEntryCacheStatistics(epub, &statistics);
+  fail_unless(statistics.entriesCached == 0 && statistics.bytesCached == 0);
+  EPUB3EntryDataRelease(cached);
+}
+END_TEST
+
+#pragma mark test_epub3_spine_prefetch
+static void * EnableSpinePrefetchThread(void * argument)
+{
+  return (void *)(intptr_t)EPUB3SetSpinePrefetchCount(argument, 2);
+}
+
+START_TEST(test_epub3_spine_prefetch)
+{
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  EPUB3Error error = kEPUB3UnknownError;
+  EPUB3Ref book = EPUB3CreateWithArchiveAtPath(path, &error);
+  fail_unless(error == kEPUB3Success);
+
+  int32_t resourceCount = EPUB3CountOfSequentialResources(book);
+  fail_unless(resourceCount > 4);
+  const char * resources[resourceCount];
+  fail_unless(EPUB3GetPathsOfSequentialResources(book, resources) == kEPUB3Success);
+  char chapters[4][PATH_MAX];
+  for(int i = 0; i < 4; i++) {
+    (void)snprintf(chapters[i], sizeof(chapters[i]), "100/%s", resources[i]);
+  }
+
+  // Prefetching goes into the entry cache, so without one it does nothing
+  fail_unless(EPUB3SetSpinePrefetchCount(book, 2) == kEPUB3Success);
+  EPUB3SetEntryCacheByteBudget(book, 1024 * 1024);
+
+  EPUB3EntryDataRef data = NULL;
+  fail_unless(EPUB3CopyEntryData(book, chapters[0], &data) == kEPUB3Success);
+  EPUB3EntryDataRelease(data);
+  EPUB3SpinePrefetcherWaitUntilIdle(book);
+  EPUB3EntryCacheStatistics statistics;
+  EPUB3GetEntryCacheStatistics(book, &statistics);
+  fail_unless(statistics.misses == 1 && statistics.entriesCached == 3, "%llu misses, %u cached.",
+              (unsigned long long)statistics.misses, statistics.entriesCached);
+
+  // Turning the page hits, and queues the chapter after the prefetched ones
+  void * buffer = NULL;
+  uint64_t bufferSize = 0;
+  fail_unless(EPUB3CopyFileIntoBuffer(book, &buffer, &bufferSize, NULL, chapters[1]) == kEPUB3Success);
+  free(buffer);
+  EPUB3SpinePrefetcherWaitUntilIdle(book);
+  EPUB3GetEntryCacheStatistics(book, &statistics);
+  fail_unless(statistics.hits == 1 && statistics.misses == 1 && statistics.entriesCached == 4);
+  fail_unless(EPUB3CopyEntryData(book, chapters[3], &data) == kEPUB3Success);
+  EPUB3EntryDataRelease(data);
+  EPUB3GetEntryCacheStatistics(book, &statistics);
+  ck_assert_int_eq(statistics.hits, 2);
+
+  // Released with work queued: the worker has to stop before the book goes away
+  fail_unless(EPUB3SetSpinePrefetchCount(book, 8) == kEPUB3Success);
+  fail_unless(EPUB3CopyEntryData(book, chapters[0], &data) == kEPUB3Success);
+  EPUB3EntryDataRelease(data);
+  EPUB3Release(book);
+
+  // Turned on from several threads at once, the book still gets a single worker to stop
+  book = EPUB3CreateWithArchiveAtPath(path, &error);
+  fail_unless(error == kEPUB3Success);
+  pthread_t threads[4];
+  for(int i = 0; i < 4; i++) {
+    fail_unless(pthread_create(&threads[i], NULL, EnableSpinePrefetchThread, book) == 0);
+  }
+  for(int i = 0; i < 4; i++) {
+    void * result = NULL;
+    pthread_join(threads[i], &result);
+    fail_unless((EPUB3Error)(intptr_t)result == kEPUB3Success);
+  }
+  EPUB3Release(book);
+}
+END_TEST
+
+#pragma mark test_epub3_probe
+static void WriteProbeArchiveEntry(zipFile archive, const char * name, const char * contents, int method)
+{
+  fail_unless(zipOpenNewFileInZip(archive, name, NULL, NULL, 0, NULL, 0, NULL, method, Z_DEFAULT_COMPRESSION) == ZIP_OK);
+  fail_unless(zipWriteInFileInZip(archive, contents, (unsigned)strlen(contents)) == ZIP_OK);
+  fail_unless(zipCloseFileInZip(archive) == ZIP_OK);
+}
+
+typedef struct {
+  uint32_t count;
+  size_t longestName;
+} ArchiveEntryTally;
+
+static EPUB3Bool CountArchiveEntry(const EPUB3ArchiveEntryInfo * info, void * context)
+{
+  ArchiveEntryTally * tally = context;
+  tally->count++;
+  if(strlen(info->name) > tally->longestName) tally->longestName = strlen(info->name);
+  return kEPUB3_YES;
+}
+
+START_TEST(test_epub3_probe)
+{
+  EPUB3ProbeResult result;
+  TEST_PATH_VAR_FOR_FILENAME(pg100Path, "pg100.epub");
+  EPUB3Error error = EPUB3Probe(pg100Path, &result);
+  fail_unless(error == kEPUB3Success, "Unable to probe %s (error %d).", pg100Path, error);
+  ck_assert_int_eq(result.fileCount, 117);
+  ck_assert_int_eq(result.versionMajor, 2);
+  ck_assert_int_eq(result.versionMinor, 0);
+  fail_if(result.hasEncryption);
+  ck_assert_str_eq(result.title, "The Complete Works of William Shakespeare");
+
+  TEST_PATH_VAR_FOR_FILENAME(zip64Path, "zip64.epub");
+  fail_unless(EPUB3Probe(zip64Path, &result) == kEPUB3Success);
+  ck_assert_int_eq(result.fileCount, 4);
+  ck_assert_int_eq(result.versionMajor, 3);
+  ck_assert_str_eq(result.title, "A ZIP64 Book");
+
+  // A lone, wrong mimetype: the probe rejects it but still counts the files
+  TEST_PATH_VAR_FOR_FILENAME(badPath, "bad_metadata.epub");
+  error = EPUB3Probe(badPath, &result);
+  ck_assert_int_eq(error, kEPUB3InvalidMimetypeError);
+  ck_assert_int_eq(result.fileCount, 1);
+
+  TEST_PATH_VAR_FOR_FILENAME(coverPath, "pg100_cover.jpg");
+  error = EPUB3Probe(coverPath, &result);
+  ck_assert_int_eq(error, kEPUB3ArchiveUnavailableError);
+
+  // Deflated metadata with entities, a namespace prefix on the package and an encryption manifest
+  char path[] = "/tmp/epub3-probe-XXXXXX";
+  int fd = mkstemp(path);
+  fail_unless(fd >= 0);
+  close(fd);
+  zipFile archive = zipOpen(path, APPEND_STATUS_CREATE);
+  fail_unless(archive != NULL);
+  WriteProbeArchiveEntry(archive, "mimetype", "application/epub+zip", 0);
+  WriteProbeArchiveEntry(archive, "META-INF/container.xml",
+                         "<?xml version=\"1.0\"?>\n<!-- <rootfile full-path=\"wrong.opf\"/> -->\n"
+                         "<container version=\"1.0\" xmlns=\"urn:oasis:names:tc:opendocument:xmlns:container\">"
+                         "<rootfiles><rootfile media-type=\"application/oebps-package+xml\" full-path = 'OPS/book.opf'/></rootfiles></container>",
+                         Z_DEFLATED);
+  WriteProbeArchiveEntry(archive, "META-INF/encryption.xml", "<encryption xmlns=\"urn:oasis:names:tc:opendocument:xmlns:container\"/>", Z_DEFLATED);
+  // Too long for the probe's name buffer, but still listed in full
+  char longName[600];
+  memset(longName, 'a', sizeof(longName) - 1);
+  longName[sizeof(longName) - 1] = '\0';
+  WriteProbeArchiveEntry(archive, longName, "long", 0);
+  WriteProbeArchiveEntry(archive, "OPS/book.opf",
+                         "<?xml version=\"1.0\"?>\n<opf:package xmlns:opf=\"http://www.idpf.org/2007/opf\" version=\"3.1\">"
+                         "<opf:metadata xmlns:dc=\"http://purl.org/dc/elements/1.1/\"><dc:identifier>x</dc:identifier>"
+                         "<dc:title>\n  Tom &amp; Jerry &#x2014; &#233;t&#xe9;\n</dc:title><dc:title>Second</dc:title></opf:metadata>"
+                         "<opf:manifest/></opf:package>",
+                         Z_DEFLATED);
+  fail_unless(zipClose(archive, NULL) == ZIP_OK);
+
+  error = EPUB3Probe(path, &result);
+  ArchiveEntryTally tally = { 0, 0 };
+  EPUB3Error enumerateError = EPUB3EnumerateArchiveEntriesAtPath(path, CountArchiveEntry, &tally);
+  unlink(path);
+  fail_unless(error == kEPUB3Success, "Unable to probe the generated book (error %d).", error);
+  ck_assert_int_eq(enumerateError, kEPUB3Success);
+  ck_assert_int_eq(tally.count, 5);
+  ck_assert_int_eq(tally.longestName, sizeof(longName) - 1);
+  ck_assert_int_eq(result.fileCount, 5);
+  ck_assert_int_eq(result.versionMajor, 3);
+  ck_assert_int_eq(result.versionMinor, 1);
+  fail_unless(result.hasEncryption);
+  ck_assert_str_eq(result.title, "Tom & Jerry \xe2\x80\x94 \xc3\xa9t\xc3\xa9");
+}
+END_TEST
+
+#pragma mark -
+#pragma mark test_epub3_writer
+START_TEST(test_epub3_writer)
+{
+  char path[] = "/tmp/epub3-writer-XXXXXX";
+  int fd = mkstemp(path);
+  fail_unless(fd >= 0);
+  close(fd);
+
+  EPUB3Error error = kEPUB3UnknownError;
+  EPUB3WriterRef writer = EPUB3WriterCreateAtPath(path, 4, &error);
+  fail_unless(error == kEPUB3Success && writer != NULL);
+  ck_assert_int_eq(EPUB3WriterAddFile(writer, "mimetype", "text/plain", 10, kEPUB3_YES), kEPUB3InvalidArgumentError);
+  ck_assert_int_eq(EPUB3WriterAddFile(writer, "/OPS/book.opf", "", 0, kEPUB3_YES), kEPUB3InvalidArgumentError);
+
+  // Repackage the book, every file deflated
+  for(uint32_t i = 1; i < epub->archiveIndex->entryCount; i++) {
+    const char * filename = epub->archiveIndex->entries[i].filename;
+    void * buffer = NULL;
+    uint64_t bufferSize = 0;
+    fail_unless(EPUB3CopyFileIntoBuffer(epub, &buffer, &bufferSize, NULL, filename) == kEPUB3Success);
+    error = EPUB3WriterAddFile(writer, filename, buffer, bufferSize, kEPUB3_YES);
+    free(buffer);
+    fail_unless(error == kEPUB3Success, "Unable to add %s (error %d).", filename, error);
+  }
+
+  // Chunk boundaries: a file spanning several chunks, one ending exactly on a boundary, a stored one and an empty one
+  uint32_t largeSize = WRITER_CHUNK_SIZE * 5 + 4321;
+  uint8_t * large = malloc(largeSize);
+  uint32_t seed = 1;
+  for(uint32_t i = 0; i < largeSize; i++) {
+    seed = seed * 1103515245U + 12345U;
+    large[i] = (i / 4096) % 3 == 0 ? (uint8_t)(seed >> 24) : (uint8_t)("lorem ipsum "[i % 12]);
+  }
+  fail_unless(EPUB3WriterAddFile(writer, "extra/large.bin", large, largeSize, kEPUB3_YES) == kEPUB3Success);
+  fail_unless(EPUB3WriterAddFile(writer, "extra/exact.bin", large, WRITER_CHUNK_SIZE * 2, kEPUB3_YES) == kEPUB3Success);
+  fail_unless(EPUB3WriterAddFile(writer, "extra/stored.bin", large, largeSize, kEPUB3_NO) == kEPUB3Success);
+  fail_unless(EPUB3WriterAddFile(writer, "extra/empty.txt", NULL, 0, kEPUB3_YES) == kEPUB3Success);
+  error = EPUB3WriterClose(writer);
+  fail_unless(error == kEPUB3Success, "Unable to close the writer (error %d).", error);
+
+  // OCF: the mimetype is the first local header, stored, with no extra field
+  FILE * file = fopen(path, "rb");
+  fail_unless(file != NULL);
+  uint8_t header[ZIP_LOCAL_HEADER_SIZE + 28];
+  fail_unless(fread(header, 1, sizeof(header), file) == sizeof(header));
+  fclose(file);
+  ck_assert_int_eq(header[8] | header[9] << 8, 0);
+  ck_assert_int_eq(header[26] | header[27] << 8, 8);
+  ck_assert_int_eq(header[28] | header[29] << 8, 0);
+  fail_unless(memcmp(header + ZIP_LOCAL_HEADER_SIZE, "mimetypeapplication/epub+zip", 28) == 0);
+
+  EPUB3Ref copy = EPUB3CreateWithArchiveAtPath(path, &error);
+  fail_unless(error == kEPUB3Success, "Unable to open the written book (error %d).", error);
+  ck_assert_int_eq(copy->archiveIndex->entryCount, epub->archiveIndex->entryCount + 4);
+  ck_assert_str_eq(copy->metadata->title, "The Complete Works of William Shakespeare");
+  for(uint32_t i = 1; i < epub->archiveIndex->entryCount; i++) {
+    const char * filename = epub->archiveIndex->entries[i].filename;
+    ck_assert_str_eq(copy->archiveIndex->entries[i].filename, filename);
+    void * expected = NULL;
+    void * actual = NULL;
+    uint64_t expectedSize = 0;
+    uint64_t actualSize = 0;
+    fail_unless(EPUB3CopyFileIntoBuffer(epub, &expected, &expectedSize, NULL, filename) == kEPUB3Success);
+    fail_unless(EPUB3CopyFileIntoBuffer(copy, &actual, &actualSize, NULL, filename) == kEPUB3Success, "%s did not read back.", filename);
+    fail_unless(expectedSize == actualSize && memcmp(expected, actual, actualSize) == 0, "%s changed.", filename);
+    free(expected);
+    free(actual);
+  }
+  const char * extras[] = { "extra/large.bin", "extra/exact.bin", "extra/stored.bin" };
+  const uint32_t extraSizes[] = { largeSize, WRITER_CHUNK_SIZE * 2, largeSize };
+  for(int i = 0; i < 3; i++) {
+    void * actual = NULL;
+    uint64_t actualSize = 0;
+    fail_unless(EPUB3CopyFileIntoBuffer(copy, &actual, &actualSize, NULL, extras[i]) == kEPUB3Success, "%s did not read back.", extras[i]);
+    fail_unless(actualSize == extraSizes[i] && memcmp(large, actual, actualSize) == 0, "%s changed.", extras[i]);
+    free(actual);
+  }
+  EPUB3ArchiveEntryPtr stored = EPUB3ArchiveIndexFindEntry(copy->archiveIndex, "extra/stored.bin");
+  ck_assert_int_eq(stored->compressionMethod, 0);
+  EPUB3ArchiveEntryPtr empty = EPUB3ArchiveIndexFindEntry(copy->archiveIndex, "extra/empty.txt");
+  fail_unless(empty != NULL && empty->uncompressedSize == 0);
+  EPUB3Release(copy);
+  free(large);
+  unlink(path);
+
+  // A writer that cannot create its file fails up front
+  writer = EPUB3WriterCreateAtPath("/nonexistent-directory/book.epub", 0, &error);
+  fail_unless(writer == NULL);
+  ck_assert_int_eq(error, kEPUB3ArchiveUnavailableError);
+}
+END_TEST
+
+#pragma mark -
+#pragma mark test_epub3_optimize_archive
+START_TEST(test_epub3_optimize_archive)
+{
+  TEST_PATH_VAR_FOR_FILENAME(pg100Path, "pg100.epub");
+  EPUB3Error error = kEPUB3UnknownError;
+  EPUB3Ref book = EPUB3CreateWithArchiveAtPath(pg100Path, &error);
+  fail_unless(error == kEPUB3Success);
+  char path[] = "/tmp/epub3-optimize-XXXXXX";
+  int fd = mkstemp(path);
+  fail_unless(fd >= 0);
+  close(fd);
+
+  fail_unless(EPUB3OptimizeArchiveToPath(book, pg100Path, 0, NULL, NULL) == kEPUB3InvalidArgumentError);
+
+  // pg100 stores its chapters in name order (0, 1, 10, 100, ...), not spine order, and deflates its cover
+  EPUB3ReadCost before;
+  EPUB3ReadCost after;
+  error = EPUB3OptimizeArchiveToPath(book, path, 0, &before, &after);
+  fail_unless(error == kEPUB3Success, "Unable to optimize %s (error %d).", pg100Path, error);
+  ck_assert_int_eq(before.spineSeeks, 19);
+  fail_unless(before.spineSeekDistance > 0);
+  ck_assert_int_eq(after.spineSeeks, 0);
+  fail_unless(after.spineSeekDistance == 0);
+  fail_unless(after.bytesInflated == before.bytesInflated - 19263);
+
+  EPUB3Ref optimized = EPUB3CreateWithArchiveAtPath(path, &error);
+  fail_unless(error == kEPUB3Success);
+  EPUB3ArchiveIndexPtr index = optimized->archiveIndex;
+  ck_assert_int_eq(index->entryCount, 117);
+  ck_assert_str_eq(index->entries[0].filename, "mimetype");
+  ck_assert_str_eq(index->entries[1].filename, "META-INF/container.xml");
+  ck_assert_str_eq(index->entries[2].filename, "META-INF/");
+  ck_assert_str_eq(index->entries[3].filename, "100/content.opf");
+  ck_assert_str_eq(index->entries[4].filename, "100/wrap0000.html"); // the non-linear cover page leads the spine
+  ck_assert_str_eq(index->entries[5].filename, "100/@public@vhost@g@gutenberg@html@dirs@etext94@shaks12-0.txt.html");
+  ck_assert_str_eq(index->entries[6].filename, "100/@public@vhost@g@gutenberg@html@dirs@etext94@shaks12-1.txt.html");
+  EPUB3ArchiveEntryPtr cover = EPUB3ArchiveIndexFindEntry(index, "100/cover.jpg");
+  ck_assert_int_eq(cover->compressionMethod, 0);
+  EPUB3ArchiveEntryPtr css = EPUB3ArchiveIndexFindEntry(index, "100/pgepub.css");
+  ck_assert_int_eq(css->compressionMethod, Z_DEFLATED);
+  void * original = NULL;
+  void * copy = NULL;
+  uint64_t originalSize = 0;
+  uint64_t copySize = 0;
+  fail_unless(EPUB3CopyCoverImage(book, &original, &originalSize) == kEPUB3Success);
+  fail_unless(EPUB3CopyCoverImage(optimized, &copy, &copySize) == kEPUB3Success);
+  fail_unless(originalSize == copySize && memcmp(original, copy, copySize) == 0);
+  free(original);
+  free(copy);
+  EPUB3Release(optimized);
+  EPUB3Release(book);
+  unlink(path);
+
+  fail_unless(EPUB3ShouldDeflateEntry("application/xhtml+xml", "a.xhtml"));
+  fail_unless(EPUB3ShouldDeflateEntry("image/svg+xml", "a.svg"));
+  fail_if(EPUB3ShouldDeflateEntry("audio/mpeg", "a.mp3"));
+  fail_if(EPUB3ShouldDeflateEntry(NULL, "images/A.JPG"));
+  fail_unless(EPUB3ShouldDeflateEntry(NULL, "fonts.v2/LICENSE"));
+}
+END_TEST
+
+#pragma mark -
+#pragma mark test_epub3_repackage_archives
+static void WriteRepackageTestBook(const char * path, EPUB3Bool withEncryption)
+{
+  zipFile archive = zipOpen(path, APPEND_STATUS_CREATE);
+  fail_unless(archive != NULL);
+  WriteProbeArchiveEntry(archive, "mimetype", "application/epub+zip", 0);
+  WriteProbeArchiveEntry(archive, "META-INF/container.xml",
+                         "<?xml version=\"1.0\"?>\n<container version=\"1.0\" xmlns=\"urn:oasis:names:tc:opendocument:xmlns:container\">"
+                         "<rootfiles><rootfile media-type=\"application/oebps-package+xml\" full-path=\"OPS/book.opf\"/></rootfiles></container>",
+                         Z_DEFLATED);
+  if(withEncryption) {
+    WriteProbeArchiveEntry(archive, "META-INF/encryption.xml",
+                           "<encryption xmlns=\"urn:oasis:names:tc:opendocument:xmlns:container\" xmlns:enc=\"http://www.w3.org/2001/04/xmlenc#\">"
+                           "<enc:EncryptedData><enc:EncryptionMethod Algorithm=\"http://www.idpf.org/2008/embedding\"/>"
+                           "<enc:CipherData><enc:CipherReference URI=\"OPS/record.xml\"/></enc:CipherData></enc:EncryptedData></encryption>",
+                           Z_DEFLATED);
+  }
+  WriteProbeArchiveEntry(archive, "OPS/book.opf",
+                         "<?xml version=\"1.0\"?>\n<package xmlns=\"http://www.idpf.org/2007/opf\" version=\"3.0\" unique-identifier=\"uid\" xml:lang=\"en\">"
+                         "<metadata xmlns:dc=\"http://purl.org/dc/elements/1.1/\"><dc:identifier id=\"uid\">urn:example:fonts</dc:identifier>"
+                         "<dc:title id=\"t1\">Fonts</dc:title><meta refines=\"#t1\" property=\"title-type\">main</meta>"
+                         "<dc:title id=\"t2\">Subtitle</dc:title><dc:language>en</dc:language><dc:creator>Someone</dc:creator>"
+                         "<meta property=\"dcterms:modified\">2000-01-01T00:00:00Z</meta>"
+                         "<meta refines=\"#text\" property=\"media:duration\">0:01:00</meta>"
+                         "<link rel=\"record\" href=\"record.xml\" media-type=\"application/xml\"/></metadata>"
+                         "<manifest><item id=\"text\" href=\"text.xhtml\" media-type=\"application/xhtml+xml\" properties=\"scripted\"/>"
+                         "<item id=\"record\" href=\"record.xml\" media-type=\"application/xml\"/></manifest>"
+                         "<spine page-progression-direction=\"rtl\"><itemref idref=\"text\" properties=\"page-spread-right\"/></spine></package>",
+                         Z_DEFLATED);
+  WriteProbeArchiveEntry(archive, "OPS/text.xhtml", "<html xmlns=\"http://www.w3.org/1999/xhtml\"><head><title>Fonts</title></head><body/></html>", Z_DEFLATED);
+  WriteProbeArchiveEntry(archive, "OPS/record.xml", "<record/>", Z_DEFLATED);
+  fail_unless(zipClose(archive, NULL) == ZIP_OK);
+}
+
+static char * CopyRepackagedPackage(const char * path)
+{
+  EPUB3Ref repackaged = EPUB3Create();
+  fail_unless(EPUB3PrepareArchiveAtPath(repackaged, path) == kEPUB3Success);
+  void * buffer = NULL;
+  uint64_t bufferSize = 0;
+  fail_unless(EPUB3CopyFileIntoBuffer(repackaged, &buffer, &bufferSize, NULL, "content.opf") == kEPUB3Success);
+  EPUB3Release(repackaged);
+  char * package = realloc(buffer, (size_t)bufferSize + 1);
+  package[bufferSize] = '\0';
+  return package;
+}
+
+START_TEST(test_epub3_repackage_archives)
+{
+  TEST_PATH_VAR_FOR_FILENAME(pg100Path, "pg100.epub");
+  EPUB3Error error = kEPUB3UnknownError;
+  EPUB3Ref book = EPUB3CreateWithArchiveAtPath(pg100Path, &error);
+  fail_unless(error == kEPUB3Success);
+  char path[] = "/tmp/epub3-repackage-XXXXXX";
+  int fd = mkstemp(path);
+  fail_unless(fd >= 0);
+  close(fd);
+  char boxSetPath[] = "/tmp/epub3-box-set-XXXXXX";
+  fd = mkstemp(boxSetPath);
+  fail_unless(fd >= 0);
+  close(fd);
+
+  EPUB3RepackagePart bad = { book, 0, 200 };
+  fail_unless(EPUB3RepackageArchivesToPath(&bad, 1, NULL, NULL, path, 0) == kEPUB3InvalidArgumentError);
+  bad.spineItemCount = 0;
+  fail_unless(EPUB3RepackageArchivesToPath(&bad, 1, NULL, NULL, pg100Path, 0) == kEPUB3InvalidArgumentError);
+
+  // Three chapters split out as a volume, after the non-linear cover page
+  EPUB3RepackagePart volume = { book, 1, 3 };
+  error = EPUB3RepackageArchivesToPath(&volume, 1, "Volume One", NULL, path, 0);
+  fail_unless(error == kEPUB3Success, "Unable to split %s (error %d).", pg100Path, error);
+  EPUB3Ref split = EPUB3CreateWithArchiveAtPath(path, &error);
+  fail_unless(error == kEPUB3Success);
+  char * title = EPUB3CopyTitle(split);
+  ck_assert_str_eq(title, "Volume One");
+  free(title);
+  char * identifier = EPUB3CopyIdentifier(split);
+  ck_assert_str_eq(identifier, book->metadata->identifier);
+  free(identifier);
+  ck_assert_int_eq(split->spine->itemCount, 3);
+  ck_assert_int_eq(EPUB3CountOfSequentialResources(split), 3);
+  fail_unless(EPUB3CountOfTocRootItems(split) > 0);
+  fail_unless(EPUB3CountOfTocRootItems(split) < EPUB3CountOfTocRootItems(book));
+
+  EPUB3ArchiveIndexPtr index = split->archiveIndex;
+  ck_assert_str_eq(index->entries[0].filename, "mimetype");
+  ck_assert_str_eq(index->entries[1].filename, "META-INF/container.xml");
+  ck_assert_str_eq(index->entries[2].filename, "content.opf");
+  ck_assert_str_eq(index->entries[3].filename, "toc.ncx");
+  ck_assert_str_eq(index->entries[4].filename, "100/@public@vhost@g@gutenberg@html@dirs@etext94@shaks12-0.txt.html");
+  fail_unless(EPUB3ArchiveIndexFindEntry(index, "100/@public@vhost@g@gutenberg@html@dirs@etext94@shaks12-3.txt.html") == NULL);
+  fail_unless(EPUB3ArchiveIndexFindEntry(index, "100/wrap0000.html") == NULL);
+  fail_unless(EPUB3ArchiveIndexFindEntry(index, "100/toc.ncx") == NULL);
+  fail_unless(EPUB3ArchiveIndexFindEntry(index, "100/content.opf") == NULL);
+  // Copied files keep their compressed bytes, so their sizes and CRCs
+  for(uint32_t i = 4; i < index->entryCount; i++) {
+    EPUB3ArchiveEntryPtr copy = &index->entries[i];
+    EPUB3ArchiveEntryPtr original = EPUB3ArchiveIndexFindEntry(book->archiveIndex, copy->filename);
+    fail_unless(original != NULL, "%s is not in the original.", copy->filename);
+    fail_unless(original->crc == copy->crc && original->compressedSize == copy->compressedSize && original->compressionMethod == copy->compressionMethod);
+  }
+  void * original = NULL;
+  void * copy = NULL;
+  uint64_t originalSize = 0;
+  uint64_t copySize = 0;
+  fail_unless(EPUB3CopyCoverImage(book, &original, &originalSize) == kEPUB3Success);
+  fail_unless(EPUB3CopyCoverImage(split, &copy, &copySize) == kEPUB3Success);
+  fail_unless(originalSize == copySize && memcmp(original, copy, copySize) == 0);
+  free(copy);
+
+  // The whole book and the volume as a box set
+  EPUB3RepackagePart boxSet[] = { { book, 0, 0 }, { split, 0, 0 } };
+  error = EPUB3RepackageArchivesToPath(boxSet, 2, "Box Set", "urn:example:box-set", boxSetPath, 2);
+  fail_unless(error == kEPUB3Success, "Unable to merge (error %d).", error);
+  EPUB3Ref merged = EPUB3CreateWithArchiveAtPath(boxSetPath, &error);
+  fail_unless(error == kEPUB3Success);
+  identifier = EPUB3CopyIdentifier(merged);
+  ck_assert_str_eq(identifier, "urn:example:box-set");
+  free(identifier);
+  ck_assert_int_eq(merged->spine->itemCount, book->spine->itemCount + 3);
+  fail_unless(EPUB3ArchiveIndexFindEntry(merged->archiveIndex, "part1/100/cover.jpg") != NULL);
+  fail_unless(EPUB3ArchiveIndexFindEntry(merged->archiveIndex, "part2/100/@public@vhost@g@gutenberg@html@dirs@etext94@shaks12-2.txt.html") != NULL);
+  ck_assert_int_eq(EPUB3CountOfTocRootItems(merged), EPUB3CountOfTocRootItems(book) + EPUB3CountOfTocRootItems(split) + 2);
+  fail_unless(EPUB3CopyCoverImage(merged, &copy, &copySize) == kEPUB3Success);
+  fail_unless(originalSize == copySize && memcmp(original, copy, copySize) == 0);
+  free(copy);
+  EPUB3Release(merged);
+
+  // A single file copied raw into a new archive
+  EPUB3WriterRef writer = EPUB3WriterCreateAtPath(boxSetPath, 1, &error);
+  fail_unless(error == kEPUB3Success);
+  fail_unless(EPUB3WriterAddFileFromArchive(writer, "cover.jpg", split, "doesnotexist") == kEPUB3FileNotFoundInArchiveError);
+  fail_unless(EPUB3WriterAddFileFromArchive(writer, "mimetype", split, "mimetype") == kEPUB3InvalidArgumentError);
+  fail_unless(EPUB3WriterAddFileFromArchive(writer, "cover.jpg", split, "100/cover.jpg") == kEPUB3Success);
+  EPUB3Release(split);
+  fail_unless(EPUB3WriterClose(writer) == kEPUB3Success);
+  EPUB3Ref single = EPUB3Create();
+  fail_unless(EPUB3PrepareArchiveAtPath(single, boxSetPath) == kEPUB3Success);
+  error = EPUB3CopyFileIntoBuffer(single, &copy, &copySize, NULL, "cover.jpg");
+  fail_unless(error == kEPUB3Success);
+  fail_unless(originalSize == copySize && memcmp(original, copy, copySize) == 0);
+  free(copy);
+  EPUB3Release(single);
+
+  // An EPUB 3 book keeps all of its metadata, renamed along with its files, and its itemref properties
+  WriteRepackageTestBook(path, kEPUB3_NO);
+  EPUB3Ref book3 = EPUB3CreateWithArchiveAtPath(path, &error);
+  fail_unless(error == kEPUB3Success, "Unable to open the generated book (error %d).", error);
+  EPUB3RepackagePart book3Part = { book3, 0, 0 };
+  error = EPUB3RepackageArchivesToPath(&book3Part, 1, "Retitled", NULL, boxSetPath, 0);
+  fail_unless(error == kEPUB3Success, "Unable to repackage the generated book (error %d).", error);
+  char * package = CopyRepackagedPackage(boxSetPath);
+  fail_unless(strstr(package, "version=\"3.0\"") != NULL && strstr(package, "unique-identifier=\"uid\"") != NULL);
+  fail_unless(strstr(package, "<dc:creator>Someone</dc:creator>") != NULL);
+  fail_unless(strstr(package, "<dc:title id=\"t1\">Retitled</dc:title>") != NULL && strstr(package, "Subtitle") == NULL);
+  fail_unless(strstr(package, "title-type") == NULL && strstr(package, "2000-01-01") == NULL);
+  fail_unless(strstr(package, "refines=\"#text\"") != NULL && strstr(package, "href=\"OPS/record.xml\"") != NULL);
+  fail_unless(strstr(package, "<itemref idref=\"text\" properties=\"page-spread-right\"/>") != NULL);
+  fail_unless(strstr(package, "page-progression-direction=\"rtl\"") != NULL && strstr(package, "properties=\"scripted\"") != NULL);
+  free(package);
+
+  // First in a box set its ids and files move; behind an EPUB 2 book it loses what EPUB 2 can't say
+  EPUB3RepackagePart mixed[] = { { book3, 0, 0 }, { book, 1, 1 } };
+  fail_unless(EPUB3RepackageArchivesToPath(mixed, 2, NULL, NULL, boxSetPath, 0) == kEPUB3Success);
+  package = CopyRepackagedPackage(boxSetPath);
+  fail_unless(strstr(package, "<dc:title id=\"t1\">Fonts</dc:title>") != NULL && strstr(package, "Subtitle") != NULL);
+  fail_unless(strstr(package, "refines=\"#p1-text\"") != NULL && strstr(package, "href=\"part1/OPS/record.xml\"") != NULL);
+  free(package);
+  mixed[0] = (EPUB3RepackagePart){ book, 1, 1 };
+  mixed[1] = (EPUB3RepackagePart){ book3, 0, 0 };
+  fail_unless(EPUB3RepackageArchivesToPath(mixed, 2, NULL, NULL, boxSetPath, 0) == kEPUB3Success);
+  package = CopyRepackagedPackage(boxSetPath);
+  fail_unless(strstr(package, "version=\"2.0\"") != NULL && strstr(package, "properties=") == NULL);
+  fail_unless(strstr(package, "page-progression-direction") == NULL && strstr(package, "nav.xhtml") == NULL);
+  fail_unless(strstr(package, "<meta content=\"p1-item2\" name=\"cover\"/>") != NULL);
+  free(package);
+  EPUB3Release(book3);
+
+  // A book with obfuscated fonts can't be taken apart
+  WriteRepackageTestBook(path, kEPUB3_YES);
+  EPUB3Ref fonts = EPUB3CreateWithArchiveAtPath(path, &error);
+  fail_unless(error == kEPUB3Success, "Unable to open the generated book (error %d).", error);
+  EPUB3RepackagePart fontsPart = { fonts, 0, 0 };
+  ck_assert_int_eq(EPUB3RepackageArchivesToPath(&fontsPart, 1, NULL, NULL, boxSetPath, 0), kEPUB3FileEncodingNotSupportedError);
+  EPUB3Release(fonts);
+
+  free(original);
+  EPUB3Release(book);
+  unlink(path);
+  unlink(boxSetPath);
+}
+END_TEST
+
+#pragma mark -
+#pragma mark test_epub3_ingest_stream
+typedef struct IngestRecord {
+  uint32_t fileCount;
+  uint32_t lastCount;
+  uint64_t byteCount;
+  EPUB3Bool skipFiles;
+} IngestRecord;
+
+static EPUB3Bool RecordIngestedFile(const char * path, const void * bytes, uint32_t length, EPUB3Bool last, void * context)
+{
+  IngestRecord * record = context;
+  if(last) {
+    record->lastCount++;
+  } else {
+    record->byteCount += length;
+  }
+  return !record->skipFiles;
+}
+
+static uint8_t * CopyBytesOfFile(const char * path, size_t * byteCount)
+{
+  struct stat st;
+  fail_unless(stat(path, &st) == 0, "Error stat'ing %s", path);
+  *byteCount = (size_t)st.st_size;
+  uint8_t * bytes = malloc(*byteCount);
+  FILE * fp = fopen(path, "rb");
+  size_t bytesRead = fread(bytes, 1, *byteCount, fp);
+  fclose(fp);
+  ck_assert_int_eq(bytesRead, *byteCount);
+  return bytes;
+}
+
+START_TEST(test_epub3_ingest_stream)
+{
+  // pg100 has its OPF near the end, so stream it rewritten with the container and OPF first
+  TEST_PATH_VAR_FOR_FILENAME(pg100Path, "pg100.epub");
+  char path[] = "/tmp/epub3-ingest-XXXXXX";
+  int fd = mkstemp(path);
+  fail_unless(fd >= 0);
+  close(fd);
+  EPUB3Error error = kEPUB3UnknownError;
+  EPUB3Ref original = EPUB3CreateWithArchiveAtPath(pg100Path, &error);
+  fail_unless(error == kEPUB3Success);
+  fail_unless(EPUB3OptimizeArchiveToPath(original, path, 0, NULL, NULL) == kEPUB3Success);
+  EPUB3Release(original);
+  size_t byteCount = 0;
+  uint8_t * bytes = CopyBytesOfFile(path, &byteCount);
+
+  // Odd sized chunks, as an upload would arrive, without a spool
+  IngestRecord record = { 0, 0, 0, kEPUB3_NO };
+  EPUB3IngestRef ingest = EPUB3IngestCreate(NULL, RecordIngestedFile, &record, &error);
+  fail_unless(error == kEPUB3Success);
+  size_t bookOffset = 0;
+  for(size_t offset = 0; offset < byteCount; offset += 4093) {
+    size_t length = byteCount - offset < 4093 ? byteCount - offset : 4093;
+    error = EPUB3IngestWrite(ingest, bytes + offset, length);
+    fail_unless(error == kEPUB3Success, "Unable to ingest at %zu (error %d).", offset, error);
+    if(bookOffset == 0 && EPUB3IngestGetBook(ingest) != NULL) {
+      bookOffset = offset + length;
+    }
+  }
+  // The metadata is there long before the upload is
+  fail_unless(bookOffset > 0 && bookOffset < byteCount / 100, "The book only arrived at %zu of %zu.", bookOffset, byteCount);
+  // Every file; directories are not written by the optimizer
+  ck_assert_int_eq(record.lastCount, 115);
+  ck_assert_int_eq(record.byteCount, 6987038);
+  EPUB3Ref book = NULL;
+  fail_unless(EPUB3IngestClose(ingest, &book) == kEPUB3Success);
+  fail_unless(book != NULL);
+  char * title = EPUB3CopyTitle(book);
+  ck_assert_str_eq(title, "The Complete Works of William Shakespeare");
+  free(title);
+  ck_assert_int_eq(book->spine->itemCount, 109);
+  fail_unless(EPUB3CountOfTocRootItems(book) > 0);
+  EPUB3Release(book);
+
+  // A stream that stops before the central directory
+  ingest = EPUB3IngestCreate(NULL, NULL, NULL, &error);
+  fail_unless(error == kEPUB3Success);
+  fail_unless(EPUB3IngestWrite(ingest, bytes, byteCount / 2) == kEPUB3Success);
+  fail_unless(EPUB3IngestGetBook(ingest) != NULL);
+  book = NULL;
+  fail_unless(EPUB3IngestClose(ingest, &book) == kEPUB3FileReadFromArchiveError);
+  fail_unless(book == NULL);
+  free(bytes);
+
+  // pg100 as it is, spooled to a file that is then opened as usual, with every file skipped after its first bytes
+  bytes = CopyBytesOfFile(pg100Path, &byteCount);
+  record = (IngestRecord){ 0, 0, 0, kEPUB3_YES };
+  ingest = EPUB3IngestCreate(path, RecordIngestedFile, &record, &error);
+  fail_unless(error == kEPUB3Success);
+  for(size_t offset = 0; offset < byteCount; offset += 65537) {
+    size_t length = byteCount - offset < 65537 ? byteCount - offset : 65537;
+    fail_unless(EPUB3IngestWrite(ingest, bytes + offset, length) == kEPUB3Success);
+  }
+  fail_unless(EPUB3IngestGetBook(ingest) != NULL);
+  fail_unless(EPUB3CountOfTocRootItems(EPUB3IngestGetBook(ingest)) > 0);
+  ck_assert_int_eq(record.lastCount, 0);
+  fail_unless(record.byteCount > 0 && record.byteCount < 6987038);
+  book = NULL;
+  error = EPUB3IngestClose(ingest, &book);
+  fail_unless(error == kEPUB3Success, "Unable to open the spool (error %d).", error);
+  ck_assert_int_eq(book->archiveIndex->entryCount, 117);
+  title = EPUB3CopyTitle(book);
+  ck_assert_str_eq(title, "The Complete Works of William Shakespeare");
+  free(title);
+  EPUB3Release(book);
+  free(bytes);
+
+  // Would-be OPFs ahead of the container are held on to, but only so many
+  zipFile archive = zipOpen(path, APPEND_STATUS_CREATE);
+  fail_unless(archive != NULL);
+  WriteProbeArchiveEntry(archive, "mimetype", "application/epub+zip", 0);
+  for(int i = 0; i <= 16; i++) {
+    char name[32];
+    (void)snprintf(name, sizeof(name), "decoy%d.opf", i);
+    WriteProbeArchiveEntry(archive, name, "<package/>", Z_DEFLATED);
+  }
+  fail_unless(zipClose(archive, NULL) == ZIP_OK);
+  bytes = CopyBytesOfFile(path, &byteCount);
+  ingest = EPUB3IngestCreate(NULL, NULL, NULL, &error);
+  ck_assert_int_eq(EPUB3IngestWrite(ingest, bytes, byteCount), kEPUB3XMLReadFromBufferError);
+  (void)EPUB3IngestClose(ingest, NULL);
+  free(bytes);
+
+  // An NCX that arrives before the OPF names it is not kept
+  archive = zipOpen(path, APPEND_STATUS_CREATE);
+  fail_unless(archive != NULL);
+  WriteProbeArchiveEntry(archive, "mimetype", "application/epub+zip", 0);
+  WriteProbeArchiveEntry(archive, "decoy.opf", "<package/>", Z_DEFLATED);
+  WriteProbeArchiveEntry(archive, "toc.ncx",
+                         "<ncx xmlns=\"http://www.daisy.org/z3986/2005/ncx/\" version=\"2005-1\"><navMap><navPoint id=\"n\" playOrder=\"1\">"
+                         "<navLabel><text>Text</text></navLabel><content src=\"text.xhtml\"/></navPoint></navMap></ncx>",
+                         Z_DEFLATED);
+  WriteProbeArchiveEntry(archive, "META-INF/container.xml",
+                         "<?xml version=\"1.0\"?>\n<container version=\"1.0\" xmlns=\"urn:oasis:names:tc:opendocument:xmlns:container\">"
+                         "<rootfiles><rootfile media-type=\"application/oebps-package+xml\" full-path=\"book.opf\"/></rootfiles></container>",
+                         Z_DEFLATED);
+  WriteProbeArchiveEntry(archive, "book.opf",
+                         "<?xml version=\"1.0\"?>\n<package xmlns=\"http://www.idpf.org/2007/opf\" version=\"2.0\" unique-identifier=\"id\">"
+                         "<metadata xmlns:dc=\"http://purl.org/dc/elements/1.1/\"><dc:identifier id=\"id\">urn:example:late</dc:identifier>"
+                         "<dc:title>Late</dc:title><dc:language>en</dc:language></metadata>"
+                         "<manifest><item id=\"ncx\" href=\"toc.ncx\" media-type=\"application/x-dtbncx+xml\"/>"
+                         "<item id=\"text\" href=\"text.xhtml\" media-type=\"application/xhtml+xml\"/></manifest>"
+                         "<spine toc=\"ncx\"><itemref idref=\"text\"/></spine></package>",
+                         Z_DEFLATED);
+  WriteProbeArchiveEntry(archive, "text.xhtml", "<html xmlns=\"http://www.w3.org/1999/xhtml\"><head><title>Late</title></head><body/></html>", Z_DEFLATED);
+  fail_unless(zipClose(archive, NULL) == ZIP_OK);
+  bytes = CopyBytesOfFile(path, &byteCount);
+  ingest = EPUB3IngestCreate(NULL, NULL, NULL, &error);
+  fail_unless(EPUB3IngestWrite(ingest, bytes, byteCount) == kEPUB3Success);
+  fail_unless(EPUB3IngestGetBook(ingest) != NULL);
+  ck_assert_int_eq(EPUB3CountOfTocRootItems(EPUB3IngestGetBook(ingest)), 0);
+  fail_unless(EPUB3IngestClose(ingest, NULL) == kEPUB3Success);
+  free(bytes);
+  unlink(path);
+
+  // Anything but a zip
+  ingest = EPUB3IngestCreate(NULL, NULL, NULL, &error);
+  fail_unless(EPUB3IngestWrite(ingest, "<html>", 6) == kEPUB3FileReadFromArchiveError);
+  fail_unless(EPUB3IngestClose(ingest, NULL) == kEPUB3FileReadFromArchiveError);
+}
+END_TEST
+
+#pragma mark -
+#pragma mark test_epub3_read_entry_range
+START_TEST(test_epub3_read_entry_range)
+{
+  // Several checkpoint spans of half compressible data, once deflated and once stored
+  uint32_t size = RANGE_CHECKPOINT_SPAN * 5 + 777;
+  uint8_t * bytes = malloc(size);
+  uint32_t seed = 7;
+  for(uint32_t i = 0; i < size; i++) {
+    seed = seed * 1103515245U + 12345U;
+    bytes[i] = (i / 512) % 2 == 0 ? (uint8_t)(seed >> 24) : (uint8_t)("to be or not to be "[i % 19]);
+  }
+  char path[] = "/tmp/epub3-range-XXXXXX";
+  int fd = mkstemp(path);
+  fail_unless(fd >= 0);
+  close(fd);
+  EPUB3Error error = kEPUB3UnknownError;
+  EPUB3WriterRef writer = EPUB3WriterCreateAtPath(path, 0, &error);
+  fail_unless(writer != NULL);
+  fail_unless(EPUB3WriterAddFile(writer, "OPS/audio.bin", bytes, size, kEPUB3_YES) == kEPUB3Success);
+  fail_unless(EPUB3WriterAddFile(writer, "OPS/video.bin", bytes, size, kEPUB3_NO) == kEPUB3Success);
+  fail_unless(EPUB3WriterAddFile(writer, "OPS/small.txt", bytes, 5000, kEPUB3_YES) == kEPUB3Success);
+  fail_unless(EPUB3WriterClose(writer) == kEPUB3Success);
+
+  const uint64_t ranges[][2] = {
+    { 0, 100 }, { RANGE_CHECKPOINT_SPAN * 3 + 12345, 70000 }, { 1, RANGE_CHECKPOINT_SPAN * 2 },
+    { size - 10, 10 }, { size - 10, 1000 }, { RANGE_CHECKPOINT_SPAN + 1, 1 }, { 4000, 2000 },
+  };
+  uint8_t * buffer = malloc(RANGE_CHECKPOINT_SPAN * 2);
+  zlib_filefunc_def fileFuncs;
+  fill_fopen_filefunc(&fileFuncs);
+  // pread, mapped and stdio only archives, the last skipping through an entry reader
+  for(int kind = 0; kind < 3; kind++) {
+    EPUB3Ref book = EPUB3Create();
+    if(kind == 0) {
+      error = EPUB3PrepareArchiveAtPath(book, path);
+    } else if(kind == 1) {
+      error = EPUB3PrepareMappedArchiveAtPath(book, path);
+    } else {
+      error = EPUB3PrepareArchiveAtPathWithFileFuncs(book, path, &fileFuncs);
+    }
+    fail_unless(error == kEPUB3Success, "Unable to prepare the archive (kind %d, error %d).", kind, error);
+    const char * names[] = { "OPS/audio.bin", "OPS/video.bin", "OPS/small.txt" };
+    for(int name = 0; name < 3; name++) {
+      uint64_t entrySize = name < 2 ? size : 5000;
+      for(size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+        uint64_t bytesRead = UINT64_MAX;
+        error = EPUB3ReadEntryRange(book, names[name], ranges[r][0], ranges[r][1], buffer, &bytesRead);
+        fail_unless(error == kEPUB3Success, "%s [%llu, +%llu) failed (kind %d, error %d).", names[name],
+                    (unsigned long long)ranges[r][0], (unsigned long long)ranges[r][1], kind, error);
+        uint64_t expected = ranges[r][0] >= entrySize ? 0 : entrySize - ranges[r][0] < ranges[r][1] ? entrySize - ranges[r][0] : ranges[r][1];
+        fail_unless(bytesRead == expected, "%s [%llu, +%llu) read %llu bytes (kind %d).", names[name],
+                    (unsigned long long)ranges[r][0], (unsigned long long)ranges[r][1], (unsigned long long)bytesRead, kind);
+        fail_unless(memcmp(buffer, bytes + ranges[r][0], (size_t)bytesRead) == 0, "%s [%llu, +%llu) differs (kind %d).",
+                    names[name], (unsigned long long)ranges[r][0], (unsigned long long)ranges[r][1], kind);
+      }
+    }
+    // Only a large deflated file read with direct access to the archive gets checkpoints
+    EPUB3ArchiveEntryPtr audio = EPUB3ArchiveIndexFindEntry(book->archiveIndex, "OPS/audio.bin");
+    if(kind < 2) {
+      fail_unless(audio->rangeIndex != NULL && audio->rangeIndex->checkpointCount >= 4, "kind %d", kind);
+    } else {
+      fail_unless(audio->rangeIndex == NULL);
+    }
+    fail_unless(EPUB3ArchiveIndexFindEntry(book->archiveIndex, "OPS/small.txt")->rangeIndex == NULL);
+    uint64_t bytesRead = 0;
+    ck_assert_int_eq(EPUB3ReadEntryRange(book, "OPS/missing.bin", 0, 1, buffer, &bytesRead), kEPUB3FileNotFoundInArchiveError);
+    EPUB3Release(book);
+  }
+  free(buffer);
+  free(bytes);
+  unlink(path);
+}
+END_TEST
+
+#pragma mark -
+#pragma mark test_epub3_resolve_entries
+START_TEST(test_epub3_resolve_entries)
+{
+  const char * hrefs[] = {
+    "toc.ncx", "pgepub.css", "./cover.jpg#page", "missing.png", "../100/wrap0000.html", "%63over.jpg",
+    "../../outside.css", "http://example.com/remote.css", "/mimetype",
+  };
+  const uint32_t hrefCount = sizeof(hrefs) / sizeof(hrefs[0]);
+  EPUB3EntryInfo entries[hrefCount];
+  EPUB3Error error = EPUB3ResolveEntries(epub, hrefs, hrefCount, entries);
+  fail_unless(error == kEPUB3Success, "Unable to resolve entries (error %d).", error);
+
+  // Sorted by local header offset, duplicates by href order, missing ones last
+  uint32_t foundCount = 0;
+  for(uint32_t i = 0; i < hrefCount; i++) {
+    if(!entries[i].found) continue;
+    fail_unless(i == foundCount, "Missing entries should sort last.");
+    foundCount++;
+    if(i > 0) {
+      fail_unless(entries[i - 1].localHeaderOffset <= entries[i].localHeaderOffset);
+    }
+    EPUB3ArchiveEntryPtr entry = EPUB3ArchiveIndexFindEntry(epub->archiveIndex, entries[i].path);
+    fail_unless(entry != NULL && entry->localHeaderOffset == entries[i].localHeaderOffset && entry->crc == entries[i].crc);
+  }
+  ck_assert_int_eq(foundCount, 6);
+  ck_assert_str_eq(entries[0].path, "mimetype");
+  ck_assert_int_eq(entries[0].hrefIndex, 8);
+  ck_assert_int_eq(entries[0].compressionMethod, 0);
+  // pg100 stores cover.jpg, pgepub.css, toc.ncx and wrap0000.html in that order
+  const uint32_t expectedOrder[] = { 8, 2, 5, 1, 0, 4 };
+  for(uint32_t i = 0; i < foundCount; i++) {
+    ck_assert_int_eq(entries[i].hrefIndex, expectedOrder[i]);
+  }
+  ck_assert_str_eq(entries[1].path, "100/cover.jpg");
+  ck_assert_str_eq(entries[2].path, "100/cover.jpg");
+  ck_assert_int_eq(entries[1].uncompressedSize, 19263);
+  ck_assert_int_eq(entries[1].compressionMethod, Z_DEFLATED);
+  ck_assert_str_eq(entries[5].path, "100/wrap0000.html");
+  for(uint32_t i = foundCount; i < hrefCount; i++) {
+    fail_unless(entries[i].path == NULL && entries[i].localHeaderOffset == 0);
+  }
+
+  // Only the first call reads the container
+  const char * rootPath = epub->rootPath;
+  ck_assert_str_eq(rootPath, "100/");
+  ck_assert_str_eq(epub->rootFilePath, "100/content.opf");
+  error = EPUB3ResolveEntries(epub, hrefs, hrefCount, entries);
+  fail_unless(error == kEPUB3Success);
+  fail_unless(epub->rootPath == rootPath);
+
+  char * path = EPUB3CopyOfArchivePathForHref("", "OPS/./text/../images/a%20b.png?x=1");
+  ck_assert_str_eq(path, "OPS/images/a b.png");
+  free(path);
+  fail_unless(EPUB3CopyOfArchivePathForHref("OPS/", "..") == NULL);
+  fail_unless(EPUB3CopyOfArchivePathForHref("OPS/", "mailto:someone@example.com") == NULL);
+  fail_unless(EPUB3CopyOfArchivePathForHref("OPS/", "text%00.html") == NULL);
+  fail_unless(EPUB3CopyOfArchivePathForHref("OPS/", "..%2F..%2Fetc%2Fpasswd") == NULL);
+  fail_unless(EPUB3CopyOfArchivePathForHref("OPS/", "images%2fa.png") == NULL);
+}
+END_TEST
+
+#pragma mark -
+#pragma mark test_epub3_enumerate_archive_entries
+typedef struct EnumerationRecord {
+  EPUB3ArchiveIndexPtr index;
+  uint32_t count;
+  uint32_t limit;
+  uint32_t mismatches;
+  char firstName[32];
+} EnumerationRecord;
+
+static EPUB3Bool RecordArchiveEntry(const EPUB3ArchiveEntryInfo * info, void * context)
+{
+  EnumerationRecord * record = context;
+  if(record->count == 0) strncpy(record->firstName, info->name, sizeof(record->firstName) - 1);
+  EPUB3ArchiveEntryPtr entry = &record->index->entries[record->count];
+  if(strcmp(entry->filename, info->name) != 0 || entry->crc != info->crc || entry->uncompressedSize != info->uncompressedSize
+     || entry->compressedSize != info->compressedSize || entry->compressionMethod != info->compressionMethod
+     || entry->localHeaderOffset != info->localHeaderOffset) {
+    record->mismatches++;
+  }
+  record->count++;
+  return record->count < record->limit;
+}
+
+START_TEST(test_epub3_enumerate_archive_entries)
+{
+  EnumerationRecord record = { epub->archiveIndex, 0, UINT32_MAX, 0, "" };
+  EPUB3Error error = EPUB3EnumerateArchiveEntries(epub, RecordArchiveEntry, &record);
+  fail_unless(error == kEPUB3Success, "Unable to enumerate entries (error %d).", error);
+  ck_assert_int_eq(record.count, 117);
+  ck_assert_int_eq(record.mismatches, 0);
+  ck_assert_str_eq(record.firstName, "mimetype");
+
+  // Without an EPUB3Ref the central directory should read back the same, in the same order
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  memset(&record, 0, sizeof(record));
+  record.index = epub->archiveIndex;
+  record.limit = UINT32_MAX;
+  error = EPUB3EnumerateArchiveEntriesAtPath(path, RecordArchiveEntry, &record);
+  fail_unless(error == kEPUB3Success, "Unable to enumerate entries at path (error %d).", error);
+  ck_assert_int_eq(record.count, 117);
+  ck_assert_int_eq(record.mismatches, 0);
+  ck_assert_str_eq(record.firstName, "mimetype");
+
+  memset(&record, 0, sizeof(record));
+  record.index = epub->archiveIndex;
+  record.limit = 3;
+  error = EPUB3EnumerateArchiveEntriesAtPath(path, RecordArchiveEntry, &record);
+  fail_unless(error == kEPUB3Success);
+  ck_assert_int_eq(record.count, 3);
+
+  TEST_PATH_VAR_FOR_FILENAME(opfPath, "pg_100_content.opf");
+  memset(&record, 0, sizeof(record));
+  error = EPUB3EnumerateArchiveEntriesAtPath(opfPath, RecordArchiveEntry, &record);
+  ck_assert_int_eq(error, kEPUB3ArchiveUnavailableError);
+  ck_assert_int_eq(record.count, 0);
+}
+END_TEST
+
+#pragma mark test_epub3_get_bytes_of_stored_file
+START_TEST(test_epub3_get_bytes_of_stored_file)
+{
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  EPUB3Error error = kEPUB3UnknownError;
+  EPUB3Ref mappedEpub = EPUB3CreateWithMappedArchiveAtPath(path, &error);
+  fail_unless(error == kEPUB3Success);
+
+  const void * bytes = NULL;
+  uint64_t byteCount = 0;
+  error = EPUB3GetBytesOfStoredFileInArchive(mappedEpub, "mimetype", &bytes, &byteCount);
+  fail_unless(error == kEPUB3Success, "Unable to borrow the stored mimetype file (error %d).", error);
+  ck_assert_int_eq(byteCount, 20);
+  fail_unless(strncmp(bytes, "application/epub+zip", byteCount) == 0);
+  fail_unless((const char *)bytes >= (const char *)mappedEpub->archiveMemory.base && (const char *)bytes < (const char *)mappedEpub->archiveMemory.base + mappedEpub->archiveMemory.size, "Stored bytes should point into the mapping.");
+
+  error = EPUB3GetBytesOfStoredFileInArchive(mappedEpub, "100/toc.ncx", &bytes, &byteCount);
+  fail_unless(error == kEPUB3FileNotStoredInArchiveError, "Deflated files can't be borrowed.");
+  error = EPUB3GetBytesOfStoredFileInArchive(mappedEpub, "doesnotexist", &bytes, &byteCount);
+  fail_unless(error == kEPUB3FileNotFoundInArchiveError);
+
+  EPUB3Bool isCopy = kEPUB3_YES;
+  error = EPUB3GetOrCopyBytesOfFileInArchive(mappedEpub, "mimetype", &bytes, &byteCount, &isCopy);
+  fail_unless(error == kEPUB3Success);
+  fail_unless(isCopy == kEPUB3_NO);
+
+  error = EPUB3GetOrCopyBytesOfFileInArchive(mappedEpub, "100/toc.ncx", &bytes, &byteCount, &isCopy);
+  fail_unless(error == kEPUB3Success);
+  fail_unless(isCopy == kEPUB3_YES);
+  ck_assert_int_eq(byteCount, 199337);
+  free((void *)bytes);
+  EPUB3Release(mappedEpub);
+
+  // Archives read through stdio always copy
+  error = EPUB3GetBytesOfStoredFileInArchive(epub, "mimetype", &bytes, &byteCount);
+  fail_unless(error == kEPUB3FileNotStoredInArchiveError);
+  error = EPUB3GetOrCopyBytesOfFileInArchive(epub, "mimetype", &bytes, &byteCount, &isCopy);
+  fail_unless(error == kEPUB3Success);
+  fail_unless(isCopy == kEPUB3_YES);
+  fail_unless(strncmp(bytes, "application/epub+zip", byteCount) == 0);
+  free((void *)bytes);
+
+  // A stored mimetype whose headers claim far more bytes than it has, or than the archive has
+  struct stat st;
+  fail_unless(stat(path, &st) == 0);
+  size_t archiveSize = (size_t)st.st_size;
+  uint8_t * archiveBytes = malloc(archiveSize);
+  FILE * fp = fopen(path, "rb");
+  size_t bytesRead = fread(archiveBytes, 1, archiveSize, fp);
+  fclose(fp);
+  ck_assert_int_eq(bytesRead, archiveSize);
+  static const uint8_t hugeSize[4] = { 0x80, 0xf0, 0xfa, 0x02 }; // 50,000,000
+  memcpy(archiveBytes + 22, hugeSize, sizeof(hugeSize));
+  EPUB3Bool patched = kEPUB3_NO;
+  for(size_t offset = 0; offset + ZIP_CENTRAL_HEADER_SIZE + 8 <= archiveSize && !patched; offset++) {
+    if(memcmp(archiveBytes + offset, "PK\1\2", 4) == 0 && memcmp(archiveBytes + offset + ZIP_CENTRAL_HEADER_SIZE, "mimetype", 8) == 0) {
+      memcpy(archiveBytes + offset + 24, hugeSize, sizeof(hugeSize));
+      patched = kEPUB3_YES;
+    }
+  }
+  fail_unless(patched);
+  EPUB3Ref craftedEpub = EPUB3Create();
+  fail_unless(EPUB3PrepareArchiveInMemory(craftedEpub, archiveBytes, archiveSize) == kEPUB3Success);
+  bytes = NULL;
+  byteCount = 0;
+  error = EPUB3GetBytesOfStoredFileInArchive(craftedEpub, "mimetype", &bytes, &byteCount);
+  ck_assert_int_eq(error, kEPUB3FileReadFromArchiveError);
+  fail_unless(bytes == NULL && byteCount == 0);
+  EPUB3Release(craftedEpub);
+  free(archiveBytes);
+}
+END_TEST
+
+#pragma mark test_epub3_raw_bytes_of_file
+START_TEST(test_epub3_raw_bytes_of_file)
+{
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  EPUB3Error error = kEPUB3UnknownError;
+  EPUB3Ref mappedEpub = EPUB3CreateWithMappedArchiveAtPath(path, &error);
+  fail_unless(error == kEPUB3Success);
+
+  void * inflated = NULL;
+  uint64_t inflatedSize = 0;
+  error = EPUB3CopyFileIntoBuffer(epub, &inflated, &inflatedSize, NULL, "100/toc.ncx");
+  fail_unless(error == kEPUB3Success);
+
+  EPUB3Ref books[] = { mappedEpub, epub };
+  for(int i = 0; i < 2; i++) {
+    const void * bytes = NULL;
+    EPUB3ArchiveEntryInfo info;
+    EPUB3Bool isCopy = kEPUB3_NO;
+    error = EPUB3GetOrCopyRawBytesOfFileInArchive(books[i], "100/toc.ncx", &bytes, &info, &isCopy);
+    fail_unless(error == kEPUB3Success, "Unable to get the raw toc.ncx (error %d).", error);
+    fail_unless(isCopy == (books[i] == epub), "Only the mapped archive should lend its bytes.");
+    ck_assert_str_eq(info.name, "100/toc.ncx");
+    ck_assert_int_eq(info.compressionMethod, Z_DEFLATED);
+    ck_assert_int_eq(info.uncompressedSize, inflatedSize);
+    fail_unless(info.compressedSize < info.uncompressedSize);
+
+    // What a client would do with Content-Encoding: deflate
+    void * output = malloc(inflatedSize);
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    fail_unless(inflateInit2(&stream, -MAX_WBITS) == Z_OK);
+    stream.next_in = (Bytef *)bytes;
+    stream.avail_in = (uInt)info.compressedSize;
+    stream.next_out = output;
+    stream.avail_out = (uInt)inflatedSize;
+    ck_assert_int_eq(inflate(&stream, Z_FINISH), Z_STREAM_END);
+    ck_assert_int_eq(stream.total_out, inflatedSize);
+    (void)inflateEnd(&stream);
+    fail_unless(memcmp(output, inflated, inflatedSize) == 0);
+    ck_assert_int_eq(crc32(0, output, (uInt)inflatedSize), info.crc);
+    free(output);
+    if(isCopy) free((void *)bytes);
+
+    error = EPUB3GetOrCopyRawBytesOfFileInArchive(books[i], "mimetype", &bytes, &info, &isCopy);
+    fail_unless(error == kEPUB3Success);
+    ck_assert_int_eq(info.compressionMethod, 0);
+    ck_assert_int_eq(info.compressedSize, 20);
+    fail_unless(strncmp(bytes, "application/epub+zip", 20) == 0);
+    if(isCopy) free((void *)bytes);
+
+    error = EPUB3GetOrCopyRawBytesOfFileInArchive(books[i], "doesnotexist", &bytes, &info, &isCopy);
+    fail_unless(error == kEPUB3FileNotFoundInArchiveError);
+  }
+  free(inflated);
+  EPUB3Release(mappedEpub);
+
+  // Bytes nobody could decode without the archive: an encrypted mimetype, then one compressed with bzip2
+  struct stat st;
+  fail_unless(stat(path, &st) == 0);
+  size_t archiveSize = (size_t)st.st_size;
+  uint8_t * archiveBytes = malloc(archiveSize);
+  FILE * fp = fopen(path, "rb");
+  size_t bytesRead = fread(archiveBytes, 1, archiveSize, fp);
+  fclose(fp);
+  ck_assert_int_eq(bytesRead, archiveSize);
+  size_t centralHeaderOffset = 0;
+  for(size_t offset = 0; offset + ZIP_CENTRAL_HEADER_SIZE + 8 <= archiveSize && centralHeaderOffset == 0; offset++) {
+    if(memcmp(archiveBytes + offset, "PK\1\2", 4) == 0 && memcmp(archiveBytes + offset + ZIP_CENTRAL_HEADER_SIZE, "mimetype", 8) == 0) {
+      centralHeaderOffset = offset;
+    }
+  }
+  fail_unless(centralHeaderOffset > 0);
+  for(int i = 0; i < 2; i++) {
+    if(i == 0) archiveBytes[centralHeaderOffset + 8] |= 1;
+    else archiveBytes[centralHeaderOffset + 10] = 12;
+    EPUB3Ref craftedEpub = EPUB3Create();
+    fail_unless(EPUB3PrepareArchiveInMemory(craftedEpub, archiveBytes, archiveSize) == kEPUB3Success);
+    const void * bytes = NULL;
+    EPUB3ArchiveEntryInfo info;
+    EPUB3Bool isCopy = kEPUB3_NO;
+    error = EPUB3GetOrCopyRawBytesOfFileInArchive(craftedEpub, "mimetype", &bytes, &info, &isCopy);
+    ck_assert_int_eq(error, kEPUB3FileEncodingNotSupportedError);
+    EPUB3Release(craftedEpub);
+  }
+  free(archiveBytes);
+}
+END_TEST
+
+#pragma mark test_epub3_entry_reader
+START_TEST(test_epub3_entry_reader)
+{
+  const char * filename = "100/toc.ncx";
+  void *expected = NULL;
+  uint64_t expectedSize = 0;
+  uint64_t bytesCopied = 0;
+  EPUB3Error error = EPUB3CopyFileIntoBuffer(epub, &expected, &expectedSize, &bytesCopied, filename);
+  fail_unless(error == kEPUB3Success);
+
+  EPUB3EntryReaderRef reader = NULL;
+  error = EPUB3EntryReaderOpen(epub, filename, &reader);
+  fail_unless(error == kEPUB3Success, "Unable to open a reader for %s (error %d).", filename, error);
+  ck_assert_int_eq(EPUB3EntryReaderGetUncompressedSize(reader), expectedSize);
+
+  char chunk[4096];
+  char *streamed = malloc(expectedSize);
+  uint32_t totalRead = 0;
+  uint32_t bytesRead = 0;
+  do {
+    error = EPUB3EntryReaderRead(reader, chunk, sizeof(chunk), &bytesRead);
+    fail_unless(error == kEPUB3Success);
+    fail_unless(totalRead + bytesRead <= expectedSize, "Reader returned more bytes than the file holds.");
+    memcpy(streamed + totalRead, chunk, bytesRead);
+    totalRead += bytesRead;
+  } while(bytesRead > 0);
+  ck_assert_int_eq(totalRead, expectedSize);
+  fail_unless(memcmp(streamed, expected, expectedSize) == 0, "Streamed bytes should match the copied file.");
+
+  error = EPUB3EntryReaderClose(reader);
+  fail_unless(error == kEPUB3Success);
+
+  // Requests past INT_MAX are clamped, and never go past the end of the file
+  error = EPUB3EntryReaderOpen(epub, filename, &reader);
+  fail_unless(error == kEPUB3Success);
+  memset(streamed, 0, expectedSize);
+  error = EPUB3EntryReaderRead(reader, streamed, UINT32_MAX, &bytesRead);
+  fail_unless(error == kEPUB3Success);
+  ck_assert_int_eq(bytesRead, expectedSize);
+  fail_unless(memcmp(streamed, expected, expectedSize) == 0, "A single oversized read should return the whole file.");
+  error = EPUB3EntryReaderClose(reader);
+  fail_unless(error == kEPUB3Success);
+  free(streamed);
+  free(expected);
+
+  error = EPUB3EntryReaderOpen(epub, "doesnotexist", &reader);
+  fail_unless(error == kEPUB3FileNotFoundInArchiveError);
+  fail_unless(reader == NULL);
+}
+END_TEST
+
+#pragma mark test_epub3_copy_file_in_one_shot
+static uint32_t rawInflateCallCount = 0;
+
+static EPUB3Bool CountingRawInflate(const void * source, size_t sourceSize, void * destination, size_t destinationSize)
+{
+  rawInflateCallCount++;
+  return EPUB3RawInflateWithZlib(source, sourceSize, destination, destinationSize);
+}
+
+static void AssertOneShotCopiesMatchStreamedReads(EPUB3Ref anEpub)
+{
+  for(uint32_t i = 0; i < anEpub->archiveIndex->entryCount; i++) {
+    EPUB3ArchiveEntryPtr entry = &anEpub->archiveIndex->entries[i];
+    fail_unless(EPUB3CanReadEntryInOneShot(anEpub, entry), "%s should take the single shot path.", entry->filename);
+
+    void * copied = NULL;
+    uint64_t copiedSize = 0;
+    EPUB3Error error = EPUB3CopyFileIntoBuffer(anEpub, &copied, &copiedSize, NULL, entry->filename);
+    fail_unless(error == kEPUB3Success, "Unable to copy %s (error %d).", entry->filename, error);
+    ck_assert_int_eq(copiedSize, entry->uncompressedSize);
+
+    EPUB3EntryReaderRef reader = NULL;
+    fail_unless(EPUB3EntryReaderOpen(anEpub, entry->filename, &reader) == kEPUB3Success);
+    char * streamed = malloc(copiedSize + 1);
+    uint32_t totalRead = 0;
+    uint32_t bytesRead = 0;
+    do {
+      fail_unless(EPUB3EntryReaderRead(reader, streamed + totalRead, copiedSize + 1 - totalRead, &bytesRead) == kEPUB3Success);
+      totalRead += bytesRead;
+    } while(bytesRead > 0 && totalRead <= copiedSize);
+    fail_unless(EPUB3EntryReaderClose(reader) == kEPUB3Success);
+    ck_assert_int_eq(totalRead, copiedSize);
+    fail_unless(memcmp(copied, streamed, copiedSize) == 0, "%s differs between the single shot and streamed reads.", entry->filename);
+    free(streamed);
+    free(copied);
+  }
+}
+
+START_TEST(test_epub3_copy_file_in_one_shot)
+{
+  AssertOneShotCopiesMatchStreamedReads(epub);
+
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  EPUB3Error error = kEPUB3UnknownError;
+  EPUB3Ref mappedEpub = EPUB3CreateWithMappedArchiveAtPath(path, &error);
+  fail_unless(error == kEPUB3Success);
+  AssertOneShotCopiesMatchStreamedReads(mappedEpub);
+
+  // 100/toc.ncx is deflated, so it goes through whichever inflate function is installed
+  void * buffer = NULL;
+  uint64_t bufferSize = 0;
+  EPUB3SetRawInflateFunction(CountingRawInflate);
+  fail_unless(EPUB3CopyFileIntoBuffer(mappedEpub, &buffer, &bufferSize, NULL, "100/toc.ncx") == kEPUB3Success);
+  ck_assert_int_eq(rawInflateCallCount, 1);
+  ck_assert_int_eq(bufferSize, 199337);
+  free(buffer);
+  EPUB3SetRawInflateFunction(NULL);
+  fail_unless(EPUB3CopyFileIntoBuffer(mappedEpub, &buffer, &bufferSize, NULL, "100/toc.ncx") == kEPUB3Success);
+  ck_assert_int_eq(rawInflateCallCount, 1);
+  free(buffer);
+  EPUB3Release(mappedEpub);
+}
+END_TEST
+
+#pragma mark test_epub3_concurrent_entry_reads
+#define CONCURRENT_READ_THREAD_COUNT (4)
+#define CONCURRENT_READ_ITERATIONS (8)
+
+typedef struct {
+  EPUB3Ref epub;
+  const char * filename;
+  const void * expected;
+  uint64_t expectedSize;
+  int mismatches;
+} ConcurrentReadContext;
+
+static void * ConcurrentReadThread(void * info)
+{
+  ConcurrentReadContext * context = info;
+  for(int i = 0; i < CONCURRENT_READ_ITERATIONS; i++) {
+    void * buffer = NULL;
+    uint64_t bufferSize = 0;
+    if(EPUB3CopyFileIntoBuffer(context->epub, &buffer, &bufferSize, NULL, context->filename) != kEPUB3Success
+       || bufferSize != context->expectedSize || memcmp(buffer, context->expected, bufferSize) != 0) {
+      context->mismatches++;
+    }
+    free(buffer);
+
+    EPUB3EntryReaderRef reader = NULL;
+    char chunk[1000];
+    uint32_t bytesRead = 0;
+    uint32_t totalRead = 0;
+    if(EPUB3EntryReaderOpen(context->epub, context->filename, &reader) != kEPUB3Success) {
+      context->mismatches++;
+      continue;
+    }
+    do {
+      if(EPUB3EntryReaderRead(reader, chunk, sizeof(chunk), &bytesRead) != kEPUB3Success
+         || totalRead + bytesRead > context->expectedSize
+         || memcmp(chunk, (const char *)context->expected + totalRead, bytesRead) != 0) {
+        context->mismatches++;
+        break;
+      }
+      totalRead += bytesRead;
+    } while(bytesRead > 0);
+    if(EPUB3EntryReaderClose(reader) != kEPUB3Success || totalRead != context->expectedSize) {
+      context->mismatches++;
+    }
+  }
+  return NULL;
+}
+
+START_TEST(test_epub3_concurrent_entry_reads)
+{
+  const char * filenames[CONCURRENT_READ_THREAD_COUNT] = { "100/toc.ncx", "100/content.opf", "META-INF/container.xml", "100/toc.ncx" };
+  ConcurrentReadContext contexts[CONCURRENT_READ_THREAD_COUNT];
+  pthread_t threads[CONCURRENT_READ_THREAD_COUNT];
+
+  for(int i = 0; i < CONCURRENT_READ_THREAD_COUNT; i++) {
+    void * expected = NULL;
+    contexts[i].epub = epub;
+    contexts[i].filename = filenames[i];
+    contexts[i].mismatches = 0;
+    fail_unless(EPUB3CopyFileIntoBuffer(epub, &expected, &contexts[i].expectedSize, NULL, filenames[i]) == kEPUB3Success);
+    contexts[i].expected = expected;
+  }
+  for(int i = 0; i < CONCURRENT_READ_THREAD_COUNT; i++) {
+    int created = pthread_create(&threads[i], NULL, ConcurrentReadThread, &contexts[i]);
+    ck_assert_int_eq(created, 0);
+  }
+  for(int i = 0; i < CONCURRENT_READ_THREAD_COUNT; i++) {
+    pthread_join(threads[i], NULL);
+    fail_unless(contexts[i].mismatches == 0, "Concurrent reads of %s returned the wrong bytes.", contexts[i].filename);
+    free((void *)contexts[i].expected);
+  }
+  ck_assert_int_eq(epub->_type.refCount, 1);
+}
+END_TEST
+
+#pragma mark test_epub3_crc32
+START_TEST(test_epub3_crc32)
+{
+  uint8_t bytes[4096 + 16];
+  for(size_t i = 0; i < sizeof(bytes); i++) {
+    bytes[i] = (uint8_t)(i * 131 + (i >> 7));
+  }
+  // Covers the byte-at-a-time tail, the 16 and 64 byte folds and misaligned starts
+  const size_t lengths[] = { 0, 1, 7, 15, 16, 63, 64, 65, 127, 128, 1000, 4096 };
+  for(size_t offset = 0; offset < 4; offset++) {
+    for(size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+      uint32_t expected = (uint32_t)crc32(crc32(0L, Z_NULL, 0), bytes + offset, (uInt)lengths[i]);
+      uint32_t actual = EPUB3CRC32(0, bytes + offset, lengths[i]);
+      fail_unless(actual == expected, "CRC of %zu bytes at offset %zu was %08x, expected %08x.", lengths[i], offset, actual, expected);
+    }
+  }
+  // Continuing a running CRC
+  uint32_t whole = EPUB3CRC32(0, bytes, 4096);
+  uint32_t split = EPUB3CRC32(EPUB3CRC32(0, bytes, 1000), bytes + 1000, 3096);
+  ck_assert_int_eq(split, whole);
+}
+END_TEST
+
+#pragma mark test_epub3_integrity_policy
+// Breaks the CRC recorded for one file, in both its local header and the central directory, so its data still
+// inflates but no longer matches
+static void CorruptRecordedCRC(uint8_t * bytes, size_t byteCount, const char * filename)
+{
+  size_t filenameLength = strlen(filename);
+  int corrupted = 0;
+  for(size_t i = 0; i + 46 + filenameLength <= byteCount; i++) {
+    if(bytes[i] != 'P' || bytes[i + 1] != 'K') continue;
+    if(bytes[i + 2] == 3 && bytes[i + 3] == 4 && (size_t)(bytes[i + 26] | (bytes[i + 27] << 8)) == filenameLength
+       && memcmp(bytes + i + 30, filename, filenameLength) == 0) {
+      bytes[i + 14] ^= 0xFF;
+      corrupted++;
+    }
+    else if(bytes[i + 2] == 1 && bytes[i + 3] == 2 && (size_t)(bytes[i + 28] | (bytes[i + 29] << 8)) == filenameLength
+       && memcmp(bytes + i + 46, filename, filenameLength) == 0) {
+      bytes[i + 16] ^= 0xFF;
+      corrupted++;
+    }
+  }
+  ck_assert_int_eq(corrupted, 2);
+}
+
+START_TEST(test_epub3_integrity_policy)
+{
+  // Not read while the book is opened, unlike the OPF and NCX
+  const char * corruptFile = "100/@public@vhost@g@gutenberg@html@dirs@etext94@shaks12-0.txt.html";
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  struct stat st;
+  fail_unless(stat(path, &st) == 0, "Error stat'ing %s", path);
+  size_t byteCount = (size_t)st.st_size;
+  uint8_t * bytes = malloc(byteCount);
+  FILE * fp = fopen(path, "rb");
+  size_t bytesRead = fread(bytes, 1, byteCount, fp);
+  fclose(fp);
+  ck_assert_int_eq(bytesRead, byteCount);
+  CorruptRecordedCRC(bytes, byteCount, corruptFile);
+
+  EPUB3Error error = kEPUB3UnknownError;
+  EPUB3Ref memoryEpub = EPUB3CreateWithArchiveInMemory(bytes, byteCount, &error);
+  fail_unless(error == kEPUB3Success);
+
+  void * buffer = NULL;
+  uint64_t bufferSize = 0;
+  error = EPUB3CopyFileIntoBuffer(memoryEpub, &buffer, &bufferSize, NULL, corruptFile);
+  fail_unless(error == kEPUB3FileReadFromArchiveError, "A CRC mismatch should fail the read.");
+  fail_unless(buffer == NULL);
+
+  EPUB3EntryReaderRef reader = NULL;
+  char chunk[4096];
+  uint32_t chunkSize = 0;
+  fail_unless(EPUB3EntryReaderOpen(memoryEpub, corruptFile, &reader) == kEPUB3Success);
+  do {
+    fail_unless(EPUB3EntryReaderRead(reader, chunk, sizeof(chunk), &chunkSize) == kEPUB3Success);
+  } while(chunkSize > 0);
+  fail_unless(EPUB3EntryReaderClose(reader) == kEPUB3FileReadFromArchiveError, "A CRC mismatch should fail the streamed read.");
+
+  EPUB3SetIntegrityPolicy(memoryEpub, kEPUB3IntegritySkip);
+  fail_unless(EPUB3CopyFileIntoBuffer(memoryEpub, &buffer, &bufferSize, NULL, corruptFile) == kEPUB3Success);
+  ck_assert_int_eq(bufferSize, 65602);
+  free(buffer);
+  fail_unless(EPUB3EntryReaderOpen(memoryEpub, corruptFile, &reader) == kEPUB3Success);
+  do {
+    fail_unless(EPUB3EntryReaderRead(reader, chunk, sizeof(chunk), &chunkSize) == kEPUB3Success);
+  } while(chunkSize > 0);
+  fail_unless(EPUB3EntryReaderClose(reader) == kEPUB3Success);
+  EPUB3Release(memoryEpub);
+  free(bytes);
+
+  // Verified once, then trusted
+  EPUB3SetIntegrityPolicy(epub, kEPUB3IntegrityVerifyOnce);
+  EPUB3ArchiveEntryPtr entry = EPUB3ArchiveIndexFindEntry(epub->archiveIndex, "100/content.opf");
+  fail_unless(entry != NULL);
+  fail_unless(EPUB3ShouldVerifyEntry(epub, entry));
+  fail_unless(EPUB3CopyFileIntoBuffer(epub, &buffer, &bufferSize, NULL, "100/content.opf") == kEPUB3Success);
+  free(buffer);
+  fail_unless(entry->verified);
+  fail_if(EPUB3ShouldVerifyEntry(epub, entry));
+  EPUB3SetIntegrityPolicy(epub, kEPUB3IntegrityVerify);
+  fail_unless(EPUB3ShouldVerifyEntry(epub, entry));
+}
+END_TEST
+
 #pragma mark test_epub3_copy_file_into_buffer
 START_TEST(test_epub3_copy_file_into_buffer)
 {
   void *buffer = NULL;
-  uint32_t bufferSize;
-  uint32_t bytesCopied;
+  uint64_t bufferSize;
+  uint64_t bytesCopied;
   const char * filename = "META-INF/container.xml";
   uint32_t expectedSize = 250U;
   EPUB3Error error = EPUB3CopyFileIntoBuffer(epub, &buffer, &bufferSize, &bytesCopied, filename);
   fail_unless(error == kEPUB3Success, "Copy into buffer failed with error: %d", error);
-  fail_unless(bufferSize == expectedSize, "Expected %s to be %u bytes but was %u bytes.", filename, expectedSize, bufferSize);
-  fail_unless(bytesCopied == expectedSize, "Expected %s to be %u bytes but was %u bytes.", filename, expectedSize, bufferSize);
-  fail_unless(bytesCopied == bufferSize, "Expected %s to be %u bytes but was %u bytes.", filename, expectedSize, bufferSize);
+  fail_unless(bufferSize == expectedSize, "Expected %s to be %u bytes but was %" PRIu64 " bytes.", filename, expectedSize, bufferSize);
+  fail_unless(bytesCopied == expectedSize, "Expected %s to be %u bytes but was %" PRIu64 " bytes.", filename, expectedSize, bufferSize);
+  fail_unless(bytesCopied == bufferSize, "Expected %s to be %u bytes but was %" PRIu64 " bytes.", filename, expectedSize, bufferSize);
 
   TEST_PATH_VAR_FOR_FILENAME(path, "pg100_container.xml");
   TEST_DATA_FILE_SIZE_SANITY_CHECK(path, 250);
@@ -120,7 +1855,7 @@ START_TEST(test_epub3_copy_file_into_buffer)
   fail_if(ferror(containerFP) != 0, "Problem reading test data file %s: %s", path, strerror(ferror(containerFP)));
   fail_unless(feof(containerFP) == 0, "The test data file %s is bigger than the archive's file.");
   fail_unless(bytesRead == bufferSize, "The test data file %s is bigger than the archive's file.");
-  fail_unless(strcmp(newBuf, buffer) == 0, "%s does not match the test data in %s.", filename, path);
+  fail_unless(memcmp(newBuf, buffer, bufferSize) == 0, "%s does not match the test data in %s.", filename, path);
 
   fclose(containerFP);
   free(newBuf);
@@ -703,6 +2438,29 @@ TEST_EXPORT TCase * check_EPUB3_parsing_make_tcase(void)
   tcase_add_test(test_case, test_epub3_get_file_count_in_archive);
   tcase_add_test(test_case, test_epub3_get_file_size_in_archive);
   tcase_add_test(test_case, test_epub3_validate_file_exists_in_zip);
+  tcase_add_test(test_case, test_epub3_archive_index);
+  tcase_add_test(test_case, test_epub3_shared_archive_index);
+  tcase_add_test(test_case, test_epub3_create_with_mapped_archive);
+  tcase_add_test(test_case, test_epub3_create_with_archive_in_memory);
+  tcase_add_test(test_case, test_epub3_zip64_archive);
+  tcase_add_test(test_case, test_epub3_create_with_io);
+  tcase_add_test(test_case, test_epub3_entry_cache);
+  tcase_add_test(test_case, test_epub3_spine_prefetch);
+  tcase_add_test(test_case, test_epub3_probe);
+  tcase_add_test(test_case, test_epub3_writer);
+  tcase_add_test(test_case, test_epub3_optimize_archive);
+  tcase_add_test(test_case, test_epub3_repackage_archives);
+  tcase_add_test(test_case, test_epub3_ingest_stream);
+  tcase_add_test(test_case, test_epub3_read_entry_range);
+  tcase_add_test(test_case, test_epub3_resolve_entries);
+  tcase_add_test(test_case, test_epub3_enumerate_archive_entries);
+  tcase_add_test(test_case, test_epub3_get_bytes_of_stored_file);
+  tcase_add_test(test_case, test_epub3_raw_bytes_of_file);
+  tcase_add_test(test_case, test_epub3_entry_reader);
+  tcase_add_test(test_case, test_epub3_copy_file_in_one_shot);
+  tcase_add_test(test_case, test_epub3_concurrent_entry_reads);
+  tcase_add_test(test_case, test_epub3_crc32);
+  tcase_add_test(test_case, test_epub3_integrity_policy);
   tcase_add_test(test_case, test_epub3_copy_file_into_buffer);
   tcase_add_test(test_case, test_epub3_parse_metadata_from_shakespeare_opf_data);
   tcase_add_test(test_case, test_epub3_parse_metadata_from_moby_dick_opf_data);
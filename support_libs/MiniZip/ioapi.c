@@ -9,6 +9,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <unistd.h>
 
 #include "zlib.h"
 #include "ioapi.h"
@@ -176,3 +179,438 @@ void fill_fopen_filefunc (pzlib_filefunc_def)
     pzlib_filefunc_def->zerror_file = ferror_file_func;
     pzlib_filefunc_def->opaque = NULL;
 }
+
+
+/* Memory backed streams: the filename passed to zopen_file is ignored and
+   every stream reads from the zlib_mem_desc held in opaque. Each stream has
+   its own position, so several unzFile may share one descriptor. */
+
+typedef struct mem_stream_s
+{
+    const zlib_mem_desc* desc;
+    uLong pos;
+} mem_stream;
+
+voidpf ZCALLBACK mem_open_file_func OF((
+   voidpf opaque,
+   const char* filename,
+   int mode));
+
+uLong ZCALLBACK mem_read_file_func OF((
+   voidpf opaque,
+   voidpf stream,
+   void* buf,
+   uLong size));
+
+uLong ZCALLBACK mem_write_file_func OF((
+   voidpf opaque,
+   voidpf stream,
+   const void* buf,
+   uLong size));
+
+long ZCALLBACK mem_tell_file_func OF((
+   voidpf opaque,
+   voidpf stream));
+
+long ZCALLBACK mem_seek_file_func OF((
+   voidpf opaque,
+   voidpf stream,
+   uLong offset,
+   int origin));
+
+int ZCALLBACK mem_close_file_func OF((
+   voidpf opaque,
+   voidpf stream));
+
+int ZCALLBACK mem_error_file_func OF((
+   voidpf opaque,
+   voidpf stream));
+
+
+voidpf ZCALLBACK mem_open_file_func (opaque, filename, mode)
+   voidpf opaque;
+   const char* filename;
+   int mode;
+{
+    mem_stream* mem = NULL;
+    const zlib_mem_desc* desc = (const zlib_mem_desc*)opaque;
+    if ((desc==NULL) || (desc->base==NULL))
+        return NULL;
+    /* read only */
+    if ((mode & ZLIB_FILEFUNC_MODE_READWRITEFILTER)!=ZLIB_FILEFUNC_MODE_READ)
+        return NULL;
+
+    mem = (mem_stream*)malloc(sizeof(mem_stream));
+    if (mem!=NULL)
+    {
+        mem->desc = desc;
+        mem->pos = 0;
+    }
+    return mem;
+}
+
+
+uLong ZCALLBACK mem_read_file_func (opaque, stream, buf, size)
+   voidpf opaque;
+   voidpf stream;
+   void* buf;
+   uLong size;
+{
+    mem_stream* mem = (mem_stream*)stream;
+    uLong avail;
+    if (mem->pos >= mem->desc->size)
+        return 0;
+    avail = mem->desc->size - mem->pos;
+    if (size > avail)
+        size = avail;
+    memcpy(buf, (const char*)mem->desc->base + mem->pos, (size_t)size);
+    mem->pos += size;
+    return size;
+}
+
+
+uLong ZCALLBACK mem_write_file_func (opaque, stream, buf, size)
+   voidpf opaque;
+   voidpf stream;
+   const void* buf;
+   uLong size;
+{
+    return 0;
+}
+
+long ZCALLBACK mem_tell_file_func (opaque, stream)
+   voidpf opaque;
+   voidpf stream;
+{
+    return (long)((mem_stream*)stream)->pos;
+}
+
+long ZCALLBACK mem_seek_file_func (opaque, stream, offset, origin)
+   voidpf opaque;
+   voidpf stream;
+   uLong offset;
+   int origin;
+{
+    mem_stream* mem = (mem_stream*)stream;
+    uLong new_pos;
+    switch (origin)
+    {
+    case ZLIB_FILEFUNC_SEEK_CUR :
+        new_pos = mem->pos + offset;
+        break;
+    case ZLIB_FILEFUNC_SEEK_END :
+        new_pos = mem->desc->size + offset;
+        break;
+    case ZLIB_FILEFUNC_SEEK_SET :
+        new_pos = offset;
+        break;
+    default: return -1;
+    }
+    if (new_pos > mem->desc->size)
+        return -1;
+    mem->pos = new_pos;
+    return 0;
+}
+
+int ZCALLBACK mem_close_file_func (opaque, stream)
+   voidpf opaque;
+   voidpf stream;
+{
+    free(stream);
+    return 0;
+}
+
+int ZCALLBACK mem_error_file_func (opaque, stream)
+   voidpf opaque;
+   voidpf stream;
+{
+    return 0;
+}
+
+void fill_memory_filefunc (pzlib_filefunc_def, pmem_desc)
+  zlib_filefunc_def* pzlib_filefunc_def;
+  const zlib_mem_desc* pmem_desc;
+{
+    pzlib_filefunc_def->zopen_file = mem_open_file_func;
+    pzlib_filefunc_def->zread_file = mem_read_file_func;
+    pzlib_filefunc_def->zwrite_file = mem_write_file_func;
+    pzlib_filefunc_def->ztell_file = mem_tell_file_func;
+    pzlib_filefunc_def->zseek_file = mem_seek_file_func;
+    pzlib_filefunc_def->zclose_file = mem_close_file_func;
+    pzlib_filefunc_def->zerror_file = mem_error_file_func;
+    pzlib_filefunc_def->opaque = (voidpf)pmem_desc;
+}
+
+
+/* Positioned streams: like the memory streams above, but the bytes come from
+   pread on the descriptor held in opaque instead of from memory. */
+
+typedef struct pread_stream_s
+{
+    const zlib_fd_desc* desc;
+    uLong pos;
+    int error;
+} pread_stream;
+
+voidpf ZCALLBACK pread_open_file_func OF((
+   voidpf opaque,
+   const char* filename,
+   int mode));
+
+uLong ZCALLBACK pread_read_file_func OF((
+   voidpf opaque,
+   voidpf stream,
+   void* buf,
+   uLong size));
+
+long ZCALLBACK pread_tell_file_func OF((
+   voidpf opaque,
+   voidpf stream));
+
+long ZCALLBACK pread_seek_file_func OF((
+   voidpf opaque,
+   voidpf stream,
+   uLong offset,
+   int origin));
+
+int ZCALLBACK pread_error_file_func OF((
+   voidpf opaque,
+   voidpf stream));
+
+
+voidpf ZCALLBACK pread_open_file_func (opaque, filename, mode)
+   voidpf opaque;
+   const char* filename;
+   int mode;
+{
+    pread_stream* stream = NULL;
+    const zlib_fd_desc* desc = (const zlib_fd_desc*)opaque;
+    if ((desc==NULL) || (desc->fd<0))
+        return NULL;
+    /* read only */
+    if ((mode & ZLIB_FILEFUNC_MODE_READWRITEFILTER)!=ZLIB_FILEFUNC_MODE_READ)
+        return NULL;
+
+    stream = (pread_stream*)malloc(sizeof(pread_stream));
+    if (stream!=NULL)
+    {
+        stream->desc = desc;
+        stream->pos = 0;
+        stream->error = 0;
+    }
+    return stream;
+}
+
+
+uLong ZCALLBACK pread_read_file_func (opaque, stream, buf, size)
+   voidpf opaque;
+   voidpf stream;
+   void* buf;
+   uLong size;
+{
+    pread_stream* ps = (pread_stream*)stream;
+    uLong done = 0;
+    while (done < size)
+    {
+        ssize_t got = pread(ps->desc->fd, (char*)buf + done, (size_t)(size - done), (off_t)(ps->pos + done));
+        if (got < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ps->error = errno;
+            break;
+        }
+        if (got == 0)
+            break;
+        done += (uLong)got;
+    }
+    ps->pos += done;
+    return done;
+}
+
+long ZCALLBACK pread_tell_file_func (opaque, stream)
+   voidpf opaque;
+   voidpf stream;
+{
+    return (long)((pread_stream*)stream)->pos;
+}
+
+long ZCALLBACK pread_seek_file_func (opaque, stream, offset, origin)
+   voidpf opaque;
+   voidpf stream;
+   uLong offset;
+   int origin;
+{
+    pread_stream* ps = (pread_stream*)stream;
+    uLong new_pos;
+    switch (origin)
+    {
+    case ZLIB_FILEFUNC_SEEK_CUR :
+        new_pos = ps->pos + offset;
+        break;
+    case ZLIB_FILEFUNC_SEEK_END :
+        new_pos = ps->desc->size + offset;
+        break;
+    case ZLIB_FILEFUNC_SEEK_SET :
+        new_pos = offset;
+        break;
+    default: return -1;
+    }
+    if (new_pos > ps->desc->size)
+        return -1;
+    ps->pos = new_pos;
+    return 0;
+}
+
+int ZCALLBACK pread_error_file_func (opaque, stream)
+   voidpf opaque;
+   voidpf stream;
+{
+    return ((pread_stream*)stream)->error;
+}
+
+void fill_pread_filefunc (pzlib_filefunc_def, pfd_desc)
+  zlib_filefunc_def* pzlib_filefunc_def;
+  const zlib_fd_desc* pfd_desc;
+{
+    pzlib_filefunc_def->zopen_file = pread_open_file_func;
+    pzlib_filefunc_def->zread_file = pread_read_file_func;
+    pzlib_filefunc_def->zwrite_file = mem_write_file_func;
+    pzlib_filefunc_def->ztell_file = pread_tell_file_func;
+    pzlib_filefunc_def->zseek_file = pread_seek_file_func;
+    pzlib_filefunc_def->zclose_file = mem_close_file_func;
+    pzlib_filefunc_def->zerror_file = pread_error_file_func;
+    pzlib_filefunc_def->opaque = (voidpf)pfd_desc;
+}
+
+
+/* Positioned streams over a caller supplied read function */
+
+typedef struct read_at_stream_s
+{
+    const zlib_read_at_desc* desc;
+    uLong pos;
+    int error;
+} read_at_stream;
+
+voidpf ZCALLBACK read_at_open_file_func OF((
+   voidpf opaque,
+   const char* filename,
+   int mode));
+
+uLong ZCALLBACK read_at_read_file_func OF((
+   voidpf opaque,
+   voidpf stream,
+   void* buf,
+   uLong size));
+
+long ZCALLBACK read_at_tell_file_func OF((
+   voidpf opaque,
+   voidpf stream));
+
+long ZCALLBACK read_at_seek_file_func OF((
+   voidpf opaque,
+   voidpf stream,
+   uLong offset,
+   int origin));
+
+int ZCALLBACK read_at_error_file_func OF((
+   voidpf opaque,
+   voidpf stream));
+
+
+voidpf ZCALLBACK read_at_open_file_func (opaque, filename, mode)
+   voidpf opaque;
+   const char* filename;
+   int mode;
+{
+    read_at_stream* stream = NULL;
+    const zlib_read_at_desc* desc = (const zlib_read_at_desc*)opaque;
+    if ((desc==NULL) || (desc->read_at==NULL))
+        return NULL;
+    /* read only */
+    if ((mode & ZLIB_FILEFUNC_MODE_READWRITEFILTER)!=ZLIB_FILEFUNC_MODE_READ)
+        return NULL;
+
+    stream = (read_at_stream*)malloc(sizeof(read_at_stream));
+    if (stream!=NULL)
+    {
+        stream->desc = desc;
+        stream->pos = 0;
+        stream->error = 0;
+    }
+    return stream;
+}
+
+
+uLong ZCALLBACK read_at_read_file_func (opaque, stream, buf, size)
+   voidpf opaque;
+   voidpf stream;
+   void* buf;
+   uLong size;
+{
+    read_at_stream* rs = (read_at_stream*)stream;
+    uLong done;
+    if (rs->pos >= rs->desc->size)
+        return 0;
+    if (size > rs->desc->size - rs->pos)
+        size = rs->desc->size - rs->pos;
+    done = (*(rs->desc->read_at))(rs->desc->opaque, rs->pos, buf, size, &rs->error);
+    rs->pos += done;
+    return done;
+}
+
+long ZCALLBACK read_at_tell_file_func (opaque, stream)
+   voidpf opaque;
+   voidpf stream;
+{
+    return (long)((read_at_stream*)stream)->pos;
+}
+
+long ZCALLBACK read_at_seek_file_func (opaque, stream, offset, origin)
+   voidpf opaque;
+   voidpf stream;
+   uLong offset;
+   int origin;
+{
+    read_at_stream* rs = (read_at_stream*)stream;
+    uLong new_pos;
+    switch (origin)
+    {
+    case ZLIB_FILEFUNC_SEEK_CUR :
+        new_pos = rs->pos + offset;
+        break;
+    case ZLIB_FILEFUNC_SEEK_END :
+        new_pos = rs->desc->size + offset;
+        break;
+    case ZLIB_FILEFUNC_SEEK_SET :
+        new_pos = offset;
+        break;
+    default: return -1;
+    }
+    if (new_pos > rs->desc->size)
+        return -1;
+    rs->pos = new_pos;
+    return 0;
+}
+
+int ZCALLBACK read_at_error_file_func (opaque, stream)
+   voidpf opaque;
+   voidpf stream;
+{
+    return ((read_at_stream*)stream)->error;
+}
+
+void fill_read_at_filefunc (pzlib_filefunc_def, pread_at_desc)
+  zlib_filefunc_def* pzlib_filefunc_def;
+  const zlib_read_at_desc* pread_at_desc;
+{
+    pzlib_filefunc_def->zopen_file = read_at_open_file_func;
+    pzlib_filefunc_def->zread_file = read_at_read_file_func;
+    pzlib_filefunc_def->zwrite_file = mem_write_file_func;
+    pzlib_filefunc_def->ztell_file = read_at_tell_file_func;
+    pzlib_filefunc_def->zseek_file = read_at_seek_file_func;
+    pzlib_filefunc_def->zclose_file = mem_close_file_func;
+    pzlib_filefunc_def->zerror_file = read_at_error_file_func;
+    pzlib_filefunc_def->opaque = (voidpf)pread_at_desc;
+}
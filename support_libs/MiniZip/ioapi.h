@@ -59,6 +59,45 @@ typedef struct zlib_filefunc_def_s
 
 void fill_fopen_filefunc OF((zlib_filefunc_def* pzlib_filefunc_def));
 
+/* Describes a zipfile which is already in memory (mapped or loaded by the
+   caller). The descriptor and the bytes must outlive every stream opened
+   through fill_memory_filefunc. */
+typedef struct zlib_mem_desc_s
+{
+    const void* base;
+    uLong size;
+} zlib_mem_desc;
+
+void fill_memory_filefunc OF((zlib_filefunc_def* pzlib_filefunc_def, const zlib_mem_desc* pmem_desc));
+
+/* Describes a zipfile open for reading on a file descriptor. Streams opened
+   through fill_pread_filefunc read with pread, so they keep their own
+   position and may be used from different threads at once. The descriptor
+   must outlive every stream. */
+typedef struct zlib_fd_desc_s
+{
+    int fd;
+    uLong size;
+} zlib_fd_desc;
+
+void fill_pread_filefunc OF((zlib_filefunc_def* pzlib_filefunc_def, const zlib_fd_desc* pfd_desc));
+
+/* Describes a zipfile read through a caller supplied positioned read
+   function, e.g. one backed by a cache or by network storage. read_at
+   returns the number of bytes read, which is less than size only at the end
+   of the file or on error (then *error is set), and must be safe to call
+   from several threads at once. The descriptor must outlive every stream. */
+typedef uLong (*read_at_func) OF((voidpf opaque, uLong offset, void* buf, uLong size, int* error));
+
+typedef struct zlib_read_at_desc_s
+{
+    read_at_func read_at;
+    voidpf opaque;
+    uLong size;
+} zlib_read_at_desc;
+
+void fill_read_at_filefunc OF((zlib_filefunc_def* pzlib_filefunc_def, const zlib_read_at_desc* pread_at_desc));
+
 #define ZREAD(filefunc,filestream,buf,size) ((*((filefunc).zread_file))((filefunc).opaque,filestream,buf,size))
 #define ZWRITE(filefunc,filestream,buf,size) ((*((filefunc).zwrite_file))((filefunc).opaque,filestream,buf,size))
 #define ZTELL(filefunc,filestream) ((*((filefunc).ztell_file))((filefunc).opaque,filestream))
@@ -116,6 +116,7 @@ typedef struct
 
     uLong crc32;                /* crc32 of all data uncompressed */
     uLong crc32_wait;           /* crc32 we must obtain after decompress all */
+    unz_crc32_func crc32_func;  /* updates crc32, NULL when it isn't checked */
     uLong rest_read_compressed; /* number of byte to be decompressed */
     uLong rest_read_uncompressed;/*number of byte to be obtained after decomp*/
     zlib_filefunc_def z_filefunc;
@@ -260,6 +261,37 @@ local int unzlocal_getLong (pzlib_filefunc_def,filestream,pX)
     return err;
 }
 
+/*
+   Reads an 8 byte ZIP64 value. uLong must be 64 bits wide to hold anything
+   above 4 GB, so larger values are refused where it isn't.
+*/
+local int unzlocal_getLong64 OF((
+    const zlib_filefunc_def* pzlib_filefunc_def,
+    voidpf filestream,
+    uLong *pX));
+
+local int unzlocal_getLong64 (pzlib_filefunc_def,filestream,pX)
+    const zlib_filefunc_def* pzlib_filefunc_def;
+    voidpf filestream;
+    uLong *pX;
+{
+    uLong low,high;
+    int err;
+
+    err = unzlocal_getLong(pzlib_filefunc_def,filestream,&low);
+    if (err==UNZ_OK)
+        err = unzlocal_getLong(pzlib_filefunc_def,filestream,&high);
+
+    if ((err==UNZ_OK) && (high!=0) && (sizeof(uLong)<8))
+        err = UNZ_BADZIPFILE;
+
+    if (err==UNZ_OK)
+        *pX = (sizeof(uLong)<8) ? low : (low | ((high<<16)<<16));
+    else
+        *pX = 0;
+    return err;
+}
+
 
 /* My own strcmpi / strcasecmp */
 local int strcmpcasenosensitive_internal (fileName1,fileName2)
@@ -388,6 +420,71 @@ local uLong unzlocal_SearchCentralDir(pzlib_filefunc_def,filestream)
     return uPosFound;
 }
 
+/*
+  Locate the ZIP64 end of central directory record, through the locator
+    that sits just before the end of central directory found above.
+    Returns 0 when the zipfile doesn't have one.
+*/
+local uLong unzlocal_SearchCentralDir64 OF((
+    const zlib_filefunc_def* pzlib_filefunc_def,
+    voidpf filestream,
+    uLong endcentral_pos));
+
+local uLong unzlocal_SearchCentralDir64(pzlib_filefunc_def,filestream,endcentral_pos)
+    const zlib_filefunc_def* pzlib_filefunc_def;
+    voidpf filestream;
+    uLong endcentral_pos;
+{
+    uLong uL;
+    uLong relative_pos;
+
+    if (endcentral_pos<20)
+        return 0;
+
+    if (ZSEEK(*pzlib_filefunc_def,filestream,endcentral_pos-20,ZLIB_FILEFUNC_SEEK_SET)!=0)
+        return 0;
+
+    /* the locator signature */
+    if (unzlocal_getLong(pzlib_filefunc_def,filestream,&uL)!=UNZ_OK)
+        return 0;
+    if (uL!=0x07064b50)
+        return 0;
+
+    /* number of the disk with the start of the zip64 end of central directory */
+    if (unzlocal_getLong(pzlib_filefunc_def,filestream,&uL)!=UNZ_OK)
+        return 0;
+    if (uL!=0)
+        return 0;
+
+    /* relative offset of the zip64 end of central directory record */
+    if (unzlocal_getLong64(pzlib_filefunc_def,filestream,&relative_pos)!=UNZ_OK)
+        return 0;
+
+    /* total number of disks */
+    if (unzlocal_getLong(pzlib_filefunc_def,filestream,&uL)!=UNZ_OK)
+        return 0;
+    if (uL!=1)
+        return 0;
+
+    /* The record is normally where the locator says it is... */
+    if (ZSEEK(*pzlib_filefunc_def,filestream,relative_pos,ZLIB_FILEFUNC_SEEK_SET)==0 &&
+        unzlocal_getLong(pzlib_filefunc_def,filestream,&uL)==UNZ_OK &&
+        uL==0x06064b50)
+        return relative_pos;
+
+    /* ...unless bytes were prepended to the zipfile. Then it sits right
+       before the locator, 56 bytes long when it has no extensible data */
+    if (endcentral_pos<20+56)
+        return 0;
+    if (ZSEEK(*pzlib_filefunc_def,filestream,endcentral_pos-20-56,ZLIB_FILEFUNC_SEEK_SET)!=0)
+        return 0;
+    if (unzlocal_getLong(pzlib_filefunc_def,filestream,&uL)!=UNZ_OK)
+        return 0;
+    if (uL!=0x06064b50)
+        return 0;
+    return endcentral_pos-20-56;
+}
+
 /*
   Open a Zip file. path contain the full pathname (by example,
      on a Windows NT computer "c:\\test\\zlib114.zip" or on an Unix computer
@@ -404,6 +501,9 @@ extern unzFile ZEXPORT unzOpen2 (path, pzlib_filefunc_def)
     unz_s us;
     unz_s *s;
     uLong central_pos,uL;
+    uLong central64_pos;        /* position of the zip64 end of central dir,
+                                   0 when there isn't one */
+    uLong end_of_central_dir;   /* where the central directory must end */
 
     uLong number_disk;          /* number of the current dist, used for
                                    spaning ZIP, unsupported, always 0*/
@@ -476,7 +576,56 @@ extern unzFile ZEXPORT unzOpen2 (path, pzlib_filefunc_def)
     if (unzlocal_getShort(&us.z_filefunc, us.filestream,&us.gi.size_comment)!=UNZ_OK)
         err=UNZ_ERRNO;
 
-    if ((central_pos<us.offset_central_dir+us.size_central_dir) &&
+    /* ZIP64 archives keep the real counts, sizes and offsets in their own
+       record, the fields above are then only placeholders */
+    central64_pos = 0;
+    if (err==UNZ_OK)
+        central64_pos = unzlocal_SearchCentralDir64(&us.z_filefunc,us.filestream,central_pos);
+    if (central64_pos!=0)
+    {
+        uLong uL64;
+
+        if (ZSEEK(us.z_filefunc, us.filestream,
+                                      central64_pos+4,ZLIB_FILEFUNC_SEEK_SET)!=0)
+            err=UNZ_ERRNO;
+
+        /* size of the zip64 end of central directory record */
+        if (unzlocal_getLong64(&us.z_filefunc, us.filestream,&uL64)!=UNZ_OK)
+            err=UNZ_ERRNO;
+
+        /* version made by, version needed to extract */
+        if (unzlocal_getLong(&us.z_filefunc, us.filestream,&uL)!=UNZ_OK)
+            err=UNZ_ERRNO;
+
+        /* number of this disk, number of the disk with the central dir */
+        if (unzlocal_getLong(&us.z_filefunc, us.filestream,&number_disk)!=UNZ_OK)
+            err=UNZ_ERRNO;
+        if (unzlocal_getLong(&us.z_filefunc, us.filestream,&number_disk_with_CD)!=UNZ_OK)
+            err=UNZ_ERRNO;
+
+        /* entries on this disk, entries in total */
+        if (unzlocal_getLong64(&us.z_filefunc, us.filestream,&us.gi.number_entry)!=UNZ_OK)
+            err=UNZ_ERRNO;
+        if (unzlocal_getLong64(&us.z_filefunc, us.filestream,&number_entry_CD)!=UNZ_OK)
+            err=UNZ_ERRNO;
+
+        if ((number_entry_CD!=us.gi.number_entry) ||
+            (number_disk_with_CD!=0) ||
+            (number_disk!=0))
+            err=UNZ_BADZIPFILE;
+
+        if (unzlocal_getLong64(&us.z_filefunc, us.filestream,&us.size_central_dir)!=UNZ_OK)
+            err=UNZ_ERRNO;
+        if (unzlocal_getLong64(&us.z_filefunc, us.filestream,&us.offset_central_dir)!=UNZ_OK)
+            err=UNZ_ERRNO;
+
+        /* the central directory ends where this record starts */
+        end_of_central_dir = central64_pos;
+    }
+    else
+        end_of_central_dir = central_pos;
+
+    if ((end_of_central_dir<us.offset_central_dir+us.size_central_dir) &&
         (err==UNZ_OK))
         err=UNZ_BADZIPFILE;
 
@@ -486,7 +635,7 @@ extern unzFile ZEXPORT unzOpen2 (path, pzlib_filefunc_def)
         return NULL;
     }
 
-    us.byte_before_the_zipfile = central_pos -
+    us.byte_before_the_zipfile = end_of_central_dir -
                             (us.offset_central_dir+us.size_central_dir);
     us.central_pos = central_pos;
     us.pfile_in_zip_read = NULL;
@@ -739,6 +888,65 @@ local int unzlocal_GetCurrentFileInfoInternal (file,
     else
         lSeek+=file_info.size_file_comment;
 
+    /* Fields that don't fit are 0xFFFFFFFF, and then the ZIP64 extra field
+       holds them instead, in this order */
+    if ((err==UNZ_OK) &&
+        ((file_info.uncompressed_size==0xFFFFFFFF) ||
+         (file_info.compressed_size==0xFFFFFFFF) ||
+         (file_info_internal.offset_curfile==0xFFFFFFFF)))
+    {
+        uLong extra_pos = 0;
+
+        if (ZSEEK(s->z_filefunc, s->filestream,
+                  s->pos_in_central_dir+s->byte_before_the_zipfile+
+                  SIZECENTRALDIRITEM+file_info.size_filename,
+                  ZLIB_FILEFUNC_SEEK_SET)!=0)
+            err=UNZ_ERRNO;
+
+        while ((err==UNZ_OK) && (extra_pos+4<=file_info.size_file_extra))
+        {
+            uLong header_id,data_size;
+
+            if (unzlocal_getShort(&s->z_filefunc, s->filestream,&header_id) != UNZ_OK)
+                err=UNZ_ERRNO;
+            if (unzlocal_getShort(&s->z_filefunc, s->filestream,&data_size) != UNZ_OK)
+                err=UNZ_ERRNO;
+            extra_pos += 4;
+            if ((err==UNZ_OK) && (extra_pos+data_size>file_info.size_file_extra))
+                err=UNZ_BADZIPFILE;
+            if (err!=UNZ_OK)
+                break;
+
+            if (header_id==0x0001)
+            {
+                uLong used = 0;
+                if ((file_info.uncompressed_size==0xFFFFFFFF) && (used+8<=data_size))
+                {
+                    if (unzlocal_getLong64(&s->z_filefunc, s->filestream,&file_info.uncompressed_size) != UNZ_OK)
+                        err=UNZ_ERRNO;
+                    used += 8;
+                }
+                if ((err==UNZ_OK) && (file_info.compressed_size==0xFFFFFFFF) && (used+8<=data_size))
+                {
+                    if (unzlocal_getLong64(&s->z_filefunc, s->filestream,&file_info.compressed_size) != UNZ_OK)
+                        err=UNZ_ERRNO;
+                    used += 8;
+                }
+                if ((err==UNZ_OK) && (file_info_internal.offset_curfile==0xFFFFFFFF) && (used+8<=data_size))
+                {
+                    if (unzlocal_getLong64(&s->z_filefunc, s->filestream,&file_info_internal.offset_curfile) != UNZ_OK)
+                        err=UNZ_ERRNO;
+                    used += 8;
+                }
+                break;
+            }
+
+            if (ZSEEK(s->z_filefunc, s->filestream,data_size,ZLIB_FILEFUNC_SEEK_CUR)!=0)
+                err=UNZ_ERRNO;
+            extra_pos += data_size;
+        }
+    }
+
     if ((err==UNZ_OK) && (pfile_info!=NULL))
         *pfile_info=file_info;
 
@@ -1031,12 +1239,14 @@ local int unzlocal_CheckCurrentFileCoherencyHeader (s,piSizeVar,
     if (unzlocal_getLong(&s->z_filefunc, s->filestream,&uData) != UNZ_OK) /* size compr */
         err=UNZ_ERRNO;
     else if ((err==UNZ_OK) && (uData!=s->cur_file_info.compressed_size) &&
+                              (uData!=0xFFFFFFFF) && /* in the ZIP64 extra field */
                               ((uFlags & 8)==0))
         err=UNZ_BADZIPFILE;
 
     if (unzlocal_getLong(&s->z_filefunc, s->filestream,&uData) != UNZ_OK) /* size uncompr */
         err=UNZ_ERRNO;
     else if ((err==UNZ_OK) && (uData!=s->cur_file_info.uncompressed_size) &&
+                              (uData!=0xFFFFFFFF) && /* in the ZIP64 extra field */
                               ((uFlags & 8)==0))
         err=UNZ_BADZIPFILE;
 
@@ -1138,6 +1348,7 @@ extern int ZEXPORT unzOpenCurrentFile3 (file, method, level, raw, password)
 
     pfile_in_zip_read_info->crc32_wait=s->cur_file_info.crc;
     pfile_in_zip_read_info->crc32=0;
+    pfile_in_zip_read_info->crc32_func=crc32;
     pfile_in_zip_read_info->compression_method =
             s->cur_file_info.compression_method;
     pfile_in_zip_read_info->filestream=s->filestream;
@@ -1374,7 +1585,9 @@ extern int ZEXPORT unzReadCurrentFile  (file, buf, len)
                 *(pfile_in_zip_read_info->stream.next_out+i) =
                         *(pfile_in_zip_read_info->stream.next_in+i);
 
-            pfile_in_zip_read_info->crc32 = crc32(pfile_in_zip_read_info->crc32,
+            if (pfile_in_zip_read_info->crc32_func!=NULL)
+                pfile_in_zip_read_info->crc32 =
+                    pfile_in_zip_read_info->crc32_func(pfile_in_zip_read_info->crc32,
                                 pfile_in_zip_read_info->stream.next_out,
                                 uDoCopy);
             pfile_in_zip_read_info->rest_read_uncompressed-=uDoCopy;
@@ -1410,8 +1623,9 @@ extern int ZEXPORT unzReadCurrentFile  (file, buf, len)
             uTotalOutAfter = pfile_in_zip_read_info->bstream.total_out_lo32;
             uOutThis = uTotalOutAfter-uTotalOutBefore;
 
-            pfile_in_zip_read_info->crc32 =
-                crc32(pfile_in_zip_read_info->crc32,bufBefore,
+            if (pfile_in_zip_read_info->crc32_func!=NULL)
+                pfile_in_zip_read_info->crc32 =
+                    pfile_in_zip_read_info->crc32_func(pfile_in_zip_read_info->crc32,bufBefore,
                         (uInt)(uOutThis));
 
             pfile_in_zip_read_info->rest_read_uncompressed -=
@@ -1456,8 +1670,9 @@ extern int ZEXPORT unzReadCurrentFile  (file, buf, len)
             uTotalOutAfter = pfile_in_zip_read_info->stream.total_out;
             uOutThis = uTotalOutAfter-uTotalOutBefore;
 
-            pfile_in_zip_read_info->crc32 =
-                crc32(pfile_in_zip_read_info->crc32,bufBefore,
+            if (pfile_in_zip_read_info->crc32_func!=NULL)
+                pfile_in_zip_read_info->crc32 =
+                    pfile_in_zip_read_info->crc32_func(pfile_in_zip_read_info->crc32,bufBefore,
                         (uInt)(uOutThis));
 
             pfile_in_zip_read_info->rest_read_uncompressed -=
@@ -1602,7 +1817,8 @@ extern int ZEXPORT unzCloseCurrentFile (file)
 
 
     if ((pfile_in_zip_read_info->rest_read_uncompressed == 0) &&
-        (!pfile_in_zip_read_info->raw))
+        (!pfile_in_zip_read_info->raw) &&
+        (pfile_in_zip_read_info->crc32_func!=NULL))
     {
         if (pfile_in_zip_read_info->crc32 != pfile_in_zip_read_info->crc32_wait)
             err=UNZ_CRCERROR;
@@ -1698,3 +1914,42 @@ extern int ZEXPORT unzSetOffset (file, pos)
     s->current_file_ok = (err == UNZ_OK);
     return err;
 }
+
+extern uLong ZEXPORT unzGetCurrentFileLocalHeaderOffset (file)
+        unzFile file;
+{
+    unz_s* s;
+
+    if (file==NULL)
+        return 0;
+    s=(unz_s*)file;
+    if (!s->current_file_ok)
+        return 0;
+    return s->cur_file_info_internal.offset_curfile + s->byte_before_the_zipfile;
+}
+
+/*
+  Replace the function used to check the crc32 of the file opened with
+  unzOpenCurrentFile. NULL skips the check altogether.
+*/
+extern int ZEXPORT unzSetCurrentFileCRC32Func (file, crc32_func)
+        unzFile file;
+        unz_crc32_func crc32_func;
+{
+    unz_s* s;
+    file_in_zip_read_info_s* pfile_in_zip_read_info;
+
+    if (file==NULL)
+        return UNZ_PARAMERROR;
+    s=(unz_s*)file;
+    pfile_in_zip_read_info=s->pfile_in_zip_read;
+    if (pfile_in_zip_read_info==NULL)
+        return UNZ_PARAMERROR;
+    /* Only before any data was read, so the sum covers the whole file */
+    if (pfile_in_zip_read_info->crc32!=0 ||
+        pfile_in_zip_read_info->rest_read_uncompressed!=s->cur_file_info.uncompressed_size)
+        return UNZ_PARAMERROR;
+
+    pfile_in_zip_read_info->crc32_func=crc32_func;
+    return UNZ_OK;
+}
@@ -7,6 +7,8 @@
      WinZip, InfoZip tools and compatible.
 
    Multi volume ZipFile (span) are not supported.
+   ZIP64 archives are read where uLong is 64 bits wide (LP64 platforms);
+     elsewhere only those whose sizes and offsets fit in 32 bits open.
    Encryption compatible with pkzip 2.04g only supported
    Old compressions used by old PKZip 1.x are not supported
 
@@ -351,6 +353,18 @@ extern uLong ZEXPORT unzGetOffset (unzFile file);
 /* Set the current file offset */
 extern int ZEXPORT unzSetOffset (unzFile file, uLong pos);
 
+/* Get the position of the local header of the current file in the
+   underlying stream (any bytes before the zipfile included) */
+extern uLong ZEXPORT unzGetCurrentFileLocalHeaderOffset (unzFile file);
+
+/* Updates a running crc32 the way zlib's crc32 does */
+typedef uLong (*unz_crc32_func) OF((uLong crc, const Bytef* buf, uInt len));
+
+/* Use crc32_func to check the file just opened with unzOpenCurrentFile,
+   before reading from it. NULL skips the check, so unzCloseCurrentFile
+   never returns UNZ_CRCERROR for that file */
+extern int ZEXPORT unzSetCurrentFileCRC32Func (unzFile file, unz_crc32_func crc32_func);
+
 
 
 #ifdef __cplusplus
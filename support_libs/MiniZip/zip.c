@@ -1023,7 +1023,9 @@ extern int ZEXPORT zipWriteInFileInZip (file, buf, len)
 
     zi->ci.stream.next_in = (Bytef*)buf;
     zi->ci.stream.avail_in = len;
-    zi->ci.crc32 = crc32(zi->ci.crc32,buf,(uInt)len);
+    /* raw data is already compressed, its crc is given to zipCloseFileInZipRaw */
+    if (!zi->ci.raw)
+        zi->ci.crc32 = crc32(zi->ci.crc32,buf,(uInt)len);
 
     while ((err==ZIP_OK) && (zi->ci.stream.avail_in>0))
     {